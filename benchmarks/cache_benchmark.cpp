@@ -0,0 +1,129 @@
+//---------------------------------------------------------------------------
+// benchmarks/cache_benchmark.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <boost/format.hpp>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/clock_cache.hpp>
+#include <hexa/lru_cache.hpp>
+
+using namespace hexa;
+using boost::format;
+
+namespace {
+
+typedef std::shared_ptr<int> payload;
+
+/** The lookups are mostly near a handful of players, like in the
+ ** server. */
+std::vector<chunk_coordinates>
+make_keys (size_t count, unsigned int seed)
+{
+    std::mt19937 rng (seed);
+    std::normal_distribution<float> around (0.f, 40.f);
+    std::vector<chunk_coordinates> result;
+    result.reserve(count);
+    for (size_t i (0); i < count; ++i)
+    {
+        result.emplace_back(world_chunk_center.x + int(around(rng)),
+                            world_chunk_center.y + int(around(rng)),
+                            world_chunk_center.z + int(around(rng) / 8));
+    }
+    return result;
+}
+
+template <class clock, class func>
+double nanoseconds_per_op (size_t ops, func f)
+{
+    auto start (clock::now());
+    f();
+    auto elapsed (clock::now() - start);
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()
+           / double(ops);
+}
+
+template <class cache_t>
+void run (const char* name, size_t entries)
+{
+    typedef std::chrono::steady_clock clock;
+
+    cache_t cache;
+    auto fill    (make_keys(entries, 1));
+    auto lookups (make_keys(entries * 8, 2));
+    size_t found (0);
+
+    double insert (nanoseconds_per_op<clock>(fill.size(), [&]
+    {
+        for (auto& k : fill)
+            cache[k] = std::make_shared<int>(1);
+    }));
+
+    double lookup (nanoseconds_per_op<clock>(lookups.size(), [&]
+    {
+        for (auto& k : lookups)
+        {
+            if (cache.try_get(k))
+                ++found;
+        }
+    }));
+
+    // Keep the cache at its size while new chunks keep coming in.
+    double churn (nanoseconds_per_op<clock>(lookups.size(), [&]
+    {
+        const size_t limit (cache.size());
+        for (auto& k : lookups)
+        {
+            auto hit (cache.try_get(k));
+            if (!hit)
+            {
+                cache[k] = std::make_shared<int>(1);
+                cache.prune(limit);
+            }
+        }
+    }));
+
+    std::cout << format("%1$-12s %2$8d %3$10.1f %4$10.1f %5$10.1f   (%6% hits)")
+                 % name % entries % insert % lookup % churn % found
+              << std::endl;
+}
+
+} // anonymous namespace
+
+int main (int argc, char* argv[])
+{
+    std::cout << "cache        elements  insert/ns  lookup/ns   churn/ns" << std::endl;
+
+    for (size_t entries : { 25000, 250000 })
+    {
+        run<lru_cache<chunk_coordinates, payload>>("lru_cache", entries);
+        run<clock_cache<chunk_coordinates, payload>>("clock_cache", entries);
+    }
+
+    return EXIT_SUCCESS;
+}
+
@@ -0,0 +1,171 @@
+//---------------------------------------------------------------------------
+// benchmarks/codec_benchmark.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+//
+// Usage: codec_benchmark <world.db> [dictionary directory]
+//
+// Reads the terrain of a world the server has generated, and compresses
+// it again with every codec.  Half of the data is used to train the
+// dictionaries, the other half to measure them.  If a directory is
+// given, the trained dictionaries are written to it; copy them to the
+// "dictionaries" directory next to a new world to use them.
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/format.hpp>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/compression.hpp>
+#include <hexa/db.hpp>
+
+using namespace hexa;
+using boost::format;
+namespace fs = boost::filesystem;
+
+namespace {
+
+/** Read and unpack up to \a limit elements of a table. */
+std::vector<binary_data> load (sql::db& from, const char* table, size_t limit)
+{
+    auto query (from.prepare_statement((format("SELECT data FROM %1% LIMIT %2%")
+                                        % table % limit).str()));
+
+    std::vector<binary_data> result;
+    while (query.step() == SQLITE_ROW)
+    {
+        auto data (deserialize_as<compressed_data>(query.get_blob(0)));
+        if (data.unpacked_len > 0)
+            result.emplace_back(decompress(data));
+    }
+    return result;
+}
+
+template <class clock, class func>
+double seconds (func f)
+{
+    auto start (clock::now());
+    f();
+    return std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count()
+           * 1.0e-6;
+}
+
+void run (const char* name, const std::vector<binary_data>& samples,
+          const compression_method& how)
+{
+    typedef std::chrono::steady_clock clock;
+
+    size_t raw (0), packed (0);
+    std::vector<compressed_data> out;
+    out.reserve(samples.size());
+
+    double pack_time (seconds<clock>([&]
+    {
+        for (auto& s : samples)
+            out.emplace_back(compress(s, how));
+    }));
+
+    binary_data buf;
+    double unpack_time (seconds<clock>([&]
+    {
+        for (auto& c : out)
+            decompress(c, buf);
+    }));
+
+    for (size_t i (0); i < samples.size(); ++i)
+    {
+        raw += samples[i].size();
+        packed += out[i].size();
+    }
+
+    const double mb (raw / 1048576.0);
+    std::cout << format("  %1$-14s %2$7.2f %3$10.1f %4$10.1f")
+                 % name % (double(raw) / packed) % (mb / pack_time) % (mb / unpack_time)
+              << std::endl;
+}
+
+} // anonymous namespace
+
+int main (int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <world.db> [dictionary directory]"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        sql::db from (argv[1]);
+        const std::pair<const char*, const char*> tables[]
+            { { "chunk", "chunk" }, { "surface", "surface" }, { "lightmap", "light" } };
+
+        for (auto& table : tables)
+        {
+            auto all (load(from, table.first, 20000));
+            if (all.size() < 2)
+            {
+                std::cout << table.first << ": not enough data" << std::endl;
+                continue;
+            }
+
+            // Train on the odd elements, measure on the even ones.
+            std::vector<binary_data> training, samples;
+            for (size_t i (0); i < all.size(); ++i)
+                (i % 2 ? training : samples).push_back(std::move(all[i]));
+
+            auto dict (std::make_shared<compression_dictionary>(train_dictionary(training)));
+            register_dictionary(dict);
+
+            std::cout << format("%1% (%2% samples)") % table.first % samples.size() << std::endl
+                      << "  codec            ratio  pack MB/s unpack MB/s" << std::endl;
+            run("lz4", samples, codec::lz4);
+            run("deflate", samples, codec::deflate);
+            run("deflate+dict", samples, compression_method(codec::deflate, dict));
+
+            if (argc > 2)
+            {
+                fs::path file (fs::path(argv[2]) / (std::string(table.second) + ".dict"));
+                if (fs::exists(file))
+                {
+                    std::cout << "  not overwriting " << file.string() << std::endl;
+                    continue;
+                }
+
+                std::ofstream out (file.string(), std::ios::binary);
+                out.write(&dict->data[0], dict->data.size());
+            }
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
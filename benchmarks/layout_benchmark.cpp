@@ -0,0 +1,264 @@
+//---------------------------------------------------------------------------
+// benchmarks/layout_benchmark.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <boost/format.hpp>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/block_types.hpp>
+#include <hexa/chunk.hpp>
+#include <hexa/ray_bundle.hpp>
+#include <hexa/surface.hpp>
+#include <hexa/voxel_algorithm.hpp>
+
+using namespace hexa;
+using boost::format;
+
+namespace {
+
+/** A chunk and its 26 neighbors, stored with a given block layout. */
+template <template <size_t> class layout>
+class terrain
+{
+public:
+    typedef chunk_base<block, chunk_size, layout> chunk_t;
+
+    /** Rolling hills with a few caves. */
+    explicit terrain (unsigned int seed)
+    {
+        for (int i (0); i < 27; ++i)
+            chunks_[i].reset(new chunk_t);
+
+        std::mt19937 rng (seed);
+        std::bernoulli_distribution cave (0.15);
+        const int lo (-int(chunk_size)), hi (2 * chunk_size);
+        for (int z (lo); z < hi; ++z)
+        {
+            for (int y (lo); y < hi; ++y)
+            {
+                for (int x (lo); x < hi; ++x)
+                {
+                    float h (8.f + 6.f * std::sin(x * 0.3f) * std::cos(y * 0.2f));
+                    uint16_t type (type::air);
+                    if (z < h - 1)
+                        type = 1;
+                    else if (z < h)
+                        type = 2;
+
+                    if (type != type::air && cave(rng))
+                        type = type::air;
+
+                    at(world_vector(x, y, z)) = block(type);
+                }
+            }
+        }
+    }
+
+    /** Get a block, relative to the corner of the center chunk. */
+    block operator[] (world_vector pos) const
+    {
+        return const_cast<terrain*>(this)->at(pos);
+    }
+
+    const chunk_t& center() const { return *chunks_[13]; }
+
+private:
+    block& at (world_vector pos)
+    {
+        world_vector o (pos + world_vector(chunk_size, chunk_size, chunk_size));
+        int c ((o.x / chunk_size) + (o.y / chunk_size) * 3 + (o.z / chunk_size) * 9);
+        return (*chunks_[c])(o.x % chunk_size, o.y % chunk_size, o.z % chunk_size);
+    }
+
+private:
+    std::array<std::unique_ptr<chunk_t>, 27> chunks_;
+};
+
+/** The same check as extract_opaque_surface(), walking through the
+ ** chunk in storage order. */
+template <class terrain_t>
+surface opaque_surface (const terrain_t& t)
+{
+    surface result;
+    result.reserve(256);
+
+    const auto& center (t.center());
+    for (auto it (center.begin()); it != center.end(); ++it)
+    {
+        uint16_t type (it->type);
+        if (type == type::air)
+            continue;
+
+        chunk_index i (center.index_to_pos(it));
+        uint8_t dirs (0);
+        for (uint8_t dir (0); dir < 6; ++dir)
+        {
+            if (!type::is_visually_solid(t[i + dir_vector[dir]].type))
+                dirs += (1 << dir);
+        }
+
+        if (dirs != 0)
+            result.emplace_back(i, dirs, type);
+    }
+
+    return result;
+}
+
+/** The ray bundles for the five upward-facing directions, like the
+ ** first detail level of the ambient occlusion light map. */
+std::array<ray_bundle, 5> make_rays (float length, int count)
+{
+    std::array<ray_bundle, 5> result;
+    const float inv_phi (3.14159265f * (3.f - std::sqrt(5.f)));
+    const float off (2.f / count);
+    vector center (0.5f, 0.5f, 0.5f);
+
+    for (int k (0); k < count; ++k)
+    {
+        float z (k * off - 1.f + off / 2.f);
+        if (z <= 0)
+            continue;
+
+        float r (std::sqrt(1.f - z * z));
+        vector v (std::cos(k * inv_phi) * r, std::sin(k * inv_phi) * r, z);
+
+        for (int i (0); i < 5; ++i)
+        {
+            vector normal (dir_vector[i]);
+            float weight (dot_prod(v, normal));
+            if (weight <= 0)
+                continue;
+
+            auto origin (center + normal * 0.8f);
+            result[i].add(voxel_raycast(origin, origin + v * length), weight);
+        }
+    }
+
+    return result;
+}
+
+template <class terrain_t>
+float trace (const ray_bundle& r, float power, world_vector blk,
+             const terrain_t& t)
+{
+    float hit (0.f);
+    for (auto& voxel : r.trunk)
+    {
+        if (!type::is_transparent(t[blk + voxel].type))
+        {
+            hit = 1.f;
+            break;
+        }
+    }
+
+    power -= hit * r.weight;
+    if (power <= 0.01f)
+        return 0.f;
+
+    if (hit == 0.f)
+    {
+        for (auto& b : r.branches)
+            power = trace(b, power, blk, t);
+    }
+
+    return power;
+}
+
+template <class terrain_t>
+float ambient_occlusion (const terrain_t& t, const surface& s,
+                         const std::array<ray_bundle, 5>& rays)
+{
+    float total (0.f);
+    for (auto& f : s)
+    {
+        for (int d (0); d < 5; ++d)
+        {
+            if (f[d])
+                total += trace(rays[d], 1.0f, world_vector(f.pos), t);
+        }
+    }
+    return total;
+}
+
+template <class clock, class func>
+double microseconds_per_op (size_t ops, func f)
+{
+    auto start (clock::now());
+    f();
+    auto elapsed (clock::now() - start);
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()
+           / (1000.0 * ops);
+}
+
+template <template <size_t> class layout>
+void run (const char* name, const std::array<ray_bundle, 5>& rays)
+{
+    typedef std::chrono::steady_clock clock;
+
+    const size_t rounds (200);
+    terrain<layout> t (1);
+    size_t faces (0);
+    float light (0.f);
+
+    double extract (microseconds_per_op<clock>(rounds, [&]
+    {
+        for (size_t i (0); i < rounds; ++i)
+            faces += count_faces(opaque_surface(t));
+    }));
+
+    auto s (opaque_surface(t));
+    double occlusion (microseconds_per_op<clock>(rounds / 10, [&]
+    {
+        for (size_t i (0); i < rounds / 10; ++i)
+            light += ambient_occlusion(t, s, rays);
+    }));
+
+    std::cout << format("%1$-8s %2$14.1f %3$14.1f   (%4% faces, %5%)")
+                 % name % extract % occlusion % (faces / rounds) % light
+              << std::endl;
+}
+
+} // anonymous namespace
+
+int main (int argc, char* argv[])
+{
+    register_new_material(0).transparency = 255;
+    register_new_material(1).is_solid = true;
+    register_new_material(2).is_solid = true;
+
+    auto rays (make_rays(10.f, 10));
+
+    std::cout << "layout   surface/us/chunk    ao/us/chunk" << std::endl;
+    run<linear_layout>("linear", rays);
+    run<morton_layout>("morton", rays);
+    run<brick_layout>("brick", rays);
+
+    return EXIT_SUCCESS;
+}
+
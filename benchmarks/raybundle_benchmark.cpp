@@ -0,0 +1,280 @@
+//---------------------------------------------------------------------------
+// benchmarks/raybundle_benchmark.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+//
+// Compares walking through a ray bundle recursively, the way the light
+// map generators used to, with the flattened form, and with the
+// flattened form on top of a dense_neighborhood.  The rays are the same
+// as the ones in the second and third detail levels of the ambient
+// occlusion light map.
+
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <boost/format.hpp>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/block_types.hpp>
+#include <hexa/dense_neighborhood.hpp>
+#include <hexa/memory_cache.hpp>
+#include <hexa/neighborhood.hpp>
+#include <hexa/persistence_null.hpp>
+#include <hexa/ray_bundle.hpp>
+#include <hexa/voxel_algorithm.hpp>
+#include <hexa/voxel_range.hpp>
+
+using namespace hexa;
+using boost::format;
+
+namespace {
+
+typedef std::array<ray_bundle, 5> rays;
+
+rays make_rays (float length, int count)
+{
+    rays result;
+    const float inv_phi (3.14159265f * (3.f - std::sqrt(5.f)));
+    const float off (2.f / count);
+    vector center (0.5f, 0.5f, 0.5f);
+
+    for (int k (0); k < count; ++k)
+    {
+        float z (k * off - 1.f + off / 2.f);
+        if (z <= 0)
+            continue;
+
+        float r (std::sqrt(1.f - z * z));
+        vector v (std::cos(k * inv_phi) * r, std::sin(k * inv_phi) * r, z);
+
+        for (int i (0); i < 5; ++i)
+        {
+            vector normal (dir_vector[i]);
+            float weight (dot_prod(v, normal));
+            if (weight <= 0)
+                continue;
+
+            auto origin (center + normal * 0.8f);
+            result[i].add(voxel_raycast(origin, origin + v * length), weight);
+        }
+    }
+
+    return result;
+}
+
+float opacity (uint16_t t)
+{
+    return 1.0f - (material_prop[t].transparency / 255.f);
+}
+
+/** The way the light map generators used to walk through the rays. */
+float recurse (const ray_bundle& r, float ray_power, const world_coordinates& blk,
+               neighborhood<chunk_ptr>& nbh, bool first = true)
+{
+    float temp (0.0f);
+    bool should_recurse (true);
+    for (auto& voxel : r.trunk)
+    {
+        auto type (nbh[blk + voxel].type);
+        if (first)
+        {
+            first = false;
+            if (material_prop[type].is_custom_block())
+                continue;
+        }
+
+        temp += opacity(type);
+        if (temp >= 1.0f)
+        {
+            should_recurse = false;
+            break;
+        }
+    }
+
+    ray_power -= std::min(temp, 1.0f) * r.weight;
+    if (ray_power <= 0.01)
+        return 0.0;
+
+    if (should_recurse)
+    {
+        for (auto& s : r.branches)
+            ray_power = recurse(s, ray_power, blk, nbh, first);
+    }
+
+    return ray_power;
+}
+
+/** Rolling hills with a few caves, in a cube of 9x9x9 chunks. */
+void fill (storage_i& cache, chunk_coordinates center)
+{
+    uint32_t seed (1);
+    for (auto c : range<world_vector>(world_vector(-4, -4, -4), world_vector(5, 5, 5)))
+    {
+        chunk_coordinates pos (center + c);
+        auto cnk (std::make_shared<chunk>());
+        for (auto i : every_block_in_chunk)
+        {
+            world_vector p (world_vector(c) * chunk_size + world_vector(i));
+            float h (8.f + 6.f * std::sin(p.x * 0.3f) * std::cos(p.y * 0.2f));
+            seed = seed * 1103515245u + 12345u;
+            bool solid (p.z < h && (seed >> 16) % 7 != 0);
+            (*cnk)[i].type = solid ? 1 : 0;
+        }
+        cache.store(pos, cnk);
+    }
+}
+
+template <class clock, class func>
+double milliseconds (func f)
+{
+    auto start (clock::now());
+    f();
+    return std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count()
+           * 1.0e-3;
+}
+
+void run (const char* name, const rays& r, storage_i& cache, chunk_coordinates pos)
+{
+    typedef std::chrono::steady_clock clock;
+
+    const int rounds (5);
+    float total_tree (0.f), total_flat (0.f), total_dense (0.f);
+    size_t faces (0);
+
+    double tree (milliseconds<clock>([&]
+    {
+        for (int i (0); i < rounds; ++i)
+        {
+            neighborhood<chunk_ptr> nbh (cache, pos, 7);
+            for (auto b : every_block_in_chunk)
+            {
+                world_coordinates blk (b);
+                if (nbh[blk].type == 0)
+                    continue;
+
+                for (int d (0); d < 5; ++d)
+                {
+                    if (nbh[world_vector(blk) + dir_vector[d]].type != 0)
+                        continue;
+
+                    total_tree += recurse(r[d], r[d].weight, blk, nbh);
+                    ++faces;
+                }
+            }
+        }
+    }));
+
+    double flat (milliseconds<clock>([&]
+    {
+        for (int i (0); i < rounds; ++i)
+        {
+            neighborhood<chunk_ptr> nbh (cache, pos, 7);
+            for (auto b : every_block_in_chunk)
+            {
+                world_coordinates blk (b);
+                if (nbh[blk].type == 0)
+                    continue;
+
+                for (int d (0); d < 5; ++d)
+                {
+                    if (nbh[world_vector(blk) + dir_vector[d]].type != 0)
+                        continue;
+
+                    total_flat += r[d].follow(r[d].weight, [&](world_vector v, bool first)
+                    {
+                        auto type (nbh[blk + v].type);
+                        if (first && material_prop[type].is_custom_block())
+                            return 0.0f;
+
+                        return opacity(type);
+                    });
+                }
+            }
+        }
+    }));
+
+    // The copy is part of the measurement.
+    double dense (milliseconds<clock>([&]
+    {
+        for (int i (0); i < rounds; ++i)
+        {
+            world_vector lo (0, 0, 0), hi (chunk_size, chunk_size, chunk_size);
+            for (auto& b : r)
+                extend_to_reach(b, lo, hi);
+
+            dense_neighborhood nbh (cache, pos, lo, hi);
+            std::vector<float> table;
+            for (size_t t (0); t < material_prop.size(); ++t)
+                table.push_back(opacity(t));
+
+            for (auto b : every_block_in_chunk)
+            {
+                world_vector blk (b);
+                if (nbh[blk] == 0)
+                    continue;
+
+                const int32_t base (nbh.index(blk));
+                for (int d (0); d < 5; ++d)
+                {
+                    if (nbh[blk + dir_vector[d]] != 0)
+                        continue;
+
+                    total_dense += r[d].follow(r[d].weight, [&](world_vector v, bool first)
+                    {
+                        auto type (nbh.at(base + nbh.offset(v)));
+                        if (first && material_prop[type].is_custom_block())
+                            return 0.0f;
+
+                        return table[type];
+                    });
+                }
+            }
+        }
+    }));
+
+    if (total_tree != total_flat || total_tree != total_dense)
+        std::cout << "  " << name << ": the results are different!" << std::endl;
+
+    std::cout << format("%1$-10s %2$6d %3$10.2f %4$10.2f %5$10.2f %6$8.1fx")
+                 % name % (faces / rounds) % (tree / rounds) % (flat / rounds)
+                 % (dense / rounds) % (tree / dense)
+              << std::endl;
+}
+
+} // anonymous namespace
+
+int main (int, char**)
+{
+    register_new_material(0).transparency = 255;
+    register_new_material(1).is_solid = true;
+
+    persistence_null db;
+    memory_cache cache (db);
+    fill(cache, world_chunk_center);
+
+    std::cout << "ms/chunk      faces       tree       flat      dense  speedup" << std::endl;
+    run("40 rays", make_rays(30, 40), cache, world_chunk_center);
+    run("100 rays", make_rays(60, 100), cache, world_chunk_center);
+
+    return EXIT_SUCCESS;
+}
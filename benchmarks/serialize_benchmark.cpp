@@ -0,0 +1,126 @@
+//---------------------------------------------------------------------------
+// benchmarks/serialize_benchmark.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+//
+// Compares serializing arrays one field at a time with the single copy
+// that is used for flat types, like light maps and physics updates.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <boost/format.hpp>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/lightmap.hpp>
+#include <hexa/protocol.hpp>
+#include <hexa/serialize.hpp>
+
+using namespace hexa;
+using boost::format;
+
+namespace {
+
+/** Wraps a value so it is serialized one field at a time, like all
+ ** arrays used to be. */
+template <class t>
+struct by_field
+{
+    t   v;
+
+    template <class archive>
+    archive& serialize(archive& ar)
+    {
+        return ar(v);
+    }
+};
+
+template <class clock, class func>
+double nanoseconds_per_op (size_t ops, func f)
+{
+    auto start (clock::now());
+    f();
+    auto elapsed (clock::now() - start);
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()
+           / double(ops);
+}
+
+template <class t>
+double measure (std::vector<t>& data, size_t rounds, size_t& bytes)
+{
+    typedef std::chrono::steady_clock clock;
+
+    std::vector<t> copy;
+    return nanoseconds_per_op<clock>(rounds, [&]
+    {
+        for (size_t i (0); i < rounds; ++i)
+        {
+            binary_data buf;
+            make_serializer(buf)(data);
+            make_deserializer(buf)(copy);
+            bytes += buf.size();
+        }
+    });
+}
+
+template <class t>
+void run (const char* name, std::vector<t>& data)
+{
+    std::vector<by_field<t>> wrapped;
+    for (auto& v : data)
+        wrapped.push_back(by_field<t>{ v });
+
+    const size_t rounds (2000);
+    size_t bytes_flat (0), bytes_by_field (0);
+    double flat (measure(data, rounds, bytes_flat));
+    double fields (measure(wrapped, rounds, bytes_by_field));
+
+    if (bytes_flat != bytes_by_field)
+        std::cout << "  " << name << ": the output is different!" << std::endl;
+
+    std::cout << format("%1$-16s %2$8d %3$12.1f %4$12.1f %5$8.1fx")
+                 % name % data.size() % fields % flat % (fields / flat)
+              << std::endl;
+}
+
+} // anonymous namespace
+
+int main (int, char**)
+{
+    std::vector<light> lights;
+    for (int i (0); i < 20000; ++i)
+        lights.emplace_back(i % 16, (i / 16) % 16, (i / 256) % 16);
+
+    std::vector<vector> vectors;
+    for (int i (0); i < 10000; ++i)
+        vectors.emplace_back(i * 0.5f, i * 0.25f, -i * 1.0f);
+
+    std::vector<msg::entity_update_physics::value> updates;
+    for (uint32_t i (0); i < 1000; ++i)
+        updates.emplace_back(i, wfpos(world_center, vector(0.5f, 0.5f, 0.f)), vector(1, 2, 3));
+
+    std::cout << "array            elements  by field/ns   flat/ns   speedup" << std::endl;
+    run("light map", lights);
+    run("vectors", vectors);
+    run("physics updates", updates);
+
+    return EXIT_SUCCESS;
+}
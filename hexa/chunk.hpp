@@ -22,7 +22,9 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <boost/thread/mutex.hpp>
 #include "block_types.hpp"
 #include "chunk_base.hpp"
@@ -75,12 +77,19 @@ public:
     /** How far along this chunk is in the generation process.
      *  This is only used server side.  If the terrain contains features that
      *  span several chunks, this may leave some chunks around the edge in
-     *  a half finished state.  This variable keeps track of this. */
-    uint8_t         generation_phase;
+     *  a half finished state.  This variable keeps track of this.
+     *  It can be safely polled by other threads while a generator is
+     *  still working on the chunk. */
+    std::atomic<uint8_t> generation_phase;
 
     /** Mutex for multithreaded terrain generation. */
     boost::mutex  lock;
 
+    /** Held by the thread that is currently running a terrain generator
+     ** on this chunk.  This is not the same as \a lock, which protects
+     ** the block data while a generator is writing to it. */
+    boost::mutex  generation_lock;
+
 public:
     chunk()
         : last_used(0)
@@ -90,7 +99,7 @@ public:
     chunk(chunk&& move) noexcept
         : base (std::move(move))
         , last_used (move.last_used)
-        , generation_phase (move.generation_phase)
+        , generation_phase (move.generation_phase.load())
         //, lock (std::move(move.lock))
     { }
 
@@ -98,10 +107,50 @@ public:
     bool    operator== (const chunk& compare) const
         { return base::operator==(compare); }
 
-    template <class archive>
-    archive& serialize(archive& ar)
+    /** Check if every block in this chunk is of the same material.
+     *  Such chunks are common; everything deep underground is solid
+     *  rock, for example. */
+    bool    is_uniform() const
+    {
+        return std::adjacent_find(begin(), end(),
+                   [](block a, block b){ return !(a == b); }) == end();
+    }
+
+    /** Serialize the chunk.
+     *  A uniform chunk only writes its material, instead of the full
+     *  array of blocks. */
+    template <class obj>
+    serializer<obj>& serialize(serializer<obj>& ar)
+    {
+        uint8_t phase (generation_phase);
+        if (is_uniform())
+            ar((*this)[0].type);
+        else
+            ar.raw_data(*this, chunk_volume);
+
+        return ar(last_used)(phase);
+    }
+
+    /** Deserialize the chunk.
+     *  A chunk is always serialized on its own, so the size of the
+     *  remaining data tells which of the two forms was used. */
+    template <class obj>
+    deserializer<obj>& serialize(deserializer<obj>& ar)
     {
-        return ar.raw_data(*this, chunk_volume)(last_used)(generation_phase);
+        uint8_t phase;
+        if (ar.bytes_left() < chunk_volume * sizeof(block))
+        {
+            uint16_t type;
+            ar(type);
+            clear(block(type));
+        }
+        else
+        {
+            ar.raw_data(*this, chunk_volume);
+        }
+        ar(last_used)(phase);
+        generation_phase = phase;
+        return ar;
     }
 };
 
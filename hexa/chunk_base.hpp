@@ -31,6 +31,82 @@
 
 namespace hexa {
 
+/** The default block layout of a chunk: rows along the X axis, stacked
+ ** along Y, then Z.
+ *  This is also the order in which chunks are serialized.  Blocks next
+ *  to each other along the Z axis are \a dim * \a dim elements apart. */
+template <size_t dim>
+struct linear_layout
+{
+    static size_t index (uint8_t x, uint8_t y, uint8_t z)
+        { return x + y * dim + z * dim * dim; }
+
+    static chunk_index position (size_t i)
+        { return chunk_index(i % dim, (i / dim) % dim, (i / (dim*dim)) % dim); }
+};
+
+/** Z-order layout.
+ *  The bits of the three coordinates are interleaved, so that blocks
+ *  that are close together in space are mostly close together in
+ *  memory as well, in all three directions.  Only works for chunks that
+ *  are a power of two along each side, up to 256. */
+template <size_t dim>
+struct morton_layout
+{
+    static_assert((dim & (dim - 1)) == 0 && dim <= 256,
+                  "Morton order needs a power of two");
+
+    static size_t index (uint8_t x, uint8_t y, uint8_t z)
+        { return spread(x) | (spread(y) << 1) | (spread(z) << 2); }
+
+    static chunk_index position (size_t i)
+        { return chunk_index(compact(i), compact(i >> 1), compact(i >> 2)); }
+
+private:
+    /** Put two zero bits between each bit of an 8-bit number. */
+    static uint32_t spread (uint32_t v)
+    {
+        v = (v | (v << 16)) & 0x030000ff;
+        v = (v | (v <<  8)) & 0x0300f00f;
+        v = (v | (v <<  4)) & 0x030c30c3;
+        v = (v | (v <<  2)) & 0x09249249;
+        return v;
+    }
+
+    /** The inverse of \a spread. */
+    static uint8_t compact (size_t i)
+    {
+        uint32_t v (i & 0x09249249);
+        v = (v | (v >>  2)) & 0x030c30c3;
+        v = (v | (v >>  4)) & 0x0300f00f;
+        v = (v | (v >>  8)) & 0x030000ff;
+        v = (v | (v >> 16)) & 0x000000ff;
+        return v;
+    }
+};
+
+/** Brick layout.
+ *  The chunk is split into bricks of 4x4x4 blocks.  Each brick is 64
+ *  consecutive elements (128 bytes for a \a block), and the bricks
+ *  themselves are stored in the linear order. */
+template <size_t dim>
+struct brick_layout
+{
+    static_assert(dim % 4 == 0, "bricks need a multiple of 4");
+
+    static size_t index (uint8_t x, uint8_t y, uint8_t z)
+    {
+        return linear_layout<dim / 4>::index(x >> 2, y >> 2, z >> 2) * 64
+               + (x & 3) + (y & 3) * 4 + (z & 3) * 16;
+    }
+
+    static chunk_index position (size_t i)
+    {
+        chunk_index brick (linear_layout<dim / 4>::position(i / 64));
+        return brick * 4 + chunk_index(i & 3, (i >> 2) & 3, (i >> 4) & 3);
+    }
+};
+
 /** A group of blocks.
  * For performance reasons, the world is generated, swapped to disk,
  * and sent to the client per chunk, instead of by block.
@@ -45,11 +121,18 @@ namespace hexa {
  *  chunk_index offset (0, 0, 1);
  *  example[pos + offset] = 25;
  *
- * \endcode */
-template <class type, size_t dim=chunk_size>
+ * \endcode
+ *
+ * The order in which the blocks are stored is decided by the \a layout
+ * policy; see \a linear_layout, \a morton_layout, and \a brick_layout.
+ * The iterators walk through the blocks in storage order, use
+ * index_to_pos() to find out where they are. */
+template <class type, size_t dim=chunk_size,
+          template <size_t> class layout=linear_layout>
 class chunk_base : private std::vector<type>, boost::noncopyable
 {
     typedef std::vector<type>      array_t;
+    typedef layout<dim>            layout_t;
 
 public:
     typedef typename array_t::value_type        value_type;
@@ -110,7 +193,7 @@ public:
         assert (y < length());
         assert (z < length());
 
-        return array_t::operator[](x + y * length() + z * area());
+        return array_t::operator[](layout_t::index(x, y, z));
     }
 
     /** Indexing operator. */
@@ -122,10 +205,10 @@ public:
         assert (y < length());
         assert (z < length());
 
-        return array_t::operator[](x + y * length() + z * area());
+        return array_t::operator[](layout_t::index(x, y, z));
     }
 
-    bool operator== (const chunk_base<type>& compare) const
+    bool operator== (const chunk_base& compare) const
         { return std::equal(begin(), end(), compare.begin()); }
 
     /** Dummy resize function.
@@ -158,7 +241,13 @@ public:
      * This function converts between the two. */
     chunk_index index_to_pos(size_type i) const
     {
-        return chunk_index(i % dim, (i / dim) % dim, (i / (dim*dim)) % dim);
+        return layout_t::position(i);
+    }
+
+    /** Convert a coordinate index to an array index. */
+    size_type pos_to_index(chunk_index pos) const
+    {
+        return layout_t::index(pos.x, pos.y, pos.z);
     }
 
     /** Convert an iterator to a coordinate index.
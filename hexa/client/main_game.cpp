@@ -528,7 +528,7 @@ void main_game::login()
 
     msg::login m;
 
-    m.protocol_version = 1;
+    m.protocol_version = msg::current_protocol_version;
     m.username = "Griefy McGriefenstein";
 
     send(serialize_packet(m), m.method());
@@ -597,6 +597,8 @@ void main_game::receive (const packet& p)
             handshake(archive); break;
         case msg::greeting::msg_id:
             greeting(archive); break;
+        case msg::kick::msg_id:
+            kick(archive); break;
         case msg::time_sync_response::msg_id:
             time_sync_response(archive); break;
         case msg::define_resources::msg_id:
@@ -609,6 +611,8 @@ void main_game::receive (const packet& p)
             entity_update_physics(archive); break;
         case msg::surface_update::msg_id:
             surface_update(archive); break;
+        case msg::surface_delta::msg_id:
+            surface_delta(archive); break;
         case msg::lightmap_update::msg_id:
             lightmap_update(archive); break;
         case msg::heightmap_update::msg_id:
@@ -635,6 +639,13 @@ void main_game::handshake (deserializer<packet>& p)
     std::cout << "Connected to " << mesg.server_name << std::endl;
 }
 
+void main_game::kick (deserializer<packet>& p)
+{
+    msg::kick mesg;
+    mesg.serialize(p);
+    std::cout << "Disconnected by the server: " << mesg.reason << std::endl;
+}
+
 void main_game::greeting (deserializer<packet>& p)
 {
     msg::greeting mesg;
@@ -773,16 +784,21 @@ void main_game::surface_update (deserializer<packet>& p)
     msg::surface_update msg;
     msg.serialize(p);
 
-    auto temp (decompress(msg.terrain));
-    surface_ptr s (new surface_data(deserialize_as<surface_data>(temp)));
+    // Empty terrain data means the chunk has no visible faces at all.
+    surface_ptr s (new surface_data);
+    if (msg.terrain.unpacked_len > 0)
+        *s = deserialize_as<surface_data>(decompress(msg.terrain));
 
     world().store(msg.position, s);
     lightmap_ptr lm (world().get_lightmap(msg.position));
     if (lm == nullptr)
         lm.reset(new light_data);
 
-    auto tmpl (decompress(msg.light));
-    (*lm) = deserialize_as<light_data>(tmpl);
+    if (msg.light.unpacked_len > 0)
+        *lm = deserialize_as<light_data>(decompress(msg.light));
+    else
+        *lm = light_data();
+
     world().store(msg.position, lm);
 
     assert(count_faces(s->opaque) == lm->opaque.size());
@@ -792,6 +808,29 @@ void main_game::surface_update (deserializer<packet>& p)
     scene_.on_update_chunk(msg.position);
 }
 
+void main_game::surface_delta (deserializer<packet>& p)
+{
+    msg::surface_delta msg;
+    msg.serialize(p);
+
+    // If we don't have the chunk yet, the full surface will arrive later
+    // on, with the changes already in it.
+    auto old_s (world().get_surface(msg.position));
+    auto old_l (world().get_lightmap(msg.position));
+    if (old_s == nullptr || old_l == nullptr)
+        return;
+
+    surface_ptr  s  (new surface_data(*old_s));
+    lightmap_ptr lm (new light_data(*old_l));
+    apply(msg.patch, *s, *lm);
+
+    world().store(msg.position, s);
+    world().store(msg.position, lm);
+
+    boost::mutex::scoped_lock lock (scene_.lock);
+    scene_.on_update_chunk(msg.position);
+}
+
 void main_game::lightmap_update (deserializer<packet>& p)
 {
     msg::lightmap_update msg;
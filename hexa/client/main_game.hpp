@@ -101,6 +101,7 @@ private:
 
     void handshake(deserializer<packet>& p);
     void greeting(deserializer<packet>& p);
+    void kick(deserializer<packet>& p);
     void time_sync_response(deserializer<packet>& p);
     void define_resources(deserializer<packet>& p);
     void define_materials(deserializer<packet>& p);
@@ -108,6 +109,7 @@ private:
     void entity_update(deserializer<packet>& p);
     void entity_update_physics(deserializer<packet>& p);
     void surface_update(deserializer<packet>& p);
+    void surface_delta(deserializer<packet>& p);
     void lightmap_update(deserializer<packet>& p);
     void heightmap_update(deserializer<packet>& p);
     void configure_hotbar(deserializer<packet>& p);
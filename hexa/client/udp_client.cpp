@@ -29,6 +29,16 @@ using boost::format;
 
 namespace hexa {
 
+namespace {
+
+/** Called by ENet when it is done with a packet. */
+void release_buffer (ENetPacket* pkt)
+{
+    packet_buffer::release(pkt->userData);
+}
+
+} // anonymous namespace
+
 udp_client::udp_client (const std::string& host, uint16_t port)
     : connected_ (false)
 {
@@ -148,21 +158,27 @@ float udp_client::rtt() const
     return peer_->roundTripTime * 0.001f;
 }
 
-void udp_client::send (const std::vector<uint8_t>& p, msg::reliability method)
+void udp_client::send (const packet_buffer& p, msg::reliability method)
 {
-    uint32_t flags (0);
+    uint32_t flags (ENET_PACKET_FLAG_NO_ALLOCATE);
 
     switch (method)
     {
-    case msg::unreliable: flags = ENET_PACKET_FLAG_UNSEQUENCED; break;
+    case msg::unreliable: flags |= ENET_PACKET_FLAG_UNSEQUENCED; break;
     case msg::reliable:
-    case msg::sequenced:  flags = ENET_PACKET_FLAG_RELIABLE; break;
+    case msg::sequenced:  flags |= ENET_PACKET_FLAG_RELIABLE; break;
     }
 
-    ENetPacket* packet (enet_packet_create(&p[0], p.size(), flags));
+    ENetPacket* packet (enet_packet_create(p.data(), p.size(), flags));
+    if (packet == nullptr)
+        throw network_error("could not create packet");
+
+    packet->userData = p.retain();
+    packet->freeCallback = release_buffer;
     {
     boost::lock_guard<boost::mutex> lock (host_mutex_);
-    enet_peer_send(peer_, 0, packet);
+    if (enet_peer_send(peer_, 0, packet) < 0)
+        enet_packet_destroy(packet);
     }
 }
 
@@ -27,6 +27,7 @@
 #include <boost/utility.hpp>
 #include <enet/enet.h>
 #include <hexa/packet.hpp>
+#include <hexa/packet_buffer.hpp>
 #include <hexa/protocol.hpp>
 
 namespace hexa {
@@ -52,7 +53,7 @@ public:
 
     void poll (unsigned int timeout = 200);
 
-    void send (const std::vector<uint8_t>& p, msg::reliability method);
+    void send (const packet_buffer& p, msg::reliability method);
 
     virtual void on_connect() { }
     virtual void on_disconnect() { }
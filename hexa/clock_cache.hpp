@@ -0,0 +1,379 @@
+//---------------------------------------------------------------------------
+/// \file  clock_cache.hpp
+/// \brief Allocation-free associative container for caches.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <boost/optional.hpp>
+
+namespace hexa {
+
+/** Associative container for in a cache, with the same interface as
+ ** lru_cache.
+ *  Instead of keeping the elements in a linked list, ordered by the time
+ *  they were last used, every element gets a 'referenced' flag that is
+ *  set whenever it is looked up.  When something has to be thrown out,
+ *  a clock hand sweeps over the elements, and takes the first one that
+ *  hasn't been referenced since the previous sweep.  This is a close
+ *  approximation of LRU.
+ *
+ *  The elements are stored in a single array, and are found through an
+ *  open addressing hash table of indices into that array.  Looking up
+ *  or touching an element never allocates memory, and inserting only
+ *  does when the tables have to grow.
+ *
+ *  Unlike with lru_cache, references to elements are invalidated when a
+ *  new element is inserted.
+ * @code
+
+hexa::clock_cache<int, std::string>  cache;
+
+cache[1] = "one";
+cache[8] = "eight";
+cache[5] = "five";
+
+// Everything was used since the last sweep; the hand goes round once,
+// and then takes the first element.
+cache.prune(2);
+std::cout << cache.count(1) << std::endl;
+// Output: "0"
+
+* @endcode */
+template <class key, class value, class hash = std::hash<key>>
+class clock_cache
+{
+    typedef uint32_t index_t;
+    enum : index_t { empty_slot = 0xffffffff };
+
+    struct element
+    {
+        key         first;
+        value       second;
+        bool        used;
+        bool        referenced;
+
+        element() : first (), second (), used (false), referenced (false) { }
+    };
+
+    std::vector<element>    elements_;
+    std::vector<index_t>    free_;
+    std::vector<index_t>    table_;
+    size_t                  size_;
+    size_t                  hand_;
+    hash                    hash_;
+
+public:
+    typedef key          key_type;    /**< The cache is indexed by this type */
+    typedef value        mapped_type; /**< The cache returns this type */
+
+public:
+    /** Construct an empty cache. */
+    clock_cache() : table_ (16, index_t(empty_slot)), size_ (0), hand_ (0) { }
+
+    /** Prune the cache back to a given size.
+     * @post size() <= max_size
+     * @param max_size  The maximum cache size */
+    void prune (size_t max_size)
+    {
+        while (size_ > max_size)
+            evict([](const key_type&, mapped_type&){ });
+    }
+
+    /** Prune the cache back to a given size, and invoke a callback for
+     ** every element that is removed.
+     * @post size() <= max_size
+     * @param max_size  The maximum cache size
+     * @param on_remove Callback for removed elements */
+    template <class func>
+    void prune (size_t max_size, func on_remove)
+    {
+        while (size_ > max_size)
+            evict(on_remove);
+    }
+
+    /** Remove the element that is next in line to be thrown out.
+     * @pre !empty()
+     * @param on_remove Called with the element before it is removed */
+    template <class func>
+    void evict (func on_remove)
+    {
+        for (;;)
+        {
+            if (hand_ >= elements_.size())
+                hand_ = 0;
+
+            element& e (elements_[hand_]);
+            if (e.used)
+            {
+                if (!e.referenced)
+                    break;
+
+                e.referenced = false;
+            }
+            ++hand_;
+        }
+
+        element& victim (elements_[hand_]);
+        on_remove(victim.first, victim.second);
+        erase(find_slot(victim.first));
+        ++hand_;
+    }
+
+    /** Remove the element that is next in line to be thrown out, but
+     ** pass over the elements that have to stay.
+     *  The hand goes round at most twice, so this gives up if every
+     *  element is pinned.
+     * @param on_remove Called with the element before it is removed
+     * @param pinned    Elements for which this returns true are kept
+     * @return False if nothing could be removed */
+    template <class func, class pred>
+    bool evict (func on_remove, pred pinned)
+    {
+        for (size_t steps (0); steps < 2 * elements_.size(); ++steps, ++hand_)
+        {
+            if (hand_ >= elements_.size())
+                hand_ = 0;
+
+            element& e (elements_[hand_]);
+            if (!e.used || pinned(e.first, e.second))
+                continue;
+
+            if (e.referenced)
+            {
+                e.referenced = false;
+                continue;
+            }
+
+            on_remove(e.first, e.second);
+            erase(find_slot(e.first));
+            ++hand_;
+            return true;
+        }
+        return false;
+    }
+
+    /** Empty the cache. */
+    void clear()
+    {
+        elements_.clear();
+        free_.clear();
+        std::fill(table_.begin(), table_.end(), index_t(empty_slot));
+        size_ = 0;
+        hand_ = 0;
+    }
+
+    /** Mark an element as recently used. */
+    void touch (const key_type& k)
+    {
+        index_t i (table_[find_slot(k)]);
+        assert(i != empty_slot);
+        if (i != empty_slot)
+            elements_[i].referenced = true;
+    }
+
+    /** Fetch an element from the cache.
+     *  If the key does not exist yet, a new empty element will be
+     *  created. */
+    mapped_type& operator[] (const key_type& k)
+    {
+        size_t slot (find_slot(k));
+        if (table_[slot] != empty_slot)
+        {
+            element& e (elements_[table_[slot]]);
+            e.referenced = true;
+            return e.second;
+        }
+
+        if ((size_ + 1) * 4 > table_.size() * 3)
+        {
+            grow();
+            slot = find_slot(k);
+        }
+
+        index_t i;
+        if (free_.empty())
+        {
+            i = elements_.size();
+            elements_.emplace_back();
+        }
+        else
+        {
+            i = free_.back();
+            free_.pop_back();
+        }
+
+        element& e (elements_[i]);
+        e.first = k;
+        e.used = true;
+        e.referenced = true;
+        table_[slot] = i;
+        ++size_;
+
+        return e.second;
+    }
+
+    /** Remove an element from the cache. */
+    void remove (const key_type& k)
+    {
+        size_t slot (find_slot(k));
+        if (table_[slot] != empty_slot)
+            erase(slot);
+    }
+
+    /** Count the number of elements for a given key.
+     *  The returned value is always 0 or 1. */
+    size_t count (const key_type& k) const
+        { return table_[find_slot(k)] != empty_slot; }
+
+    /** Get the number of elements in the cache. */
+    size_t size() const { return size_; }
+
+    /** Check if the cache is empty. */
+    bool empty() const { return size_ == 0; }
+
+    /** Get an element from the cache without changing its age. */
+    mapped_type& get (const key_type& k) const
+    {
+        index_t i (table_[find_slot(k)]);
+        if (i == empty_slot)
+            throw std::runtime_error("clock_cache::get: key not found");
+
+        return const_cast<mapped_type&>(elements_[i].second);
+    }
+
+    boost::optional<mapped_type&> try_get (const key_type& k) const
+    {
+        index_t i (table_[find_slot(k)]);
+        if (i == empty_slot)
+            return boost::none;
+
+        return const_cast<mapped_type&>(elements_[i].second);
+    }
+
+    boost::optional<mapped_type&> try_get (const key_type& k)
+    {
+        index_t i (table_[find_slot(k)]);
+        if (i == empty_slot)
+            return boost::none;
+
+        elements_[i].referenced = true;
+        return elements_[i].second;
+    }
+
+    /** Call a function for every key-value pair in the cache, in no
+     ** particular order. */
+    template <class func>
+    func for_each (func op) const
+    {
+        for (const element& e : elements_)
+        {
+            if (e.used)
+                op(e.first, e.second);
+        }
+        return op;
+    }
+
+private:
+    size_t home (const key_type& k) const
+    {
+        // The std::hash for our vectors doesn't mix its bits very well,
+        // and the sharded_cache already used the upper bits of a
+        // Fibonacci hash to pick a shard.
+        uint64_t h (hash_(k));
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+
+        return h & (table_.size() - 1);
+    }
+
+    /** Find the slot in the hash table that holds a key, or the empty
+     ** slot where it should go. */
+    size_t find_slot (const key_type& k) const
+    {
+        const size_t mask (table_.size() - 1);
+        size_t slot (home(k));
+        while (table_[slot] != empty_slot && !(elements_[table_[slot]].first == k))
+            slot = (slot + 1) & mask;
+
+        return slot;
+    }
+
+    void erase (size_t slot)
+    {
+        index_t i (table_[slot]);
+        element& e (elements_[i]);
+        e.first = key_type();
+        e.second = mapped_type();
+        e.used = false;
+        e.referenced = false;
+        free_.push_back(i);
+        --size_;
+
+        // Backward shift deletion: move elements that sit further along
+        // the probe sequence into the gap, so lookups never have to
+        // skip over tombstones.
+        const size_t mask (table_.size() - 1);
+        for (size_t next ((slot + 1) & mask); table_[next] != empty_slot;
+             next = (next + 1) & mask)
+        {
+            size_t h (home(elements_[table_[next]].first));
+            if (((next - h) & mask) >= ((next - slot) & mask))
+            {
+                table_[slot] = table_[next];
+                slot = next;
+            }
+        }
+        table_[slot] = empty_slot;
+    }
+
+    void grow()
+    {
+        std::vector<index_t> old (table_.size() * 2, index_t(empty_slot));
+        table_.swap(old);
+
+        const size_t mask (table_.size() - 1);
+        for (index_t i : old)
+        {
+            if (i == empty_slot)
+                continue;
+
+            size_t slot (home(elements_[i].first));
+            while (table_[slot] != empty_slot)
+                slot = (slot + 1) & mask;
+
+            table_[slot] = i;
+        }
+    }
+};
+
+} // namespace hexa
+
@@ -0,0 +1,550 @@
+//---------------------------------------------------------------------------
+// lib/compression.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2012-2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "compression.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <unordered_map>
+#include <boost/thread/mutex.hpp>
+#include <zlib.h>
+#include "lz4/lz4.h"
+
+namespace hexa {
+
+namespace {
+
+boost::mutex                            dictionaries_lock;
+std::map<uint32_t, dictionary_ptr>      dictionaries;
+
+/** Length of the strings that train_dictionary() looks for. */
+const size_t segment_size (32);
+
+/** Start a zlib stream without any custom allocators. */
+void init_stream (z_stream& strm)
+{
+    strm.zalloc   = Z_NULL;
+    strm.zfree    = Z_NULL;
+    strm.opaque   = Z_NULL;
+    strm.next_in  = Z_NULL;
+    strm.avail_in = 0;
+}
+
+/** Compress a single LZ4 block, and append it to \a out. */
+void append_lz4_block (binary_data& out, const char* in, size_t len)
+{
+    const size_t start (out.size());
+    out.resize(start + LZ4_compressBound(len));
+    int compressed_length (LZ4_compress(in, &out[start], len));
+    if (compressed_length <= 0)
+        throw std::runtime_error("lz4 compression failed");
+
+    out.resize(start + compressed_length);
+}
+
+//---------------------------------------------------------------------------
+
+class lz4_compressor : public compressor::impl
+{
+public:
+    lz4_compressor () : framed_ (false), total_ (0) { }
+
+    void write (const char* data, size_t len)
+    {
+        total_ += len;
+        while (len > 0)
+        {
+            if (pending_.size() == lz4_frame_size)
+            {
+                append_frame(&pending_[0], pending_.size());
+                pending_.clear();
+            }
+
+            // Whole frames that are followed by more data don't have to
+            // be copied first.
+            if (pending_.empty() && len > lz4_frame_size)
+            {
+                append_frame(data, lz4_frame_size);
+                data += lz4_frame_size;
+                len  -= lz4_frame_size;
+                continue;
+            }
+
+            size_t n (std::min(len, lz4_frame_size - pending_.size()));
+            pending_.insert(pending_.end(), data, data + n);
+            data += n;
+            len  -= n;
+        }
+    }
+
+    compressed_data finish()
+    {
+        if (total_ > 0xffffffffull)
+            throw std::runtime_error("too much data for compression");
+
+        compressed_data out;
+        if (total_ == 0)
+            return out;
+
+        out.unpacked_len = total_;
+        if (!framed_)
+        {
+            append_lz4_block(out.buf, &pending_[0], pending_.size());
+            return out;
+        }
+
+        append_frame(&pending_[0], pending_.size());
+        out.buf.swap(frames_);
+        return out;
+    }
+
+private:
+    void append_frame (const char* data, size_t len)
+    {
+        framed_ = true;
+        const size_t prefix (frames_.size());
+        frames_.resize(prefix + sizeof(uint32_t));
+        append_lz4_block(frames_, data, len);
+
+        const uint32_t packed (frames_.size() - prefix - sizeof(uint32_t));
+        for (size_t i (0); i < sizeof(uint32_t); ++i)
+            frames_[prefix + i] = char(packed >> (i * 8));
+    }
+
+private:
+    binary_data pending_;
+    binary_data frames_;
+    bool        framed_;
+    uint64_t    total_;
+};
+
+class deflate_compressor : public compressor::impl
+{
+public:
+    deflate_compressor (const dictionary_ptr& dict)
+        : total_ (0)
+    {
+        init_stream(strm_);
+        if (deflateInit(&strm_, Z_BEST_COMPRESSION) != Z_OK)
+            throw std::runtime_error("cannot initialize deflate");
+
+        if (dict && deflateSetDictionary(&strm_,
+                                         reinterpret_cast<const Bytef*>(&dict->data[0]),
+                                         dict->data.size()) != Z_OK)
+        {
+            deflateEnd(&strm_);
+            throw std::runtime_error("cannot use compression dictionary");
+        }
+    }
+
+    ~deflate_compressor()
+    {
+        deflateEnd(&strm_);
+    }
+
+    void write (const char* data, size_t len)
+    {
+        total_ += len;
+        strm_.next_in  = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        strm_.avail_in = len;
+        while (strm_.avail_in > 0)
+            run(Z_NO_FLUSH);
+    }
+
+    compressed_data finish()
+    {
+        while (run(Z_FINISH) != Z_STREAM_END)
+            ;
+
+        // Don't use total_in; setting a dictionary counts towards it.
+        if (total_ > 0xffffffffull)
+            throw std::runtime_error("too much data for compression");
+
+        compressed_data out;
+        if (total_ == 0)
+            return out;
+
+        out.method = codec::deflate;
+        out.unpacked_len = total_;
+        out.buf.swap(buf_);
+        out.resize(strm_.total_out);
+        return out;
+    }
+
+private:
+    int run (int flush)
+    {
+        if (buf_.size() == strm_.total_out)
+            buf_.resize(std::max<size_t>(buf_.size() * 2, 4096));
+
+        strm_.next_out  = reinterpret_cast<Bytef*>(&buf_[strm_.total_out]);
+        strm_.avail_out = buf_.size() - strm_.total_out;
+
+        int rc (deflate(&strm_, flush));
+        if (rc == Z_STREAM_ERROR)
+            throw std::runtime_error("deflate failed");
+
+        return rc;
+    }
+
+private:
+    z_stream    strm_;
+    binary_data buf_;
+    uint64_t    total_;
+};
+
+//---------------------------------------------------------------------------
+
+class lz4_decompressor : public decompressor::impl
+{
+public:
+    lz4_decompressor (const compressed_data& in)
+        : in_ (in)
+        , framed_ (in.unpacked_len > lz4_frame_size)
+        , pos_ (0)
+        , still_packed_ (in.unpacked_len)
+        , buffered_ (0)
+        , used_ (0)
+    { }
+
+    size_t read (char* out, size_t len)
+    {
+        size_t done (0);
+        while (done < len)
+        {
+            if (used_ < buffered_)
+            {
+                size_t n (std::min(len - done, buffered_ - used_));
+                std::memcpy(out + done, &frame_[used_], n);
+                used_ += n;
+                done  += n;
+                continue;
+            }
+
+            if (still_packed_ == 0)
+                break;
+
+            // Frames that fit are unpacked in place.
+            const size_t frame_len (std::min(still_packed_, lz4_frame_size));
+            if (len - done >= frame_len)
+            {
+                unpack_frame(out + done, frame_len);
+                done += frame_len;
+            }
+            else
+            {
+                frame_.resize(frame_len);
+                unpack_frame(&frame_[0], frame_len);
+                buffered_ = frame_len;
+                used_ = 0;
+            }
+        }
+        return done;
+    }
+
+private:
+    void unpack_frame (char* out, size_t frame_len)
+    {
+        size_t packed (in_.size() - pos_);
+        if (framed_)
+        {
+            if (packed < sizeof(uint32_t))
+                throw std::runtime_error("lz4 data is truncated");
+
+            const unsigned char* p (reinterpret_cast<const unsigned char*>(in_.ptr() + pos_));
+            packed = p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+            pos_ += sizeof(uint32_t);
+            if (packed > in_.size() - pos_)
+                throw std::runtime_error("lz4 data is truncated");
+        }
+
+        int read (LZ4_uncompress(in_.ptr() + pos_, out, frame_len));
+        if (read < 0 || size_t(read) != packed)
+            throw std::runtime_error("lz4 decompression failed");
+
+        pos_ += packed;
+        still_packed_ -= frame_len;
+    }
+
+private:
+    const compressed_data& in_;
+    const bool  framed_;
+    size_t      pos_;
+    size_t      still_packed_;
+    binary_data frame_;
+    size_t      buffered_;
+    size_t      used_;
+};
+
+class deflate_decompressor : public decompressor::impl
+{
+public:
+    deflate_decompressor (const compressed_data& in)
+    {
+        init_stream(strm_);
+        strm_.next_in  = reinterpret_cast<Bytef*>(const_cast<char*>(in.ptr()));
+        strm_.avail_in = in.size();
+        if (inflateInit(&strm_) != Z_OK)
+            throw std::runtime_error("cannot initialize inflate");
+    }
+
+    ~deflate_decompressor()
+    {
+        inflateEnd(&strm_);
+    }
+
+    size_t read (char* out, size_t len)
+    {
+        strm_.next_out  = reinterpret_cast<Bytef*>(out);
+        strm_.avail_out = len;
+
+        while (strm_.avail_out > 0)
+        {
+            int rc (inflate(&strm_, Z_NO_FLUSH));
+            if (rc == Z_NEED_DICT)
+            {
+                auto dict (find_dictionary(strm_.adler));
+                if (dict == nullptr)
+                    throw std::runtime_error("data needs an unknown compression dictionary");
+
+                inflateSetDictionary(&strm_, reinterpret_cast<const Bytef*>(&dict->data[0]),
+                                     dict->data.size());
+                continue;
+            }
+
+            if (rc == Z_STREAM_END)
+                break;
+
+            if (rc != Z_OK)
+                throw std::runtime_error("inflate failed");
+        }
+
+        return len - strm_.avail_out;
+    }
+
+private:
+    z_stream    strm_;
+};
+
+/** The id of the dictionary a deflate stream needs, or zero. */
+uint32_t dictionary_of (const compressed_data& in)
+{
+    if (!in.uses_dictionary() || in.size() < 6)
+        return 0;
+
+    const unsigned char* p (reinterpret_cast<const unsigned char*>(in.ptr()));
+    return (uint32_t(p[2]) << 24) | (uint32_t(p[3]) << 16) | (uint32_t(p[4]) << 8) | p[5];
+}
+
+} // anonymous namespace
+
+codec codec_by_name (const std::string& name)
+{
+    if (name == "lz4")
+        return codec::lz4;
+
+    if (name == "deflate")
+        return codec::deflate;
+
+    throw std::runtime_error("unknown codec '" + name + "'");
+}
+
+//---------------------------------------------------------------------------
+
+compression_dictionary::compression_dictionary (binary_data d)
+    : data (std::move(d))
+{
+    if (data.empty())
+        throw std::runtime_error("empty compression dictionary");
+
+    id = adler32(adler32(0, Z_NULL, 0),
+                 reinterpret_cast<const Bytef*>(&data[0]), data.size());
+}
+
+void register_dictionary (dictionary_ptr dict)
+{
+    boost::mutex::scoped_lock l (dictionaries_lock);
+    dictionaries[dict->id] = dict;
+}
+
+dictionary_ptr find_dictionary (uint32_t id)
+{
+    boost::mutex::scoped_lock l (dictionaries_lock);
+    auto found (dictionaries.find(id));
+    return found == dictionaries.end() ? nullptr : found->second;
+}
+
+binary_data train_dictionary (const std::vector<binary_data>& samples,
+                              size_t size)
+{
+    // Count in how many samples every aligned string shows up.  A
+    // string that is in many different samples is worth more than one
+    // that is repeated a lot within a single sample; deflate can already
+    // find those on its own.
+    std::unordered_map<std::string, size_t> count;
+    for (auto& sample : samples)
+    {
+        std::unordered_map<std::string, bool> seen;
+        for (size_t i (0); i + segment_size <= sample.size(); i += segment_size / 2)
+            seen[std::string(&sample[i], segment_size)] = true;
+
+        for (auto& s : seen)
+            ++count[s.first];
+    }
+
+    std::vector<std::pair<size_t, std::string>> ranked;
+    for (auto& c : count)
+    {
+        if (c.second > 1)
+            ranked.emplace_back(c.second, c.first);
+    }
+    std::sort(ranked.begin(), ranked.end());
+
+    // Deflate can refer back to the end of the dictionary more cheaply,
+    // so the most common strings go last.
+    const size_t fits (std::min(ranked.size(), size / segment_size));
+    binary_data result;
+    result.reserve(fits * segment_size);
+    for (auto i (ranked.end() - fits); i != ranked.end(); ++i)
+        result.insert(result.end(), i->second.begin(), i->second.end());
+
+    return result;
+}
+
+//---------------------------------------------------------------------------
+
+bool compressed_data::uses_dictionary() const
+{
+    // The FDICT bit in the zlib header.
+    return method == codec::deflate && buf.size() >= 2 && (buf[1] & 0x20);
+}
+
+compressor::compressor (const compression_method& how)
+{
+    switch (how.method)
+    {
+    case codec::lz4:
+        impl_.reset(new lz4_compressor);
+        return;
+
+    case codec::deflate:
+        impl_.reset(new deflate_compressor(how.dictionary));
+        return;
+    }
+
+    throw std::runtime_error("unknown codec");
+}
+
+compressor::~compressor()
+{ }
+
+void compressor::write (const char* data, size_t len)
+{
+    impl_->write(data, len);
+}
+
+compressed_data compressor::finish()
+{
+    return impl_->finish();
+}
+
+decompressor::decompressor (const compressed_data& in)
+    : left_ (in.unpacked_len)
+{
+    if (left_ == 0)
+        return;
+
+    switch (in.method)
+    {
+    case codec::lz4:
+        impl_.reset(new lz4_decompressor(in));
+        return;
+
+    case codec::deflate:
+        impl_.reset(new deflate_decompressor(in));
+        return;
+    }
+
+    throw std::runtime_error("unknown codec");
+}
+
+decompressor::~decompressor()
+{ }
+
+size_t decompressor::read (char* out, size_t len)
+{
+    len = std::min(len, left_);
+    if (len == 0)
+        return 0;
+
+    if (impl_->read(out, len) != len)
+        throw std::runtime_error("compressed data is truncated");
+
+    left_ -= len;
+    return len;
+}
+
+//---------------------------------------------------------------------------
+
+compressed_data compress (const char* in, size_t len,
+                          const compression_method& how)
+{
+    if (len == 0)
+        return compressed_data();
+
+    // A single LZ4 block can skip the copy the compressor would make.
+    if (how.method == codec::lz4 && len <= lz4_frame_size)
+    {
+        compressed_data out;
+        out.unpacked_len = len;
+        append_lz4_block(out.buf, in, len);
+        return out;
+    }
+
+    compressor c (how);
+    c.write(in, len);
+    return c.finish();
+}
+
+void decompress (const compressed_data& in, char* out)
+{
+    decompressor d (in);
+    d.read(out, in.unpacked_len);
+}
+
+compressed_data recompress (compressed_data in, const compression_method& how)
+{
+    const uint32_t wanted (how.dictionary ? how.dictionary->id : 0);
+    if (   in.empty()
+        || (in.method == how.method
+            && (in.method == codec::lz4 || dictionary_of(in) == wanted)))
+    {
+        return in;
+    }
+
+    binary_data tmp (in.unpacked_len);
+    decompress(in, &tmp[0]);
+    return compress(tmp, how);
+}
+
+} // namespace hexa
+
@@ -1,6 +1,6 @@
 //---------------------------------------------------------------------------
 /// \file   hexa/compression.hpp
-/// \brief  Convenience functions and classes for using LZ4 compression
+/// \brief  Convenience functions and classes for compressing data
 //
 // This file is part of Hexahedra.
 //
@@ -22,12 +22,81 @@
 
 #pragma once
 
-#include "lz4/lz4.h"
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/utility.hpp>
 #include "basic_types.hpp"
 #include "serialize.hpp"
 
 namespace hexa {
 
+/** The ways data can be compressed. */
+enum class codec : uint8_t
+{
+    /** LZ4.  Very fast, and the default for everything. */
+    lz4 = 0,
+    /** Deflate at the highest level, optionally with a preset
+     ** dictionary.  A lot slower to compress than LZ4, but the results
+     ** are smaller; meant for terrain that is written once and then
+     ** mostly read back from disk. */
+    deflate = 1
+};
+
+/** Get a codec by name: "lz4" or "deflate".
+ * @throw std::runtime_error if there is no such codec */
+codec codec_by_name (const std::string& name);
+
+/** Data that is often found in a certain type of compressed data, such
+ ** as a typical run of stone blocks.
+ *  The deflate codec can use this as a starting point, which makes a big
+ *  difference for small buffers like a single chunk.  A dictionary is
+ *  identified by its checksum, and the data it was used on can only be
+ *  unpacked if the same dictionary was registered with
+ *  register_dictionary() first.  Once data has been stored with a
+ *  dictionary, that dictionary has to be kept around forever. */
+class compression_dictionary
+{
+public:
+    /** The contents; the most common strings are at the end. */
+    binary_data data;
+    /** The Adler-32 checksum of \a data. */
+    uint32_t    id;
+
+public:
+    explicit compression_dictionary (binary_data d);
+};
+
+typedef std::shared_ptr<const compression_dictionary> dictionary_ptr;
+
+/** Make a dictionary known, so data that was compressed with it can be
+ ** unpacked. */
+void register_dictionary (dictionary_ptr dict);
+
+/** Look up a registered dictionary.
+ * @return The dictionary, or a null pointer if it wasn't registered */
+dictionary_ptr find_dictionary (uint32_t id);
+
+/** Build a dictionary from a number of typical examples.
+ * @param samples  Uncompressed data; the more the better
+ * @param size     The maximum size of the dictionary, in bytes */
+binary_data train_dictionary (const std::vector<binary_data>& samples,
+                              size_t size = 32768);
+
+/** How a type of data should be compressed. */
+class compression_method
+{
+public:
+    codec           method;
+    /** Only used by \a codec::deflate; can be null. */
+    dictionary_ptr  dictionary;
+
+public:
+    compression_method (codec c = codec::lz4, dictionary_ptr d = nullptr)
+        : method (c), dictionary (d)
+    { }
+};
+
 /** A buffer holding compressed data. */
 class compressed_data
 {
@@ -37,14 +106,16 @@ public:
     /** The buffer with the compressed data. */
     buf_t       buf;
     /** The length of the uncompressed data. */
-    uint16_t    unpacked_len;
+    uint32_t    unpacked_len;
+    /** The codec that was used to compress the data. */
+    codec       method;
 
 public:
     typedef buf_t::iterator         iterator;
     typedef buf_t::const_iterator   const_iterator;
 
 public:
-    compressed_data() : unpacked_len(0) { }
+    compressed_data() : unpacked_len(0), method(codec::lz4) { }
 
     compressed_data(compressed_data&&) = default;
 
@@ -54,6 +125,7 @@ public:
         {
             buf = std::move(m.buf);
             unpacked_len = m.unpacked_len;
+            method = m.method;
         }
         return *this;
     }
@@ -77,53 +149,170 @@ public:
     iterator       end()         { return buf.end(); }
     const_iterator end() const   { return buf.end(); }
 
+    /** Check if the data can only be unpacked with a dictionary. */
+    bool uses_dictionary() const;
+
     bool operator== (const compressed_data& compare) const
     {
         return    unpacked_len == compare.unpacked_len
+               && method       == compare.method
                && buf          == compare.buf;
     }
 
-    template <class archive>
-    archive& serialize(archive& ar) const
+    /** Serialize the data.
+     *  LZ4 data that fits in 16 bits is written as the unpacked length
+     *  and the buffer, like it always was.  Anything else starts with an
+     *  empty length and a marker, followed by the codec and 32-bit
+     *  sizes. */
+    template <class obj>
+    serializer<obj>& serialize(serializer<obj>& ar) const
     {
-        return ar(unpacked_len)(buf);
+        if (method == codec::lz4 && unpacked_len <= 0xffff && buf.size() <= 0xffff)
+            return ar(uint16_t(unpacked_len))(buf);
+
+        ar(uint16_t(0))(uint16_t(extended_marker))(uint8_t(method));
+        ar(uint32_t(unpacked_len))(uint32_t(buf.size()));
+        return ar.raw_data(buf, buf.size());
     }
 
-    template <class archive>
-    archive& serialize(archive& ar)
+    template <class obj>
+    deserializer<obj>& serialize(deserializer<obj>& ar)
     {
-        return ar(unpacked_len)(buf);
+        uint16_t short_len;
+        method = codec::lz4;
+        ar(short_len);
+        unpacked_len = short_len;
+        if (unpacked_len != 0)
+            return ar(buf);
+
+        uint16_t marker;
+        ar(marker);
+        if (marker != extended_marker)
+        {
+            buf.clear();
+            return ar.raw_data(buf, marker);
+        }
+
+        uint8_t m;
+        uint32_t len, size;
+        ar(m)(len)(size);
+        if (m > uint8_t(codec::deflate))
+            throw std::runtime_error("unknown codec");
+
+        method = codec(m);
+        unpacked_len = len;
+        buf.clear();
+        return ar.raw_data(buf, size);
     }
+
+private:
+    enum { extended_marker = 0xffff };
 };
 
+/** The size of the frames LZ4 data is split into.
+ *  Anything up to this size is compressed as a single block, which is
+ *  how all LZ4 data used to be stored.  Larger data is split into
+ *  frames of this size, each one preceded by its compressed size, so it
+ *  can be unpacked a frame at a time. */
+const size_t lz4_frame_size = 65536;
 
-/** Compress a buffer
- * \param in   The data to be compressed.  Note that this buffer must be
- *             smaller than 65536 bytes.
- * \return The compressed data.  */
-template <class input_t>
-compressed_data compress (const input_t& in)
+/** Compresses data that is handed over a piece at a time.
+ *  There is no limit on the total size.
+ * \code
+
+compressor c (codec::lz4);
+c.write(&header[0], header.size());
+for (auto& item : items)
+    c.write(&item[0], item.size());
+
+compressed_data result (c.finish());
+
+ * \endcode */
+class compressor : boost::noncopyable
 {
-    size_t byte_size (in.size() * sizeof(typename input_t::value_type));
-    if (byte_size > 0xffff)
-        throw std::runtime_error("too much data for compression");
+public:
+    explicit compressor (const compression_method& how = compression_method());
+    ~compressor();
 
-    auto in_ptr (reinterpret_cast<const char*>(&*in.begin()));
-    compressed_data out;
-    if (byte_size > 0)
+    /** Add data to the end. */
+    void write (const char* data, size_t len);
+
+    /** Get the result; the compressor cannot be used after this. */
+    compressed_data finish();
+
+    /** The codec specific part. */
+    class impl
     {
-        out.resize(byte_size + 16);
-        std::fill(out.begin(), out.end(), 0);
-        out.unpacked_len = byte_size;
+    public:
+        virtual ~impl() { }
+        virtual void write (const char* data, size_t len) = 0;
+        virtual compressed_data finish() = 0;
+    };
+
+private:
+    std::unique_ptr<impl> impl_;
+};
 
-        int compressed_length (LZ4_compress(in_ptr, out.ptr(), byte_size));
-        if (compressed_length <= 0)
-            throw std::runtime_error("lz4 compression failed");
+/** Unpacks compressed data a piece at a time, straight into the
+ ** caller's buffers.
+ *  The compressed data must stay around until the decompressor is done
+ *  with it. */
+class decompressor : boost::noncopyable
+{
+public:
+    explicit decompressor (const compressed_data& in);
+    ~decompressor();
 
-        out.resize(compressed_length);
-    }
+    /** Unpack the next part of the data.
+     * \param out  Where to put it
+     * \param len  The size of \a out
+     * \return The number of bytes written; this is only less than
+     *         \a len at the end of the data */
+    size_t read (char* out, size_t len);
 
-    return out;
+    /** The number of bytes that are still to come. */
+    size_t bytes_left () const { return left_; }
+
+    /** The codec specific part. */
+    class impl
+    {
+    public:
+        virtual ~impl() { }
+        virtual size_t read (char* out, size_t len) = 0;
+    };
+
+private:
+    std::unique_ptr<impl> impl_;
+    size_t                left_;
+};
+
+/** Compress a block of memory.
+ * \param in      The data to be compressed
+ * \param len     The size of \a in, in bytes
+ * \param how     The codec and dictionary to use
+ * \return The compressed data */
+compressed_data compress (const char* in, size_t len,
+                          const compression_method& how = compression_method());
+
+/** Decompress into a block of memory.
+ * \param in    The compressed data
+ * \param out   Where to put the decompressed data; there must be room
+ *              for at least \a in.unpacked_len bytes */
+void decompress (const compressed_data& in, char* out);
+
+/** Compress a buffer
+ * \param in   The data to be compressed
+ * \param how  The codec and dictionary to use
+ * \return The compressed data.  */
+template <class input_t>
+compressed_data compress (const input_t& in,
+                          const compression_method& how = compression_method())
+{
+    size_t byte_size (in.size() * sizeof(typename input_t::value_type));
+    if (byte_size == 0)
+        return compressed_data();
+
+    return compress(reinterpret_cast<const char*>(&*in.begin()), byte_size, how);
 }
 
 
@@ -134,20 +323,11 @@ compressed_data compress (const input_t& in)
 template <class output_t>
 output_t& decompress (const compressed_data& in, output_t& out)
 {
-    uint16_t byte_size (in.unpacked_len);
-
-    // Make room for the unpacked data
-    out.resize(byte_size / sizeof(typename output_t::value_type));
-    std::fill(out.begin(), out.end(), 0);
-    if (byte_size > 0)
-    {
-        auto out_ptr (reinterpret_cast<char*>(&*out.begin()));
-        int output_length (LZ4_uncompress(in.ptr(), out_ptr, byte_size));
-        if (output_length < 0)
-            throw std::runtime_error("lz4 decompression failed");
-
-        assert((size_t)output_length == in.size());
-    }
+    // Make room for the unpacked data.  It is written straight into
+    // the output, so there's no need to clear it first.
+    out.resize(in.unpacked_len / sizeof(typename output_t::value_type));
+    if (in.unpacked_len > 0)
+        decompress(in, reinterpret_cast<char*>(&*out.begin()));
 
     return out;
 }
@@ -167,5 +347,9 @@ binary_data decompress (const compressed_data& in)
     return decompress_as<binary_data>(in);
 }
 
+/** Compress data again with another method, if it isn't compressed
+ ** that way already. */
+compressed_data recompress (compressed_data in, const compression_method& how);
+
 } // namespace hexa
 
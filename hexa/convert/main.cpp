@@ -0,0 +1,176 @@
+//---------------------------------------------------------------------------
+// convert/main.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include <iostream>
+#include <string>
+
+#include <boost/format.hpp>
+#include <boost/program_options/option.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/filesystem/operations.hpp>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/config.hpp>
+#include <hexa/db.hpp>
+#include <hexa/os.hpp>
+#include <hexa/persistence_regions.hpp>
+
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+using boost::format;
+using namespace hexa;
+
+namespace {
+
+std::string default_db_path()
+{
+    return (app_user_dir() / fs::path(SERVER_DB_PATH)).string();
+}
+
+/** Copy one table of chunk data. */
+size_t convert (sql::db& from, const char* table, const char* z,
+                persistent_storage_i::data_type type, persistence_regions& to)
+{
+    auto query (from.prepare_statement((format("SELECT x, y, %1%, data FROM %2%")
+                                        % z % table).str()));
+
+    const size_t batch_size (4096);
+    persistent_storage_i::batch batch;
+    size_t count (0);
+
+    int rc;
+    while ((rc = query.step()) == SQLITE_ROW)
+    {
+        batch.emplace_back(chunk_coordinates(query.get_uint(0),
+                                             query.get_uint(1),
+                                             query.get_uint(2)),
+                           deserialize_as<compressed_data>(query.get_blob(3)));
+
+        if (batch.size() == batch_size)
+        {
+            to.store(type, batch);
+            count += batch.size();
+            batch.clear();
+            std::cout << "\r" << table << ": " << count << std::flush;
+        }
+    }
+
+    if (rc != SQLITE_DONE)
+        throw std::runtime_error((format("cannot read table %1%") % table).str());
+
+    to.store(type, batch);
+    count += batch.size();
+    std::cout << "\r" << table << ": " << count << std::endl;
+
+    return count;
+}
+
+/** Copy the coarse height map. */
+size_t convert_heights (sql::db& from, persistence_regions& to)
+{
+    auto query (from.prepare_statement("SELECT x, y, z FROM height"));
+    size_t count (0);
+
+    int rc;
+    while ((rc = query.step()) == SQLITE_ROW)
+    {
+        to.store(map_coordinates(query.get_uint(0), query.get_uint(1)),
+                 query.get_uint(2));
+        ++count;
+    }
+
+    if (rc != SQLITE_DONE)
+        throw std::runtime_error("cannot read table height");
+
+    std::cout << "height: " << count << std::endl;
+    return count;
+}
+
+} // anonymous namespace
+
+int main (int argc, char* argv[])
+{
+    po::options_description generic("Command line options");
+    generic.add_options()
+        ("version,v", "print version string")
+        ("help", "show help message");
+
+    po::options_description config("Configuration");
+    config.add_options()
+        ("dbdir", po::value<std::string>()->default_value(default_db_path()),
+            "the server database directory")
+        ("game", po::value<std::string>()->default_value("defaultgame"),
+            "which game to convert")
+        ;
+
+    po::options_description cmdline;
+    cmdline.add(generic).add(config);
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, cmdline), vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << cmdline << std::endl;
+        return EXIT_SUCCESS;
+    }
+    if (vm.count("version"))
+    {
+        std::cout << "hexahedra " << PROJECT_VERSION << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    try
+    {
+        fs::path dbdir (fs::path(vm["dbdir"].as<std::string>())
+                        / vm["game"].as<std::string>());
+        fs::path db_file (dbdir / "world.db");
+
+        if (!fs::exists(db_file))
+            throw std::runtime_error("cannot find " + db_file.string());
+
+        if (fs::exists(dbdir / "regions"))
+            throw std::runtime_error((dbdir / "regions").string() + " already exists");
+
+        sql::db from (db_file);
+        persistence_regions to (dbdir / "regions");
+
+        convert(from, "area",     "idx", persistent_storage_i::area,    to);
+        convert(from, "chunk",    "z",   persistent_storage_i::chunk,   to);
+        convert(from, "surface",  "z",   persistent_storage_i::surface, to);
+        convert(from, "lightmap", "z",   persistent_storage_i::light,   to);
+        convert_heights(from, to);
+
+        to.cleanup();
+        std::cout << "Done.  Start the server with --storage regions to use them."
+                  << std::endl;
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
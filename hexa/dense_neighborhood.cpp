@@ -0,0 +1,139 @@
+//---------------------------------------------------------------------------
+// lib/dense_neighborhood.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "dense_neighborhood.hpp"
+
+#include <algorithm>
+#include <boost/thread/thread.hpp>
+
+#include "block_types.hpp"
+#include "chunk.hpp"
+#include "ray_bundle.hpp"
+
+namespace hexa {
+
+namespace {
+
+/** Round down to a multiple of the chunk size, also for negative
+ ** numbers. */
+int32_t chunk_floor (int32_t x)
+{
+    return x >= 0 ? x / chunk_size : -((chunk_size - 1 - x) / chunk_size);
+}
+
+} // anonymous namespace
+
+dense_neighborhood::dense_neighborhood (storage_i& src,
+                                        const chunk_coordinates& center,
+                                        world_vector lo, world_vector hi,
+                                        unsigned int threads)
+    : lo_       (lo)
+    , size_     (hi - lo)
+    , stride_y_ (size_.x)
+    , stride_z_ (size_.x * size_.y)
+    , data_     (size_t(size_.x) * size_.y * size_.z, type::air)
+{
+    assert(size_.x > 0 && size_.y > 0 && size_.z > 0);
+
+    std::vector<world_vector> chunks;
+    for (int32_t z (chunk_floor(lo.z)); z <= chunk_floor(hi.z - 1); ++z)
+    {
+        for (int32_t y (chunk_floor(lo.y)); y <= chunk_floor(hi.y - 1); ++y)
+        {
+            for (int32_t x (chunk_floor(lo.x)); x <= chunk_floor(hi.x - 1); ++x)
+                chunks.emplace_back(x, y, z);
+        }
+    }
+
+    // Every chunk covers its own part of the array, so the threads
+    // don't have to coordinate anything.
+    threads = std::max(1u, std::min<unsigned int>(threads, chunks.size()));
+    auto work ([&](unsigned int first)
+    {
+        for (size_t i (first); i < chunks.size(); i += threads)
+            copy(src, center, chunks[i]);
+    });
+
+    boost::thread_group helpers;
+    for (unsigned int i (1); i < threads; ++i)
+        helpers.create_thread([=]{ work(i); });
+
+    work(0);
+    helpers.join_all();
+}
+
+void dense_neighborhood::copy (storage_i& src, const chunk_coordinates& center,
+                               world_vector rel)
+{
+    chunk_coordinates pos (center + rel);
+    if (is_air_chunk(pos, src.get_coarse_height(pos)))
+        return;
+
+    auto cnk (src.get_chunk(pos));
+    if (cnk == nullptr)
+        return;
+
+    // The part of the chunk that is inside the box.
+    const world_vector corner (rel * chunk_size);
+    const world_vector from (std::max(lo_.x, corner.x) - corner.x,
+                             std::max(lo_.y, corner.y) - corner.y,
+                             std::max(lo_.z, corner.z) - corner.z);
+    const world_vector to (std::min<int32_t>(lo_.x + size_.x - corner.x, chunk_size),
+                           std::min<int32_t>(lo_.y + size_.y - corner.y, chunk_size),
+                           std::min<int32_t>(lo_.z + size_.z - corner.z, chunk_size));
+
+    const chunk& c (*cnk);
+    for (int32_t z (from.z); z < to.z; ++z)
+    {
+        for (int32_t y (from.y); y < to.y; ++y)
+        {
+            uint16_t* dest (&data_[index(corner + world_vector(from.x, y, z))]);
+            for (int32_t x (from.x); x < to.x; ++x)
+                *dest++ = c(x, y, z).type;
+        }
+    }
+}
+
+void extend_to_reach (const ray_bundle& r, world_vector& lo, world_vector& hi)
+{
+    for (auto& v : r.flat_voxels)
+    {
+        lo.x = std::min(lo.x, v.x);
+        lo.y = std::min(lo.y, v.y);
+        lo.z = std::min(lo.z, v.z);
+        hi.x = std::max<int32_t>(hi.x, v.x + chunk_size);
+        hi.y = std::max<int32_t>(hi.y, v.y + chunk_size);
+        hi.z = std::max<int32_t>(hi.z, v.z + chunk_size);
+    }
+}
+
+std::vector<float> opacity_table ()
+{
+    std::vector<float> result;
+    result.reserve(material_prop.size());
+    for (auto& m : material_prop)
+        result.push_back(1.0f - (m.transparency / 255.f));
+
+    return result;
+}
+
+} // namespace hexa
+
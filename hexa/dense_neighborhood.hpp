@@ -0,0 +1,157 @@
+//---------------------------------------------------------------------------
+/// \file   hexa/dense_neighborhood.hpp
+/// \brief  A read-only copy of the material IDs around a chunk.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <cassert>
+#include <vector>
+#include "basic_types.hpp"
+#include "block_types.hpp"
+#include "storage_i.hpp"
+
+namespace hexa {
+
+class ray_bundle;
+
+/** A read-only copy of the material IDs in a box around a chunk.
+ *  Unlike \ref hexa::neighborhood, which looks up the right chunk for
+ *  every block, this one copies everything it needs into one array
+ *  when it is created.  After that, reading a block is a single
+ *  indexed load.  This makes it a good fit for the light map
+ *  generators, which look at the same region millions of times.
+ *
+ *  Blocks can be read through their position, or through an index
+ *  plus an offset(), which saves a few multiplications in inner loops.
+ * \code
+
+dense_neighborhood snapshot (storage, pos, world_vector(-16, -16, -16),
+                                           world_vector(32, 32, 32));
+
+auto base (snapshot.index(block));
+for (auto& v : voxels)
+    total += opacity[snapshot.at(base + snapshot.offset(v))];
+
+ * \endcode */
+class dense_neighborhood
+{
+public:
+    /** Copy the material IDs from storage.
+     *  Chunks that are known to be all air are skipped without being
+     *  fetched, and unavailable chunks count as air.
+     * @param src      The chunk storage
+     * @param center   The position of the chunk in the middle
+     * @param lo       The lower corner of the box, in blocks relative to
+     *                 the corner of \a center
+     * @param hi       The upper corner of the box (exclusive)
+     * @param threads  The number of threads that fetch and copy the
+     *                 chunks */
+    dense_neighborhood (storage_i& src, const chunk_coordinates& center,
+                        world_vector lo, world_vector hi,
+                        unsigned int threads = 1);
+
+    /** The lower corner of the box. */
+    world_vector lower() const { return lo_; }
+
+    /** The upper corner of the box (exclusive). */
+    world_vector upper() const { return lo_ + size_; }
+
+    /** Get the array index of a block position. */
+    int32_t index (world_vector pos) const
+    {
+        assert(pos.x >= lo_.x && pos.x < lo_.x + size_.x);
+        assert(pos.y >= lo_.y && pos.y < lo_.y + size_.y);
+        assert(pos.z >= lo_.z && pos.z < lo_.z + size_.z);
+        return offset(pos - lo_);
+    }
+
+    /** Get the difference between the indices of two blocks that are a
+     ** given distance apart. */
+    int32_t offset (world_vector delta) const
+    {
+        return delta.x + delta.y * stride_y_ + delta.z * stride_z_;
+    }
+
+    /** Get a material ID by its index. */
+    uint16_t at (int32_t idx) const
+    {
+        assert(idx >= 0 && size_t(idx) < data_.size());
+        return data_[idx];
+    }
+
+    /** Get a material ID by its position. */
+    uint16_t operator[] (world_vector pos) const
+    {
+        return at(index(pos));
+    }
+
+private:
+    void copy (storage_i& src, const chunk_coordinates& center,
+               world_vector rel);
+
+private:
+    world_vector            lo_;
+    world_vector            size_;
+    int32_t                 stride_y_;
+    int32_t                 stride_z_;
+    std::vector<uint16_t>   data_;
+};
+
+/** Extend a box so it holds every voxel a ray bundle visits, starting
+ ** from any block in a chunk.
+ * @param r   The rays, relative to the block they start from
+ * @param lo  The lower corner of the box, is updated
+ * @param hi  The upper corner of the box (exclusive), is updated */
+void extend_to_reach (const ray_bundle& r, world_vector& lo, world_vector& hi);
+
+/** The opacity of every material, in the range 0..1. */
+std::vector<float> opacity_table ();
+
+/** The opacity of the voxels around a block, for ray_bundle::follow().
+ ** If the very first voxel of a ray is a custom block, it is skipped. */
+class opacity_at
+{
+public:
+    /** \param nbh      The materials around the block
+     *  \param opacity  The table from opacity_table()
+     *  \param blk      The block the rays start from */
+    opacity_at (const dense_neighborhood& nbh, const std::vector<float>& opacity,
+                world_vector blk)
+        : nbh_ (nbh), opacity_ (opacity), base_ (nbh.index(blk))
+    { }
+
+    float operator() (world_vector voxel, bool first) const
+    {
+        auto type (nbh_.at(base_ + nbh_.offset(voxel)));
+        if (first && material_prop[type].is_custom_block())
+            return 0.0f;
+
+        return opacity_[type];
+    }
+
+private:
+    const dense_neighborhood&   nbh_;
+    const std::vector<float>&   opacity_;
+    int32_t                     base_;
+};
+
+} // namespace hexa
+
@@ -0,0 +1,146 @@
+//---------------------------------------------------------------------------
+// lib/lamp_index.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "lamp_index.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "block_types.hpp"
+#include "chunk.hpp"
+#include "voxel_range.hpp"
+
+namespace hexa {
+
+namespace {
+
+/** How far a position is outside the range 0..chunk_size. */
+int32_t outside (int32_t x)
+{
+    return x < 0 ? -x : std::max(0, x - (chunk_size - 1));
+}
+
+} // anonymous namespace
+
+lamp_index::lamp_index (storage_i& src, size_t max_size)
+    : src_      (src)
+    , max_size_ (max_size)
+    , changes_  (0)
+{
+}
+
+std::vector<lamp_index::lamp>
+lamp_index::near (const chunk_coordinates& pos, float radius)
+{
+    std::vector<lamp> result;
+    const float limit (radius * radius);
+    const int32_t reach ((int32_t(std::ceil(radius)) + chunk_size - 1) / chunk_size);
+
+    for (auto offset : cube_range<world_vector>(reach))
+    {
+        const chunk_coordinates cp (pos + offset);
+        cell lamps;
+        boost::unique_lock<boost::mutex> lock (lock_);
+        auto found (cells_.try_get(cp));
+        if (found)
+        {
+            lamps = *found;
+        }
+        else
+        {
+            // Scanning might have to load the chunk, don't keep the
+            // others waiting.
+            const unsigned int stamp (changes_);
+            lock.unlock();
+            lamps = scan(cp);
+            lock.lock();
+            if (changes_ == stamp)
+            {
+                cells_[cp] = lamps;
+                cells_.prune(max_size_);
+            }
+        }
+        lock.unlock();
+
+        for (auto& l : lamps)
+        {
+            const world_vector p (offset * chunk_size + world_vector(l.pos));
+            const world_vector d (outside(p.x), outside(p.y), outside(p.z));
+            if (d.x * d.x + d.y * d.y + d.z * d.z <= limit)
+                result.push_back(lamp { p, l.strength });
+        }
+    }
+
+    return result;
+}
+
+void
+lamp_index::changed (world_coordinates pos, uint16_t material)
+{
+    boost::lock_guard<boost::mutex> lock (lock_);
+    ++changes_;
+
+    // Chunks that aren't in the index yet will be scanned later on.
+    auto found (cells_.try_get(pos / chunk_size));
+    if (!found)
+        return;
+
+    cell& lamps (*found);
+    const chunk_index ci (pos % chunk_size);
+    lamps.erase(std::remove_if(lamps.begin(), lamps.end(),
+                               [&](const entry& e){ return e.pos == ci; }),
+                lamps.end());
+
+    const uint8_t strength (material_prop[material].light_emission);
+    if (strength > 0)
+        lamps.push_back(entry { ci, strength });
+}
+
+void
+lamp_index::forget (const chunk_coordinates& pos)
+{
+    boost::lock_guard<boost::mutex> lock (lock_);
+    ++changes_;
+    cells_.remove(pos);
+}
+
+lamp_index::cell
+lamp_index::scan (const chunk_coordinates& pos) const
+{
+    cell result;
+    if (is_air_chunk(pos, src_.get_coarse_height(pos)))
+        return result;
+
+    auto cnk (src_.get_chunk(pos));
+    if (cnk == nullptr)
+        return result;
+
+    for (auto i : every_block_in_chunk)
+    {
+        const uint8_t strength (material_prop[(*cnk)[i].type].light_emission);
+        if (strength > 0)
+            result.push_back(entry { i, strength });
+    }
+
+    return result;
+}
+
+} // namespace hexa
@@ -0,0 +1,86 @@
+//---------------------------------------------------------------------------
+/// \file   hexa/lamp_index.hpp
+/// \brief  Find the light emitting blocks around a chunk.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include "basic_types.hpp"
+#include "lru_cache.hpp"
+#include "storage_i.hpp"
+
+namespace hexa {
+
+/** A grid of all light emitting blocks, one cell per chunk.
+ *  A chunk is scanned for lamps the first time it is needed.  After
+ *  that, the index has to be told about every change: changed() for
+ *  single blocks, and forget() when the terrain generators have been
+ *  at work on a whole chunk. */
+class lamp_index
+{
+public:
+    /** A light emitting block. */
+    struct lamp
+    {
+        /** The position, relative to the corner of the chunk that was
+         ** asked for in near(). */
+        world_vector    pos;
+        /** The material's light emission, 1..255. */
+        uint8_t         strength;
+    };
+
+    /** Set up an empty index.
+     * @param src       The chunks are scanned from here
+     * @param max_size  The number of chunks to keep in the index */
+    lamp_index (storage_i& src, size_t max_size = 65536);
+
+    /** Get all lamps within a given distance of a chunk. */
+    std::vector<lamp> near (const chunk_coordinates& pos, float radius);
+
+    /** Update the index after a single block has changed. */
+    void changed (world_coordinates pos, uint16_t material);
+
+    /** Scan a chunk again the next time it is needed. */
+    void forget (const chunk_coordinates& pos);
+
+private:
+    struct entry
+    {
+        chunk_index     pos;
+        uint8_t         strength;
+    };
+
+    typedef std::vector<entry> cell;
+
+    cell scan (const chunk_coordinates& pos) const;
+
+private:
+    storage_i&                         src_;
+    size_t                             max_size_;
+    boost::mutex                       lock_;
+    lru_cache<chunk_coordinates, cell> cells_;
+    /** Counts the changes, so a chunk that changed while it was being
+     ** scanned is not stored. */
+    unsigned int                       changes_;
+};
+
+} // namespace hexa
@@ -0,0 +1,315 @@
+//---------------------------------------------------------------------------
+// lib/light_volume.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "light_volume.hpp"
+
+#include <algorithm>
+#include <utility>
+
+#include "block_types.hpp"
+#include "chunk.hpp"
+#include "dense_neighborhood.hpp"
+
+namespace hexa {
+
+namespace {
+
+enum
+{
+    emission_mask = 0x0f,
+    /** Light can get into this block. */
+    lit_flag      = 0x10,
+    /** Sky light goes straight through this block. */
+    clear_flag    = 0x20,
+    /** The block is on the outer layer of the box. */
+    edge_flag     = 0x40
+};
+
+/** The direction of step_[5]. */
+const int down (5);
+
+uint8_t cell (uint16_t material)
+{
+    const auto& m (material_prop[material]);
+    uint8_t result ((m.light_emission * 15 + 127) / 255);
+    if (material == type::air || m.transparency > 0)
+        result |= lit_flag;
+    if (m.transparency == 255)
+        result |= clear_flag;
+
+    return result;
+}
+
+/** Round down to a multiple of the chunk size, also for negative
+ ** numbers. */
+int32_t chunk_floor (int32_t x)
+{
+    return x >= 0 ? x / chunk_size : -((chunk_size - 1 - x) / chunk_size);
+}
+
+} // anonymous namespace
+
+light_volume::light_volume (storage_i& src, const chunk_coordinates& center,
+                            int margin)
+    : lo_       (-margin - 1, -margin - 1, -margin - 1)
+    , size_     (chunk_size + 2 * margin + 2, chunk_size + 2 * margin + 2,
+                 chunk_size + 2 * margin + 2)
+    , stride_z_ (size_.x * size_.y)
+    , step_     {{ 1, -1, size_.x, -size_.x, stride_z_, -stride_z_ }}
+    , cells_    (size_t(size_.x) * size_.y * size_.z)
+    , levels_   (cells_.size(), 0)
+    , above_    (size_t(size_.x) * size_.y, true)
+{
+    {
+    dense_neighborhood materials (src, center, lo_, lo_ + size_);
+    for (size_t i (0); i < cells_.size(); ++i)
+        cells_[i] = cell(materials.at(i));
+    }
+
+    for (int32_t z (0); z < size_.z; ++z)
+    {
+        for (int32_t y (0); y < size_.y; ++y)
+        {
+            for (int32_t x (0); x < size_.x; ++x)
+            {
+                if (   x == 0 || x == size_.x - 1 || y == 0 || y == size_.y - 1
+                    || z == 0 || z == size_.z - 1)
+                {
+                    cells_[x + y * size_.x + z * stride_z_] |= edge_flag;
+                }
+            }
+        }
+    }
+
+    // Find out which columns are still open to the sky above the box.
+    // The coarse height map tells us where to stop looking.
+    const int32_t top (lo_.z + size_.z);
+    for (int32_t cy (chunk_floor(lo_.y)); cy <= chunk_floor(lo_.y + size_.y - 1); ++cy)
+    {
+        for (int32_t cx (chunk_floor(lo_.x)); cx <= chunk_floor(lo_.x + size_.x - 1); ++cx)
+        {
+            chunk_coordinates pos (center + world_vector(cx, cy, chunk_floor(top)));
+            const auto height (src.get_coarse_height(pos));
+            if (height == undefined_height)
+                continue;
+
+            const world_vector corner (cx * chunk_size, cy * chunk_size, 0);
+            const int32_t x0 (std::max(lo_.x, corner.x) - corner.x);
+            const int32_t x1 (std::min<int32_t>(lo_.x + size_.x - corner.x, chunk_size));
+            const int32_t y0 (std::max(lo_.y, corner.y) - corner.y);
+            const int32_t y1 (std::min<int32_t>(lo_.y + size_.y - corner.y, chunk_size));
+
+            int32_t from (top - chunk_floor(top) * chunk_size);
+            for (; !is_air_chunk(pos, height); ++pos.z, from = 0)
+            {
+                auto cnk (src.get_chunk(pos));
+                if (cnk == nullptr)
+                    continue;
+
+                bool any_open (false);
+                for (int32_t y (y0); y < y1; ++y)
+                {
+                    for (int32_t x (x0); x < x1; ++x)
+                    {
+                        const size_t col (x + corner.x - lo_.x + (y + corner.y - lo_.y) * size_.x);
+                        bool open (above_[col]);
+                        for (int32_t z (from); z < chunk_size && open; ++z)
+                            open = cell((*cnk)(x, y, z).type) & clear_flag;
+
+                        above_[col] = open;
+                        any_open |= open;
+                    }
+                }
+                if (!any_open)
+                    break;
+            }
+        }
+    }
+
+    for (channel c : { sky, artificial })
+    {
+        queue todo;
+        for (int32_t z (1); z < size_.z - 1; ++z)
+        {
+            // Sky light can only start in the top layer.
+            if (c == sky && z < size_.z - 2)
+                continue;
+
+            for (int32_t y (1); y < size_.y - 1; ++y)
+            {
+                for (int32_t x (1); x < size_.x - 1; ++x)
+                {
+                    const int32_t i (x + y * size_.x + z * stride_z_);
+                    const uint8_t lvl (source(i, c));
+                    if (lvl > 0)
+                    {
+                        set(i, c, lvl);
+                        todo.push_back(i);
+                    }
+                }
+            }
+        }
+        spread(todo, c);
+    }
+}
+
+uint8_t light_volume::source (int32_t i, channel c) const
+{
+    if (c == artificial)
+        return cells_[i] & emission_mask;
+
+    // Sky light comes in through the edge layer at the top of the box.
+    const int32_t above (i + stride_z_);
+    if (!(cells_[i] & lit_flag) || above + stride_z_ < int32_t(cells_.size()))
+        return 0;
+
+    const uint8_t edge (cells_[above]);
+    if (!above_[above % stride_z_] || !(edge & lit_flag))
+        return 0;
+
+    if ((edge & clear_flag) && (cells_[i] & clear_flag))
+        return max_level;
+
+    return (edge & clear_flag) ? max_level - 1 : max_level - 2;
+}
+
+void light_volume::spread (queue& todo, channel c)
+{
+    for (size_t head (0); head < todo.size(); ++head)
+    {
+        const int32_t i (todo[head]);
+        const uint8_t lvl (get(i, c));
+        if (lvl <= 1)
+            continue;
+
+        for (int d (0); d < 6; ++d)
+        {
+            const int32_t next (i + step_[d]);
+            const uint8_t flags (cells_[next]);
+            if ((flags & (lit_flag | edge_flag)) != lit_flag)
+                continue;
+
+            uint8_t next_lvl (lvl - 1);
+            if (c == sky && d == down && lvl == max_level && (flags & clear_flag))
+                next_lvl = max_level;
+
+            if (next_lvl > get(next, c))
+            {
+                set(next, c, next_lvl);
+                todo.push_back(next);
+            }
+        }
+    }
+}
+
+void light_volume::put_out (int32_t i, channel c, queue& relight)
+{
+    const uint8_t lvl (get(i, c));
+    if (lvl == 0)
+        return;
+
+    // Every voxel that could have gotten its light from a darkened
+    // neighbor is darkened as well.  Brighter voxels must have their
+    // own way to the light; they will fill the gap again.
+    std::vector<std::pair<int32_t, uint8_t>> dark;
+    set(i, c, 0);
+    dark.emplace_back(i, lvl);
+    for (size_t head (0); head < dark.size(); ++head)
+    {
+        const int32_t j (dark[head].first);
+        const uint8_t was (dark[head].second);
+        for (int d (0); d < 6; ++d)
+        {
+            const int32_t next (j + step_[d]);
+            const uint8_t next_lvl (get(next, c));
+            if (next_lvl == 0)
+                continue;
+
+            if (   next_lvl < was
+                || (c == sky && d == down && was == max_level && next_lvl == max_level))
+            {
+                set(next, c, 0);
+                dark.emplace_back(next, next_lvl);
+            }
+            else
+            {
+                relight.push_back(next);
+            }
+        }
+    }
+
+    // Light sources in the dark area light up again.
+    for (auto& p : dark)
+    {
+        const uint8_t own (source(p.first, c));
+        if (own > get(p.first, c))
+        {
+            set(p.first, c, own);
+            relight.push_back(p.first);
+        }
+    }
+}
+
+void light_volume::update (int32_t i, channel c)
+{
+    queue relight;
+    put_out(i, c, relight);
+
+    for (int d (0); d < 6; ++d)
+    {
+        const int32_t next (i + step_[d]);
+        if (get(next, c) > 0)
+            relight.push_back(next);
+    }
+
+    const uint8_t own (source(i, c));
+    if (own > get(i, c))
+    {
+        set(i, c, own);
+        relight.push_back(i);
+    }
+
+    spread(relight, c);
+}
+
+void light_volume::change (world_vector pos, uint16_t material)
+{
+    const int32_t i (index(pos));
+    const uint8_t flags (cells_[i] & edge_flag);
+    cells_[i] = cell(material) | flags;
+
+    if (!flags)
+    {
+        update(i, sky);
+        update(i, artificial);
+        return;
+    }
+
+    // The edge is never lit, but the top of it lets the sky light in.
+    const world_vector rel (pos - lo_);
+    if (   rel.z == size_.z - 1 && rel.x > 0 && rel.x < size_.x - 1
+        && rel.y > 0 && rel.y < size_.y - 1)
+    {
+        update(i - stride_z_, sky);
+    }
+}
+
+} // namespace hexa
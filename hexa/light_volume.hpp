@@ -0,0 +1,180 @@
+//---------------------------------------------------------------------------
+/// \file   hexa/light_volume.hpp
+/// \brief  Flood-filled sky and block light around a chunk.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <vector>
+#include "basic_types.hpp"
+#include "storage_i.hpp"
+
+namespace hexa {
+
+/** The light level of every voxel in a box around a chunk.
+ *  There are two channels, both 0..15.  Sky light starts at 15 in the
+ *  columns that are open to the sky, and travels straight down through
+ *  clear blocks without losing any strength.  Block light starts at
+ *  the blocks that emit light.  Both channels lose one level for every
+ *  other step they take through air or transparent blocks.
+ *
+ *  Light never travels further than 15 blocks (apart from sky light
+ *  going straight down), so the box reaches \a margin blocks beyond
+ *  the chunk on all sides; this makes the light levels in and right
+ *  next to the chunk exact.  After a block changes, change() only
+ *  visits the voxels whose light is affected, instead of filling the
+ *  whole box again.
+ *
+ *  All positions are relative to the corner of the center chunk. */
+class light_volume
+{
+public:
+    /** The light channels. */
+    enum channel { sky = 0, artificial = 1 };
+
+    enum
+    {
+        /** The highest light level. */
+        max_level = 15,
+        /** The default distance the box reaches beyond the chunk. */
+        default_margin = max_level + 1
+    };
+
+    /** Copy the materials around a chunk from storage, and flood the
+     ** box with light.
+     * @param src     The chunk storage
+     * @param center  The position of the chunk in the middle
+     * @param margin  How far the box reaches beyond the chunk */
+    light_volume (storage_i& src, const chunk_coordinates& center,
+                  int margin = default_margin);
+
+    /** The lower corner of the box. */
+    world_vector lower() const { return lo_ + world_vector(1, 1, 1); }
+
+    /** The upper corner of the box (exclusive). */
+    world_vector upper() const { return lo_ + size_ - world_vector(1, 1, 1); }
+
+    /** Check if a position is inside the box. */
+    bool contains (world_vector pos) const
+    {
+        const world_vector l (lower()), u (upper());
+        return    pos.x >= l.x && pos.x < u.x
+               && pos.y >= l.y && pos.y < u.y
+               && pos.z >= l.z && pos.z < u.z;
+    }
+
+    /** Check if change() can handle a block.
+     *  This is true for the box itself, and for the single layer of
+     *  blocks around it that keeps the light in. */
+    bool covers (world_vector pos) const
+    {
+        const world_vector l (lo_), u (lo_ + size_);
+        return    pos.x >= l.x && pos.x < u.x
+               && pos.y >= l.y && pos.y < u.y
+               && pos.z >= l.z && pos.z < u.z;
+    }
+
+    /** Check if a change to the blocks in a region can affect the light
+     ** in this box.
+     *  This is the case for every region that overlaps the box, or
+     *  that is somewhere above it.  Changes above the box cannot be
+     *  handled by change(), the volume has to be built again.
+     * @param lo  The lower corner of the region
+     * @param hi  The upper corner of the region (exclusive) */
+    bool depends_on (world_vector lo, world_vector hi) const
+    {
+        const world_vector l (lo_), u (lo_ + size_);
+        return    lo.x < u.x && hi.x > l.x
+               && lo.y < u.y && hi.y > l.y
+               && hi.z > l.z;
+    }
+
+    /** Get the light level of a voxel.
+     *  Positions outside the box are always dark. */
+    uint8_t level (world_vector pos, channel c) const
+    {
+        if (!contains(pos))
+            return 0;
+
+        return get(index(pos), c);
+    }
+
+    /** Change a block, and update the light around it.
+     *  The cost of this is proportional to the number of voxels whose
+     *  light changes, not to the size of the box.
+     * @param pos       The block's position, see covers()
+     * @param material  The new material */
+    void change (world_vector pos, uint16_t material);
+
+private:
+    typedef std::vector<int32_t> queue;
+
+    int32_t index (world_vector pos) const
+    {
+        pos -= lo_;
+        assert(pos.x >= 0 && pos.x < size_.x);
+        assert(pos.y >= 0 && pos.y < size_.y);
+        assert(pos.z >= 0 && pos.z < size_.z);
+        return pos.x + pos.y * size_.x + pos.z * stride_z_;
+    }
+
+    uint8_t get (int32_t i, channel c) const
+    {
+        return (levels_[i] >> (c * 4)) & 0x0f;
+    }
+
+    void set (int32_t i, channel c, uint8_t lvl)
+    {
+        const int shift (c * 4);
+        levels_[i] = (levels_[i] & ~(0x0f << shift)) | (lvl << shift);
+    }
+
+    /** The level a voxel has on its own, without any light coming in
+     ** from its neighbors. */
+    uint8_t source (int32_t i, channel c) const;
+
+    /** Spread the light from a list of lit voxels. */
+    void spread (queue& todo, channel c);
+
+    /** Put out the light in and around a voxel, and collect the lit
+     ** voxels around the darkened area. */
+    void put_out (int32_t i, channel c, queue& relight);
+
+    /** Recalculate the light around a voxel after it changed. */
+    void update (int32_t i, channel c);
+
+private:
+    world_vector            lo_;
+    world_vector            size_;
+    int32_t                 stride_z_;
+    std::array<int32_t, 6>  step_;
+
+    /** Emitted light in the lower four bits, plus a few flags. */
+    std::vector<uint8_t>    cells_;
+    /** Sky light in the lower four bits, block light in the upper. */
+    std::vector<uint8_t>    levels_;
+    /** For every column, whether the sky is visible from right above
+     ** the box. */
+    std::vector<bool>       above_;
+};
+
+} // namespace hexa
@@ -23,6 +23,7 @@
 #pragma once
 
 #include <memory>
+#include <type_traits>
 #include "basic_types.hpp"
 #include "chunk_base.hpp"
 #include "pos_dir.hpp"
@@ -66,6 +67,13 @@ struct light
 
 #pragma pack(pop)
 
+static_assert(sizeof(light) == 2 && std::is_trivially_copyable<light>::value,
+              "the flat light map layout copies light values as they are");
+
+/** Light values are serialized as a single 16-bit integer. */
+template <>
+struct flat_layout<light> : flat_fields<2> { };
+
 /** The light map of a chunk.
  *  This is a simple array of light values.  The position and direction of
  *  each element is determined by the chunk's \ref hexa::surface "surface";
@@ -96,7 +104,6 @@ public:
     template <class archive>
     archive& serialize(archive& ar)
     {
-        ///\todo Serialize lightmaps properly
         return ar(data);
     }
 };
@@ -126,9 +133,14 @@ public:
 
     bool empty() const { return opaque.empty() && transparent.empty(); }
 
+    /** Serialize the light maps.
+     *  Light values have a flat_layout, so both arrays are copied in
+     *  one go. */
     template <class archive>
     archive& serialize(archive& ar)
-        { return ar(opaque)(transparent)(phase); }
+    {
+        return ar(opaque)(transparent)(phase);
+    }
 };
 
 /** Reference counted pointer for light data. */
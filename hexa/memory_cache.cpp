@@ -21,7 +21,13 @@
 
 #include "memory_cache.hpp"
 
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <ostream>
+#include <boost/algorithm/string.hpp>
 #include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
 #include "trace.hpp"
 
 namespace hexa {
@@ -37,54 +43,279 @@ std::shared_ptr<type> unpack_as(const compressed_data& data)
     return std::make_shared<type>(deserialize_as<type>(tmp));
 }
 
+/** Fetch something from the persistent storage, or return a nullptr if
+ ** it isn't there. */
+template <class type>
+std::shared_ptr<type> load_as(persistent_storage_i& from,
+                              persistent_storage_i::data_type t,
+                              chunk_coordinates xyz)
+{
+    if (!from.is_available(t, xyz))
+        return nullptr;
+
+    return unpack_as<type>(from.retrieve(t, xyz));
+}
+
+/** Compress a batch of dirty elements, and hand them to the persistent
+ ** storage in one go. */
+template <class batch_t>
+void write_back (persistent_storage_i& to, persistent_storage_i::data_type t,
+                 const batch_t& data,
+                 const std::array<compression_method, 5>& how)
+{
+    persistent_storage_i::batch out;
+    out.reserve(data.size());
+    for (auto& elem : data)
+        out.emplace_back(elem.first, compress(serialize(*elem.second), how[t]));
+
+    to.store(t, out);
+}
+
+/** Fetch the elements that aren't in memory yet in one batch. */
+template <class type, class cache_t>
+void prefetch_into (cache_t& cache, persistent_storage_i& from,
+                    persistent_storage_i::data_type t,
+                    const std::vector<chunk_coordinates>& xyz)
+{
+    std::vector<chunk_coordinates> missing;
+    for (auto& pos : xyz)
+    {
+        if (!cache.contains(pos))
+            missing.emplace_back(pos);
+    }
+
+    if (missing.empty())
+        return;
+
+    for (auto& elem : from.retrieve(t, missing))
+        cache.insert_if_missing(elem.first, unpack_as<type>(elem.second));
+}
+
+template <class type>
+size_t vector_bytes (const std::vector<type>& v)
+{
+    return v.capacity() * sizeof(type);
+}
+
+size_t area_bytes (const area_ptr& p)
+{
+    return sizeof(area_data) + chunk_area * sizeof(area_data::value_type);
+}
+
+size_t chunk_bytes (const chunk_ptr& p)
+{
+    return sizeof(chunk) + p->size() * sizeof(block);
+}
+
+size_t packed_bytes (const palette_chunk_ptr& p)
+{
+    return p->bytes();
+}
+
+size_t lightmap_bytes (const lightmap_ptr& p)
+{
+    return sizeof(light_data) + vector_bytes(p->opaque.data)
+                              + vector_bytes(p->transparent.data);
+}
+
+size_t surface_bytes (const surface_ptr& p)
+{
+    return sizeof(surface_data) + vector_bytes(p->opaque)
+                                + vector_bytes(p->transparent);
+}
+
+const char* type_names[] = { "area", "chunk", "surface", "light", "height" };
+
+/** Divide the memory budget over the data types.
+ *  Types that use less than their fair share keep everything; what they
+ *  leave over is divided among the others, in proportion to their
+ *  weights. */
+std::array<size_t, 5>
+share_budget (const std::array<size_t, 5>& used,
+              const std::array<double, 5>& weights, size_t budget)
+{
+    std::array<size_t, 5> result;
+
+    if (std::accumulate(used.begin(), used.end(), size_t(0)) <= budget)
+    {
+        result.fill(std::numeric_limits<size_t>::max());
+        return result;
+    }
+
+    // Handle the types in order of how much they use per unit of weight,
+    // the smallest users first.
+    std::array<int, 5> order {{ 0, 1, 2, 3, 4 }};
+    std::sort(order.begin(), order.end(), [&](int a, int b)
+    {
+        return used[a] * weights[b] < used[b] * weights[a];
+    });
+
+    double left (budget);
+    double total_weight (std::accumulate(weights.begin(), weights.end(), 0.0));
+    for (int i : order)
+    {
+        double share (total_weight > 0 ? left * weights[i] / total_weight : 0);
+        result[i] = std::min<double>(used[i], share);
+        left -= result[i];
+        total_weight -= weights[i];
+    }
+
+    return result;
+}
+
 } // anonymous namespace
 
+memory_cache::memory_cache (persistent_storage_i& next, size_t budget)
+    : areas_     (nullptr, area_bytes)
+    , chunks_    (nullptr, chunk_bytes)
+    , lightmaps_ (nullptr, lightmap_bytes)
+    , surfaces_  (nullptr, surface_bytes)
+    , packed_    (nullptr, packed_bytes)
+    , heights_   (undefined_height)
+    , next_      (next)
+    , budget_    (budget)
+    , packed_share_ (0.5)
+{
+    weights_.fill(1.0);
+}
+
 memory_cache::~memory_cache()
 {
     cleanup();
 }
 
+void
+memory_cache::weight (data_type type, double w)
+{
+    if (w < 0)
+        throw std::invalid_argument("cache weights cannot be negative");
+
+    weights_.at(type) = w;
+}
+
+double
+memory_cache::weight (data_type type) const
+{
+    return weights_.at(type);
+}
+
+void
+memory_cache::compression (data_type type, compression_method how)
+{
+    compression_.at(type) = how;
+}
+
+const compression_method&
+memory_cache::compression (data_type type) const
+{
+    return compression_.at(type);
+}
+
+void
+memory_cache::packed_share (double share)
+{
+    if (share < 0 || share > 1)
+        throw std::invalid_argument("the packed share must be between 0 and 1");
+
+    packed_share_ = share;
+}
+
+memory_cache::statistics
+memory_cache::stats () const
+{
+    statistics result;
+    result.types[persistent_storage_i::area]    = areas_.stats();
+    result.types[persistent_storage_i::chunk]   = chunks_.stats();
+    result.types[persistent_storage_i::surface] = surfaces_.stats();
+    result.types[persistent_storage_i::light]   = lightmaps_.stats();
+    result.types[persistent_storage_i::height]  = heights_.stats();
+    result.packed = packed_.stats();
+
+    for (auto& t : result.types)
+        result.total += t;
+
+    result.total += result.packed;
+
+    result.budget = budget_;
+    return result;
+}
+
 void
 memory_cache::cleanup ()
 {
-    {
-    boost::lock_guard<boost::mutex> areas_lock (areas_mutex_);
-    for (auto& p : areas_dirty_)
-        next_.store(persistent_storage_i::area, p, compress(serialize(*areas_.get(p))));
+    std::array<size_t, 5> used;
+    used[persistent_storage_i::area]    = areas_.bytes();
+    used[persistent_storage_i::chunk]   = chunks_.bytes() + packed_.bytes();
+    used[persistent_storage_i::surface] = surfaces_.bytes();
+    used[persistent_storage_i::light]   = lightmaps_.bytes();
+    used[persistent_storage_i::height]  = heights_.bytes();
 
-    areas_dirty_.clear();
-    areas_.prune(size_limit_);
-    }
-    {
-    boost::lock_guard<boost::mutex> chunks_lock (chunks_mutex_);
-    for (auto& p : chunks_dirty_)
-        next_.store(persistent_storage_i::chunk, p, compress(serialize(*chunks_.get(p))));
+    auto limit (share_budget(used, weights_, budget_));
 
-    chunks_dirty_.clear();
-    chunks_.prune(size_limit_);
-    }
+    areas_.flush(limit[persistent_storage_i::area],
+                 [&](const area_cache::batch& b)
     {
-    boost::lock_guard<boost::mutex> lightmaps_lock (lightmaps_mutex_);
-    for (auto& p : lightmaps_dirty_)
-        next_.store(persistent_storage_i::light, p, compress(serialize(*lightmaps_.get(p))));
-
-    lightmaps_dirty_.clear();
-    lightmaps_.prune(size_limit_);
-    }
+        write_back(next_, persistent_storage_i::area, b, compression_);
+    });
+
+    // The packed chunks are trimmed first; the unpacked ones get the
+    // rest of the chunks' share.  Whatever is packed below can take the
+    // total over the limit a little, until the next cleanup.
+    const size_t chunk_limit (limit[persistent_storage_i::chunk]);
+    const bool   unlimited   (chunk_limit == std::numeric_limits<size_t>::max());
+    const size_t packed_limit (unlimited ? chunk_limit : size_t(chunk_limit * packed_share_));
+
+    packed_.flush(packed_limit, [](const packed_cache::batch&){ });
+    const size_t hot_limit (unlimited ? chunk_limit
+                                      : chunk_limit - std::min(chunk_limit, packed_.bytes()));
+
+    chunks_.flush(hot_limit,
+                  [&](const chunk_cache::batch& b)
+    {
+        write_back(next_, persistent_storage_i::chunk, b, compression_);
+    },
+                  [&](const chunk_cache::batch& evicted)
     {
-    boost::lock_guard<boost::mutex> surfaces_lock (surfaces_mutex_);
-    for (auto& p : surfaces_dirty_)
-        next_.store(persistent_storage_i::surface, p, compress(serialize(*surfaces_.get(p))));
+        if (packed_limit == 0)
+            return;
 
-    surfaces_dirty_.clear();
-    surfaces_.prune(size_limit_);
-    }
+        // Only chunks that nobody else holds can be packed without
+        // taking their lock.  The others will be read from disk again.
+        for (auto& elem : evicted)
+        {
+            if (elem.second.use_count() == 1)
+                packed_.insert(elem.first, std::make_shared<palette_chunk>(*elem.second));
+        }
+    });
+    packed_.flush(packed_limit, [](const packed_cache::batch&){ });
+    lightmaps_.flush(limit[persistent_storage_i::light],
+                     [&](const lightmap_cache::batch& b)
     {
-    boost::lock_guard<boost::mutex> heights_lock (heights_mutex_);
-    heights_.prune(size_limit_);
-    }
+        write_back(next_, persistent_storage_i::light, b, compression_);
+    });
+    surfaces_.flush(limit[persistent_storage_i::surface],
+                    [&](const surface_cache::batch& b)
+    {
+        write_back(next_, persistent_storage_i::surface, b, compression_);
+    });
+    heights_.flush(limit[persistent_storage_i::height],
+                   [](const height_cache::batch&){ });
+
+    next_.cleanup();
 }
 
+void
+memory_cache::prefetch (const std::vector<chunk_coordinates>& xyz, int what)
+{
+    if (what & prefetch_chunks)
+        prefetch_into<chunk>(chunks_, next_, persistent_storage_i::chunk, xyz);
+
+    if (what & prefetch_surfaces)
+        prefetch_into<surface_data>(surfaces_, next_, persistent_storage_i::surface, xyz);
+
+    if (what & prefetch_lightmaps)
+        prefetch_into<light_data>(lightmaps_, next_, persistent_storage_i::light, xyz);
+}
 
 void
 memory_cache::store (map_coordinates xy, uint16_t index, area_ptr data)
@@ -94,11 +325,7 @@ memory_cache::store (map_coordinates xy, uint16_t index, area_ptr data)
 
     //trace((boost::format("store area at %1%, index %2%") % xy % index).str());
 
-    chunk_coordinates c (xy.x, xy.y, index);
-
-    boost::lock_guard<boost::mutex> areas_lock (areas_mutex_);
-    areas_dirty_.insert(c);
-    areas_[c] = data;
+    areas_.store(chunk_coordinates(xy.x, xy.y, index), data);
 }
 
 void
@@ -109,9 +336,8 @@ memory_cache::store (chunk_coordinates xyz, chunk_ptr data)
 
     //trace((boost::format("store chunk at %1%") % world_rel_coordinates(xyz -world_chunk_center)).str());
 
-    boost::lock_guard<boost::mutex> chunks_lock (chunks_mutex_);
-    chunks_dirty_.insert(xyz);
-    chunks_[xyz] = data;
+    chunks_.store(xyz, data);
+    packed_.erase(xyz);
 }
 
 void
@@ -122,9 +348,7 @@ memory_cache::store (chunk_coordinates xyz, lightmap_ptr data)
 
     //trace((boost::format("store lightmap at %1%") % world_rel_coordinates(xyz -world_chunk_center)).str());
 
-    boost::lock_guard<boost::mutex> lightmaps_lock (lightmaps_mutex_);
-    lightmaps_dirty_.insert(xyz);
-    lightmaps_[xyz] = data;
+    lightmaps_.store(xyz, data);
 }
 
 void
@@ -135,9 +359,7 @@ memory_cache::store (chunk_coordinates xyz, surface_ptr data)
 
     //trace((boost::format("store surface at %1%") % world_rel_coordinates(xyz -world_chunk_center)).str());
 
-    boost::lock_guard<boost::mutex> surfaces_lock (surfaces_mutex_);
-    surfaces_dirty_.insert(xyz);
-    surfaces_[xyz] = data;
+    surfaces_.store(xyz, data);
 }
 
 void
@@ -150,49 +372,44 @@ memory_cache::store (map_coordinates xy, chunk_height data)
     //       % map_rel_coordinates(xy - map_chunk_center)
     //       % int32_t(data - world_chunk_center.z)).str());
 
-    boost::lock_guard<boost::mutex> heights_lock (heights_mutex_);
-    heights_[xy] = data;
+    heights_.insert(xy, data);
     next_.store(xy, data);
 }
 
 bool
 memory_cache::is_area_data_available (map_coordinates xy, uint16_t index)
 {
-    boost::lock_guard<boost::mutex> areas_lock (areas_mutex_);
     chunk_coordinates xyz (xy.x, xy.y, index);
-    return    areas_.count(xyz) > 0
+    return    areas_.contains(xyz)
            || next_.is_available(persistent_storage_i::area, xyz);
 }
 
 bool
 memory_cache::is_chunk_available (chunk_coordinates xyz)
 {
-    boost::lock_guard<boost::mutex> chunks_lock (chunks_mutex_);
-    return    chunks_.count(xyz) > 0
+    return    chunks_.contains(xyz)
+           || packed_.contains(xyz)
            || next_.is_available(persistent_storage_i::chunk, xyz);
 }
 
 bool
 memory_cache::is_lightmap_available (chunk_coordinates xyz)
 {
-    boost::lock_guard<boost::mutex> lightmaps_lock (lightmaps_mutex_);
-    return    lightmaps_.count(xyz) > 0
+    return    lightmaps_.contains(xyz)
            || next_.is_available(persistent_storage_i::light, xyz);
 }
 
 bool
 memory_cache::is_surface_available (chunk_coordinates xyz)
 {
-    boost::lock_guard<boost::mutex> surfaces_lock (surfaces_mutex_);
-    return    surfaces_.count(xyz) > 0
+    return    surfaces_.contains(xyz)
            || next_.is_available(persistent_storage_i::surface, xyz);
 }
 
 bool
 memory_cache::is_coarse_height_available (map_coordinates xy)
 {
-    boost::lock_guard<boost::mutex> heights_lock (heights_mutex_);
-    return    heights_.count(xy) > 0
+    return    heights_.contains(xy)
            || next_.is_available(persistent_storage_i::height, xy);
 }
 
@@ -200,22 +417,10 @@ area_ptr
 memory_cache::get_area_data (map_coordinates xy, uint16_t index)
 {
     chunk_coordinates xyz (xy.x, xy.y, index);
-
-    boost::lock_guard<boost::mutex> areas_lock (areas_mutex_);
-    auto found (areas_.try_get(xyz));
-    if (found)
-        return *found;
-
-    areas_dirty_.erase(xyz);
-
-    if (!next_.is_available(persistent_storage_i::area, xyz))
-        return nullptr;
-
-    auto compressed (next_.retrieve(persistent_storage_i::area, xyz));
-    auto result (unpack_as<area_data>(compressed));
-    areas_[xyz] = result;
-
-    return result;
+    return areas_.get(xyz, [&]
+    {
+        return load_as<area_data>(next_, persistent_storage_i::area, xyz);
+    });
 }
 
 chunk_ptr
@@ -225,41 +430,26 @@ memory_cache::get_chunk (chunk_coordinates xyz)
     if (height != undefined_height && xyz.z >= height)
         return nullptr;
 
-    boost::lock_guard<boost::mutex> chunks_lock (chunks_mutex_);
-    auto found (chunks_.try_get(xyz));
-    if (found)
-        return *found;
-
-    chunks_dirty_.erase(xyz);
-
-    if (!next_.is_available(persistent_storage_i::chunk, xyz))
-        return nullptr;
-
-    auto result (unpack_as<chunk>(next_.retrieve(persistent_storage_i::chunk, xyz)));
-    chunks_[xyz] = result;
-
-    return result;
+    return chunks_.get(xyz, [&]
+    {
+        // Unpacking is a lot cheaper than going to the storage.
+        auto packed (packed_.peek(xyz));
+        if (packed)
+        {
+            packed_.erase(xyz);
+            return packed->unpack();
+        }
+        return load_as<chunk>(next_, persistent_storage_i::chunk, xyz);
+    });
 }
 
 lightmap_ptr
 memory_cache::get_lightmap (chunk_coordinates xyz)
 {
-    boost::lock_guard<boost::mutex> lightmaps_lock (lightmaps_mutex_);
-
-    auto found (lightmaps_.try_get(xyz));
-    if (found)
-        return *found;
-
-    lightmaps_dirty_.erase(xyz);
-
-    if (!next_.is_available(persistent_storage_i::light, xyz))
-        return nullptr;
-
-    auto compressed (next_.retrieve(persistent_storage_i::light, xyz));
-    auto result (unpack_as<light_data>(compressed));
-    lightmaps_[xyz] = result;
-
-    return result;
+    return lightmaps_.get(xyz, [&]
+    {
+        return load_as<light_data>(next_, persistent_storage_i::light, xyz);
+    });
 }
 
 surface_ptr
@@ -268,106 +458,132 @@ memory_cache::get_surface (chunk_coordinates xyz)
     if (is_air_chunk(xyz, get_coarse_height(xyz)))
         return empty_surface;
 
-    boost::lock_guard<boost::mutex> surfaces_lock (surfaces_mutex_);
-
-    auto found (surfaces_.try_get(xyz));
-    if (found)
-        return *found;
-
-    surfaces_dirty_.erase(xyz);
-
-    if (!next_.is_available(persistent_storage_i::surface, xyz))
-        return nullptr;
-
-    auto compressed (next_.retrieve(persistent_storage_i::surface, xyz));
-    auto result (unpack_as<surface_data>(compressed));
-    surfaces_[xyz] = result;
-
-    return result;
+    return surfaces_.get(xyz, [&]
+    {
+        return load_as<surface_data>(next_, persistent_storage_i::surface, xyz);
+    });
 }
 
 chunk_height
 memory_cache::get_coarse_height (map_coordinates xy)
 {
-    boost::lock_guard<boost::mutex> heights_lock (heights_mutex_);
-
-    auto found (heights_.try_get(xy));
-    if (!found)
+    return heights_.get(xy, [&]
     {
         if (!next_.is_available(persistent_storage_i::height, xy))
             return undefined_height;
 
-        chunk_height result (next_.retrieve(xy));
-        heights_[xy] = result;
-
-        return result;
-    }
-
-    return *found;
+        return next_.retrieve(xy);
+    });
 }
 
 compressed_data
 memory_cache::get_compressed_lightmap (chunk_coordinates xyz)
 {
-    boost::lock_guard<boost::mutex> lightmaps_lock (lightmaps_mutex_);
+    auto found (lightmaps_.peek(xyz));
 
-    if (   lightmaps_dirty_.count(xyz) > 0
-        || !next_.is_available(persistent_storage_i::light, xyz))
+    if (   found
+        && (   lightmaps_.is_dirty(xyz)
+            || !next_.is_available(persistent_storage_i::light, xyz)))
     {
-        auto found (lightmaps_.try_get(xyz));
-        if (!found)
-        {
-            // There's a chance the lightmap isn't stored becuase there is
-            // no corresponding surface.  In that case, return an empty
-            // buffer.
-            auto srf (surfaces_.try_get(xyz));
-            if (!srf || *srf == nullptr || (**srf).empty())
-                return compressed_data();
-
-            // If that's not the case, something's wrong and we can't fix
-            // it here.
-            throw not_in_storage_error((boost::format("light map at %1%") % xyz).str());
-        }
-
-        assert(*found != nullptr);
-        lightmaps_dirty_.erase(xyz);
-        auto tmp (serialize(**found));
-        compressed_data result (compress(tmp));
-
+        compressed_data result (compress(serialize(*found),
+                                         compression_[persistent_storage_i::light]));
         next_.store(persistent_storage_i::light, xyz, result);
+        lightmaps_.mark_clean(xyz, found);
 
         return result;
     }
 
+    if (!found && !next_.is_available(persistent_storage_i::light, xyz))
+    {
+        // There's a chance the lightmap isn't stored becuase there is
+        // no corresponding surface.  In that case, return an empty
+        // buffer.
+        auto srf (surfaces_.peek(xyz));
+        if (srf == nullptr || srf->empty())
+            return compressed_data();
+
+        // If that's not the case, something's wrong and we can't fix
+        // it here.
+        throw not_in_storage_error((boost::format("light map at %1%") % xyz).str());
+    }
+
     return next_.retrieve(persistent_storage_i::light, xyz);
 }
 
 compressed_data
 memory_cache::get_compressed_surface (chunk_coordinates xyz)
 {
-    boost::lock_guard<boost::mutex> surfaces_lock (surfaces_mutex_);
+    auto found (surfaces_.peek(xyz));
 
-    if (   surfaces_dirty_.count(xyz) > 0
-        || !next_.is_available(persistent_storage_i::surface, xyz))
+    if (   found
+        && (   surfaces_.is_dirty(xyz)
+            || !next_.is_available(persistent_storage_i::surface, xyz)))
     {
-        auto found (surfaces_.try_get(xyz));
-        if (!found)
-            throw not_in_storage_error((boost::format("surface at %1%") % xyz).str());
-
-        surfaces_dirty_.erase(xyz);
-        auto s_ptr (*found);
-        if (!s_ptr)
-            throw not_in_storage_error((boost::format("surface at %1% inconsistent") % xyz).str());
-
-        auto tmp (serialize(*s_ptr));
-        auto result (compress(tmp));
+        compressed_data result (compress(serialize(*found),
+                                         compression_[persistent_storage_i::surface]));
         next_.store(persistent_storage_i::surface, xyz, result);
+        surfaces_.mark_clean(xyz, found);
 
         return result;
     }
 
+    if (!found && !next_.is_available(persistent_storage_i::surface, xyz))
+        throw not_in_storage_error((boost::format("surface at %1%") % xyz).str());
+
     return next_.retrieve(persistent_storage_i::surface, xyz);
 }
 
+//---------------------------------------------------------------------------
+
+void set_cache_weights (memory_cache& cache, const std::string& spec)
+{
+    std::vector<std::string> items;
+    boost::split(items, spec, boost::is_any_of(","), boost::token_compress_on);
+
+    for (auto& item : items)
+    {
+        if (item.empty())
+            continue;
+
+        auto eq (item.find('='));
+        if (eq == std::string::npos)
+            throw std::runtime_error("cache weight '" + item + "' should look like 'chunk=1.5'");
+
+        std::string name (boost::trim_copy(item.substr(0, eq)));
+        auto found (std::find(std::begin(type_names), std::end(type_names), name));
+        if (found == std::end(type_names))
+            throw std::runtime_error("unknown cache type '" + name + "'");
+
+        try
+        {
+            double w (boost::lexical_cast<double>(boost::trim_copy(item.substr(eq + 1))));
+            cache.weight(static_cast<memory_cache::data_type>(found - std::begin(type_names)), w);
+        }
+        catch (boost::bad_lexical_cast&)
+        {
+            throw std::runtime_error("bad cache weight '" + item + "'");
+        }
+    }
+}
+
+std::ostream& operator<< (std::ostream& str, const memory_cache::statistics& s)
+{
+    boost::format line ("%-8s %10d entries %10.1f MiB %10d hits %10d misses %10d evicted\n");
+    auto mib ([](size_t bytes){ return bytes / 1048576.0; });
+
+    for (size_t i (0); i < s.types.size(); ++i)
+    {
+        auto& t (s.types[i]);
+        str << line % type_names[i] % t.entries % mib(t.bytes)
+                    % t.hits % t.misses % t.evictions;
+    }
+    str << line % "packed" % s.packed.entries % mib(s.packed.bytes)
+                % s.packed.hits % s.packed.misses % s.packed.evictions;
+    str << line % "total" % s.total.entries % mib(s.total.bytes)
+                % s.total.hits % s.total.misses % s.total.evictions;
+
+    return str << boost::format("budget   %.1f MiB\n") % mib(s.budget);
+}
+
 } // namespace hexa
 
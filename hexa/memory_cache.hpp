@@ -22,10 +22,12 @@
 
 #pragma once
 
-#include <unordered_set>
-#include <boost/thread/mutex.hpp>
-#include "lru_cache.hpp"
+#include <array>
+#include <iosfwd>
+#include <string>
+#include "palette_chunk.hpp"
 #include "persistent_storage_i.hpp"
+#include "sharded_cache.hpp"
 #include "storage_i.hpp"
 
 namespace hexa {
@@ -33,42 +35,95 @@ namespace hexa {
 /** Memory cache for game data.
  *  This cache sits on top of a persistent storage.  It keeps the most recently
  *  used data uncompressed in memory, and makes sure storage and retrieval is
- *  done in batches if possible. */
+ *  done in batches if possible.
+ *
+ *  The caches are sharded, and no locks are held while data is read
+ *  from or written to the persistent storage.  Many worker threads can
+ *  use it at the same time.
+ *
+ *  All data types share one memory budget.  When cleanup() finds that
+ *  the budget is exceeded, the oldest elements are thrown out.  Every
+ *  type has a weight; when memory is tight, a type with twice the weight
+ *  of another gets to keep twice as many bytes.
+ *
+ *  Chunks that are thrown out are not forgotten right away.  They are
+ *  kept as palette_chunk objects, which take a fraction of the memory,
+ *  and are unpacked again when they're needed.  The packed chunks get a
+ *  part of the chunks' share of the budget. */
 class memory_cache : public storage_i, boost::noncopyable
 {
-    typedef std::unordered_set<chunk_coordinates>   dirty_flags;
-
     /** Area data cache.
      *  Note that it is indexed by chunk_coordinates, not map_coordinates.
      *  This is a bit of a hack; there can be different types of area data
      *  for a given position.  The z-ordinate is abused to store the type
      *  index. */
-    lru_cache<chunk_coordinates, area_ptr>      areas_;
-    dirty_flags  areas_dirty_;
-    boost::mutex areas_mutex_;
+    typedef sharded_cache<chunk_coordinates, area_ptr>      area_cache;
+    typedef sharded_cache<chunk_coordinates, chunk_ptr>     chunk_cache;
+    typedef sharded_cache<chunk_coordinates, lightmap_ptr>  lightmap_cache;
+    typedef sharded_cache<chunk_coordinates, surface_ptr>   surface_cache;
+    typedef sharded_cache<map_coordinates,   chunk_height>  height_cache;
+    typedef sharded_cache<chunk_coordinates, palette_chunk_ptr> packed_cache;
+
+    area_cache      areas_;
+    chunk_cache     chunks_;
+    lightmap_cache  lightmaps_;
+    surface_cache   surfaces_;
+
+    /** Chunks that were thrown out of \a chunks_, in packed form.  These
+     ** are never dirty. */
+    packed_cache    packed_;
+
+    /** The coarse height map is written through right away, it's never
+     ** dirty. */
+    height_cache    heights_;
 
-    lru_cache<chunk_coordinates, chunk_ptr>     chunks_;
-    dirty_flags  chunks_dirty_;
-    boost::mutex chunks_mutex_;
+    persistent_storage_i& next_;
 
-    lru_cache<chunk_coordinates, lightmap_ptr>  lightmaps_;
-    dirty_flags  lightmaps_dirty_;
-    boost::mutex lightmaps_mutex_;
+public:
+    typedef persistent_storage_i::data_type data_type;
+
+    /** Memory use of every data type, indexed by data_type. */
+    struct statistics
+    {
+        std::array<cache_stats, 5>  types;
+        /** The packed chunks; these are not included in types[chunk] */
+        cache_stats                 packed;
+        cache_stats                 total;
+        size_t                      budget;
+    };
 
-    lru_cache<chunk_coordinates, surface_ptr>   surfaces_;
-    dirty_flags  surfaces_dirty_;
-    boost::mutex surfaces_mutex_;
+public:
+    /** Constructor.
+     * \param next    The persistent storage underneath this cache
+     * \param budget  Maximum memory use, in bytes */
+    memory_cache(persistent_storage_i& next, size_t budget = 256 << 20);
 
-    lru_cache<map_coordinates,   chunk_height>  heights_;
-    boost::mutex heights_mutex_;
+    void cleanup();
 
-    persistent_storage_i& next_;
+    /** Load everything that isn't in memory yet with a single batch
+     ** query on the persistent storage. */
+    void prefetch (const std::vector<chunk_coordinates>& xyz, int what);
+    using storage_i::prefetch;
 
-public:
-    memory_cache(persistent_storage_i& next, size_t sizelim = 25000)
-        : next_ (next), size_limit_ (sizelim) { }
+    void    budget (size_t bytes) { budget_ = bytes; }
+    size_t  budget () const       { return budget_; }
 
-    void cleanup();
+    /** Set the part of the chunks' budget that can be used by packed
+     ** chunks, between 0 and 1.  The default is 0.5; 0 turns packing
+     ** off. */
+    void    packed_share (double share);
+    double  packed_share () const { return packed_share_; }
+
+    /** Set the weight of a data type, the default is 1. */
+    void    weight (data_type type, double w);
+    double  weight (data_type type) const;
+
+    /** Set how a data type is compressed before it is written to the
+     ** persistent storage.  The default is LZ4 for everything. */
+    void    compression (data_type type, compression_method how);
+    const compression_method& compression (data_type type) const;
+
+    statistics stats() const;
 
     ~memory_cache();
 
@@ -97,8 +152,19 @@ public:
     get_compressed_surface (chunk_coordinates xyz);
 
 private:
-    size_t      size_limit_;
+    size_t                  budget_;
+    std::array<double, 5>   weights_;
+    std::array<compression_method, 5> compression_;
+    double                  packed_share_;
 };
 
+/** Set the cache weights from a string such as "chunk=2,light=0.5".
+ *  The names are area, chunk, surface, light, and height.
+ * \throw std::runtime_error if the string cannot be parsed */
+void set_cache_weights (memory_cache& cache, const std::string& spec);
+
+/** Print the cache statistics, one line per data type. */
+std::ostream& operator<< (std::ostream& str, const memory_cache::statistics& s);
+
 } // namespace hexa
 
@@ -64,6 +64,7 @@ public:
         : src_      (src)
         , center_   (center)
         , len_      (radius * 2 + 1)
+        , edge_     (radius * chunk_size)
         , cache_    (len_ * len_ * len_)
     {
     }
@@ -89,12 +90,7 @@ public:
      * @return The block at \a pos */
     value_type& operator[] (world_vector pos)
     {
-        world_coordinates o (pos + offset() * chunk_size);
-        assert(o.x < len_ * chunk_size);
-        assert(o.y < len_ * chunk_size);
-        assert(o.z < len_ * chunk_size);
-        chunk_coordinates a (o / chunk_size);
-        return (*access(a.x + a.y * length() + a.z * area()))[o % chunk_size];
+        return lookup(pos);
     }
 
     /** Get a block from the cache.
@@ -105,12 +101,7 @@ public:
      * @return The block at \a pos */
     const value_type& operator[] (world_vector pos) const
     {
-        world_coordinates o (pos + offset() * chunk_size);
-        assert(o.x < len_ * chunk_size);
-        assert(o.y < len_ * chunk_size);
-        assert(o.z < len_ * chunk_size);
-        chunk_coordinates a (o / chunk_size);
-        return (*access(a.x + a.y * length() + a.z * area()))[o % chunk_size];
+        return lookup(pos);
     }
 
     /** Get the middle chunk. */
@@ -206,7 +197,23 @@ public:
     iterator end()       { return iterator(*this).end(); }
 
 protected:
-    chunk_ptr_type access(size_t idx) const
+    /** This is used very often by the light map generators, so it avoids
+     ** divisions by anything that isn't a power of two. */
+    value_type& lookup (world_vector pos) const
+    {
+        const uint32_t x (pos.x + edge_), y (pos.y + edge_), z (pos.z + edge_);
+        assert(x < len_ * chunk_size);
+        assert(y < len_ * chunk_size);
+        assert(z < len_ * chunk_size);
+        const size_t cell (  x / chunk_size
+                           + (y / chunk_size + (z / chunk_size) * len_) * len_);
+        return (*access(cell))(x % chunk_size, y % chunk_size, z % chunk_size);
+    }
+
+    /** Get one of the chunks, and fetch it if needed.
+     *  This returns a reference, so looking up a block doesn't have to
+     *  touch the reference count of its chunk. */
+    const chunk_ptr_type& access(size_t idx) const
     {
         assert(idx < cache_.size());
 
@@ -232,6 +239,7 @@ protected:
     storage_i&                  src_;
     chunk_coordinates           center_;
     size_t                      len_;
+    uint32_t                    edge_;
     mutable std::vector<chunk_ptr_type> cache_;
     static chunk_ptr_type       empty_;
 };
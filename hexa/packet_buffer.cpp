@@ -0,0 +1,144 @@
+//---------------------------------------------------------------------------
+// lib/packet_buffer.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "packet_buffer.hpp"
+
+#include <boost/thread/tss.hpp>
+
+namespace hexa {
+
+namespace {
+
+/** Don't keep more than this many free buffers around per thread. */
+const size_t max_pooled = 256;
+
+/** Buffers that grew larger than this (usually because they held the
+ ** terrain of a chunk) are freed rather than pooled. */
+const size_t max_pooled_capacity = 256 * 1024;
+
+class pool
+{
+public:
+    ~pool()
+    {
+        for (auto b : free_)
+            delete b;
+    }
+
+    packet_buffer::block* get()
+    {
+        if (free_.empty())
+            return new packet_buffer::block;
+
+        auto result (free_.back());
+        free_.pop_back();
+        return result;
+    }
+
+    void put(packet_buffer::block* b)
+    {
+        if (   free_.size() >= max_pooled
+            || b->bytes.capacity() > max_pooled_capacity)
+        {
+            delete b;
+            return;
+        }
+
+        b->bytes.clear();
+        free_.push_back(b);
+    }
+
+    size_t size() const
+    {
+        return free_.size();
+    }
+
+private:
+    std::vector<packet_buffer::block*> free_;
+};
+
+boost::thread_specific_ptr<pool> this_pool;
+
+pool& local_pool()
+{
+    if (this_pool.get() == nullptr)
+        this_pool.reset(new pool);
+
+    return *this_pool;
+}
+
+void unref (packet_buffer::block* b)
+{
+    if (b != nullptr && --b->refs == 0)
+        local_pool().put(b);
+}
+
+} // anonymous namespace
+
+packet_buffer::packet_buffer()
+    : block_ (local_pool().get())
+{
+    block_->refs = 1;
+}
+
+packet_buffer::packet_buffer(const packet_buffer& copy)
+    : block_ (copy.block_)
+{
+    ++block_->refs;
+}
+
+packet_buffer::packet_buffer(packet_buffer&& move)
+    : block_ (move.block_)
+{
+    // The moved-from buffer gets a fresh block, so it stays usable.
+    move.block_ = local_pool().get();
+    move.block_->refs = 1;
+}
+
+packet_buffer::~packet_buffer()
+{
+    unref(block_);
+}
+
+packet_buffer& packet_buffer::operator= (packet_buffer copy)
+{
+    std::swap(block_, copy.block_);
+    return *this;
+}
+
+void* packet_buffer::retain() const
+{
+    ++block_->refs;
+    return block_;
+}
+
+void packet_buffer::release(void* handle)
+{
+    unref(static_cast<block*>(handle));
+}
+
+size_t packet_buffer::pooled()
+{
+    return local_pool().size();
+}
+
+} // namespace hexa
+
@@ -0,0 +1,97 @@
+//---------------------------------------------------------------------------
+/// \file   hexa/packet_buffer.hpp
+/// \brief  Pooled buffers for outgoing network packets.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace hexa {
+
+/** A reference counted byte buffer for an outgoing packet.
+ *  Buffers are taken from a pool that belongs to the current thread.
+ *  When the last reference goes away, the buffer is handed to the pool
+ *  of whatever thread let go of it, with its memory still allocated.
+ *  Once the pools have warmed up, serializing a packet doesn't need to
+ *  allocate anything.
+ *
+ *  Copies share the same bytes.  The buffer can be kept alive from C
+ *  code, such as an ENet packet, with retain() and release().
+ * \code
+
+packet_buffer buf;
+buf.bytes().push_back(msg_id);
+make_serializer(buf.bytes())(position)(data);
+
+ENetPacket* p (enet_packet_create(buf.data(), buf.size(),
+                                  ENET_PACKET_FLAG_NO_ALLOCATE));
+p->userData = buf.retain();
+p->freeCallback = [](ENetPacket* p){ packet_buffer::release(p->userData); };
+
+ * \endcode */
+class packet_buffer
+{
+public:
+    typedef std::vector<uint8_t>    bytes_t;
+
+    /** Take an empty buffer from the pool. */
+    packet_buffer();
+    packet_buffer(const packet_buffer& copy);
+    packet_buffer(packet_buffer&& move);
+    ~packet_buffer();
+
+    packet_buffer& operator= (packet_buffer copy);
+
+    /** The contents, for serializers to write to. */
+    bytes_t&        bytes()       { return block_->bytes; }
+    const bytes_t&  bytes() const { return block_->bytes; }
+
+    const uint8_t*  data() const  { return block_->bytes.data(); }
+    size_t          size() const  { return block_->bytes.size(); }
+    bool            empty() const { return block_->bytes.empty(); }
+
+    /** Add a reference that is not owned by a packet_buffer.
+     * \return A handle that must be passed to release() once */
+    void* retain() const;
+
+    /** Drop a reference that was taken with retain(). */
+    static void release(void* handle);
+
+    /** The number of buffers in this thread's pool. */
+    static size_t pooled();
+
+public:
+    /** The bytes and the number of references to them. */
+    struct block
+    {
+        bytes_t             bytes;
+        std::atomic<int>    refs;
+    };
+
+private:
+    block* block_;
+};
+
+} // namespace hexa
+
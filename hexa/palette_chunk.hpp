@@ -0,0 +1,299 @@
+//---------------------------------------------------------------------------
+/// \file   hexa/palette_chunk.hpp
+/// \brief  Compact in-memory representation of a chunk.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <vector>
+#include "chunk.hpp"
+
+namespace hexa {
+
+/** A chunk that stores a small index into a palette of materials for
+ ** every block, instead of the full 16-bit material.
+ *  Most chunks only use a handful of materials; a chunk of stone and
+ *  air only needs a single bit per block.  The index is 1, 2, 4, or 8
+ *  bits wide, depending on the size of the palette.  A chunk of only
+ *  one material doesn't need an index at all, and only keeps its
+ *  palette.  If a chunk uses
+ *  more than 256 different materials, it switches to the dense layout,
+ *  and stores the material of every block directly.
+ *
+ *  Blocks can be read and changed in place, but changing blocks is a
+ *  lot slower than with a regular chunk.  It is mostly meant to keep
+ *  chunks that aren't used right now in memory.
+ * \code
+
+chunk cnk;
+cnk(1, 2, 3) = block(12);
+
+palette_chunk packed (cnk);
+assert(packed(1, 2, 3) == 12);
+assert(packed.width() == 1);
+
+chunk solid;
+solid.clear(block(1));
+assert(palette_chunk(solid).width() == 0);
+
+* \endcode */
+class palette_chunk
+{
+public:
+    typedef block   value_type;
+
+public:
+    /** The time stamp of the chunk this was made from. */
+    gameclock_t     last_used;
+
+    /** The generation phase of the chunk this was made from. */
+    uint8_t         generation_phase;
+
+public:
+    /** A chunk filled with air. */
+    palette_chunk()
+        : last_used (0)
+        , generation_phase (0)
+        , width_ (0)
+        , palette_ (1, block(type::air))
+    { }
+
+    /** Pack a chunk. */
+    explicit palette_chunk (const chunk& cnk)
+        : last_used (cnk.last_used)
+        , generation_phase (cnk.generation_phase)
+    {
+        for (auto b : cnk)
+        {
+            if (std::find(palette_.begin(), palette_.end(), b) == palette_.end())
+            {
+                palette_.push_back(b);
+                if (palette_.size() > 256)
+                    break;
+            }
+        }
+
+        if (palette_.size() > 256)
+        {
+            palette_.clear();
+            width_ = 16;
+        }
+        else
+        {
+            std::sort(palette_.begin(), palette_.end());
+            width_ = width_for(palette_.size());
+        }
+
+        if (width_ == 0)
+            return;
+
+        bits_.assign(words_needed(width_), 0);
+        for (size_t i (0); i < chunk_volume; ++i)
+            put(i, index_of(cnk[i]));
+    }
+
+    palette_chunk (palette_chunk&&) = default;
+    palette_chunk& operator= (palette_chunk&&) = default;
+
+    /** Unpack into a regular chunk. */
+    chunk_ptr unpack() const
+    {
+        auto result (std::make_shared<chunk>());
+        if (width_ == 0)
+        {
+            result->clear(palette_[0]);
+        }
+        else
+        {
+            for (size_t i (0); i < chunk_volume; ++i)
+                (*result)[i] = at(i);
+        }
+
+        result->last_used = last_used;
+        result->generation_phase = generation_phase;
+        return result;
+    }
+
+    /** Indexing operator. */
+    value_type operator[] (chunk_index idx) const
+        { return operator()(idx.x, idx.y, idx.z); }
+
+    /** Indexing operator. */
+    value_type operator() (uint8_t x, uint8_t y, uint8_t z) const
+    {
+        assert(x < chunk_size);
+        assert(y < chunk_size);
+        assert(z < chunk_size);
+        return at(x + y * chunk_size + z * chunk_area);
+    }
+
+    /** Change a single block.  If the material isn't in the palette yet,
+     ** it is added, and the indices are made wider if needed. */
+    void set (uint8_t x, uint8_t y, uint8_t z, value_type b)
+    {
+        assert(x < chunk_size);
+        assert(y < chunk_size);
+        assert(z < chunk_size);
+        size_t i (x + y * chunk_size + z * chunk_area);
+
+        if (width_ == 16)
+        {
+            put(i, b.type);
+            return;
+        }
+
+        auto found (std::find(palette_.begin(), palette_.end(), b));
+        if (found != palette_.end())
+        {
+            if (width_ != 0)
+                put(i, found - palette_.begin());
+
+            return;
+        }
+
+        if (palette_.size() == 256)
+        {
+            // Go dense.
+            std::vector<uint64_t> old;
+            old.swap(bits_);
+            const unsigned int old_width (width_);
+            width_ = 16;
+            bits_.assign(words_needed(width_), 0);
+            for (size_t j (0); j < chunk_volume; ++j)
+                put(j, palette_[get(old, old_width, j)].type);
+
+            palette_.clear();
+            put(i, b.type);
+            return;
+        }
+
+        palette_.push_back(b);
+        const unsigned int needed (width_for(palette_.size()));
+        if (needed != width_)
+        {
+            std::vector<uint64_t> old;
+            old.swap(bits_);
+            const unsigned int old_width (width_);
+            width_ = needed;
+            bits_.assign(words_needed(width_), 0);
+            for (size_t j (0); j < chunk_volume; ++j)
+                put(j, get(old, old_width, j));
+        }
+        put(i, palette_.size() - 1);
+    }
+
+    /** The number of bits per block: 0, 1, 2, 4, 8, or 16. */
+    unsigned int width() const { return width_; }
+
+    /** The number of materials in the palette; 0 for a dense chunk. */
+    size_t palette_size() const { return palette_.size(); }
+
+    /** Check if the chunk is stored without a palette. */
+    bool is_dense() const { return width_ == 16; }
+
+    /** Check if the whole chunk is made of a single material. */
+    bool is_uniform() const { return width_ == 0; }
+
+    /** The memory used by this chunk, in bytes. */
+    size_t bytes() const
+    {
+        return sizeof(*this) + bits_.capacity() * sizeof(uint64_t)
+                             + palette_.capacity() * sizeof(block);
+    }
+
+    bool operator== (const palette_chunk& compare) const
+    {
+        for (size_t i (0); i < chunk_volume; ++i)
+        {
+            if (!(at(i) == compare.at(i)))
+                return false;
+        }
+        return true;
+    }
+
+private:
+    static unsigned int width_for (size_t palette_size)
+    {
+        if (palette_size <= 1)
+            return 0;
+
+        unsigned int w (1);
+        while ((size_t(1) << w) < palette_size)
+            w *= 2;
+
+        return w;
+    }
+
+    static size_t words_needed (unsigned int width)
+    {
+        return chunk_volume * width / 64;
+    }
+
+    static uint16_t get (const std::vector<uint64_t>& bits,
+                         unsigned int width, size_t i)
+    {
+        if (width == 0)
+            return 0;
+
+        // The widths divide 64, so an index never straddles two words.
+        const size_t bit (i * width);
+        const uint64_t mask ((uint64_t(1) << width) - 1);
+        return (bits[bit / 64] >> (bit % 64)) & mask;
+    }
+
+    void put (size_t i, uint16_t v)
+    {
+        const size_t bit (i * width_);
+        const uint64_t mask ((uint64_t(1) << width_) - 1);
+        uint64_t& word (bits_[bit / 64]);
+        word = (word & ~(mask << (bit % 64))) | (uint64_t(v) << (bit % 64));
+    }
+
+    value_type at (size_t i) const
+    {
+        if (width_ == 0)
+            return palette_[0];
+
+        uint16_t v (get(bits_, width_, i));
+        return width_ == 16 ? block(v) : palette_[v];
+    }
+
+    uint16_t index_of (block b) const
+    {
+        if (width_ == 16)
+            return b.type;
+
+        return std::lower_bound(palette_.begin(), palette_.end(), b) - palette_.begin();
+    }
+
+private:
+    unsigned int            width_;
+    std::vector<block>      palette_;
+    std::vector<uint64_t>   bits_;
+};
+
+/** Reference-counted pointer to a packed chunk. */
+typedef std::shared_ptr<palette_chunk> palette_chunk_ptr;
+
+} // namespace hexa
+
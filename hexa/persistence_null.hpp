@@ -55,6 +55,15 @@ public:
         { return false; }
 
 
+    void store (data_type type, const batch& data) { }
+
+    batch retrieve (data_type type, const range<chunk_coordinates>& box)
+        { return batch(); }
+
+    batch retrieve (data_type type, const std::vector<chunk_coordinates>& xyz)
+        { return batch(); }
+
+
     void store (const entity_system& es) { }
 
     void store (const entity_system& es, es::entity entity_id) { }
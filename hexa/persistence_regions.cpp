@@ -0,0 +1,777 @@
+//---------------------------------------------------------------------------
+// persistence_regions.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "persistence_regions.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <boost/filesystem/operations.hpp>
+#include <boost/format.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include "trace.hpp"
+
+namespace fs = boost::filesystem;
+namespace ip = boost::interprocess;
+
+namespace hexa {
+
+namespace {
+
+const unsigned int rs (persistence_regions::region_size);
+
+// File layout: a 16-byte header, the offset tables for the four data
+// types, and then the data.
+const uint32_t  magic       (0x47525848); // "HXRG"
+const uint32_t  version     (2);
+const size_t    elements    (rs * rs * rs);
+const size_t    data_types  (4);
+const size_t    header_size (16);
+
+// Every record starts with the unpacked length of the compressed data
+// and the codec.  Version 1 files only had a 16-bit length, and always
+// used LZ4; they are upgraded when they are opened.
+const size_t    record_header    (8);
+const size_t    record_header_v1 (sizeof(uint16_t));
+
+// Don't bother compacting a file for less than this.
+const uint64_t  min_garbage (64 * 1024);
+
+// Close region files that aren't in use once there are this many open.
+const size_t    max_open_files (256);
+
+struct entry
+{
+    uint32_t    offset;
+    uint32_t    length;
+};
+
+void write_record_header (const compressed_data& data, char* out)
+{
+    const uint32_t len (data.unpacked_len);
+    std::memcpy(out, &len, sizeof(len));
+    out[4] = static_cast<char>(data.method);
+    std::memset(out + 5, 0, record_header - 5);
+}
+
+void read_record_header (const char* in, size_t header, compressed_data& data)
+{
+    if (header == record_header_v1)
+    {
+        uint16_t len;
+        std::memcpy(&len, in, sizeof(len));
+        data.unpacked_len = len;
+        data.method = codec::lz4;
+        return;
+    }
+
+    uint32_t len;
+    std::memcpy(&len, in, sizeof(len));
+    if (static_cast<uint8_t>(in[4]) > static_cast<uint8_t>(codec::deflate))
+        throw std::runtime_error("unknown codec in region file");
+
+    data.unpacked_len = len;
+    data.method = static_cast<codec>(in[4]);
+}
+
+const size_t    data_start (header_size + data_types * elements * sizeof(entry));
+
+chunk_coordinates region_of (chunk_coordinates p)
+{
+    return chunk_coordinates(p.x / rs, p.y / rs, p.z / rs);
+}
+
+size_t index_of (chunk_coordinates p)
+{
+    return (p.x % rs) + (p.y % rs) * rs + (p.z % rs) * rs * rs;
+}
+
+void check_type (persistent_storage_i::data_type type)
+{
+    if (static_cast<size_t>(type) >= data_types)
+        throw std::logic_error("region files cannot store this data type");
+}
+
+} // anonymous namespace
+
+//---------------------------------------------------------------------------
+
+/** A single region file.  All member functions expect the caller to
+ ** hold the lock. */
+class persistence_regions::region_file : boost::noncopyable
+{
+public:
+    typedef std::vector<std::pair<size_t, const compressed_data*>> records;
+
+    region_file (const fs::path& path)
+        : path_ (path)
+    {
+        open();
+    }
+
+    ~region_file()
+    {
+        try { flush(); } catch (...) { }
+    }
+
+    bool has (data_type type, size_t idx)
+    {
+        return at(type, idx).length >= record_header_;
+    }
+
+    compressed_data read (data_type type, size_t idx)
+    {
+        const entry e (at(type, idx));
+        if (e.length < record_header_)
+        {
+            std::stringstream msg;
+            msg << "data type " << (int)type << " in " << path_.string();
+            throw not_in_storage_error(msg.str());
+        }
+
+        compressed_data result;
+        char header[record_header];
+        result.buf.resize(e.length - record_header_);
+        file_.seekg(e.offset);
+        file_.read(header, record_header_);
+        if (!result.buf.empty())
+            file_.read(result.ptr(), result.buf.size());
+
+        if (!file_)
+        {
+            file_.clear();
+            throw std::runtime_error("cannot read from " + path_.string());
+        }
+        read_record_header(header, record_header_, result);
+        return result;
+    }
+
+    /** Append a number of records with a single write, and point the
+     ** offset table to them. */
+    void append (data_type type, const records& data)
+    {
+        std::vector<char> out;
+        std::vector<entry> placed;
+        placed.reserve(data.size());
+        for (auto& r : data)
+        {
+            entry e;
+            e.offset = static_cast<uint32_t>(size_ + out.size());
+            e.length = static_cast<uint32_t>(record_header + r.second->size());
+            placed.push_back(e);
+
+            char header[record_header];
+            write_record_header(*r.second, header);
+            out.insert(out.end(), header, header + record_header);
+            out.insert(out.end(), r.second->begin(), r.second->end());
+        }
+
+        if (size_ + out.size() > 0xffffffffull)
+        {
+            compact();
+            if (size_ + out.size() > 0xffffffffull)
+                throw std::runtime_error(path_.string() + " is full");
+
+            // The offsets moved.
+            append(type, data);
+            return;
+        }
+
+        file_.seekp(size_);
+        file_.write(&out[0], out.size());
+        file_.flush();
+        if (!file_)
+        {
+            file_.clear();
+            throw std::runtime_error("cannot write to " + path_.string());
+        }
+        size_ += out.size();
+
+        // Only point to the new data once it has been written.
+        for (size_t i (0); i < data.size(); ++i)
+        {
+            entry& e (at(type, data[i].first));
+            garbage_ += e.length;
+            e = placed[i];
+        }
+    }
+
+    void flush()
+    {
+        file_.flush();
+        table_.flush();
+    }
+
+    bool needs_compaction (double max_garbage) const
+    {
+        return garbage_ > min_garbage
+               && garbage_ > max_garbage * (size_ - data_start);
+    }
+
+    /** Rewrite the file without the garbage, in the current version
+     ** of the file format. */
+    void compact()
+    {
+        fs::path tmp (path_.string() + ".tmp");
+        try
+        {
+            std::ofstream out (tmp.string(), std::ios::binary | std::ios::trunc);
+            std::vector<entry> table (data_types * elements, entry{0, 0});
+
+            const uint32_t header[4] = { magic, version, 0, 0 };
+            out.write(reinterpret_cast<const char*>(header), header_size);
+            out.write(reinterpret_cast<const char*>(&table[0]), table.size() * sizeof(entry));
+
+            // Elements that are close to each other in the world end up
+            // close to each other in the file.
+            uint64_t pos (data_start);
+            std::vector<char> buf;
+            for (size_t i (0); i < table.size(); ++i)
+            {
+                const entry e (at(i));
+                if (e.length < record_header_)
+                    continue;
+
+                buf.resize(e.length);
+                file_.seekg(e.offset);
+                file_.read(&buf[0], buf.size());
+
+                // Records from older files get a new header.
+                char rec[record_header];
+                compressed_data info;
+                read_record_header(&buf[0], record_header_, info);
+                write_record_header(info, rec);
+                out.write(rec, record_header);
+                out.write(&buf[record_header_], buf.size() - record_header_);
+
+                const uint32_t length (e.length - record_header_ + record_header);
+                table[i].offset = static_cast<uint32_t>(pos);
+                table[i].length = length;
+                pos += length;
+            }
+
+            out.seekp(header_size);
+            out.write(reinterpret_cast<const char*>(&table[0]), table.size() * sizeof(entry));
+            out.close();
+
+            if (!file_ || !out)
+            {
+                file_.clear();
+                throw std::runtime_error("cannot compact " + path_.string());
+            }
+        }
+        catch (...)
+        {
+            fs::remove(tmp);
+            throw;
+        }
+
+        trace("compacting %1%, %2% bytes of garbage", path_.string(), garbage_);
+        close();
+        fs::rename(tmp, path_);
+        open();
+    }
+
+private:
+    void open()
+    {
+        if (!fs::exists(path_))
+        {
+            {
+            const uint32_t header[4] = { magic, version, 0, 0 };
+            std::ofstream out (path_.string(), std::ios::binary);
+            out.write(reinterpret_cast<const char*>(header), sizeof(header));
+            if (!out)
+                throw std::runtime_error("cannot create " + path_.string());
+            }
+            fs::resize_file(path_, data_start);
+        }
+
+        size_ = fs::file_size(path_);
+        if (size_ < data_start)
+            throw std::runtime_error(path_.string() + " is not a region file");
+
+        mapping_ = ip::file_mapping(path_.string().c_str(), ip::read_write);
+        table_ = ip::mapped_region(mapping_, ip::read_write, 0, data_start);
+
+        auto header (static_cast<const uint32_t*>(table_.get_address()));
+        if (header[0] != magic || header[1] == 0 || header[1] > version)
+            throw std::runtime_error(path_.string() + " is not a region file");
+
+        const bool outdated (header[1] < version);
+        record_header_ = outdated ? record_header_v1 : record_header;
+
+        file_.open(path_.string(), std::ios::in | std::ios::out | std::ios::binary);
+        if (!file_)
+            throw std::runtime_error("cannot open " + path_.string());
+
+        uint64_t live (0);
+        for (size_t i (0); i < data_types * elements; ++i)
+            live += at(i).length;
+
+        garbage_ = size_ - data_start - live;
+
+        if (outdated)
+        {
+            trace("upgrading %1%", path_.string());
+            compact();
+        }
+    }
+
+    void close()
+    {
+        flush();
+        file_.close();
+        table_ = ip::mapped_region();
+        mapping_ = ip::file_mapping();
+    }
+
+    entry& at (size_t i)
+    {
+        return reinterpret_cast<entry*>(static_cast<char*>(table_.get_address())
+                                        + header_size)[i];
+    }
+
+    entry& at (data_type type, size_t idx)
+    {
+        return at(static_cast<size_t>(type) * elements + idx);
+    }
+
+private:
+    fs::path            path_;
+    std::fstream        file_;
+    ip::file_mapping    mapping_;
+    ip::mapped_region   table_;
+    uint64_t            size_;
+    uint64_t            garbage_;
+    /** The size of the record headers in this file. */
+    size_t              record_header_;
+
+public:
+    boost::mutex        lock;
+};
+
+//---------------------------------------------------------------------------
+
+persistence_regions::persistence_regions (const fs::path& dir,
+                                          double max_garbage)
+    : dir_               (dir)
+    , max_garbage_       (max_garbage)
+    , compact_requested_ (false)
+    , stop_              (false)
+{
+    if (!fs::is_directory(dir_) && !fs::create_directories(dir_))
+        throw std::runtime_error("cannot create directory " + dir_.string());
+
+    thread_ = boost::thread([=]{ compactor(); });
+}
+
+persistence_regions::~persistence_regions()
+{
+    {
+    boost::lock_guard<boost::mutex> l (compact_mutex_);
+    stop_ = true;
+    compact_cond_.notify_one();
+    }
+    thread_.join();
+
+    boost::lock_guard<boost::mutex> l (heights_mutex_);
+    try
+    {
+        write_heights();
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "persistence_regions: " << e.what() << std::endl;
+    }
+}
+
+persistence_regions::region_ptr
+persistence_regions::get_region (chunk_coordinates region, bool create)
+{
+    boost::lock_guard<boost::mutex> l (regions_mutex_);
+
+    auto found (regions_.find(region));
+    if (found != regions_.end() && (found->second || !create))
+        return found->second;
+
+    fs::path file (dir_ / (boost::format("%08x-%08x-%08x.region")
+                           % region.x % region.y % region.z).str());
+
+    // Remember the files that don't exist as well, so we don't have to
+    // ask the file system every time.
+    if (!create && !fs::exists(file))
+    {
+        regions_[region] = nullptr;
+        return nullptr;
+    }
+
+    if (regions_.size() >= max_open_files)
+    {
+        for (auto i (regions_.begin()); i != regions_.end(); )
+        {
+            if (!i->second || i->second.unique())
+                i = regions_.erase(i);
+            else
+                ++i;
+        }
+    }
+
+    auto result (std::make_shared<region_file>(file));
+    regions_[region] = result;
+    return result;
+}
+
+persistence_regions::height_file&
+persistence_regions::get_heights (map_coordinates region)
+{
+    auto found (heights_.find(region));
+    if (found != heights_.end())
+        return found->second;
+
+    height_file& result (heights_[region]);
+    result.heights.fill(undefined_height);
+    result.dirty = false;
+
+    fs::path file (dir_ / (boost::format("%08x-%08x.height")
+                           % region.x % region.y).str());
+
+    std::ifstream in (file.string(), std::ios::binary);
+    if (in)
+    {
+        in.read(reinterpret_cast<char*>(&result.heights[0]),
+                result.heights.size() * sizeof(chunk_height));
+    }
+    return result;
+}
+
+void
+persistence_regions::write_heights()
+{
+    for (auto& h : heights_)
+    {
+        if (!h.second.dirty)
+            continue;
+
+        fs::path file (dir_ / (boost::format("%08x-%08x.height")
+                               % h.first.x % h.first.y).str());
+
+        std::ofstream out (file.string(), std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&h.second.heights[0]),
+                  h.second.heights.size() * sizeof(chunk_height));
+        if (!out)
+            throw std::runtime_error("cannot write to " + file.string());
+
+        h.second.dirty = false;
+    }
+}
+
+//---------------------------------------------------------------------------
+
+void
+persistence_regions::store (data_type type, chunk_coordinates xyz,
+                            const compressed_data& data)
+{
+    check_type(type);
+    auto r (get_region(region_of(xyz), true));
+
+    boost::lock_guard<boost::mutex> l (r->lock);
+    r->append(type, { { index_of(xyz), &data } });
+}
+
+void
+persistence_regions::store (map_coordinates xy, chunk_height data)
+{
+    boost::lock_guard<boost::mutex> l (heights_mutex_);
+    height_file& f (get_heights(map_coordinates(xy.x / rs, xy.y / rs)));
+    f.heights[(xy.x % rs) + (xy.y % rs) * rs] = data;
+    f.dirty = true;
+}
+
+compressed_data
+persistence_regions::retrieve (data_type type, chunk_coordinates xyz)
+{
+    check_type(type);
+    auto r (get_region(region_of(xyz), false));
+    if (!r)
+    {
+        std::stringstream msg;
+        msg << "data type " << (int)type << " at " << xyz;
+        throw not_in_storage_error(msg.str());
+    }
+
+    boost::lock_guard<boost::mutex> l (r->lock);
+    return r->read(type, index_of(xyz));
+}
+
+chunk_height
+persistence_regions::retrieve (map_coordinates xy)
+{
+    boost::lock_guard<boost::mutex> l (heights_mutex_);
+    height_file& f (get_heights(map_coordinates(xy.x / rs, xy.y / rs)));
+    chunk_height result (f.heights[(xy.x % rs) + (xy.y % rs) * rs]);
+    if (result == undefined_height)
+    {
+        std::stringstream msg;
+        msg << "coarse map height at " << xy;
+        throw not_in_storage_error(msg.str());
+    }
+    return result;
+}
+
+bool
+persistence_regions::is_available (data_type type, chunk_coordinates xyz)
+{
+    check_type(type);
+    auto r (get_region(region_of(xyz), false));
+    if (!r)
+        return false;
+
+    boost::lock_guard<boost::mutex> l (r->lock);
+    return r->has(type, index_of(xyz));
+}
+
+bool
+persistence_regions::is_available (data_type type, map_coordinates xy)
+{
+    if (type != height)
+        return false;
+
+    boost::lock_guard<boost::mutex> l (heights_mutex_);
+    height_file& f (get_heights(map_coordinates(xy.x / rs, xy.y / rs)));
+    return f.heights[(xy.x % rs) + (xy.y % rs) * rs] != undefined_height;
+}
+
+//---------------------------------------------------------------------------
+
+void
+persistence_regions::store (data_type type, const batch& data)
+{
+    if (data.empty())
+        return;
+
+    check_type(type);
+
+    std::unordered_map<chunk_coordinates, region_file::records> grouped;
+    for (auto& elem : data)
+        grouped[region_of(elem.first)].emplace_back(index_of(elem.first), &elem.second);
+
+    for (auto& g : grouped)
+    {
+        auto r (get_region(g.first, true));
+        boost::lock_guard<boost::mutex> l (r->lock);
+        r->append(type, g.second);
+    }
+}
+
+persistent_storage_i::batch
+persistence_regions::retrieve (data_type type, const range<chunk_coordinates>& box)
+{
+    batch result;
+    if (box.empty())
+        return result;
+
+    check_type(type);
+
+    const chunk_coordinates first (box.first());
+    const chunk_coordinates last  (box.last());
+    const chunk_coordinates lo (region_of(first));
+    const chunk_coordinates hi (region_of(chunk_coordinates(last.x - 1, last.y - 1, last.z - 1)));
+
+    for (uint32_t rz (lo.z); rz <= hi.z; ++rz)
+    {
+        for (uint32_t ry (lo.y); ry <= hi.y; ++ry)
+        {
+            for (uint32_t rx (lo.x); rx <= hi.x; ++rx)
+            {
+                auto r (get_region(chunk_coordinates(rx, ry, rz), false));
+                if (!r)
+                    continue;
+
+                boost::lock_guard<boost::mutex> l (r->lock);
+                for (uint32_t z (std::max(first.z, rz * rs)); z < std::min(last.z, (rz + 1) * rs); ++z)
+                {
+                    for (uint32_t y (std::max(first.y, ry * rs)); y < std::min(last.y, (ry + 1) * rs); ++y)
+                    {
+                        for (uint32_t x (std::max(first.x, rx * rs)); x < std::min(last.x, (rx + 1) * rs); ++x)
+                        {
+                            chunk_coordinates pos (x, y, z);
+                            size_t idx (index_of(pos));
+                            if (r->has(type, idx))
+                                result.emplace_back(pos, r->read(type, idx));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return result;
+}
+
+persistent_storage_i::batch
+persistence_regions::retrieve (data_type type,
+                               const std::vector<chunk_coordinates>& xyz)
+{
+    batch result;
+    if (xyz.empty())
+        return result;
+
+    check_type(type);
+
+    std::unordered_map<chunk_coordinates, std::vector<chunk_coordinates>> grouped;
+    for (auto& pos : xyz)
+        grouped[region_of(pos)].emplace_back(pos);
+
+    for (auto& g : grouped)
+    {
+        auto r (get_region(g.first, false));
+        if (!r)
+            continue;
+
+        boost::lock_guard<boost::mutex> l (r->lock);
+        for (auto& pos : g.second)
+        {
+            size_t idx (index_of(pos));
+            if (r->has(type, idx))
+                result.emplace_back(pos, r->read(type, idx));
+        }
+    }
+
+    return result;
+}
+
+//---------------------------------------------------------------------------
+
+void
+persistence_regions::store (const entity_system& es)
+{
+}
+
+void
+persistence_regions::store (const entity_system& es, es::entity entity_id)
+{
+}
+
+void
+persistence_regions::retrieve (entity_system& es)
+{
+}
+
+void
+persistence_regions::retrieve (entity_system& es, es::entity entity_id)
+{
+}
+
+bool
+persistence_regions::is_available (es::entity entity_id)
+{
+    return false;
+}
+
+//---------------------------------------------------------------------------
+
+void
+persistence_regions::cleanup()
+{
+    std::vector<region_ptr> open;
+    {
+    boost::lock_guard<boost::mutex> l (regions_mutex_);
+    for (auto& r : regions_)
+    {
+        if (r.second)
+            open.push_back(r.second);
+    }
+    }
+
+    for (auto& r : open)
+    {
+        boost::lock_guard<boost::mutex> l (r->lock);
+        r->flush();
+    }
+
+    {
+    boost::lock_guard<boost::mutex> l (heights_mutex_);
+    write_heights();
+    }
+
+    boost::lock_guard<boost::mutex> l (compact_mutex_);
+    compact_requested_ = true;
+    compact_cond_.notify_one();
+}
+
+size_t
+persistence_regions::compact()
+{
+    std::vector<region_ptr> open;
+    {
+    boost::lock_guard<boost::mutex> l (regions_mutex_);
+    for (auto& r : regions_)
+    {
+        if (r.second)
+            open.push_back(r.second);
+    }
+    }
+
+    size_t count (0);
+    for (auto& r : open)
+    {
+        boost::lock_guard<boost::mutex> l (r->lock);
+        if (r->needs_compaction(max_garbage_))
+        {
+            r->compact();
+            ++count;
+        }
+    }
+    return count;
+}
+
+void
+persistence_regions::compactor()
+{
+    boost::unique_lock<boost::mutex> l (compact_mutex_);
+    for (;;)
+    {
+        while (!stop_ && !compact_requested_)
+            compact_cond_.wait(l);
+
+        if (stop_)
+            return;
+
+        compact_requested_ = false;
+        l.unlock();
+        try
+        {
+            compact();
+        }
+        catch (std::exception& e)
+        {
+            std::cerr << "persistence_regions: " << e.what() << std::endl;
+        }
+        l.lock();
+    }
+}
+
+} // namespace hexa
+
@@ -0,0 +1,135 @@
+//---------------------------------------------------------------------------
+/// \file   hexa/persistence_regions.hpp
+/// \brief  Stores the terrain in region files.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <array>
+#include <memory>
+#include <unordered_map>
+#include <boost/filesystem/path.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/utility.hpp>
+#include "persistent_storage_i.hpp"
+
+namespace hexa {
+
+/** Stores the terrain in region files, as an alternative to the sqlite
+ ** database.
+ *  Every file holds a region of 32x32x32 chunks.  It starts with a fixed
+ *  table that holds the offset and length of every element, for every
+ *  data type.  This table is memory-mapped.  New data is always appended
+ *  to the end of the file, and the table is updated to point to it.
+ *
+ *  The space taken by the old versions is reclaimed by a background
+ *  thread, which rewrites the files that have become too sparse.
+ *
+ *  The coarse height map is stored in separate files, one per column of
+ *  regions. */
+class persistence_regions : public persistent_storage_i, boost::noncopyable
+{
+public:
+    /** Chunks along each side of a region. */
+    static const unsigned int region_size = 32;
+
+    /** Open a directory with region files.
+     * \param dir          The directory; it is created if it doesn't
+     *                     exist yet
+     * \param max_garbage  Compact a file once this fraction of it is
+     *                     taken by data that was overwritten */
+    persistence_regions (const boost::filesystem::path& dir,
+                         double max_garbage = 0.5);
+
+    ~persistence_regions();
+
+    void store (data_type type, chunk_coordinates xyz, const compressed_data& data);
+    void store (map_coordinates xy, chunk_height data);
+
+    compressed_data retrieve (data_type type, chunk_coordinates xyz);
+    chunk_height    retrieve (map_coordinates xy);
+
+    bool is_available (data_type type, chunk_coordinates xyz);
+    bool is_available (data_type type, map_coordinates xy);
+
+    /** Append everything with one write per region file. */
+    void  store (data_type type, const batch& data);
+
+    /** Fetch a box by walking the offset tables of the regions it
+     ** overlaps. */
+    batch retrieve (data_type type, const range<chunk_coordinates>& box);
+
+    /** Fetch a list of positions, grouped by region. */
+    batch retrieve (data_type type, const std::vector<chunk_coordinates>& xyz);
+
+    void store (const entity_system& es);
+    void store (const entity_system& es, es::entity entity_id);
+    void retrieve (entity_system& es);
+    void retrieve (entity_system& es, es::entity entity_id);
+    bool is_available (es::entity entity_id);
+
+    /** Write the offset tables and height maps to disk, and let the
+     ** background thread look for files that need compacting. */
+    void cleanup();
+
+    /** Compact every file that has too much garbage right away.
+     * \return The number of files that were rewritten */
+    size_t compact();
+
+private:
+    class region_file;
+    typedef std::shared_ptr<region_file> region_ptr;
+
+    struct height_file
+    {
+        std::array<chunk_height, region_size * region_size>  heights;
+        bool dirty;
+    };
+
+    /** Get the region a chunk is in.
+     * \param create  If false, a null pointer is returned if the region
+     *                file doesn't exist yet */
+    region_ptr      get_region (chunk_coordinates region, bool create);
+    height_file&    get_heights (map_coordinates region);
+    void            write_heights ();
+
+    void            compactor ();
+
+private:
+    const boost::filesystem::path   dir_;
+    const double                    max_garbage_;
+
+    boost::mutex                    regions_mutex_;
+    std::unordered_map<chunk_coordinates, region_ptr>   regions_;
+
+    boost::mutex                    heights_mutex_;
+    std::unordered_map<map_coordinates, height_file>    heights_;
+
+    boost::mutex                    compact_mutex_;
+    boost::condition_variable       compact_cond_;
+    bool                            compact_requested_;
+    bool                            stop_;
+    boost::thread                   thread_;
+};
+
+} // namespace hexa
+
@@ -21,6 +21,9 @@
 
 #include "persistence_sqlite.hpp"
 
+#include <algorithm>
+#include <tuple>
+#include <boost/format.hpp>
 #include <boost/range.hpp>
 #include <sqlite3.h>
 
@@ -43,6 +46,7 @@ persistence_sqlite::persistence_sqlite(asio::io_service& io,
                                        const fs::path& setup)
     : io_ (io)
     , timeout_ (io)
+    , auto_commit_ (true)
     , db_ (db_file, setup)
 {
     read_.emplace_back  (db_.prepare_statement("SELECT data FROM area WHERE x=? AND y=? AND idx=?"));
@@ -65,6 +69,20 @@ persistence_sqlite::persistence_sqlite(asio::io_service& io,
     write_height_= db_.prepare_statement("INSERT OR REPLACE INTO height (x,y,z) VALUES (?,?,?)");
     exists_.emplace_back(db_.prepare_statement("SELECT count(*) FROM height WHERE x=? AND y=? LIMIT 1"));
 
+    // Batch queries; these make use of the (x,y,z) primary keys.
+    const char* tables[] = { "area", "chunk", "surface", "lightmap" };
+    for (int i (0); i < 4; ++i)
+    {
+        const char* z (i == area ? "idx" : "z");
+        read_column_.emplace_back(db_.prepare_statement((format(
+            "SELECT %2%, data FROM %1% WHERE x=? AND y=? AND %2% BETWEEN ? AND ?")
+            % tables[i] % z).str()));
+        read_box_.emplace_back(db_.prepare_statement((format(
+            "SELECT x, y, %2%, data FROM %1% WHERE x BETWEEN ? AND ? "
+            "AND y BETWEEN ? AND ? AND %2% BETWEEN ? AND ?")
+            % tables[i] % z).str()));
+    }
+
     db_.exec("PRAGMA synchronous=OFF;");
 }
 
@@ -93,20 +111,43 @@ void persistence_sqlite::end_transaction()
 void
 persistence_sqlite::arm_timer()
 {
+    if (!auto_commit_)
+        return;
+
     timeout_.cancel();
     timeout_.expires_from_now(boost::posix_time::milliseconds(500));
     timeout_.async_wait(boost::bind(&persistence_sqlite::timeout, this,
                                     boost::asio::placeholders::error));
-    begin_transaction();
 }
 
 void
 persistence_sqlite::timeout(const boost::system::error_code& err)
 {
-    if (err != boost::asio::error::operation_aborted)
+    if (err == boost::asio::error::operation_aborted)
+        return;
+
+    // Don't commit halfway through a store or a batch.
+    boost::mutex::scoped_lock l (lock);
+    if (auto_commit_)
         end_transaction();
 }
 
+void
+persistence_sqlite::cleanup()
+{
+    boost::mutex::scoped_lock l (lock);
+    end_transaction();
+}
+
+void
+persistence_sqlite::auto_commit (bool on)
+{
+    boost::mutex::scoped_lock l (lock);
+    auto_commit_ = on;
+    if (!on)
+        timeout_.cancel();
+}
+
 
 //---------------------------------------------------------------------------
 
@@ -120,6 +161,7 @@ persistence_sqlite::store (data_type type, chunk_coordinates xyz,
     assert(idx < write_.size());
     auto& query (write_[idx]);
 
+    begin_transaction();
     arm_timer();
     query.reset();
 
@@ -140,6 +182,7 @@ persistence_sqlite::store (map_coordinates xy, chunk_height z)
 
     auto& query (write_height_);
 
+    begin_transaction();
     arm_timer();
     query.reset();
 
@@ -206,6 +249,137 @@ persistence_sqlite::retrieve (map_coordinates xy)
 
 //---------------------------------------------------------------------------
 
+void
+persistence_sqlite::store (data_type type, const batch& data)
+{
+    if (data.empty())
+        return;
+
+    boost::mutex::scoped_lock l (lock);
+
+    unsigned int idx (static_cast<unsigned int>(type));
+    if (idx >= read_box_.size())
+        throw std::logic_error("cannot store this data type in a batch");
+
+    auto& query (write_[idx]);
+
+    // All the inserts end up in the same transaction, which stays open
+    // until the timer or cleanup() commits it.
+    begin_transaction();
+    arm_timer();
+    for (auto& elem : data)
+    {
+        query.reset();
+        query.bind(1, elem.first.x);
+        query.bind(2, elem.first.y);
+        query.bind(3, elem.first.z);
+        query.bind(4, serialize(elem.second));
+
+        auto rc (query.step());
+        if (rc != SQLITE_DONE && rc != SQLITE_OK)
+            throw std::runtime_error(std::string("cannot store data : ") + err_str_(rc));
+    }
+}
+
+persistent_storage_i::batch
+persistence_sqlite::retrieve (data_type type, const range<chunk_coordinates>& box)
+{
+    batch result;
+    if (box.empty())
+        return result;
+
+    boost::mutex::scoped_lock l (lock);
+
+    unsigned int idx (static_cast<unsigned int>(type));
+    if (idx >= read_box_.size())
+        throw std::logic_error("cannot retrieve this data type in a batch");
+
+    auto& query (read_box_[idx]);
+    query.reset();
+
+    // BETWEEN is inclusive, the range isn't.
+    query.bind(1, box.first().x);
+    query.bind(2, box.last().x - 1);
+    query.bind(3, box.first().y);
+    query.bind(4, box.last().y - 1);
+    query.bind(5, box.first().z);
+    query.bind(6, box.last().z - 1);
+
+    int rc;
+    while ((rc = query.step()) == SQLITE_ROW)
+    {
+        result.emplace_back(chunk_coordinates(query.get_uint(0),
+                                              query.get_uint(1),
+                                              query.get_uint(2)),
+                            deserialize_as<compressed_data>(query.get_blob(3)));
+    }
+
+    if (rc != SQLITE_DONE)
+        throw std::runtime_error(std::string("cannot retrieve data : ") + err_str_(rc));
+
+    return result;
+}
+
+persistent_storage_i::batch
+persistence_sqlite::retrieve (data_type type,
+                              const std::vector<chunk_coordinates>& xyz)
+{
+    batch result;
+    if (xyz.empty())
+        return result;
+
+    unsigned int idx (static_cast<unsigned int>(type));
+    if (idx >= read_column_.size())
+        throw std::logic_error("cannot retrieve this data type in a batch");
+
+    std::vector<chunk_coordinates> sorted (xyz);
+    std::sort(sorted.begin(), sorted.end(), [](const chunk_coordinates& a,
+                                               const chunk_coordinates& b)
+    {
+        return std::tie(a.x, a.y, a.z) < std::tie(b.x, b.y, b.z);
+    });
+
+    boost::mutex::scoped_lock l (lock);
+    auto& query (read_column_[idx]);
+
+    for (auto first (sorted.begin()); first != sorted.end(); )
+    {
+        auto last (std::find_if(first, sorted.end(), [&](const chunk_coordinates& p)
+        {
+            return p.x != first->x || p.y != first->y;
+        }));
+
+        query.reset();
+        query.bind(1, first->x);
+        query.bind(2, first->y);
+        query.bind(3, first->z);
+        query.bind(4, (last - 1)->z);
+
+        int rc;
+        while ((rc = query.step()) == SQLITE_ROW)
+        {
+            chunk_coordinates pos (first->x, first->y, query.get_uint(0));
+
+            // Skip the holes in the requested column.
+            if (std::binary_search(first, last, pos,
+                                   [](const chunk_coordinates& a, const chunk_coordinates& b)
+                                   { return a.z < b.z; }))
+            {
+                result.emplace_back(pos, deserialize_as<compressed_data>(query.get_blob(1)));
+            }
+        }
+
+        if (rc != SQLITE_DONE)
+            throw std::runtime_error(std::string("cannot retrieve data : ") + err_str_(rc));
+
+        first = last;
+    }
+
+    return result;
+}
+
+//---------------------------------------------------------------------------
+
 bool
 persistence_sqlite::is_available (data_type type, chunk_coordinates xyz)
 {
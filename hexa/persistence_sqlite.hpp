@@ -55,6 +55,15 @@ public:
     bool is_available (data_type type, chunk_coordinates xyz);
     bool is_available (data_type type, map_coordinates xy);
 
+    /** Store everything in a single transaction. */
+    void  store (data_type type, const batch& data);
+
+    /** Fetch a box with a single range query. */
+    batch retrieve (data_type type, const range<chunk_coordinates>& box);
+
+    /** Fetch a list of positions.  The positions are grouped by column,
+     ** and every column is fetched with a single range query. */
+    batch retrieve (data_type type, const std::vector<chunk_coordinates>& xyz);
 
     void store (const entity_system& es);
     void store (const entity_system& es, es::entity entity_id);
@@ -62,6 +71,15 @@ public:
     void retrieve (entity_system& es, es::entity entity_id);
     bool is_available (es::entity entity_id);
 
+    /** Commit everything that was stored so far. */
+    void cleanup();
+
+    /** Choose who commits the data.  By default, a transaction is
+     ** committed half a second after the last access.  If this is
+     ** turned off, nothing is committed until cleanup() is called, so a
+     ** write_behind in front of it gets one transaction per batch. */
+    void auto_commit (bool on);
+
 protected:
     void  begin_transaction();
     void  end_transaction();
@@ -73,6 +91,7 @@ private:
 private:
     boost::asio::io_service&    io_;
     boost::asio::deadline_timer timeout_;
+    bool                        auto_commit_;
 
     sql::db db_;
     std::unique_ptr<sql::transaction>   transaction_;
@@ -81,6 +100,8 @@ private:
     std::vector<sql::prepared_statement>  read_;
     std::vector<sql::prepared_statement>  write_;
     std::vector<sql::prepared_statement>  exists_;
+    std::vector<sql::prepared_statement>  read_column_;
+    std::vector<sql::prepared_statement>  read_box_;
 
     sql::prepared_statement  read_height_;
     sql::prepared_statement  write_height_;
@@ -34,5 +34,36 @@ persistent_storage_i::raii_transaction::~raii_transaction()
     ref_.end_transaction();
 }
 
+void
+persistent_storage_i::store (data_type type, const batch& data)
+{
+    auto tr (transaction());
+    for (auto& elem : data)
+        store(type, elem.first, elem.second);
+}
+
+persistent_storage_i::batch
+persistent_storage_i::retrieve (data_type type, const range<chunk_coordinates>& box)
+{
+    std::vector<chunk_coordinates> all;
+    if (!box.empty())
+        all.assign(box.begin(), box.end());
+
+    return retrieve(type, all);
+}
+
+persistent_storage_i::batch
+persistent_storage_i::retrieve (data_type type,
+                                const std::vector<chunk_coordinates>& xyz)
+{
+    batch result;
+    for (auto& pos : xyz)
+    {
+        if (is_available(type, pos))
+            result.emplace_back(pos, retrieve(type, pos));
+    }
+    return result;
+}
+
 } // namespace hexa
 
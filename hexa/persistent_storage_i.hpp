@@ -23,11 +23,14 @@
 #pragma once
 
 #include <stdexcept>
+#include <utility>
+#include <vector>
 #include <boost/signal.hpp>
 #include <boost/thread/mutex.hpp>
 #include "basic_types.hpp"
 #include "compression.hpp"
 #include "entity_system.hpp"
+#include "voxel_range.hpp"
 
 namespace hexa {
 
@@ -50,6 +53,9 @@ public:
     }
     data_type;
 
+    /** A number of elements of the same type, and their positions. */
+    typedef std::vector<std::pair<chunk_coordinates, compressed_data>> batch;
+
     class raii_transaction
     {
         friend class persistent_storage_i;
@@ -87,6 +93,24 @@ public:
         is_available (data_type type, map_coordinates xy) = 0;
 
 
+    /** Store many elements at once.
+     *  The default implementation stores them one by one, inside a
+     *  single transaction. */
+    virtual void
+        store (data_type type, const batch& data);
+
+    /** Fetch everything of a given type that is stored inside a box.
+     *  The default implementation checks every position. */
+    virtual batch
+        retrieve (data_type type, const range<chunk_coordinates>& box);
+
+    /** Fetch the elements at a list of positions.  Positions that have
+     ** nothing stored are left out of the result.
+     *  The default implementation fetches them one by one. */
+    virtual batch
+        retrieve (data_type type, const std::vector<chunk_coordinates>& xyz);
+
+
 
     virtual void
         store (const entity_system& es) = 0;
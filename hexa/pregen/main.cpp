@@ -0,0 +1,356 @@
+//---------------------------------------------------------------------------
+// pregen/main.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <iostream>
+#include <fstream>
+#include <tuple>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/chrono.hpp>
+#include <boost/format.hpp>
+#include <boost/thread.hpp>
+#include <boost/program_options/option.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/config.hpp>
+#include <hexa/os.hpp>
+#include <hexa/algorithm.hpp>
+#include <hexa/persistence_regions.hpp>
+#include <hexa/persistence_sqlite.hpp>
+#include <hexa/memory_cache.hpp>
+#include <hexa/write_behind.hpp>
+#include <hexa/trace.hpp>
+
+#include <hexa/server/init_terrain_generators.hpp>
+#include <hexa/server/lua.hpp>
+#include <hexa/server/server_entity_system.hpp>
+#include <hexa/server/world.hpp>
+
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+using boost::format;
+using namespace hexa;
+
+// Some of the terrain generators look up the game directory here.
+po::variables_map global_settings;
+
+namespace {
+
+volatile std::sig_atomic_t interrupted (0);
+
+void on_signal (int)
+{
+    interrupted = 1;
+}
+
+std::string default_db_path()
+{
+    return (app_user_dir() / fs::path(SERVER_DB_PATH)).string();
+}
+
+/** All columns within \a radius chunks of \a center.  They are sorted
+ ** in square regions, so the terrain generators can share their work
+ ** between neighboring chunks.  The regions nearest to the center go
+ ** first. */
+std::vector<map_coordinates>
+columns_to_generate (map_coordinates center, int radius, int region_size)
+{
+    typedef std::tuple<int, int, int, map_coordinates> sort_key;
+    std::vector<sort_key> keys;
+
+    for (int y (-radius); y <= radius; ++y)
+    {
+        for (int x (-radius); x <= radius; ++x)
+        {
+            if (x * x + y * y > radius * radius)
+                continue;
+
+            // Round towards minus infinity, so every region has the
+            // same size.
+            int rx ((x + radius) / region_size), ry ((y + radius) / region_size);
+            int cx ((radius + region_size / 2) / region_size);
+            int d  ((rx - cx) * (rx - cx) + (ry - cx) * (ry - cx));
+
+            keys.emplace_back(d, ry, rx, map_coordinates(center.x + x, center.y + y));
+        }
+    }
+
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<map_coordinates> result;
+    result.reserve(keys.size());
+    for (auto& k : keys)
+        result.push_back(std::get<3>(k));
+
+    return result;
+}
+
+} // anonymous namespace
+
+int main (int argc, char* argv[])
+{
+    auto& vm (global_settings);
+
+    po::options_description generic("Command line options");
+    generic.add_options()
+        ("version,v", "print version string")
+        ("help", "show help message");
+
+    po::options_description config("Configuration");
+    config.add_options()
+        ("datadir", po::value<std::string>()->default_value(GAME_DATA_PATH),
+            "the data directory")
+        ("dbdir", po::value<std::string>()->default_value(default_db_path()),
+            "the server database directory")
+        ("game", po::value<std::string>()->default_value("defaultgame"),
+            "which game to generate")
+        ("worker-threads", po::value<unsigned int>()->default_value(0),
+            "number of terrain generation threads, 0 means one per core")
+        ("cache-size", po::value<unsigned int>()->default_value(256),
+            "memory budget of the terrain cache, in MiB")
+        ("cache-weights", po::value<std::string>()->default_value(""),
+            "share of the cache per data type, e.g. \"chunk=2,light=0.5\"")
+        ("write-queue", po::value<unsigned int>()->default_value(64),
+            "size of the queue of terrain waiting to be written to the database, in MiB")
+        ("storage", po::value<std::string>()->default_value("sqlite"),
+            "how the terrain is stored on disk: \"sqlite\" or \"regions\"")
+        ("x", po::value<int>()->default_value(0),
+            "center of the map, in chunks east of the origin")
+        ("y", po::value<int>()->default_value(0),
+            "center of the map, in chunks north of the origin")
+        ("radius", po::value<unsigned int>()->default_value(32),
+            "generate all chunks up to this distance from the center")
+        ("bottom", po::value<int>()->default_value(-4),
+            "lowest chunk layer, relative to the water level")
+        ("top", po::value<int>()->default_value(4),
+            "highest chunk layer, relative to the water level")
+        ("region-size", po::value<unsigned int>()->default_value(8),
+            "size of the square regions that are generated together")
+        ("checkpoint", po::value<unsigned int>()->default_value(30),
+            "write everything to the database every this many seconds")
+        ;
+
+    po::options_description cmdline;
+    cmdline.add(generic).add(config);
+
+    po::store(po::parse_command_line(argc, argv, cmdline), vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << cmdline << std::endl;
+        return EXIT_SUCCESS;
+    }
+    if (vm.count("version"))
+    {
+        std::cout << "hexahedra " << PROJECT_VERSION << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    try
+    {
+        std::string game_name (vm["game"].as<std::string>());
+        fs::path datadir (vm["datadir"].as<std::string>());
+        fs::path dbdir   (fs::path(vm["dbdir"].as<std::string>()) / game_name);
+        fs::path gamedir (datadir / std::string("games") / game_name);
+
+        const int radius (vm["radius"].as<unsigned int>());
+        const int bottom (vm["bottom"].as<int>());
+        const int top    (vm["top"].as<int>());
+        const int region (std::max(1u, vm["region-size"].as<unsigned int>()));
+
+        if (top < bottom)
+            throw std::runtime_error("the top layer is below the bottom layer");
+
+        if (!fs::is_directory(gamedir))
+            throw std::runtime_error("cannot open game '" + game_name + "'");
+
+        if (!fs::is_directory(dbdir) && !fs::create_directories(dbdir))
+            throw std::runtime_error("cannot create directory '" + dbdir.string() + "'");
+
+        boost::asio::io_service io_srv;
+
+        // Declared before the world, the workers can still be answering
+        // requests while it shuts down.
+        std::atomic<size_t>         done (0);
+
+        std::unique_ptr<persistent_storage_i> db;
+        std::string backend (vm["storage"].as<std::string>());
+        if (backend == "sqlite")
+        {
+            auto sqlite (make_unique<persistence_sqlite>(io_srv, dbdir / "world.db", datadir / "dbsetup.sql"));
+            // The write-behind queue commits once per batch.
+            sqlite->auto_commit(false);
+            db = std::move(sqlite);
+        }
+        else if (backend == "regions")
+            db = make_unique<persistence_regions>(dbdir / "regions");
+        else
+            throw std::runtime_error("unknown storage '" + backend + "'");
+
+        write_behind                db_queue (*db, size_t(vm["write-queue"].as<unsigned int>()) << 20);
+        memory_cache                storage (db_queue, size_t(vm["cache-size"].as<unsigned int>()) << 20);
+        set_cache_weights(storage, vm["cache-weights"].as<std::string>());
+        hexa::server_entity_system  entities;
+        hexa::world                 world (storage, vm["worker-threads"].as<unsigned int>());
+        hexa::lua                   scripting (entities, world);
+
+        // The Lua scripts define the materials the terrain generators
+        // refer to.
+        for(fs::recursive_directory_iterator i (gamedir);
+            i != fs::recursive_directory_iterator(); ++i)
+        {
+            if (fs::is_regular_file(*i) && i->path().extension() == ".lua")
+            {
+                if (!scripting.load(i->path()))
+                    throw std::runtime_error(scripting.get_error());
+            }
+        }
+
+        boost::property_tree::ptree setup;
+        fs::path conf_file (gamedir / "setup.json");
+        std::ifstream conf_str (conf_file.string());
+        if (!conf_str)
+            throw std::runtime_error(std::string("cannot open ") + conf_file.string());
+
+        boost::property_tree::read_json(conf_str, setup);
+        hexa::init_terrain_gen(world, setup);
+
+        map_coordinates center (map_chunk_center.x + vm["x"].as<int>(),
+                                map_chunk_center.y + vm["y"].as<int>());
+        auto columns (columns_to_generate(center, radius, region));
+
+        const size_t layers (top - bottom + 1);
+        const size_t total (columns.size() * layers);
+
+        // Don't flood the queue; this keeps the regions together, and
+        // keeps the memory use down.
+        const size_t max_queued (world.worker_count() * 256);
+
+        std::cout << "Generating " << total << " chunks in "
+                  << columns.size() << " columns, using "
+                  << world.worker_count() << " threads" << std::endl;
+
+        std::signal(SIGINT, on_signal);
+        std::signal(SIGTERM, on_signal);
+
+        using namespace boost::chrono;
+        const seconds checkpoint (vm["checkpoint"].as<unsigned int>());
+
+        size_t queued (0), last_done (0);
+        auto next (columns.begin());
+        auto start (steady_clock::now());
+        auto last_report (start), last_checkpoint (start);
+
+        while (!interrupted)
+        {
+            while (next != columns.end() && queued - done < max_queued)
+            {
+                // Chunks that were done in an earlier run are skipped
+                // by the world; this makes it safe to restart.
+                for (int z (bottom); z <= top; ++z)
+                {
+                    chunk_coordinates pos (next->x, next->y, world_chunk_center.z + z);
+                    world.requests.push({ world::request::surface_and_lightmap,
+                                          pos, [&]{ ++done; } });
+                }
+                queued += layers;
+                ++next;
+            }
+
+            // The light maps are refined after their requests have
+            // been answered; wait for those too.
+            if (done == total && world.is_idle())
+                break;
+
+            boost::this_thread::sleep_for(milliseconds(100));
+
+            auto now (steady_clock::now());
+            if (now - last_report >= seconds(1))
+            {
+                double elapsed (duration_cast<milliseconds>(now - last_report).count() * 1.0e-3);
+                size_t current (done);
+                auto queue (db_queue.stats());
+                std::cout << format("\r%1%/%2% chunks (%3$.1f%%), %4$.0f chunks/s, "
+                                    "write lag %5$.1f s     ")
+                             % current % total % (100.0 * current / total)
+                             % ((current - last_done) / elapsed) % queue.lag
+                          << std::flush;
+
+                last_done = current;
+                last_report = now;
+            }
+
+            if (now - last_checkpoint >= checkpoint)
+            {
+                world.cleanup();
+                last_checkpoint = now;
+            }
+        }
+
+        if (interrupted)
+        {
+            std::cout << std::endl << "Interrupted, run again to resume." << std::endl;
+            world.requests.clear();
+            world.refinements.clear();
+        }
+
+        auto elapsed (duration_cast<milliseconds>(steady_clock::now() - start).count() * 1.0e-3);
+        std::cout << std::endl
+                  << format("%1% chunks in %2$.1f s, %3$.0f chunks/s")
+                     % size_t(done) % elapsed % (done / std::max(elapsed, 0.001))
+                  << std::endl;
+
+        world.cleanup();
+        db_queue.flush();
+        std::cout << std::endl << storage.stats() << db_queue.stats();
+
+        // The world stops its workers before the storage is written
+        // back and closed.
+    }
+    catch (luabind::error& e)
+    {
+        std::cerr << "Uncaught Lua error: " << lua_tostring(e.state(), -1) << std::endl;
+        return -1;
+    }
+    catch (boost::property_tree::ptree_error& e)
+    {
+        std::cerr << "Error in JSON: " << e.what() << std::endl;
+        return -1;
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+
+    return EXIT_SUCCESS;
+}
+
@@ -27,7 +27,9 @@
 #include "compression.hpp"
 #include "hotbar_slot.hpp"
 #include "packet.hpp"
+#include "packet_buffer.hpp"
 #include "serialize.hpp"
+#include "surface_patch.hpp"
 
 namespace hexa {
 namespace msg {
@@ -43,6 +45,11 @@ typedef enum
 }
 reliability;
 
+/** The version of the protocol described in this file.  It has to be
+ ** raised every time the format of a message changes; the server turns
+ ** away clients that speak another version. */
+const uint8_t current_protocol_version = 2;
+
 /** Interface for all network messages.
  * If you want to know the binary format of a message, just look at the
  * serialize() function.  Variables are sent in network byte order, and
@@ -379,7 +386,9 @@ public:
     void serialize(archive& ar) { ar(position)(data); }
 };
 
-/** The surface and light map of a chunk. */
+/** The surface and light map of a chunk.
+ *  A chunk without any visible faces, such as solid rock deep
+ *  underground, is sent with empty terrain and light data. */
 class surface_update : public msg_i
 {
 public:
@@ -400,6 +409,28 @@ public:
     }
 };
 
+/** A few faces of a chunk have changed, usually because a single block
+ ** was placed or removed.
+ *  This is sent instead of a \a surface_update, and is only useful to
+ *  clients that already have the surface and light map of the chunk. */
+class surface_delta : public msg_i
+{
+public:
+    enum { msg_id = 17 };
+    uint8_t type() const { return msg_id; }
+    reliability method() const { return sequenced; }
+
+    chunk_coordinates   position; /**< Position of the chunk. */
+    surface_patch       patch;    /**< The changes. */
+
+    /** (De)serialize this message. */
+    template <class archive>
+    void serialize(archive& ar)
+    {
+        ar(position)(patch);
+    }
+};
+
 /** Register player stat info. */
 class player_stat_register : public msg_i
 {
@@ -717,15 +748,28 @@ public:
 
 /**@}*/
 
+/** Serialize a message, prefixed with its id, into a pooled buffer. */
 template <class message_t>
-std::vector<uint8_t> serialize_packet(message_t& m)
+packet_buffer serialize_packet(message_t& m)
 {
-    std::vector<uint8_t> result;
-    result.push_back(message_t::msg_id);
-    auto archive (make_serializer(result));
+    packet_buffer result;
+    result.bytes().push_back(message_t::msg_id);
+    auto archive (make_serializer(result.bytes()));
     m.serialize(archive);
     return result;
 }
 
 }} // namespace hexa::msg
 
+namespace hexa {
+
+/** Physics updates only hold 32-bit fields, so they are copied in one
+ ** go. */
+template <>
+struct flat_layout<msg::entity_update_physics::value> : flat_fields<4> { };
+
+static_assert(sizeof(msg::entity_update_physics::value) == 40,
+              "entity_update_physics::value has padding");
+
+} // namespace hexa
+
@@ -27,7 +27,26 @@ using namespace boost::range;
 
 namespace hexa {
 
+namespace {
+
+/** A new branch; only the bundle at the root needs a flattened copy. */
+ray_bundle leaf (ray_bundle::value_type ray, float w)
+{
+    ray_bundle result;
+    result.trunk = move(ray);
+    result.weight = w;
+    return result;
+}
+
+} // anonymous namespace
+
 void ray_bundle::add(ray_bundle::value_type ray, float w)
+{
+    merge(move(ray), w);
+    flatten();
+}
+
+void ray_bundle::merge(ray_bundle::value_type ray, float w)
 {
     // If this is the first ray in the bundle, just add it.
     if (trunk.empty() && branches.empty())
@@ -66,12 +85,12 @@ void ray_bundle::add(ray_bundle::value_type ray, float w)
             if (k == end(branches))
             {
                 // Nope.  The remaining ray becomes a new branch.
-                branches.emplace_back(ray_bundle(move(ray), w));
+                branches.emplace_back(leaf(move(ray), w));
             }
             else
             {
                 // It does.  Recurse down this branch.
-                k->add(move(ray), w);
+                k->merge(move(ray), w);
             }
         }
     }
@@ -80,30 +99,67 @@ void ray_bundle::add(ray_bundle::value_type ray, float w)
         // The ray diverged from the trunk halfway.  Fork the trunk at
         // this point.  One branch is the rest of the trunk, the other
         // is the remaining part of the ray.
-        ray_bundle split (value_type(j, end(trunk)), weight);
+        ray_bundle split (leaf(value_type(j, end(trunk)), weight));
         std::swap(branches, split.branches);
         trunk.erase(j, end(trunk));
         branches.emplace_back(move(split));
         weight += w;
 
         if (!ray.empty())
-            branches.emplace_back(ray_bundle(move(ray), w));
+            branches.emplace_back(leaf(move(ray), w));
     }
 }
 
 void ray_bundle::normalize_weight()
 {
     if (trunk.empty() || weight == 0)
+    {
         weight = 0;
+        if (!flat.empty())
+            flat.front().weight = 0;
+    }
     else
         multiply_weight(1.0f / weight);
 }
 
 void ray_bundle::multiply_weight(float factor)
+{
+    scale(factor);
+    for (auto& n : flat)
+        n.weight *= factor;
+}
+
+void ray_bundle::scale(float factor)
 {
     weight *= factor;
-    for (auto& branch : branches) 
-        branch.multiply_weight(factor);
+    for (auto& branch : branches)
+        branch.scale(factor);
+}
+
+void ray_bundle::flatten()
+{
+    flat.clear();
+    flat_voxels.clear();
+    flatten(flat, flat_voxels, true);
+}
+
+void ray_bundle::flatten(std::vector<flat_node>& nodes, value_type& voxels,
+                         bool leading) const
+{
+    const size_t index (nodes.size());
+    flat_node n;
+    n.first   = voxels.size();
+    voxels.insert(voxels.end(), trunk.begin(), trunk.end());
+    n.last    = voxels.size();
+    n.weight  = weight;
+    n.leading = leading && !trunk.empty();
+    nodes.push_back(n);
+
+    // If the trunk is empty, the rays start in the branches.
+    for (auto& branch : branches)
+        branch.flatten(nodes, voxels, leading && trunk.empty());
+
+    nodes[index].skip = nodes.size();
 }
 
 } // namespace hexa
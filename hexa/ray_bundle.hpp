@@ -22,6 +22,8 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <vector>
 #include "ray.hpp"
 
@@ -33,12 +35,29 @@ namespace hexa {
  *  at first, before diverging later on.  This class bundles such groups of
  *  rays in a tree structure, so that every voxel has to be traversed only
  *  once, and large parts of the ray-tree can be skipped if a voxel is
- *  blocking them. */
+ *  blocking them.
+ *
+ *  Besides the tree itself, the bundle keeps a flattened copy of it that
+ *  follow() walks through with a simple loop. */
 class ray_bundle
 {
 public:
     typedef std::vector<world_vector>   value_type;
 
+    /** A node of the tree in its flattened form. */
+    struct flat_node
+    {
+        /** The trunk, as a range of indices in \a flat_voxels. */
+        uint32_t    first, last;
+        /** The index of the first node after this node's branches. */
+        uint32_t    skip;
+        /** \sa ray_bundle::weight */
+        float       weight;
+        /** True if the first voxel of the trunk is also the first voxel
+         ** of the rays. */
+        bool        leading;
+    };
+
     /** Every part of the tree has a weight, usually it relates linearly
      *  to the number of rays in this branch. */
     float                   weight;
@@ -48,13 +67,22 @@ public:
      ** different branches. */
     std::vector<ray_bundle> branches;
 
+    /** All nodes of the tree, in the order they are visited.  This is
+     *  kept up to date by add() and the weight functions, but only for
+     *  the bundle they were called on, not for its branches. */
+    std::vector<flat_node>  flat;
+    /** The trunks of all nodes in \a flat, one after the other. */
+    value_type              flat_voxels;
+
 public:
     ray_bundle() : weight(0) {}
 
     ray_bundle(value_type ray, float w)
         : weight (w)
         , trunk  (ray)
-    { }
+    {
+        flatten();
+    }
 
     /** Add a ray with a given weight to the bundle. */
     void add (value_type ray, float weight);
@@ -68,6 +96,51 @@ public:
 
     bool operator==(world_vector comp) const
         { return trunk.front() == comp; }
+
+    /** Follow the rays until they are blocked.
+     *  Every trunk takes away light in proportion to its weight and how
+     *  opaque its voxels are.  Once the voxels along a trunk add up to
+     *  fully opaque, its branches are skipped.
+     * @param ray_power  The light at the start
+     * @param opacity    Called with the offset of a voxel, and whether
+     *                   it is the first voxel of a ray.  Returns the
+     *                   opacity in the range 0..1.
+     * @return The light that is left at the end of the rays */
+    template <class func>
+    float follow (float ray_power, func opacity) const
+    {
+        const uint32_t count (flat.size());
+        uint32_t i (0);
+        while (i < count)
+        {
+            const flat_node& n (flat[i]);
+            float temp (0.0f);
+            bool blocked (false);
+            for (uint32_t v (n.first); v < n.last; ++v)
+            {
+                temp += opacity(flat_voxels[v], n.leading && v == n.first);
+                if (temp >= 1.0f)
+                {
+                    blocked = true;
+                    break;
+                }
+            }
+
+            ray_power -= std::min(temp, 1.0f) * n.weight;
+            if (ray_power <= 0.01)
+                return 0.0f;
+
+            i = blocked ? n.skip : i + 1;
+        }
+        return ray_power;
+    }
+
+private:
+    void merge (value_type ray, float weight);
+    void scale (float factor);
+    void flatten ();
+    void flatten (std::vector<flat_node>& nodes, value_type& voxels,
+                  bool leading) const;
 };
 
 } // namespace hexa
@@ -22,10 +22,13 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <deque>
 #include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #ifdef WIN32
@@ -57,6 +60,97 @@ uint64_t htonll(uint64_t x)
     return ntohll(x);
 }
 
+//---------------------------------------------------------------------------
+
+/// Convert an array of flat elements between host and network byte
+/// order, in place.
+// @param data   The array
+// @param bytes  The size of the array, in bytes
+// @param field  The size of the fields the elements are made of
+inline
+void swap_byte_order (char* data, size_t bytes, size_t field)
+{
+    if (htons(1) == 1)
+        return;
+
+    char* const end (data + bytes);
+    switch (field)
+    {
+    case 2:
+        for (uint16_t v; data < end; data += 2)
+            std::memcpy(&v, data, 2), v = htons(v), std::memcpy(data, &v, 2);
+        break;
+
+    case 4:
+        for (uint32_t v; data < end; data += 4)
+            std::memcpy(&v, data, 4), v = htonl(v), std::memcpy(data, &v, 4);
+        break;
+
+    case 8:
+        for (uint64_t v; data < end; data += 8)
+            std::memcpy(&v, data, 8), v = htonll(v), std::memcpy(data, &v, 8);
+        break;
+    }
+}
+
+/// The base for types that are flat, see flat_layout.
+template <size_t bytes>
+struct flat_fields : std::true_type
+{
+    enum { field = bytes };
+
+    /// Convert an array between host and network byte order.
+    static void swap (char* data, size_t size)
+    {
+        swap_byte_order(data, size, field);
+    }
+};
+
+/// Tells whether a type is written exactly as it is laid out in memory,
+/// apart from the byte order.
+//  Such a type consists of integers or floats that are all \a field
+//  bytes wide, without any padding, and it is serialized in the order
+//  the members are declared.  Arrays of them are copied in one go, and
+//  then converted to network byte order.  Specialize this for structs
+//  that qualify; if you get it wrong, the unit tests will tell you.
+//  Structs with fields of different widths can provide their own
+//  swap() instead of deriving from flat_fields.
+template <class t>
+struct flat_layout : std::false_type
+{
+    enum { field = 0 };
+};
+
+template <> struct flat_layout<uint8_t>  : flat_fields<1> { };
+template <> struct flat_layout<int8_t>   : flat_fields<1> { };
+template <> struct flat_layout<uint16_t> : flat_fields<2> { };
+template <> struct flat_layout<int16_t>  : flat_fields<2> { };
+template <> struct flat_layout<uint32_t> : flat_fields<4> { };
+template <> struct flat_layout<int32_t>  : flat_fields<4> { };
+template <> struct flat_layout<float>    : flat_fields<4> { };
+template <> struct flat_layout<uint64_t> : flat_fields<8> { };
+template <> struct flat_layout<double>   : flat_fields<8> { };
+
+template <class t>
+struct flat_layout<vector2<t>> : flat_layout<t> { };
+
+template <class t>
+struct flat_layout<vector3<t>> : flat_layout<t> { };
+
+/// Offsets within a chunk are packed in 16 bits.
+template <>
+struct flat_layout<vector3<int8_t>> : std::false_type
+{
+    enum { field = 0 };
+};
+
+template <> struct flat_layout<wfpos> : flat_fields<4> { };
+
+static_assert(sizeof(vector3<float>) == 12, "vector3 is not flat");
+static_assert(sizeof(wfpos) == 24, "wfpos is not flat");
+
+//---------------------------------------------------------------------------
+
 /// Serializes common data types to a binary representation
 template <class obj>
 class serializer
@@ -201,23 +295,13 @@ public:
     template <class t>
     self& operator() (std::vector<t>& val)
     {
-        uint16_t array_size (val.size());
-        write(htons(array_size));
-        for (uint16_t i (0); i < array_size; ++i)
-             (*this)(val[i]);
-
-        return *this;
+        return write_array(val, flat_layout<t>());
     }
 
     template <class t>
     self& operator() (const std::vector<t>& val)
     {
-        uint16_t array_size (val.size());
-        write(htons(array_size));
-        for (uint16_t i (0); i < array_size; ++i)
-             (*this)(val[i]);
-
-        return *this;
+        return write_array(val, flat_layout<t>());
     }
 
     template <class t>
@@ -261,7 +345,7 @@ public:
     }
 
     template <class t>
-    self& raw_data(t& val, size_t elements)
+    self& raw_data(const t& val, size_t elements)
     {
         // The 'elements' parameter seems useless here, but it's used in
         // the deserializer.
@@ -270,12 +354,66 @@ public:
         if (!val.empty())
         {
             const char* s_ptr (reinterpret_cast<const char*>(&*val.begin()));
-            const char* e_ptr (reinterpret_cast<const char*>(&*val.end()));
+            const char* e_ptr (s_ptr + elements * sizeof(typename t::value_type));
             write_.insert(write_.end(), s_ptr, e_ptr);
         }
 
         return *this;
     }
+
+    /// Make room for a number of bytes that are about to be written.
+    self& reserve(size_t bytes)
+    {
+        write_.reserve(write_.size() + bytes);
+        return *this;
+    }
+
+private:
+    /// Grow the buffer in one step for what is about to be written.
+    //  Unlike reserve(), this doesn't lose the exponential growth when it
+    //  is called for lots of small arrays.
+    void make_room(size_t bytes)
+    {
+        const size_t needed (write_.size() + bytes);
+        if (needed > write_.capacity())
+            write_.reserve(std::max<size_t>(needed, write_.capacity() * 2));
+    }
+
+    /// Write an array one element at a time.
+    template <class array>
+    self& write_array(array& val, std::false_type)
+    {
+        uint16_t array_size (val.size());
+        write(htons(array_size));
+        make_room(array_size * sizeof(val[0]));
+        for (uint16_t i (0); i < array_size; ++i)
+             (*this)(val[i]);
+
+        return *this;
+    }
+
+    /// Write an array of flat elements with a single copy.
+    template <class t>
+    self& write_array(const std::vector<t>& val, std::true_type)
+    {
+        static_assert(std::is_trivially_copyable<t>::value,
+                      "flat_layout needs trivially copyable elements");
+
+        uint16_t array_size (val.size());
+        const size_t bytes (array_size * sizeof(t));
+        make_room(sizeof(array_size) + bytes);
+        write(htons(array_size));
+        if (bytes == 0)
+            return *this;
+
+        size_type pos (write_.size());
+        write_.resize(pos + bytes);
+        char* dest (reinterpret_cast<char*>(&*(write_.begin() + pos)));
+        std::memcpy(dest, &val[0], bytes);
+        flat_layout<t>::swap(dest, bytes);
+
+        return *this;
+    }
 };
 
 /// Create a serializer.
@@ -461,11 +599,7 @@ public:
         uint16_t len;
         (*this)(len);
 
-        val.resize(len);
-        for(uint16_t i (0); i < len; ++i)
-            (*this)(val[i]);
-
-        return *this;
+        return read_array(val, len, flat_layout<t>());
     }
 
     template <class t>
@@ -514,12 +648,51 @@ public:
 
         val.resize(elements);
         char* ptr (reinterpret_cast<char*>(&*val.begin()));
-        std::copy(cursor_, cursor_ + bytes, ptr);
+        std::memcpy(ptr, &*cursor_, bytes);
         std::advance(cursor_, bytes);
 
         return *this;
     }
 
+    /// Look at the next byte without reading it.
+    uint8_t peek() const
+    {
+        if (cursor_ == read_.end())
+            throw std::runtime_error("end of data reached");
+
+        return *cursor_;
+    }
+
+private:
+    /// Read an array one element at a time.
+    template <class t>
+    self& read_array(std::vector<t>& val, size_t elements, std::false_type)
+    {
+        val.resize(elements);
+        for(size_t i (0); i < elements; ++i)
+            (*this)(val[i]);
+
+        return *this;
+    }
+
+    /// Read an array of flat elements with a single copy.
+    template <class t>
+    self& read_array(std::vector<t>& val, size_t elements, std::true_type)
+    {
+        static_assert(std::is_trivially_copyable<t>::value,
+                      "flat_layout needs trivially copyable elements");
+
+        val.clear();
+        raw_data(val, elements);
+        if (elements > 0)
+        {
+            flat_layout<t>::swap(reinterpret_cast<char*>(&val[0]),
+                                 elements * sizeof(t));
+        }
+        return *this;
+    }
+
+public:
     template <typename t>
     t get()
     {
@@ -27,7 +27,7 @@
 #include <boost/format.hpp>
 #include <boost/math/constants/constants.hpp>
 
-#include <hexa/neighborhood.hpp>
+#include <hexa/dense_neighborhood.hpp>
 #include <hexa/voxel_algorithm.hpp>
 #include <hexa/voxel_range.hpp>
 #include <hexa/trace.hpp>
@@ -44,11 +44,6 @@ typedef std::array<unsigned int, 3> triangle;
 namespace {
 
 
-float opacity (uint16_t t)
-{
-    return 1.0f - (material_prop[t].transparency / 255.f);
-}
-
 bool f (uint16_t t)
 {
     return t == 0 || material_prop[t].transparency > 0;
@@ -136,50 +131,6 @@ ambient_occlusion_lightmap::precalc (float ambient_raylen, unsigned int count) c
 ambient_occlusion_lightmap::~ambient_occlusion_lightmap ()
 { }
 
-float
-ambient_occlusion_lightmap::recurse (const ray_bundle& r, float ray_power,
-                                     const world_coordinates& blk,
-                                     neighborhood<chunk_ptr>& nbh,
-                                     bool first) const
-{
-    float temp (0.0f);
-    bool should_recurse (true);
-
-    for (auto& voxel : r.trunk)
-    {
-        auto type (nbh[blk + voxel].type);
-
-        // If the very first block we traverse is a custom block, we
-        // skip it.
-        if (first)
-        {
-            first = false;
-            if (material_prop[type].is_custom_block())
-                continue;
-        }
-
-        temp += opacity(type);
-        if (temp >= 1.0f)
-        {
-            should_recurse = false;
-            break;
-        }
-    }
-
-    ray_power -= std::min(temp, 1.0f) * r.weight;
-
-    if (ray_power <= 0.01)
-        return 0.0;
-
-    if (should_recurse)
-    {
-        for (auto& s : r.branches)
-            ray_power = recurse(s, ray_power, blk, nbh, first);
-    }
-
-    return ray_power;
-}
-
 lightmap&
 ambient_occlusion_lightmap::generate (const chunk_coordinates& pos,
                                       const surface& s,
@@ -189,19 +140,28 @@ ambient_occlusion_lightmap::generate (const chunk_coordinates& pos,
     assert(phase < detail_levels_.size());
     trace((boost::format("for %1%") % world_vector(pos - world_chunk_center)).str());
 
-    neighborhood<chunk_ptr> nbh (cache_, pos, 7);
+    if (s.empty())
+        return lightchunk;
+
+    // Copy everything the rays can reach.
+    world_vector lo (0, 0, 0), hi (chunk_size, chunk_size, chunk_size);
+    for (auto& r : detail_levels_[phase])
+        extend_to_reach(r, lo, hi);
+
+    dense_neighborhood nbh (cache_, pos, lo, hi);
+    const auto opacities (opacity_table());
 
     auto lmi (std::begin(lightchunk));
     for (faces f : s)
     {
-        world_coordinates blk (f.pos);
+        world_vector blk (f.pos);
 
         for (int d (0) ; d < 5; ++d)
         {
             if (f[d])
             {
                 const ray_bundle& r (detail_levels_[phase][d]);
-                float light_level (recurse(r, r.weight, blk, nbh));
+                float light_level (r.follow(r.weight, opacity_at(nbh, opacities, blk)));
 
                 if (d < 4)
                     light_level += d * 0.05f;
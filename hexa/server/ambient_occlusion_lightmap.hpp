@@ -51,13 +51,12 @@ public:
 
     unsigned int phases() const { return 3; }
 
+    /** The rays are spread out over a hemisphere; a single block
+     ** further away than this only blocks a tiny fraction of them. */
+    unsigned int influence_radius() const { return 10; }
+
 private:
     rays  precalc (float length, unsigned int count) const;
-
-    float recurse(const ray_bundle& r, float ray_power,
-                  const world_coordinates& blk,
-                  neighborhood<chunk_ptr>& nbh,
-                  bool first = true) const;
 };
 
 } // namespace hexa
@@ -0,0 +1,148 @@
+//---------------------------------------------------------------------------
+// server/flood_lightmap.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "flood_lightmap.hpp"
+
+#include <cassert>
+#include <utility>
+
+using namespace boost::property_tree;
+
+namespace hexa {
+
+flood_lightmap::flood_lightmap (storage_i& c, const ptree& conf)
+    : lightmap_generator_i (c, conf)
+    , cache_size_ (conf.get<size_t>("cache_size", 128))
+    , changes_ (0)
+{
+}
+
+flood_lightmap::~flood_lightmap ()
+{ }
+
+lightmap&
+flood_lightmap::generate (const chunk_coordinates& pos,
+                          const surface& s,
+                          lightmap& lc, unsigned int) const
+{
+    if (s.empty())
+        return lc;
+
+    auto e (get(pos));
+    boost::lock_guard<boost::mutex> lock (e->lock);
+    const light_volume& vol (e->volume);
+
+    // Every face gets the light of the voxel right in front of it.
+    auto lmi (std::begin(lc));
+    for (const faces& f : s)
+    {
+        for (int d (0); d < 6; ++d)
+        {
+            if (!f[d])
+                continue;
+
+            const world_vector front (world_vector(f.pos) + dir_vector[d]);
+            lmi->sunlight   = vol.level(front, light_volume::sky);
+            lmi->artificial = vol.level(front, light_volume::artificial);
+            ++lmi;
+        }
+    }
+    assert(lmi == std::end(lc));
+
+    return lc;
+}
+
+void
+flood_lightmap::block_changed (world_coordinates pos, uint16_t material)
+{
+    std::vector<std::pair<entry_ptr, world_vector>> affected;
+    {
+    boost::lock_guard<boost::mutex> lock (lock_);
+    ++changes_;
+
+    std::vector<chunk_coordinates> stale;
+    volumes_.for_each([&](const chunk_coordinates& c, const entry_ptr& e)
+    {
+        const world_vector rel (pos - c * chunk_size);
+        if (e->volume.covers(rel))
+            affected.emplace_back(e, rel);
+        else if (e->volume.depends_on(rel, rel + world_vector(1, 1, 1)))
+            stale.push_back(c);
+    });
+
+    // A block above the box might have opened or closed a way to the
+    // sky; only a full rebuild can tell.
+    for (auto& c : stale)
+        volumes_.remove(c);
+    }
+
+    for (auto& a : affected)
+    {
+        boost::lock_guard<boost::mutex> lock (a.first->lock);
+        a.first->volume.change(a.second, material);
+    }
+}
+
+void
+flood_lightmap::chunk_changed (chunk_coordinates pos)
+{
+    boost::lock_guard<boost::mutex> lock (lock_);
+    ++changes_;
+
+    std::vector<chunk_coordinates> stale;
+    volumes_.for_each([&](const chunk_coordinates& c, const entry_ptr& e)
+    {
+        const world_vector rel ((pos - c) * chunk_size);
+        if (e->volume.depends_on(rel, rel + world_vector(chunk_size, chunk_size, chunk_size)))
+            stale.push_back(c);
+    });
+
+    for (auto& c : stale)
+        volumes_.remove(c);
+}
+
+flood_lightmap::entry_ptr
+flood_lightmap::get (const chunk_coordinates& pos) const
+{
+    unsigned int stamp;
+    {
+    boost::lock_guard<boost::mutex> lock (lock_);
+    auto found (volumes_.try_get(pos));
+    if (found)
+        return *found;
+
+    stamp = changes_;
+    }
+
+    // Building the volume takes a while, so do it outside the lock.
+    auto result (std::make_shared<entry>(cache_, pos));
+
+    boost::lock_guard<boost::mutex> lock (lock_);
+    if (changes_ == stamp && cache_size_ > 0)
+    {
+        volumes_[pos] = result;
+        volumes_.prune(cache_size_);
+    }
+
+    return result;
+}
+
+} // namespace hexa
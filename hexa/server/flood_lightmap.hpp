@@ -0,0 +1,92 @@
+//---------------------------------------------------------------------------
+/// \file   server/flood_lightmap.hpp
+/// \brief  Sky and block light that spreads from voxel to voxel.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <hexa/basic_types.hpp>
+#include <hexa/light_volume.hpp>
+#include <hexa/lru_cache.hpp>
+#include <hexa/storage_i.hpp>
+#include "lightmap_generator_i.hpp"
+
+namespace hexa {
+
+/** Fill the sunlight and artificial light channels by flooding the
+ ** world with light, starting at the sky and at the lamps.
+ *  Unlike \ref sun_lightmap and \ref lamp_lightmap, which cast rays
+ *  from every face towards every light source, the cost of this
+ *  does not depend on the number of lamps.  The light levels around
+ *  recently used chunks are kept in memory, so a changed block only
+ *  costs as much as the number of voxels whose light changes.
+ *
+ *  Configuration:
+ *  - cache_size: how many chunks to keep the light levels of,
+ *                every one takes about 250 kB (default 128) */
+class flood_lightmap : public lightmap_generator_i
+{
+public:
+    flood_lightmap(storage_i& cache, const boost::property_tree::ptree& conf);
+
+    virtual ~flood_lightmap();
+
+    virtual lightmap& generate(const chunk_coordinates& pos,
+                               const surface& s,
+                               lightmap& chunk,
+                               unsigned int phase = 0) const;
+
+    /** Light travels 15 blocks, and faces read the light from the
+     ** voxel in front of them. */
+    unsigned int influence_radius() const { return light_volume::max_level + 1; }
+
+    void block_changed (world_coordinates pos, uint16_t material);
+
+    void chunk_changed (chunk_coordinates pos);
+
+private:
+    struct entry
+    {
+        entry (storage_i& src, const chunk_coordinates& pos)
+            : volume (src, pos) { }
+
+        boost::mutex  lock;
+        light_volume  volume;
+    };
+
+    typedef std::shared_ptr<entry> entry_ptr;
+
+    /** Get the light around a chunk, from the cache if possible. */
+    entry_ptr  get (const chunk_coordinates& pos) const;
+
+private:
+    size_t  cache_size_;
+
+    mutable boost::mutex                             lock_;
+    mutable lru_cache<chunk_coordinates, entry_ptr>  volumes_;
+    /** Counts the changes to the world, so volumes that were built
+     ** while the world was being changed are not cached. */
+    unsigned int                                     changes_;
+};
+
+} // namespace hexa
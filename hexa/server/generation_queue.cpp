@@ -0,0 +1,319 @@
+//---------------------------------------------------------------------------
+// server/generation_queue.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "generation_queue.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+#include <hexa/trace.hpp>
+
+namespace hexa {
+
+namespace {
+
+typedef generation_queue::request::type_t type_t;
+
+/** Combine the work of two requests for the same chunk. */
+type_t merge (type_t a, type_t b)
+{
+    if (a == b || b == generation_queue::request::chunk)
+        return a;
+
+    if (a == generation_queue::request::chunk)
+        return b;
+
+    // Any combination of surface and lightmap requests.
+    return generation_queue::request::surface_and_lightmap;
+}
+
+int64_t delta (uint32_t a, uint32_t b)
+{
+    return static_cast<int64_t>(a) - static_cast<int64_t>(b);
+}
+
+void answer_all (const std::vector<std::function<void()>>& answers)
+{
+    for (auto& f : answers)
+        f();
+}
+
+} // anonymous namespace
+
+generation_queue::generation_queue (unsigned int view_distance)
+    : quit_ (0)
+    , sequence_ (0)
+    , view_distance_ (view_distance)
+    , dirty_ (false)
+{
+}
+
+void generation_queue::push (request rq)
+{
+    {
+    boost::lock_guard<boost::mutex> lock (mutex_);
+
+    if (rq.type == request::quit)
+    {
+        ++quit_;
+        cond_.notify_all();
+        return;
+    }
+
+    auto found (pending_.find(rq.pos));
+    if (found != pending_.end())
+    {
+        // Piggyback on the request that's already waiting.
+        found->second.type = merge(found->second.type, rq.type);
+        if (rq.answer)
+            found->second.answers.emplace_back(std::move(rq.answer));
+
+        return;
+    }
+
+    pending& entry (pending_[rq.pos]);
+    entry.type = rq.type;
+    if (rq.answer)
+        entry.answers.emplace_back(std::move(rq.answer));
+
+    heap_.push_back({ distance(rq.pos), sequence_++, rq.pos });
+    std::push_heap(heap_.begin(), heap_.end());
+
+    cond_.notify_one();
+    }
+
+    if (on_push_)
+        on_push_();
+}
+
+generation_queue::request generation_queue::pop ()
+{
+    boost::unique_lock<boost::mutex> lock (mutex_);
+
+    for (;;)
+    {
+        if (dirty_)
+        {
+            auto dropped (reprioritize());
+            if (!dropped.empty())
+            {
+                lock.unlock();
+                answer_all(dropped);
+                lock.lock();
+                continue;
+            }
+        }
+
+        if (quit_ > 0 || !heap_.empty())
+            return take();
+
+        cond_.wait(lock);
+    }
+}
+
+bool generation_queue::try_pop (request& rq)
+{
+    boost::unique_lock<boost::mutex> lock (mutex_);
+
+    if (dirty_)
+    {
+        auto dropped (reprioritize());
+        if (!dropped.empty())
+        {
+            lock.unlock();
+            answer_all(dropped);
+            lock.lock();
+        }
+    }
+
+    if (quit_ == 0 && heap_.empty())
+        return false;
+
+    rq = take();
+    return true;
+}
+
+size_t generation_queue::size() const
+{
+    boost::lock_guard<boost::mutex> lock (mutex_);
+    return pending_.size() + quit_;
+}
+
+bool generation_queue::empty() const
+{
+    boost::lock_guard<boost::mutex> lock (mutex_);
+    return pending_.empty() && quit_ == 0;
+}
+
+void generation_queue::clear()
+{
+    std::vector<std::function<void()>> dropped;
+    {
+    boost::lock_guard<boost::mutex> lock (mutex_);
+    for (auto& p : pending_)
+    {
+        for (auto& f : p.second.answers)
+            dropped.emplace_back(std::move(f));
+    }
+    pending_.clear();
+    heap_.clear();
+    quit_ = 0;
+    }
+
+    answer_all(dropped);
+}
+
+void generation_queue::update_player (uint32_t id, chunk_coordinates pos)
+{
+    boost::lock_guard<boost::mutex> lock (mutex_);
+
+    auto found (players_.find(id));
+    if (found != players_.end() && found->second == pos)
+        return;
+
+    players_[id] = pos;
+    dirty_ = true;
+}
+
+void generation_queue::remove_player (uint32_t id)
+{
+    boost::lock_guard<boost::mutex> lock (mutex_);
+    if (players_.erase(id))
+        dirty_ = true;
+}
+
+void generation_queue::view_distance (unsigned int distance)
+{
+    boost::lock_guard<boost::mutex> lock (mutex_);
+    view_distance_ = distance;
+    dirty_ = true;
+}
+
+unsigned int generation_queue::view_distance () const
+{
+    boost::lock_guard<boost::mutex> lock (mutex_);
+    return view_distance_;
+}
+
+void generation_queue::on_push (std::function<void()> fn)
+{
+    boost::lock_guard<boost::mutex> lock (mutex_);
+    on_push_ = std::move(fn);
+}
+
+//---------------------------------------------------------------------------
+
+uint64_t generation_queue::distance (chunk_coordinates pos) const
+{
+    if (players_.empty())
+        return 0;
+
+    uint64_t result (std::numeric_limits<uint64_t>::max());
+    for (auto& plr : players_)
+    {
+        int64_t dx (delta(pos.x, plr.second.x)),
+                dy (delta(pos.y, plr.second.y)),
+                dz (delta(pos.z, plr.second.z));
+
+        result = std::min<uint64_t>(result, dx * dx + dy * dy + dz * dz);
+    }
+
+    return result;
+}
+
+bool generation_queue::out_of_view (uint64_t distance) const
+{
+    return !players_.empty()
+           && distance > uint64_t(view_distance_) * view_distance_;
+}
+
+std::vector<std::function<void()>> generation_queue::reprioritize ()
+{
+    // Requests are only dropped here, and not in push().  A client can
+    // ask for the terrain around its new position before we've heard
+    // that it moved.
+    std::vector<std::function<void()>> dropped;
+    size_t before (heap_.size());
+    auto last (heap_.begin());
+    for (auto& e : heap_)
+    {
+        e.distance = distance(e.pos);
+        if (out_of_view(e.distance))
+        {
+            auto found (pending_.find(e.pos));
+            for (auto& f : found->second.answers)
+                dropped.emplace_back(std::move(f));
+
+            pending_.erase(found);
+        }
+        else
+        {
+            *last++ = e;
+        }
+    }
+    heap_.erase(last, heap_.end());
+    std::make_heap(heap_.begin(), heap_.end());
+
+    if (heap_.size() != before)
+        trace("dropped %1% requests that are out of view", before - heap_.size());
+
+    dirty_ = false;
+    return dropped;
+}
+
+generation_queue::request generation_queue::take ()
+{
+    if (quit_ > 0)
+    {
+        --quit_;
+        return { request::quit, chunk_coordinates(), []{} };
+    }
+
+    std::pop_heap(heap_.begin(), heap_.end());
+    auto pos (heap_.back().pos);
+    heap_.pop_back();
+
+    auto found (pending_.find(pos));
+    assert(found != pending_.end());
+
+    request result { found->second.type, pos, nullptr };
+    auto answers (std::move(found->second.answers));
+    pending_.erase(found);
+
+    if (answers.size() == 1)
+    {
+        result.answer = std::move(answers.front());
+    }
+    else
+    {
+        result.answer = [answers]
+        {
+            for (auto& f : answers)
+                f();
+        };
+    }
+
+    return result;
+}
+
+} // namespace hexa
+
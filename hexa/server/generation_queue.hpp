@@ -0,0 +1,149 @@
+//---------------------------------------------------------------------------
+/// \file   hexa/server/generation_queue.hpp
+/// \brief  Priority queue for world generation requests.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <hexa/basic_types.hpp>
+
+namespace hexa {
+
+/** Thread-safe queue of chunks waiting to be generated.
+ *  Requests are handed out nearest-player-first.  Whenever a player
+ *  moves to another chunk, the queue is reordered, and requests that
+ *  have ended up outside every player's view distance are dropped.  If
+ *  no players are known (e.g. when pregenerating a map), the requests
+ *  are handled in the order they came in.
+ *
+ *  Several requests for the same chunk are merged into one.  All the
+ *  callbacks will be called once the merged request has been handled.
+ *  The callbacks of dropped requests are called as well, so nobody is
+ *  left waiting; they have to check if the data is actually there. */
+class generation_queue
+{
+public:
+    struct request
+    {
+        enum type_t
+        {
+            chunk, surface, lightmap, surface_and_lightmap, quit
+        };
+
+        type_t                  type;
+        chunk_coordinates       pos;
+        std::function<void()>   answer;
+    };
+
+public:
+    /** Construct an empty queue.
+     * \param view_distance  Requests that are further away from all
+     *                       players than this many chunks are dropped */
+    generation_queue (unsigned int view_distance = 32);
+
+    /** Add a request to the queue.
+     *  Quit requests take precedence over everything else. */
+    void    push (request rq);
+
+    /** Take the request closest to a player, blocks until one is
+     ** available. */
+    request pop ();
+
+    /** Take the request closest to a player, if there is one.
+     * \return True if \a rq was set */
+    bool    try_pop (request& rq);
+
+    size_t  size() const;
+    bool    empty() const;
+
+    /** Drop everything that is waiting.  The dropped requests are
+     ** answered, like the ones that go out of view. */
+    void    clear();
+
+    /** Tell the queue where a player is.
+     *  This is cheap to call often, the queue is only reordered if the
+     *  player has moved to another chunk. */
+    void    update_player (uint32_t id, chunk_coordinates pos);
+
+    /** Forget about a player that has left the game. */
+    void    remove_player (uint32_t id);
+
+    void          view_distance (unsigned int distance);
+    unsigned int  view_distance () const;
+
+    /** Set a function that is called every time a new request was
+     ** added.  This has to be done before anything is pushed. */
+    void          on_push (std::function<void()> fn);
+
+private:
+    struct pending
+    {
+        request::type_t                     type;
+        std::vector<std::function<void()>>  answers;
+    };
+
+    struct heap_entry
+    {
+        uint64_t            distance;
+        uint64_t            sequence;
+        chunk_coordinates   pos;
+
+        /** Reversed, so std::push_heap gives us a min-heap. */
+        bool operator< (const heap_entry& compare) const
+        {
+            return distance != compare.distance ? distance > compare.distance
+                                                : sequence > compare.sequence;
+        }
+    };
+
+    /** Squared distance to the nearest player, zero if there are none. */
+    uint64_t    distance (chunk_coordinates pos) const;
+    bool        out_of_view (uint64_t distance) const;
+    /** Reorder the heap, and drop whatever is out of view.
+     * \return The callbacks of the dropped requests; the caller has to
+     *         call them after releasing the lock */
+    std::vector<std::function<void()>> reprioritize ();
+    request     take ();
+
+private:
+    mutable boost::mutex        mutex_;
+    boost::condition_variable   cond_;
+
+    std::unordered_map<chunk_coordinates, pending>  pending_;
+    std::vector<heap_entry>                         heap_;
+    std::unordered_map<uint32_t, chunk_coordinates> players_;
+
+    std::function<void()>                           on_push_;
+
+    unsigned int    quit_;
+    uint64_t        sequence_;
+    unsigned int    view_distance_;
+    bool            dirty_;
+};
+
+} // namespace hexa
+
@@ -28,6 +28,7 @@
 #include "world.hpp"
 
 #include "ambient_occlusion_lightmap.hpp"
+#include "flood_lightmap.hpp"
 #include "test_lightmap.hpp"
 #include "lamp_lightmap.hpp"
 #include "radiosity_lightmap.hpp"
@@ -136,6 +137,9 @@ void init_terrain_gen (world& w, const ptree& config)
             else if (module == "debug")
                 w.add_lightmap_generator(make_unique<test_lightmap>(w, info));
 
+            else if (module == "flood")
+                w.add_lightmap_generator(make_unique<flood_lightmap>(w, info));
+
             else if (module == "lamp")
                 w.add_lightmap_generator(make_unique<lamp_lightmap>(w, info));
 
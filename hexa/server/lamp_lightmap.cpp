@@ -23,14 +23,13 @@
 
 #include <algorithm>
 #include <array>
-#include <unordered_set>
-#include <iostream>
+#include <cmath>
 
 #include <boost/math/constants/constants.hpp>
 #include <boost/range/algorithm.hpp>
 #include <boost/range/adaptors.hpp>
 
-#include <hexa/neighborhood.hpp>
+#include <hexa/dense_neighborhood.hpp>
 #include <hexa/voxel_algorithm.hpp>
 #include <hexa/voxel_range.hpp>
 
@@ -45,17 +44,22 @@ namespace hexa {
 
 namespace {
 
+/** Overall brightness of the lamps. */
+const float brightness (6.0f);
+
+/** Lamps that add less than this to the light level of a face are
+ ** left out; that's half a step on the 0..15 scale. */
+const float cutoff (0.5f / 15.4f);
+
+/** The distance at which a lamp of full strength drops below the
+ ** cutoff. */
+const float max_reach (std::sqrt(brightness / cutoff));
+
 float opacity (uint16_t t)
 {
     return 1.0f - (material_prop[t].transparency / 255.f);
 }
 
-bool f (uint16_t t)
-{
-    return t == 0 || material_prop[t].transparency > 0;
-}
-
-
 } // anonymous namespace
 
 
@@ -64,6 +68,7 @@ bool f (uint16_t t)
 
 lamp_lightmap::lamp_lightmap (storage_i& c, const ptree& conf)
     : lightmap_generator_i (c, conf)
+    , lamps_ (c)
 {
 }
 
@@ -72,13 +77,15 @@ lamp_lightmap::~lamp_lightmap ()
 
 struct lamp
 {
-    lamp(vector p, float s)
-        : pos(p + vector(0.5, 0.5, 0.5))
+    lamp(world_vector p, float s)
+        : pos(vector(p) + vector(0.5, 0.5, 0.5))
+        , ipos(p)
         , str(s)
     { }
 
-    vector  pos;
-    float   str;
+    vector          pos;
+    world_vector    ipos;
+    float           str;
 };
 
 lightmap&
@@ -86,55 +93,31 @@ lamp_lightmap::generate (const chunk_coordinates& pos,
                          const surface& s,
                          lightmap& lightchunk, unsigned int phase) const
 {
-    static const float boost (6.0f);
-
     if (s.empty())
         return lightchunk;
 
-    //unsigned int lamp_limit[] = { 3, 8, 100 };
-
-    world_coordinates origin (pos * chunk_size);
     const vector half (0.5f, 0.5f, 0.5f);
-    block_vector no (chunk_size * 2, chunk_size * 2, chunk_size * 2);
-
-    // Go through all the surfaces in the chunks surrounding the current
-    // chunk we're making a lightmap for (a 5x5x5 Moore neighborhood).
-    // Put all the block types in a flat array (we'll need to access them
-    // quite often, this speeds up the traversal) and place the point light
-    // sources.
-    //
+
+    // The shadow rays stay inside the box around the chunk and the
+    // lamps, so that's all the terrain we need.
     std::vector<lamp> lamps;
-    chunk_base<block, chunk_size*5> nbh;
-    for (auto i : cube_range<block_vector>(2))
+    world_vector lo (-1, -1, -1), hi (chunk_size + 1, chunk_size + 1, chunk_size + 1);
+    for (auto& l : lamps_.near(pos, max_reach))
     {
-        auto cp (cache_.get_surface(pos + i));
-        if (!cp)
-            continue;
-
-        block_vector origin (i * chunk_size + no);
-        for (auto& face : cp->opaque)
-        {
-            block_vector pos (origin + face.pos);
-            nbh[pos] = face.type;
-
-            uint8_t strength (material_prop[face.type].light_emission) ;
-            if (strength)
-                lamps.push_back(lamp(pos - no, strength / 255.f));
-        }
-        for (auto& face : cp->transparent)
-        {
-            block_vector pos (origin + face.pos);
-            nbh[face.pos] = face.type;
-
-            uint8_t strength (material_prop[face.type].light_emission) ;
-            if (strength)
-                lamps.push_back(lamp(pos - no, strength / 255.f));
-        }
+        lamps.emplace_back(l.pos, l.strength / 255.f);
+        lo.x = std::min(lo.x, l.pos.x);
+        lo.y = std::min(lo.y, l.pos.y);
+        lo.z = std::min(lo.z, l.pos.z);
+        hi.x = std::max(hi.x, l.pos.x + 1);
+        hi.y = std::max(hi.y, l.pos.y + 1);
+        hi.z = std::max(hi.z, l.pos.z + 1);
     }
 
     if (lamps.empty())
         return lightchunk;
 
+    dense_neighborhood nbh (cache_, pos, lo, hi);
+
     auto lmi (std::begin(lightchunk));
     for (const faces& f : s)
     {
@@ -151,16 +134,21 @@ lamp_lightmap::generate (const chunk_coordinates& pos,
             for (auto& lamp : lamps)
             {
                 const vector& lp (lamp.pos);
-                auto ilp (floor(lp));
 
-                if (ilp == f.pos)
+                if (lamp.ipos == world_vector(f.pos))
                 {
                     light_level = 1;
                     break;
                 }
 
-                float weight (lamp.str * dot_prod(normalize(lp - o), normal) / squared_distance(lp, o));
-                if (weight <= 0)
+                // Lamps that are too far away to make a difference are
+                // skipped before tracing the ray.
+                const float falloff (lamp.str * brightness / squared_distance(lp, o));
+                if (falloff < cutoff)
+                    continue;
+
+                const float weight (falloff * dot_prod(normalize(lp - o), normal));
+                if (weight < cutoff)
                     continue;
 
                 float power (1.0f);
@@ -170,12 +158,13 @@ lamp_lightmap::generate (const chunk_coordinates& pos,
                 // transparent.
                 voxel_raycast(o, lp, [&](vector3<int> rv)
                 {
-                    return rv == ilp || (power -= opacity(nbh[rv + no])) <= 0;
+                    return    world_vector(rv) == lamp.ipos
+                           || (power -= opacity(nbh[world_vector(rv)])) <= 0;
                 });
 
                 if (power > 0)
                 {
-                    light_level += power * weight * boost;
+                    light_level += power * weight;
                     if (light_level >= 1)
                         break;
                 }
@@ -191,5 +180,22 @@ lamp_lightmap::generate (const chunk_coordinates& pos,
     return lightchunk;
 }
 
-} // namespace hexa
+unsigned int
+lamp_lightmap::influence_radius () const
+{
+    return std::ceil(max_reach);
+}
 
+void
+lamp_lightmap::block_changed (world_coordinates pos, uint16_t material)
+{
+    lamps_.changed(pos, material);
+}
+
+void
+lamp_lightmap::chunk_changed (chunk_coordinates pos)
+{
+    lamps_.forget(pos);
+}
+
+} // namespace hexa
@@ -25,12 +25,16 @@
 #include <array>
 #include <vector>
 #include <hexa/basic_types.hpp>
-#include <hexa/ray_bundle.hpp>
+#include <hexa/lamp_index.hpp>
 #include <hexa/storage_i.hpp>
 #include "lightmap_generator_i.hpp"
 
 namespace hexa {
 
+/** Light up the faces near light emitting blocks.
+ *  The lamps around a chunk are looked up in a \ref lamp_index, and
+ *  every lamp that is close enough to make a difference casts a ray
+ *  to every face. */
 class lamp_lightmap : public lightmap_generator_i
 {
 public:
@@ -45,7 +49,15 @@ public:
 
     unsigned int phases() const { return 3; }
 
+    /** The distance at which the brightest lamp fades out. */
+    unsigned int influence_radius() const;
+
+    void block_changed (world_coordinates pos, uint16_t material);
+
+    void chunk_changed (chunk_coordinates pos);
+
 private:
+    mutable lamp_index  lamps_;
 };
 
 } // namespace hexa
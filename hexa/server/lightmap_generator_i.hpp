@@ -63,6 +63,24 @@ public:
      *  function should return the number of phases this generator supports. */
     virtual unsigned int phases() const { return 1; }
 
+    /** How far away a changed block can still make a noticeable
+     ** difference to the light of a face, in blocks.
+     *  After a single block has changed, only the faces this close to
+     *  it get new light. */
+    virtual unsigned int influence_radius() const { return chunk_size; }
+
+    /** Called after a single block was changed in the game world.
+     *  Generators that keep light data of their own can update it
+     *  here, before the light maps around the block are generated
+     *  again.
+     * @param pos       The block's position
+     * @param material  The block's new material */
+    virtual void block_changed (world_coordinates pos, uint16_t material) { }
+
+    /** Called after the terrain generators have created or changed a
+     ** whole chunk. */
+    virtual void chunk_changed (chunk_coordinates pos) { }
+
 protected:
     storage_i&  cache_; /**< The game world. */
     boost::property_tree::ptree config_; /**< This module's configuration. */
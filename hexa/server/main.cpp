@@ -19,10 +19,12 @@
 // Copyright 2012-2013, nocte@hippie.nu
 //---------------------------------------------------------------------------
 
+#include <array>
 #include <cassert>
 #include <iostream>
 #include <fstream>
 #include <ctime>
+#include <iterator>
 #include <signal.h>
 
 #ifndef _WIN32
@@ -48,8 +50,11 @@
 #include <hexa/protocol.hpp>
 #include <hexa/drop_privileges.hpp>
 #include <hexa/voxel_range.hpp>
+#include <hexa/algorithm.hpp>
+#include <hexa/persistence_regions.hpp>
 #include <hexa/persistence_sqlite.hpp>
 #include <hexa/memory_cache.hpp>
+#include <hexa/write_behind.hpp>
 #include <hexa/trace.hpp>
 #include <hexa/entity_system_physics.hpp>
 #include <hexa/win32_minidump.hpp>
@@ -74,6 +79,42 @@ static std::string default_db_path()
     return (app_user_dir() / fs::path(SERVER_DB_PATH)).string();
 }
 
+/** Tell the cache how to compress the terrain it writes to disk.
+ *  If there is a dictionary for a data type, such as chunk.dict, it is
+ *  registered, so terrain that was stored with it can be read.  The
+ *  dictionaries are used for new data as well if the codec is deflate. */
+static void set_compression (memory_cache& cache, codec c,
+                             const fs::path& dictionaries)
+{
+    const std::array<std::pair<persistent_storage_i::data_type, const char*>, 4> types
+        {{ { persistent_storage_i::area,    "area" },
+           { persistent_storage_i::chunk,   "chunk" },
+           { persistent_storage_i::surface, "surface" },
+           { persistent_storage_i::light,   "light" } }};
+
+    for (auto& t : types)
+    {
+        compression_method how (c);
+        fs::path file (dictionaries / (std::string(t.second) + ".dict"));
+        if (fs::exists(file))
+        {
+            std::ifstream in (file.string(), std::ios::binary);
+            binary_data buf ((std::istreambuf_iterator<char>(in)),
+                             std::istreambuf_iterator<char>());
+            if (!in && !in.eof())
+                throw std::runtime_error("cannot read " + file.string());
+
+            auto dict (std::make_shared<compression_dictionary>(std::move(buf)));
+            register_dictionary(dict);
+            trace("compression dictionary %1%, id %2%", file.string(), dict->id);
+
+            if (c == codec::deflate)
+                how.dictionary = dict;
+        }
+        cache.compression(t.first, how);
+    }
+}
+
 bool lolquit = false;
 void physics (server_entity_system& s, storage_i& terrain)
 {
@@ -101,6 +142,23 @@ void physics (server_entity_system& s, storage_i& terrain)
     }
 }
 
+// Every two seconds or so, write changes back to the database, and keep
+// the memory cache within its budget.  This can block on a full write
+// queue, so it has its own thread.
+void maintenance (world& w)
+{
+    using namespace boost::chrono;
+
+    milliseconds tick (50);
+    int count (0);
+    while (!lolquit)
+    {
+        boost::this_thread::sleep_for(tick);
+        if (++count % 40 == 0)
+            w.cleanup();
+    }
+}
+
 #ifdef _WIN32
 
 HANDLE stopEvent;
@@ -144,6 +202,24 @@ int main (int argc, char* argv[])
             "the server database directory")
         ("game", po::value<std::string>()->default_value("defaultgame"),
             "which game to start")
+        ("worker-threads", po::value<unsigned int>()->default_value(0),
+            "number of terrain generation threads, 0 means one per core")
+        ("cache-size", po::value<unsigned int>()->default_value(256),
+            "memory budget of the terrain cache, in MiB")
+        ("cache-weights", po::value<std::string>()->default_value(""),
+            "share of the cache per data type, e.g. \"chunk=2,light=0.5\"")
+        ("write-queue", po::value<unsigned int>()->default_value(64),
+            "size of the queue of terrain waiting to be written to the database, in MiB")
+        ("storage", po::value<std::string>()->default_value("sqlite"),
+            "how the terrain is stored on disk: \"sqlite\" or \"regions\"")
+        ("storage-codec", po::value<std::string>()->default_value("lz4"),
+            "how terrain is compressed on disk: \"lz4\" or \"deflate\"")
+        ("wire-codec", po::value<std::string>()->default_value("lz4"),
+            "how terrain is compressed when it is sent to the players")
+        ("view-distance", po::value<unsigned int>()->default_value(32),
+            "terrain requests further than this many chunks away from every player are dropped")
+        ("refine-budget", po::value<double>()->default_value(0.25),
+            "fraction of the worker threads' time that can be spent on improving light maps")
         ;
 
     po::options_description cmdline;
@@ -219,13 +295,34 @@ int main (int argc, char* argv[])
 
         trace("Game DB %1%", db_file.string());
 
-        persistence_sqlite          db_per (io_srv, db_file, datadir / "dbsetup.sql");
-        memory_cache                storage (db_per);
+        std::unique_ptr<persistent_storage_i> db_per;
+        std::string backend (vm["storage"].as<std::string>());
+        if (backend == "sqlite")
+        {
+            auto sqlite (make_unique<persistence_sqlite>(io_srv, db_file, datadir / "dbsetup.sql"));
+            // The write-behind queue commits once per batch.
+            sqlite->auto_commit(false);
+            db_per = std::move(sqlite);
+        }
+        else if (backend == "regions")
+            db_per = make_unique<persistence_regions>(dbdir / "regions");
+        else
+            throw std::runtime_error("unknown storage '" + backend + "'");
+
+        write_behind                db_queue (*db_per, size_t(vm["write-queue"].as<unsigned int>()) << 20);
+        memory_cache                storage (db_queue, size_t(vm["cache-size"].as<unsigned int>()) << 20);
+        set_cache_weights(storage, vm["cache-weights"].as<std::string>());
+        set_compression(storage, codec_by_name(vm["storage-codec"].as<std::string>()),
+                        dbdir / "dictionaries");
         hexa::server_entity_system  entities;
-        hexa::world                 world (storage);
+        hexa::world                 world (storage, vm["worker-threads"].as<unsigned int>());
+        world.requests.view_distance(vm["view-distance"].as<unsigned int>());
+        world.refinements.view_distance(vm["view-distance"].as<unsigned int>());
+        world.refine_budget(vm["refine-budget"].as<double>());
         hexa::lua                   scripting (entities, world);
         hexa::network               server (vm["port"].as<unsigned int>(), world, entities, scripting);
 
+        server.set_codec(codec_by_name(vm["wire-codec"].as<std::string>()));
         scripting.uglyhack(&server);
 
         //std::cout << "Drop privileges" << std::endl;
@@ -260,6 +357,7 @@ int main (int argc, char* argv[])
         hexa::init_terrain_gen(world, config);
         boost::thread gameloop ([&]{ server.run(); });
         boost::thread physics_thread ([&]{ physics(entities, world); });
+        boost::thread maintenance_thread ([&]{ maintenance(world); });
         trace("All systems go");
 
 #ifndef _WIN32
@@ -290,6 +388,7 @@ int main (int argc, char* argv[])
         trace("Stopping threads...");
         lolquit=true;
         physics_thread.join();
+        maintenance_thread.join();
         gameloop.join();
 
         trace("Shutting down...");
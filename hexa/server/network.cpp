@@ -71,6 +71,7 @@ network::network(uint16_t port, world& w, server_entity_system& entities,
     , world_    (w)
     , es_       (entities)
     , lua_      (scripting)
+    , codec_    (codec::lz4)
 {
 }
 
@@ -82,14 +83,27 @@ void network::run()
     {
         poll(5);
 
-        // Send updated terrain
-        for (chunk_coordinates c : world_.changeset)
+        // Send updated terrain.  The patches go first; if a chunk was
+        // also changed in other ways, the full surface that follows
+        // already includes them.
+        for (auto& p : world_.take_patches())
+            send_patch(p.first, p.second);
+
+        auto changed (world_.take_changeset());
+        for (chunk_coordinates c : changed)
             send_surface(c);
 
-        world_.changeset.clear();
+        // Refined light maps of chunks that were sent in full just now
+        // are already up to date.
+        for (chunk_coordinates c : world_.take_refined())
+        {
+            if (!changed.count(c))
+                send_lightmap(c);
+        }
 
         // Send changes in the entity system
         ++count;
+
         if (count % 20 == 0)
         {
         msg::entity_update_physics msg;
@@ -102,6 +116,15 @@ void network::run()
                 es::storage::var_ref<vector> v_)
         {
             msg.updates.emplace_back(i->first, p_, v_);
+
+            // Let the terrain generator know where the players are, so
+            // it can work on the nearest chunks first.
+            if (connections_.count(i->first))
+            {
+                const chunk_coordinates cp (wfpos(p_).pos / chunk_size);
+                world_.requests.update_player(i->first, cp);
+                world_.refinements.update_player(i->first, cp);
+            }
         });
 
         auto n (clock::now());
@@ -233,6 +256,8 @@ void network::on_disconnect (ENetPeer* c)
     es_.delete_entity(e->second);
     }
 
+    world_.requests.remove_player(e->second);
+    world_.refinements.remove_player(e->second);
     connections_.erase(e->second);
     entities_.erase(c);
     clock_offset_.erase(c);
@@ -280,7 +305,7 @@ void network::on_receive (ENetPeer* c, const packet& p)
     }
 }
 
-bool network::send (uint32_t entity, const std::vector<uint8_t>& msg,
+bool network::send (uint32_t entity, const packet_buffer& msg,
                     msg::reliability method) const
 {
     auto found (connections_.find(entity));
@@ -346,14 +371,28 @@ void network::change_block(const world_coordinates& pos, const std::string& mate
 }
 */
 
+void network::fill_surface_update(msg::surface_update& msg,
+                                  const chunk_coordinates& cpos)
+{
+    msg.position = cpos;
+
+    // The stored data is forwarded as it is.  Don't bother sending
+    // chunks that can't be seen; the size of the serialized surface is
+    // enough to tell, so there's no need to unpack it.
+    auto terrain (world_.get_compressed_surface(cpos));
+    if (terrain.unpacked_len <= surface_data::flat_header_size)
+        return;
+
+    msg.terrain = recompress(std::move(terrain), codec_);
+    msg.light   = recompress(world_.get_compressed_lightmap(cpos), codec_);
+}
+
 void network::send_surface(const chunk_coordinates& cpos)
 {
     trace("broadcast surface %1%", world_vector(cpos - world_chunk_center));
 
     msg::surface_update reply;
-    reply.position = cpos;
-    reply.terrain  = world_.get_compressed_surface(cpos);
-    reply.light    = world_.get_compressed_lightmap(cpos);
+    fill_surface_update(reply, cpos);
 
     assert(count_faces(world_.get_surface(cpos)->opaque) == world_.get_lightmap(cpos)->opaque.size());
     assert(count_faces(world_.get_surface(cpos)->transparent) == world_.get_lightmap(cpos)->transparent.size());
@@ -367,6 +406,43 @@ void network::send_surface(const chunk_coordinates& cpos)
     }
 }
 
+void network::send_lightmap(const chunk_coordinates& cpos)
+{
+    trace("broadcast light map %1%", world_vector(cpos - world_chunk_center));
+
+    msg::lightmap_update reply;
+    reply.position = cpos;
+    reply.data     = recompress(world_.get_compressed_lightmap(cpos), codec_);
+
+    auto buf (serialize_packet(reply));
+    for (auto& conn : connections_)
+    {
+        auto plr_pos (es_.get<wfpos>(conn.first, entity_system::c_position));
+        auto dist (manhattan_distance(cpos, plr_pos.pos / chunk_size));
+        if (dist < 64)
+            send(conn.second, buf, reply.method());
+    }
+}
+
+void network::send_patch(const chunk_coordinates& cpos,
+                         const surface_patch& patch)
+{
+    trace("broadcast patch %1%", world_vector(cpos - world_chunk_center));
+
+    msg::surface_delta reply;
+    reply.position = cpos;
+    reply.patch    = patch;
+
+    auto buf (serialize_packet(reply));
+    for (auto& conn : connections_)
+    {
+        auto plr_pos (es_.get<wfpos>(conn.first, entity_system::c_position));
+        auto dist (manhattan_distance(cpos, plr_pos.pos / chunk_size));
+        if (dist < 64)
+            send(conn.second, buf, reply.method());
+    }
+}
+
 void network::send_surface(const chunk_coordinates& cpos, uint32_t dest)
 {
     trace("new job: surface %1%", world_vector(cpos - world_chunk_center));
@@ -378,9 +454,7 @@ void network::send_surface(const chunk_coordinates& cpos, ENetPeer* dest)
     trace("send surface %1%", world_vector(cpos - world_chunk_center));
 
     msg::surface_update reply;
-    reply.position = cpos;
-    reply.terrain  = world_.get_compressed_surface(cpos);
-    reply.light    = world_.get_compressed_lightmap(cpos);
+    fill_surface_update(reply, cpos);
 
     send(dest, serialize_packet(reply), reply.method());
 }
@@ -401,6 +475,21 @@ void network::login (const packet_info& info)
 {
     auto msg (make<msg::login>(info.p));
 
+    if (msg.protocol_version != msg::current_protocol_version)
+    {
+        trace("player %1% uses protocol version %2%, turned away",
+              info.plr, int(msg.protocol_version));
+
+        msg::kick reply;
+        reply.reason = (format("This server uses protocol version %1%, your client uses version %2%.")
+                        % int(msg::current_protocol_version)
+                        % int(msg.protocol_version)).str();
+
+        send(info.conn, serialize_packet(reply), reply.method());
+        disconnect(info.conn);
+        return;
+    }
+
     trace("player %1% login", info.plr);
     world_coordinates start_pos (world_center);
 
@@ -522,6 +611,8 @@ entities_.set(te, c_model, uint16_t(0));
     if (is_air_chunk(pcp, ch))
         pcp.z = ch - 1;
 
+    world_.requests.update_player(info.plr, start_pos / chunk_size);
+    world_.refinements.update_player(info.plr, start_pos / chunk_size);
     world_.requests.push({ world::request::surface_and_lightmap, pcp,
                            [=]{ send_surface(pcp, info.plr); }
                            });
@@ -645,6 +736,17 @@ void network::req_chunks (const packet_info& info)
 {
     auto msg (make<msg::request_chunks>(info.p));
 
+    // Clients ask for everything within their view radius at once; get
+    // whatever is already on disk in one batch instead of chunk by chunk.
+    std::vector<chunk_coordinates> wanted;
+    wanted.reserve(msg.requests.size());
+    for (auto& req : msg.requests)
+        wanted.emplace_back(req.position);
+
+    world_.prefetch(wanted, storage_i::prefetch_chunks
+                            | storage_i::prefetch_surfaces
+                            | storage_i::prefetch_lightmaps);
+
     for(auto& req : msg.requests)
     {
         trace("request for surface %1%", world_rel_coordinates(req.position - world_chunk_center));
@@ -30,6 +30,7 @@
 #include <es/entity.hpp>
 
 #include <hexa/concurrent_queue.hpp>
+#include <hexa/protocol.hpp>
 #include <hexa/ray.hpp>
 
 #include "udp_server.hpp"
@@ -74,9 +75,15 @@ public:
     void on_disconnect (ENetPeer* c);
     void on_receive (ENetPeer* c, const packet& p);
 
-    bool send (uint32_t entity, const std::vector<uint8_t>& msg,
+    bool send (uint32_t entity, const packet_buffer& msg,
                msg::reliability method) const;
 
+    /** Set how terrain is compressed when it is sent to the players.
+     *  Terrain that was stored on disk in another way is compressed
+     *  again before it is sent.  Clients don't know about compression
+     *  dictionaries, so \a how shouldn't use one. */
+    void set_codec (codec how) { codec_ = how; }
+
 private:
     struct packet_info
     {
@@ -103,11 +110,16 @@ private:
     void send_surface (const chunk_coordinates& pos, uint32_t dest);
     void send_surface (const chunk_coordinates& pos, ENetPeer* dest);
     void send_height  (const map_coordinates& pos, ENetPeer* dest);
+    void send_patch   (const chunk_coordinates& pos, const surface_patch& patch);
+    void send_lightmap (const chunk_coordinates& pos);
+    void fill_surface_update (msg::surface_update& msg,
+                              const chunk_coordinates& pos);
 
 private:
     world&                  world_;
     server_entity_system&   es_;
     lua&                    lua_;
+    codec                   codec_;
 
     std::unordered_map<ENetPeer*, player>   players_;
     std::unordered_map<ENetPeer*, uint64_t> clock_offset_;
@@ -23,8 +23,9 @@
 
 #include <algorithm>
 #include <array>
+#include <cmath>
 
-#include <hexa/neighborhood.hpp>
+#include <hexa/dense_neighborhood.hpp>
 #include <hexa/voxel_algorithm.hpp>
 #include <hexa/voxel_range.hpp>
 #include <hexa/trace.hpp>
@@ -38,10 +39,8 @@ typedef std::array<unsigned int, 3> triangle;
 
 namespace {
 
-float opacity (uint16_t t)
-{
-    return 1.0f - (material_prop[t].transparency / 255.f);
-}
+/** How far the rays go, for every phase. */
+const float ray_length[] = { 10, 60, 200 };
 
 bool f (uint16_t t)
 {
@@ -59,14 +58,23 @@ sun_lightmap::sun_lightmap (storage_i& c, const ptree& conf)
     , direction_ (-0.4, 0.75)
     , radius_    (3.0 * 0.01745)
 {
-    detail_levels_.emplace_back(generate(10, 0));
-    detail_levels_.emplace_back(generate(60, 1));
-    detail_levels_.emplace_back(generate(200, 2));
+    for (size_t i (0); i < 3; ++i)
+        detail_levels_.emplace_back(generate(ray_length[i], i));
 }
 
 sun_lightmap::~sun_lightmap ()
 { }
 
+unsigned int sun_lightmap::influence_radius () const
+{
+    // A block can cast a shadow as far as the rays go, but relighting
+    // everything the longest rays can reach is far too slow to do right
+    // away.  Only the faces within reach of the shortest rays are done;
+    // the ones further away keep their old light until their light map
+    // is generated again.
+    return std::ceil(ray_length[0]);
+}
+
 void sun_lightmap::add (sun_lightmap::rays& r, float raylen, yaw_pitch dir2) const
 {
     const vector half (0.5, 0.5, 0.5);
@@ -130,49 +138,6 @@ sun_lightmap::generate (float raylen, size_t count) const
     return result;
 }
 
-float
-sun_lightmap::recurse (const ray_bundle& r, float ray_power,
-                       const world_coordinates& blk,
-                       neighborhood<chunk_ptr>& nbh,
-                       bool first) const
-{
-    float temp (0.0f);
-    bool should_recurse (true);
-    for (auto& voxel : r.trunk)
-    {
-        auto type (nbh[blk + voxel].type);
-
-        // If the very first block we traverse is a custom block, we
-        // skip it.
-        if (first)
-        {
-            first = false;
-            if (material_prop[type].is_custom_block())
-                continue;
-        }
-
-        temp += opacity(type);
-        if (temp >= 1.0f)
-        {
-            should_recurse = false;
-            break;
-        }
-    }
-
-    ray_power -= std::min(temp, 1.0f) * r.weight;
-
-    if (ray_power <= 0.01)
-        return 0.0;
-
-    if (should_recurse)
-    {
-        for (auto& s : r.branches)
-            ray_power = recurse(s, ray_power, blk, nbh, first);
-    }
-
-    return ray_power;
-}
-
 lightmap&
 sun_lightmap::generate (const chunk_coordinates& pos,
                         const surface& s,
@@ -181,13 +146,22 @@ sun_lightmap::generate (const chunk_coordinates& pos,
 {
     trace((boost::format("for %1%") % world_vector(pos - world_chunk_center)).str());
 
-    neighborhood<chunk_ptr> nbh (cache_, pos, 13);
+    if (s.empty())
+        return lightchunk;
+
+    // Copy everything the rays can reach.
+    world_vector lo (0, 0, 0), hi (chunk_size, chunk_size, chunk_size);
+    for (auto& r : detail_levels_[phase])
+        extend_to_reach(r, lo, hi);
+
+    dense_neighborhood nbh (cache_, pos, lo, hi);
+    const auto opacities (opacity_table());
 
     auto lmi (std::begin(lightchunk));
 
     for (faces f : s)
     {
-        world_coordinates blk (f.pos);
+        world_vector blk (f.pos);
 
         for (int d (0); d < 6; ++d)
         {
@@ -195,7 +169,7 @@ sun_lightmap::generate (const chunk_coordinates& pos,
                 continue;
 
             const ray_bundle& r (detail_levels_[phase][d]);
-            float light_level (recurse(r, r.weight, blk, nbh));
+            float light_level (r.follow(r.weight, opacity_at(nbh, opacities, blk)));
             lmi->sunlight = clamp(light_level, 0.0f, 1.0f) * 15.4f;
             ++lmi;
         }
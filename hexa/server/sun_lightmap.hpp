@@ -52,15 +52,12 @@ public:
 
     unsigned int phases() const { return 3; }
 
+    unsigned int influence_radius() const;
+
 private:
     void  add (rays& r, float length, yaw_pitch dir) const;
     rays  generate (float len, size_t count) const;
 
-    float recurse(const ray_bundle& r, float ray_power,
-                  const world_coordinates& blk,
-                  neighborhood<chunk_ptr>& nbh,
-                  bool first = true) const;
-
 private:
     yaw_pitch   direction_;
     float       radius_;
@@ -29,6 +29,16 @@ using boost::format;
 
 namespace hexa {
 
+namespace {
+
+/** Called by ENet when it is done with a packet. */
+void release_buffer (ENetPacket* pkt)
+{
+    packet_buffer::release(pkt->userData);
+}
+
+} // anonymous namespace
+
 udp_server::udp_server(uint16_t port, uint16_t max_users)
     : sv_ (nullptr)
 {
@@ -73,20 +83,33 @@ void udp_server::poll (uint16_t milliseconds)
     }
 }
 
-void udp_server::send (ENetPeer* peer, const std::vector<uint8_t>& msg,
+void udp_server::send (ENetPeer* peer, const packet_buffer& msg,
                        msg::reliability method) const
 {
-    uint32_t flags (0);
+    uint32_t flags (ENET_PACKET_FLAG_NO_ALLOCATE);
 
     switch (method)
     {
-    case msg::unreliable: flags = ENET_PACKET_FLAG_UNSEQUENCED; break;
+    case msg::unreliable: flags |= ENET_PACKET_FLAG_UNSEQUENCED; break;
     case msg::reliable:
-    case msg::sequenced:  flags = ENET_PACKET_FLAG_RELIABLE; break;
+    case msg::sequenced:  flags |= ENET_PACKET_FLAG_RELIABLE; break;
     }
 
-    auto pkt (enet_packet_create(&msg[0], msg.size(), flags));
-    enet_peer_send(peer, 0, pkt);
+    auto pkt (enet_packet_create(msg.data(), msg.size(), flags));
+    if (pkt == nullptr)
+        throw std::runtime_error("cannot create packet");
+
+    pkt->userData = msg.retain();
+    pkt->freeCallback = release_buffer;
+
+    // If ENet didn't take it, the packet is ours to clean up.
+    if (enet_peer_send(peer, 0, pkt) < 0)
+        enet_packet_destroy(pkt);
+}
+
+void udp_server::disconnect (ENetPeer* peer) const
+{
+    enet_peer_disconnect_later(peer, 0);
 }
 
 } // namespace hexa
@@ -24,6 +24,7 @@
 
 #include <vector>
 #include <enet/enet.h>
+#include <hexa/packet_buffer.hpp>
 #include <hexa/protocol.hpp>
 
 namespace hexa {
@@ -36,11 +37,15 @@ public:
 
     void poll (uint16_t milliseconds);
 
-    void send (ENetPeer* dest, const std::vector<uint8_t>& msg,
+    /** Send a packet to a peer.
+     *  ENet doesn't copy the data; the packet keeps a reference to
+     *  \a msg until it has been sent. */
+    void send (ENetPeer* dest, const packet_buffer& msg,
                msg::reliability method) const;
 
-    void broadcast (const std::vector<uint8_t>& msg,
-                    msg::reliability method) const;
+    /** Close the connection to a peer, after everything that was
+     ** queued for it has been sent. */
+    void disconnect (ENetPeer* peer) const;
 
     virtual void on_connect (ENetPeer* peer) = 0;
     virtual void on_receive (ENetPeer* peer, const packet& pkt) = 0;
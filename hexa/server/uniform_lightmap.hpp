@@ -41,6 +41,9 @@ public:
                                lightmap& chunk,
                                unsigned int phase = 0) const;
 
+    /** The light doesn't depend on the terrain at all. */
+    unsigned int influence_radius() const { return 0; }
+
 private:
     uint8_t sun_;
     uint8_t amb_;
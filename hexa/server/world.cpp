@@ -47,33 +47,40 @@ namespace hexa {
 
 static chunk empty_chunk;
 
-world::world (storage_i& storage)
+world::world (storage_i& storage, unsigned int threads)
     : storage_ (storage)
+    , budget_ (1.0)
+    , budget_left_ (0.0)
+    , budget_time_ (boost::chrono::steady_clock::now())
+    , scheduler_ (threads, [=]{ return take_request() || take_refinement(); })
 {
-    for (int i (0); i < 1; ++i)
-        workers_.emplace_back([=]{ worker(i); });
+    requests.on_push([=]{ scheduler_.notify(); });
+    refinements.on_push([=]{ scheduler_.notify(); });
 }
 
 world::~world()
 {
-    // Message all worker threads to finish whatever they're doing, and
-    // quit.
-    for (unsigned int i (0); i < workers_.size(); ++i)
-        requests.push({ request::quit, chunk_coordinates(), []{} });
-
-    for (auto& wt : workers_)
-        wt.join();
+    // Let the workers finish whatever they're doing; anything that's
+    // still waiting in the queue is dropped.
+    scheduler_.stop();
 }
 
 //---------------------------------------------------------------------------
 
-world::exclusive_section::exclusive_section(std::vector<boost::unique_lock<boost::mutex>>&& locks)
-    : locked_(std::move(locks))
+world::exclusive_section::exclusive_section(storage_i& storage,
+                                            std::vector<boost::unique_lock<boost::mutex>>&& locks)
+    : storage_(&storage)
+    , locked_(std::move(locks))
 {
 }
 
 world::exclusive_section::~exclusive_section()
 {
+    // The generators may have changed any of these chunks; mark them
+    // as dirty, so they are written back instead of being thrown away.
+    for (auto& c : cache_)
+        storage_->store(c.first, c.second);
+
     for (auto& l : locked_)
         l.unlock();
 }
@@ -151,14 +158,13 @@ void
 world::store (chunk_coordinates pos, chunk_ptr data)
 {
     // Adjust the coarse height map if needed
-    map_coordinates mc (pos);
-    auto h (get_coarse_height(mc));
-    if (needs_chunk_height_adjustment(pos, h))
-        store(mc, adjust_chunk_height(pos, h));
+    adjust_coarse_height(pos);
 
     //boost::lock_guard<std::recursive_mutex> chunk_lock (data->lock);
 
     storage_.store(pos, data);
+    for (auto& g : lightgen_)
+        g->chunk_changed(pos);
 
     // Regenerate surface data
     surface_ptr updated_surface (get_or_create_surface(pos));
@@ -216,22 +222,7 @@ world::get_lightmap (chunk_coordinates pos)
         return result;
 
     // Create a new lightmap and run it through the generators.
-    result.reset(new light_data);
-
-    result->opaque.resize(count_faces(s->opaque));
-    if (!s->opaque.empty())
-    {
-        for (auto& g : lightgen_)
-            g->generate(pos, s->opaque, result->opaque, 2);
-    }
-
-    result->transparent.resize(count_faces(s->transparent));
-    if (!s->transparent.empty())
-    {
-        for (auto& g : lightgen_)
-            g->generate(pos, s->transparent, result->transparent, 2);
-    }
-
+    result = generate_lightmap(pos, *s, lightmap_phases() - 1);
     store(pos, result);
 
     return result;
@@ -299,6 +290,7 @@ world::get_surface (chunk_coordinates pos)
                             }));
     */
 
+    storage_.prefetch(surroundings(pos, 1u), prefetch_chunks);
     neighborhood<chunk_ptr> nbh (*this, pos);
     result.reset(new surface_data(extract_opaque_surface(nbh),
                                   extract_transparent_surface(nbh)));
@@ -340,6 +332,12 @@ world::get_compressed_surface (chunk_coordinates xyz)
     return storage_.get_compressed_surface(xyz);
 }
 
+void
+world::prefetch (const std::vector<chunk_coordinates>& xyz, int what)
+{
+    storage_.prefetch(xyz, what);
+}
+
 //---------------------------------------------------------------------------
 
 chunk_height
@@ -480,7 +478,7 @@ world::change_block (world_coordinates pos, uint16_t material)
         if (material == 0)
             return; // It's already air, quit
 
-        storage_.store(cp, adjust_chunk_height(cp, coarse_h));
+        adjust_coarse_height(cp);
         cnk = get_or_create_chunk(cp);
     }
     else
@@ -488,37 +486,33 @@ world::change_block (world_coordinates pos, uint16_t material)
         cnk = get_chunk(cp);
     }
 
-    {
-
     if ((*cnk)[ci].type == material)
         return; // Nothing has changed, don't bother.
 
     (*cnk)[ci].type = material;
     cnk->is_dirty = true;
     storage_.store(cp, cnk);
-    update(cp);
-    }
 
-    // If this block was changed to air, and it's at the edge of the
-    // chunk, we need to update the surface of the neighboring chunk(s)
-    // as well.
-    if (material == 0)
+    for (auto& g : lightgen_)
+        g->block_changed(pos, material);
+
+    // Only the block itself and its six neighbors can have different
+    // faces now.  The neighbors may be in other chunks.
+    std::map<chunk_coordinates, std::vector<chunk_index>> touched;
+    touched[cp].push_back(ci);
+    for (int dir (0); dir < 6; ++dir)
     {
-        if (ci.x == 0)
-            update(cp + chunk_coordinates(-1, 0, 0));
-        else if (ci.x == chunk_size - 1)
-            update(cp + chunk_coordinates(1, 0, 0));
+        world_coordinates next (pos + dir_vector[dir]);
+        touched[next / chunk_size].push_back(next % chunk_size);
+    }
 
-        if (ci.y == 0)
-            update(cp + chunk_coordinates(0, -1, 0));
-        else if (ci.y == chunk_size - 1)
-            update(cp + chunk_coordinates(0, 1, 0));
+    // The light can change in every chunk the light map generators can
+    // reach from here, also across edges and corners.
+    for (auto c : to_chunk_range(surroundings(pos, influence_radius())))
+        touched[c];
 
-        if (ci.z == 0)
-            update(cp + chunk_coordinates(0, 0, -1));
-        else if (ci.z == chunk_size - 1)
-            update(cp + chunk_coordinates(0, 0, 1));
-    }
+    for (auto& t : touched)
+        patch(t.first, t.second, pos);
 }
 
 void
@@ -526,30 +520,133 @@ world::update (chunk_coordinates cp)
 {
     trace("update chunk %1%", world_rel_coordinates(cp - world_chunk_center));
     // Regenerate surface
+    storage_.prefetch(surroundings(cp, 1u), prefetch_chunks);
     neighborhood<chunk_ptr> nbh (storage_, cp);
     surface_ptr srfc (new surface_data(extract_opaque_surface(nbh),
                                        extract_transparent_surface(nbh)));
 
     // Regenerate light map
-    lightmap_ptr lm (new light_data);
-    lm->opaque.resize(count_faces(srfc->opaque));
-    if (!srfc->opaque.empty())
+    lightmap_ptr lm (generate_lightmap(cp, *srfc, lightmap_phases() - 1));
+
     {
-        for (auto& g: lightgen_)
-            g->generate(cp, srfc->opaque, lm->opaque, 2);
+    boost::lock_guard<boost::mutex> lock (light_lock_);
+    storage_.store(cp, srfc);
+    storage_.store(cp, lm);
     }
 
-    lm->transparent.resize(count_faces(srfc->transparent));
-    if (!srfc->transparent.empty())
+    mark_changed(cp);
+}
+
+void
+world::patch (chunk_coordinates cp, const std::vector<chunk_index>& blocks,
+              world_coordinates changed)
+{
+    trace("patch chunk %1%", world_rel_coordinates(cp - world_chunk_center));
+
+    // The patch is built on copies without holding the light lock.  If
+    // another thread stored a new surface or light map in the meantime,
+    // the work is thrown away and done again.
+    surface_ptr  old_s;
+    surface_patch p;
+    for (int attempt (0); ; ++attempt)
     {
-        for (auto& g : lightgen_)
-            g->generate(cp, srfc->transparent, lm->transparent, 2);
+        if (attempt == 3)
+        {
+            update(cp);
+            return;
+        }
+
+        old_s = storage_.get_surface(cp);
+        auto old_l (storage_.get_lightmap(cp));
+        if (old_s == nullptr || old_l == nullptr)
+        {
+            // Nothing to patch.  The neighbors will get a fresh surface
+            // when they're needed, but the changed chunk itself might
+            // have just been created.
+            if (cp == changed / chunk_size)
+                update(cp);
+
+            return;
+        }
+
+        neighborhood<chunk_ptr> nbh (storage_, cp);
+
+        p = surface_patch();
+        for (auto& i : blocks)
+        {
+            p.opaque.emplace_back(opaque_faces(nbh, i));
+            p.transparent.emplace_back(transparent_faces(nbh, i));
+        }
+
+        // Work on copies; other threads may still be using the old ones.
+        surface_ptr  srfc (new surface_data(*old_s));
+        lightmap_ptr lm (new light_data(*old_l));
+        replace_faces(srfc->opaque, lm->opaque, p.opaque);
+        replace_faces(srfc->transparent, lm->transparent, p.transparent);
+
+        // Only the faces near the changed block get new light.
+        const world_vector center (changed - cp * chunk_size);
+        const int radius (influence_radius());
+        surface_data near (faces_near(srfc->opaque, center, radius),
+                           faces_near(srfc->transparent, center, radius));
+
+        if (blocks.empty() && near.empty())
+            return;
+
+        if (!near.empty())
+        {
+            auto light (generate_lightmap(cp, near, old_l->phase));
+            p.opaque_lit = std::move(near.opaque);
+            p.opaque_light = std::move(light->opaque);
+            p.transparent_lit = std::move(near.transparent);
+            p.transparent_light = std::move(light->transparent);
+
+            set_light(srfc->opaque, lm->opaque, p.opaque_lit, p.opaque_light);
+            set_light(srfc->transparent, lm->transparent,
+                      p.transparent_lit, p.transparent_light);
+        }
+
+        boost::lock_guard<boost::mutex> lock (light_lock_);
+        if (   storage_.get_surface(cp) != old_s
+            || storage_.get_lightmap(cp) != old_l)
+        {
+            continue;
+        }
+
+        storage_.store(cp, srfc);
+        storage_.store(cp, lm);
+        break;
     }
 
-    storage_.store(cp, srfc);
-    storage_.store(cp, lm);
+    // Leave out the blocks that didn't change at all.
+    auto same_as_before = [](const surface& before, const faces& f)
+    {
+        auto found (std::find(before.begin(), before.end(), f.pos));
+        return found == before.end() ? f.dirs == 0
+                                     : found->dirs == f.dirs && found->type == f.type;
+    };
+    p.opaque.erase(std::remove_if(p.opaque.begin(), p.opaque.end(),
+                       [&](const faces& f){ return same_as_before(old_s->opaque, f); }),
+                   p.opaque.end());
+    p.transparent.erase(std::remove_if(p.transparent.begin(), p.transparent.end(),
+                       [&](const faces& f){ return same_as_before(old_s->transparent, f); }),
+                   p.transparent.end());
+
+    if (p.empty())
+        return;
 
-    changeset.insert(cp);
+    boost::lock_guard<boost::mutex> lock (changeset_lock_);
+    patches_.emplace_back(cp, std::move(p));
+}
+
+unsigned int
+world::influence_radius () const
+{
+    unsigned int result (0);
+    for (auto& g : lightgen_)
+        result = std::max(result, g->influence_radius());
+
+    return result;
 }
 
 void
@@ -565,46 +662,169 @@ world::cleanup()
     storage_.cleanup();
 }
 
+void
+world::adjust_coarse_height (chunk_coordinates pos)
+{
+    boost::lock_guard<boost::mutex> lock (height_lock_);
+    auto coarse_h (get_coarse_height(pos));
+    if (needs_chunk_height_adjustment(pos, coarse_h))
+        store(map_coordinates(pos), adjust_chunk_height(pos, coarse_h));
+}
+
 //---------------------------------------------------------------------------
 
-void
+bool
 world::refine_lightmap (chunk_coordinates pos, int phase)
 {
     surface_ptr s (get_surface(pos));
-    if (!s)
-        return;
+    if (!s || s->empty())
+        return false;
+
+    lightmap_ptr result (generate_lightmap(pos, *s, phase));
+
+    // Throw the result away if a block was changed in the meantime;
+    // patch() or update() has already stored a better light map.
+    boost::lock_guard<boost::mutex> lock (light_lock_);
+    if (storage_.get_surface(pos) != s)
+        return false;
 
-    // Create a blank lightmap and run it through the generators.
+    store(pos, result);
+    return true;
+}
+
+lightmap_ptr
+world::generate_lightmap (chunk_coordinates pos, const surface_data& s,
+                          int phase) const
+{
     lightmap_ptr result (new light_data);
-    result->opaque.resize(count_faces(s->opaque));
-    if (!s->opaque.empty())
+    result->phase = phase;
+
+    result->opaque.resize(count_faces(s.opaque));
+    if (!s.opaque.empty())
     {
         for (auto& g : lightgen_)
-            g->generate(pos, s->opaque, result->opaque, phase);
+        {
+            g->generate(pos, s.opaque, result->opaque,
+                        std::min<unsigned int>(phase, g->phases() - 1));
+        }
     }
 
-    result->transparent.resize(count_faces(s->transparent));
-    if (!s->transparent.empty())
+    result->transparent.resize(count_faces(s.transparent));
+    if (!s.transparent.empty())
     {
         for (auto& g : lightgen_)
-            g->generate(pos, s->transparent, result->transparent, phase);
+        {
+            g->generate(pos, s.transparent, result->transparent,
+                        std::min<unsigned int>(phase, g->phases() - 1));
+        }
     }
 
-    store(pos, result);
+    return result;
+}
+
+int
+world::lightmap_phases () const
+{
+    unsigned int result (1);
+    for (auto& g : lightgen_)
+        result = std::max(result, g->phases());
+
+    return result;
+}
+
+std::unordered_set<chunk_coordinates>
+world::take_changeset ()
+{
+    std::unordered_set<chunk_coordinates> result;
+    boost::lock_guard<boost::mutex> lock (changeset_lock_);
+    result.swap(changeset_);
+    return result;
+}
+
+world::patch_list
+world::take_patches ()
+{
+    patch_list result;
+    boost::lock_guard<boost::mutex> lock (changeset_lock_);
+    result.swap(patches_);
+    return result;
+}
+
+std::unordered_set<chunk_coordinates>
+world::take_refined ()
+{
+    std::unordered_set<chunk_coordinates> result;
+    boost::lock_guard<boost::mutex> lock (changeset_lock_);
+    result.swap(refined_);
+    return result;
+}
+
+void
+world::mark_changed (chunk_coordinates pos)
+{
+    boost::lock_guard<boost::mutex> lock (changeset_lock_);
+    changeset_.insert(pos);
+}
+
+void
+world::mark_refined (chunk_coordinates pos)
+{
+    boost::lock_guard<boost::mutex> lock (changeset_lock_);
+    refined_.insert(pos);
+}
+
+void
+world::refine_budget (double fraction)
+{
+    boost::lock_guard<boost::mutex> lock (budget_lock_);
+    budget_ = clamp(fraction, 0.0, 1.0);
+    budget_left_ = 0.0;
+    budget_time_ = boost::chrono::steady_clock::now();
+}
+
+bool
+world::within_budget ()
+{
+    boost::lock_guard<boost::mutex> lock (budget_lock_);
+    if (budget_ <= 0.0)
+        return false;
+
+    if (budget_ >= 1.0)
+        return true;
+
+    // The budget fills up at a steady rate, but never saves up more
+    // than a second's worth.
+    auto now (boost::chrono::steady_clock::now());
+    const double rate (budget_ * scheduler_.size());
+    const boost::chrono::duration<double> elapsed (now - budget_time_);
+    budget_left_ = std::min(rate, budget_left_ + elapsed.count() * rate);
+    budget_time_ = now;
+
+    return budget_left_ > 0.0;
+}
+
+void
+world::spend_budget (double seconds)
+{
+    boost::lock_guard<boost::mutex> lock (budget_lock_);
+    budget_left_ -= seconds;
 }
 
 chunk_ptr
 world::get_or_create_chunk(chunk_coordinates pos)
 {
     auto result (storage_.get_chunk(pos));
+    if (result != nullptr)
+        return result;
 
+    boost::lock_guard<boost::mutex> lock (create_lock_);
+
+    // Another thread might have beaten us to it.
+    result = storage_.get_chunk(pos);
     if (result == nullptr)
     {
         result = std::make_shared<chunk>();
-
-        auto coarse_h (get_coarse_height(pos));
-        if (needs_chunk_height_adjustment(pos, coarse_h))
-            storage_.store(pos, adjust_chunk_height(pos, coarse_h));
+        adjust_coarse_height(pos);
     }
 
     return result;
@@ -637,122 +857,135 @@ world::get_or_generate_chunk(chunk_coordinates pos, int phase, bool adjust_heigh
 
     if (result == nullptr)
     {
-        auto coarse_h (get_coarse_height(pos));
-        if (needs_chunk_height_adjustment(pos, coarse_h))
+        boost::lock_guard<boost::mutex> lock (create_lock_);
+
+        // Check again, another worker might have created it in the
+        // meantime.
+        result = storage_.get_chunk(pos);
+        if (result == nullptr)
         {
-            if (!adjust_height)
-                return nullptr;
+            auto coarse_h (get_coarse_height(pos));
+            if (needs_chunk_height_adjustment(pos, coarse_h))
+            {
+                if (!adjust_height)
+                    return nullptr;
 
-            trace("new air chunk at %1%", world_vector(pos - world_chunk_center));
-            result = std::make_shared<chunk>();
+                trace("new air chunk at %1%", world_vector(pos - world_chunk_center));
+                result = std::make_shared<chunk>();
 
-            // If this is an air chunk, don't run it through the generators.
-            result->generation_phase = phase;
-            storage_.store(pos, adjust_chunk_height(pos, coarse_h));
-        }
-        else
-        {
-            trace("new blank chunk at %1%", world_vector(pos - world_chunk_center));
-            result = std::make_shared<chunk>();
+                // If this is an air chunk, don't run it through the generators.
+                result->generation_phase = phase;
+                adjust_coarse_height(pos);
+            }
+            else
+            {
+                trace("new blank chunk at %1%", world_vector(pos - world_chunk_center));
+                result = std::make_shared<chunk>();
+            }
+            storage_.store(pos, result);
         }
-        storage_.store(pos, result);
     }
 
-    if (result->generation_phase < phase)
+    // The chunk is advanced one phase at a time, while holding its
+    // generation lock.  A generator in phase i will only ever wait for
+    // chunks that are still below phase i, so two workers can never end
+    // up waiting for each other.
+    const int target (std::min<int>(phase, terraingen_.size()));
+    bool generated (false);
+    while (result->generation_phase < target)
     {
-        trace("running chunk at %1% through terrain generators %2%...",
-              world_vector(pos - world_chunk_center), (int)result->generation_phase);
+        boost::lock_guard<boost::mutex> lock (result->generation_lock);
 
-        for (int i (result->generation_phase);
-             i < std::min<int>(phase, terraingen_.size()); ++i)
-        {
-            terraingen_[i]->generate(pos, *result);
-        }
-        result->generation_phase = phase;
-        storage_.store(pos, result);
-    }
+        const int i (result->generation_phase);
+        if (i >= target)
+            break; // Somebody else finished the job while we waited.
 
-    return result;
-}
+        trace("running chunk at %1% through terrain generator %2%...",
+              world_vector(pos - world_chunk_center), i);
 
-world::exclusive_section
-world::lock_region(const std::set<chunk_coordinates>& region,
-                   const terrain_generator_i& requester)
-{
-    std::vector<boost::unique_lock<boost::mutex>> locks;
+        terraingen_[i]->generate(pos, *result);
+        result->generation_phase = i + 1;
+        storage_.store(pos, result);
+        generated = true;
+    }
 
-    unsigned int phase(0);
-    for (; phase < terraingen_.size(); ++phase)
+    if (generated)
     {
-        if (terraingen_[phase].get() == &requester)
-            break;
+        for (auto& g : lightgen_)
+            g->chunk_changed(pos);
     }
 
-    if (phase == terraingen_.size())
-        throw std::runtime_error("lock was requested by an unregistered terrain generation module");
-
-    // First make sure we have all the locks we need, without actually
-    // locking the mutexes yet.  This step might trigger more terrain
-    // generation, so this could take a while.
-    for (auto cnk_pos : region)
+    if (result->generation_phase < phase)
     {
-        auto cnk (get_or_generate_chunk(cnk_pos, phase));
-        if (cnk)
-            locks.emplace_back(cnk->lock, boost::defer_lock);
+        boost::lock_guard<boost::mutex> lock (result->generation_lock);
+        if (result->generation_phase < phase)
+            result->generation_phase = phase;
     }
 
-    // Now try to lock them.  Because we always lock them in the same order,
-    // there are no deadlocks if two or more generators contest overlapping
-    // parts of the world.
-    for (auto& l : locks)
-        l.lock();
-
-    exclusive_section result (std::move(locks));
-    for (auto cnk : region)
-        result.set_chunk(cnk, get_raw_chunk(cnk));
-
     return result;
 }
 
-world::exclusive_section
-world::lock_range(const range<chunk_coordinates>& region,
-                   const terrain_generator_i& requester)
+unsigned int
+world::generator_phase (const terrain_generator_i& requester) const
 {
-    std::vector<boost::unique_lock<boost::mutex>> locks;
-
-    unsigned int phase(0);
-    for (; phase < terraingen_.size(); ++phase)
+    for (unsigned int phase (0); phase < terraingen_.size(); ++phase)
     {
         if (terraingen_[phase].get() == &requester)
-            break;
+            return phase;
     }
 
-    if (phase == terraingen_.size())
-        throw std::runtime_error("lock was requested by an unregistered terrain generation module");
+    throw std::runtime_error("lock was requested by an unregistered terrain generation module");
+}
+
+world::exclusive_section
+world::lock_chunks (std::vector<chunk_coordinates> region, unsigned int phase)
+{
+    // Every caller has to lock the chunks in the same order, otherwise
+    // two workers contesting overlapping parts of the world can deadlock.
+    std::sort(region.begin(), region.end());
+    region.erase(std::unique(region.begin(), region.end()), region.end());
 
-    // First make sure we have all the locks we need, without actually
+    // First make sure we have all the chunks we need, without actually
     // locking the mutexes yet.  This step might trigger more terrain
     // generation, so this could take a while.
+    std::vector<chunk_ptr> chunks;
+    chunks.reserve(region.size());
     for (auto cnk_pos : region)
+        chunks.emplace_back(get_or_generate_chunk(cnk_pos, phase));
+
+    std::vector<boost::unique_lock<boost::mutex>> locks;
+    locks.reserve(chunks.size());
+    for (auto& cnk : chunks)
     {
-        auto cnk (get_or_generate_chunk(cnk_pos, phase));
         if (cnk)
-            locks.emplace_back(cnk->lock, boost::defer_lock);
+            locks.emplace_back(cnk->lock);
     }
 
-    // Now try to lock them.  Because we always lock them in the same order,
-    // there are no deadlocks if two or more generators contest overlapping
-    // parts of the world.
-    for (auto& l : locks)
-        l.lock();
-
-    exclusive_section result (std::move(locks));
-    for (auto cnk : region)
-        result.set_chunk(cnk, get_raw_chunk(cnk));
+    // Hand out the chunks we've locked, not whatever happens to be in
+    // storage right now.
+    exclusive_section result (storage_, std::move(locks));
+    for (size_t i (0); i < region.size(); ++i)
+        result.set_chunk(region[i], chunks[i]);
 
     return result;
 }
 
+world::exclusive_section
+world::lock_region(const std::set<chunk_coordinates>& region,
+                   const terrain_generator_i& requester)
+{
+    return lock_chunks({ region.begin(), region.end() },
+                       generator_phase(requester));
+}
+
+world::exclusive_section
+world::lock_range(const range<chunk_coordinates>& region,
+                   const terrain_generator_i& requester)
+{
+    return lock_chunks({ region.begin(), region.end() },
+                       generator_phase(requester));
+}
+
 /*
 world::exclusive_section
 world::lock_region(std::initializer_list<chunk_coordinates> cnks)
@@ -802,67 +1035,241 @@ world::get_type(chunk_coordinates xyz) const
     return normal_chunk;
 }
 
+bool
+world::take_request ()
+{
+    boost::lock_guard<boost::mutex> lock (taking_lock_);
+    request rq;
+    if (!requests.try_pop(rq))
+        return false;
+
+    if (rq.type != request::quit)
+        schedule(std::move(rq));
+
+    return true;
+}
+
 void
-world::worker(int id)
+world::schedule (request rq)
 {
-    trace("launched worker %1%", id);
+    trace("new job type %1% for %2%", rq.type, world_rel_coordinates(rq.pos - world_chunk_center));
 
-    while (true)
+    task_ptr last;
+    switch (rq.type)
     {
-        auto rq (requests.pop());
-        trace("new job type %1% for worker %2%", rq.type, id);
+    case request::chunk:
+        last = terrain_task(rq.pos, terraingen_.size());
+        break;
+
+    case request::surface:
+        last = surface_task(rq.pos);
+        break;
+
+    case request::lightmap:
+    case request::surface_and_lightmap:
+        // The player gets a rough light map first.  The better ones
+        // are made once there's nothing else to do, and sent later on.
+        last = lightmap_task(rq.pos, 0);
+        if (lightmap_phases() > 1)
+            refinements.push({ request::lightmap, rq.pos, nullptr });
+        break;
+
+    case request::quit:
+        return;
+    }
 
-        switch (rq.type)
-        {
-        case request::quit:
-            trace("stopped worker %1%", id);
-            return;
+    auto answer (std::move(rq.answer));
+    auto reply (task_scheduler::make_task([=]{ if (answer) answer(); }));
+    if (last)
+        reply->depends_on(last);
 
-        case request::chunk:
-            break;
+    scheduler_.submit(reply);
+}
 
-        case request::surface:
-            if (!is_surface_available(rq.pos))
-                get_surface(rq.pos);
+bool
+world::take_refinement ()
+{
+    if (!within_budget())
+        return false;
 
-            break;
+    boost::lock_guard<boost::mutex> lock (taking_lock_);
+    request rq;
+    if (!refinements.try_pop(rq) || rq.type == request::quit)
+        return false;
 
-        case request::lightmap:
-            if (!is_lightmap_available(rq.pos))
-                get_lightmap(rq.pos);
+    auto existing (storage_.get_lightmap(rq.pos));
+    if (existing && existing->phase + 1 < lightmap_phases())
+        lightmap_task(rq.pos, existing->phase + 1);
 
-            break;
+    return true;
+}
 
-        case request::surface_and_lightmap:
-            trace("worker %1% checks for surface", id);
-            if (!is_surface_available(rq.pos))
-            {
-                trace("worker %1% generating surface", id);
-                get_surface(rq.pos);
-                trace("worker %1% done generating surface", id);
-            }
-            else
-            {
-                trace("worker %1% found surface", id);
-            }
-            trace("worker %1% checks for lightmap", id);
-            if (!is_lightmap_available(rq.pos))
-            {
-                trace("worker %1% generating lightmap", id);
-                get_lightmap(rq.pos);
-                trace("worker %1% done generating lightmap", id);
-            }
-            else
-            {
-                trace("worker %1% found lightmap", id);
-            }
-            break;
+world::task_ptr
+world::area_task (map_coordinates pos)
+{
+    if (areagen_.empty())
+        return nullptr;
+
+    chunk_coordinates key_pos (pos.x, pos.y, 0);
+    return add_task(task_key(area_job, key_pos, 0),
+                    []{ return std::vector<task_ptr>(); },
+                    [=]
+    {
+        for (uint16_t i (0); i < areagen_.size(); ++i)
+            get_area_data(pos, i);
+    });
+}
+
+world::task_ptr
+world::terrain_task (chunk_coordinates pos, int phase)
+{
+    if (phase <= 0)
+        return area_task(map_coordinates(pos));
+
+    if (is_air_chunk(pos, get_coarse_height(pos)))
+        return nullptr;
+
+    auto existing (storage_.get_chunk(pos));
+    if (existing && existing->generation_phase >= phase)
+        return nullptr;
+
+    return add_task(task_key(terrain_job, pos, phase),
+                    [=]{ return std::vector<task_ptr> { terrain_task(pos, phase - 1) }; },
+                    [=]{ get_or_generate_chunk(pos, phase); });
+}
+
+world::task_ptr
+world::surface_task (chunk_coordinates pos)
+{
+    if (is_air_chunk(pos, get_coarse_height(pos)) || is_surface_available(pos))
+        return nullptr;
+
+    // The surface extraction needs the chunk itself, and its direct
+    // neighbors.
+    return add_task(task_key(surface_job, pos, 0), [=]
+    {
+        int phase (terraingen_.size());
+        std::vector<task_ptr> result { terrain_task(pos, phase) };
+        for (int d (0); d < 6; ++d)
+            result.emplace_back(terrain_task(pos + dir_vector[d], phase));
+
+        return result;
+    },
+    [=]{ get_surface(pos); });
+}
+
+world::task_ptr
+world::lightmap_task (chunk_coordinates pos, int phase)
+{
+    if (is_air_chunk(pos, get_coarse_height(pos)))
+        return nullptr;
+
+    if (phase == 0)
+    {
+        if (is_lightmap_available(pos))
+            return nullptr;
+
+        return add_task(task_key(lightmap_job, pos, 0),
+                        [=]{ return std::vector<task_ptr> { surface_task(pos) }; },
+                        [=]
+        {
+            auto s (get_surface(pos));
+            if (s && !s->empty() && !is_lightmap_available(pos))
+                store(pos, generate_lightmap(pos, *s, 0));
+        });
+    }
+
+    auto existing (storage_.get_lightmap(pos));
+    if (existing && existing->phase >= phase)
+        return nullptr;
+
+    return add_task(task_key(lightmap_job, pos, phase),
+                    [=]{ return std::vector<task_ptr> { lightmap_task(pos, phase - 1) }; },
+                    [=]
+    {
+        auto start (boost::chrono::steady_clock::now());
+        if (refine_lightmap(pos, phase))
+        {
+            mark_refined(pos);
+
+            // Go back in line for the next phase, so the chunks closer
+            // to the players get their turn first.
+            if (phase + 1 < lightmap_phases())
+                refinements.push({ request::lightmap, pos, nullptr });
         }
+        const boost::chrono::duration<double> spent (boost::chrono::steady_clock::now() - start);
+        spend_budget(spent.count());
+    });
+}
+
+template <typename deps_fn>
+world::task_ptr
+world::add_task (const task_key& key, deps_fn deps, std::function<void()> job)
+{
+    {
+    boost::lock_guard<boost::mutex> lock (tasks_lock_);
+    auto found (tasks_.find(key));
+    if (found != tasks_.end())
+        return found->second;
+    }
+
+    // Set up the dependencies outside the lock; they might have to add
+    // tasks of their own.
+    auto result (task_scheduler::make_task([=]
+    {
+        try
+        {
+            job();
+        }
+        catch (...)
+        {
+            forget_task(key);
+            throw;
+        }
+        forget_task(key);
+    }));
+
+    for (auto& t : deps())
+    {
+        if (t)
+            result->depends_on(t);
+    }
 
-        trace("worker %1% signals answer", id);
-        rq.answer();
-        trace("worker %1% done", id);
+    {
+    boost::lock_guard<boost::mutex> lock (tasks_lock_);
+    auto inserted (tasks_.insert(std::make_pair(key, result)));
+    if (!inserted.second)
+        return inserted.first->second; // Someone else was faster.
     }
+
+    scheduler_.submit(result);
+    return result;
+}
+
+size_t
+world::pending_tasks ()
+{
+    boost::lock_guard<boost::mutex> lock (tasks_lock_);
+    return tasks_.size();
+}
+
+bool
+world::is_idle ()
+{
+    boost::lock_guard<boost::mutex> lock (taking_lock_);
+
+    // A finishing task queues up its next refinement before it goes
+    // away, so the tasks have to be checked first.
+    return    pending_tasks() == 0
+           && requests.empty()
+           && refinements.empty();
+}
+
+void
+world::forget_task (const task_key& key)
+{
+    boost::lock_guard<boost::mutex> lock (tasks_lock_);
+    tasks_.erase(key);
 }
 
 } // namespace hexa
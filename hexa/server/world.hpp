@@ -22,26 +22,31 @@
 
 #pragma once
 
+#include <map>
 #include <memory>
 #include <set>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include <boost/chrono/chrono.hpp>
 #include <boost/thread.hpp>
 
 #include <es/storage.hpp>
 
 #include <hexa/basic_types.hpp>
 #include <hexa/chunk.hpp>
-#include <hexa/concurrent_queue.hpp>
 #include <hexa/height_chunk.hpp>
 #include <hexa/lightmap.hpp>
 #include <hexa/storage_i.hpp>
+#include <hexa/surface_patch.hpp>
+#include <hexa/task_scheduler.hpp>
 #include <hexa/world_subsection.hpp>
 #include <hexa/voxel_range.hpp>
 
 #include "area_generator_i.hpp"
+#include "generation_queue.hpp"
 #include "terrain_generator_i.hpp"
 #include "lightmap_generator_i.hpp"
 
@@ -56,19 +61,17 @@ public:
     }
     chunk_type;
 
-    struct request
-    {
-        enum type_t
-        {
-            chunk, surface, lightmap, surface_and_lightmap, quit
-        };
-
-        type_t                  type;
-        chunk_coordinates       pos;
-        std::function<void()>   answer;
-    };
+    typedef generation_queue::request request;
 
-    concurrent_queue<request> requests;
+    /** Work for the worker threads, nearest to a player goes first.
+     *  Idle workers take requests from this queue, and split them up
+     *  into tasks for the scheduler. */
+    generation_queue requests;
+
+    /** Light maps that can be improved, nearest to a player first.
+     *  The workers only get to these when there are no more
+     *  \a requests, and only as far as refine_budget() allows. */
+    generation_queue refinements;
 
 public:
     /** This lock can be acquired through lock_region(). */
@@ -82,16 +85,35 @@ public:
         ~exclusive_section();
 
     protected:
-        exclusive_section(std::vector<boost::unique_lock<boost::mutex>>&& locks);
+        exclusive_section(storage_i& storage,
+                          std::vector<boost::unique_lock<boost::mutex>>&& locks);
 
     private:
+        /** The changed chunks are stored here before they're unlocked. */
+        storage_i*  storage_;
         std::vector<boost::unique_lock<boost::mutex>> locked_;
     };
 
 public:
-    world(storage_i& storage);
+    /** Set up a new game world.
+     * \param storage  The underlying storage
+     * \param threads  The number of worker threads that will process
+     *                  the request queue.  Zero means one per core. */
+    world(storage_i& storage, unsigned int threads = 0);
     virtual ~world();
 
+    /** The number of worker threads that were started. */
+    unsigned int worker_count() const
+        { return scheduler_.size(); }
+
+    /** The number of tasks that haven't finished yet.  Light maps are
+     ** still being refined after their requests have been answered. */
+    size_t      pending_tasks();
+
+    /** Check if there's nothing left to do: no requests or refinements
+     ** waiting in line, and no tasks that haven't finished yet. */
+    bool        is_idle();
+
     void        add_area_generator(std::unique_ptr<area_generator_i>&& gen);
     void        add_terrain_generator(std::unique_ptr<terrain_generator_i>&& gen);
     void        add_lightmap_generator(std::unique_ptr<lightmap_generator_i>&& gen);
@@ -123,6 +145,11 @@ public:
     compressed_data
     get_compressed_surface (chunk_coordinates xyz);
 
+    /** Load whatever is already stored at a list of positions in one
+     ** go.  Nothing is generated. */
+    void        prefetch(const std::vector<chunk_coordinates>& xyz, int what);
+    using storage_i::prefetch;
+
     chunk_type  get_type(chunk_coordinates xyz) const;
 
     int         find_area_generator(const std::string& name) const;
@@ -158,11 +185,46 @@ public:
 
 
 
-    std::unordered_set<chunk_coordinates> changeset;
+    /** Get the chunks whose surface or light map has changed since the
+     ** last call, so they can be sent to the clients again. */
+    std::unordered_set<chunk_coordinates> take_changeset();
+
+    /** Get the chunks that got a better light map since the last call.
+     *  Their surfaces are still the same, so only the light maps
+     *  need to be sent again. */
+    std::unordered_set<chunk_coordinates> take_refined();
+
+    /** Set how much of the workers' time can be spent on refining light
+     ** maps.
+     * \param fraction  Zero turns refinement off, one means there's no
+     *                  limit (the default) */
+    void  refine_budget (double fraction);
+
+    typedef std::vector<std::pair<chunk_coordinates, surface_patch>> patch_list;
+
+    /** Get the patches that were made to surfaces and light maps since
+     ** the last call, in the order they were made.  These come from
+     ** single block changes; the chunks they apply to are not in the
+     ** changeset, unless something else changed them as well. */
+    patch_list  take_patches();
 
 protected:
     block get_block_nolocking(world_coordinates pos);
-    void  refine_lightmap (chunk_coordinates pos, int phase);
+    /** Generate a better light map for a chunk.
+     * \return False if the chunk has changed in the meantime, and the
+     *         result was thrown away */
+    bool  refine_lightmap (chunk_coordinates pos, int phase);
+
+    /** Run a surface through all light map generators.
+     *  Generators that don't support \a phase use their best quality. */
+    lightmap_ptr  generate_lightmap (chunk_coordinates pos,
+                                     const surface_data& s, int phase) const;
+
+    /** The number of light map phases, the highest of all generators. */
+    int   lightmap_phases () const;
+
+    void  mark_changed (chunk_coordinates pos);
+    void  mark_refined (chunk_coordinates pos);
 
     /** Get an existing chunk, or if it doesn't exist yet, create an
      ** empty one.
@@ -181,7 +243,69 @@ protected:
     /** Regenerate surface and lightmap data. */
     void  update (chunk_coordinates pos);
 
-    void worker(int id);
+    /** Update the surface and light map of a chunk after a single block
+     ** has changed, without regenerating all of it.
+     * \param pos      The chunk
+     * \param blocks   The blocks in this chunk whose faces may have
+     *                 changed; empty if only the light can be different
+     * \param changed  The block that was changed */
+    void  patch (chunk_coordinates pos, const std::vector<chunk_index>& blocks,
+                 world_coordinates changed);
+
+    /** How far a block change affects the light, the highest of all
+     ** generators. */
+    unsigned int  influence_radius () const;
+
+    /** Make sure the coarse height map at \a pos leaves room for a
+     ** chunk that isn't all air. */
+    void  adjust_coarse_height (chunk_coordinates pos);
+
+    /** Look up which phase a terrain generator runs in. */
+    unsigned int  generator_phase (const terrain_generator_i& requester) const;
+
+    /** Generate and lock a set of chunks on behalf of lock_region() and
+     ** lock_range(). */
+    exclusive_section  lock_chunks (std::vector<chunk_coordinates> region,
+                                    unsigned int phase);
+
+protected:
+    typedef task_scheduler::task_ptr task_ptr;
+
+    /** Idle handler for the scheduler: take a request off the queue, and
+     ** turn it into tasks. */
+    bool  take_request ();
+
+    /** Pick a light map from \a refinements and turn it into a task,
+     ** if the budget allows it. */
+    bool  take_refinement ();
+
+    /** Check if there's time left for refining light maps. */
+    bool  within_budget ();
+
+    /** Take the time a refinement took off the budget. */
+    void  spend_budget (double seconds);
+    void  schedule (request rq);
+
+    /** The tasks that build up a chunk.  Each of these returns a nullptr
+     ** if there's nothing left to do, and shares the task with whoever
+     ** asked for the same thing while it hasn't finished yet. */
+    task_ptr  area_task (map_coordinates pos);
+    task_ptr  terrain_task (chunk_coordinates pos, int phase);
+    task_ptr  surface_task (chunk_coordinates pos);
+    task_ptr  lightmap_task (chunk_coordinates pos, int phase);
+
+    enum task_kind { area_job, terrain_job, surface_job, lightmap_job };
+    typedef std::tuple<int, chunk_coordinates, int> task_key;
+
+    /** Look up a pending task, or create it if there's none yet.
+     * \param key   What the task does
+     * \param deps  Returns the tasks this one depends on
+     * \param job   The actual work */
+    template <typename deps_fn>
+    task_ptr  add_task (const task_key& key, deps_fn deps,
+                        std::function<void()> job);
+
+    void      forget_task (const task_key& key);
 
 protected:
     es::storage  entities_;
@@ -196,7 +320,38 @@ private:
 
     int heightmap_;
 
-    std::vector<boost::thread>    workers_;
+    /** Makes sure only one thread creates a new chunk at a given
+     ** position. */
+    boost::mutex create_lock_;
+    /** Protects read-modify-write updates of the coarse height map. */
+    boost::mutex height_lock_;
+    /** Held while the surface and light map of a chunk are checked
+     ** against the versions a patch or refinement started from, and
+     ** replaced. */
+    boost::mutex light_lock_;
+
+    boost::mutex                            changeset_lock_;
+    std::unordered_set<chunk_coordinates>   changeset_;
+    patch_list                              patches_;
+    std::unordered_set<chunk_coordinates>   refined_;
+
+    /** Held while a request or refinement is turned into tasks, so
+     ** is_idle() never sees it halfway. */
+    boost::mutex                            taking_lock_;
+
+    /** The fraction of worker time that can go to refinement, and how
+     ** many seconds of it are left right now. */
+    boost::mutex                            budget_lock_;
+    double                                  budget_;
+    double                                  budget_left_;
+    boost::chrono::steady_clock::time_point budget_time_;
+
+    boost::mutex                            tasks_lock_;
+    std::map<task_key, task_ptr>            tasks_;
+
+    /** Declared last; the workers have to be stopped before anything
+     ** else is torn down. */
+    task_scheduler                          scheduler_;
 };
 
 } // namespace hexa
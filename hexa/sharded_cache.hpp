@@ -0,0 +1,487 @@
+//---------------------------------------------------------------------------
+/// \file   hexa/sharded_cache.hpp
+/// \brief  Thread-safe LRU cache, split up in independently locked shards.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <array>
+#include <functional>
+#include <future>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+#include "clock_cache.hpp"
+
+namespace hexa {
+
+/** Usage statistics of a cache. */
+struct cache_stats
+{
+    size_t  entries;    /**< Number of elements in memory */
+    size_t  bytes;      /**< Estimated memory use */
+    size_t  hits;       /**< Lookups that were found in memory */
+    size_t  misses;     /**< Lookups that had to go to the storage */
+    size_t  evictions;  /**< Elements that were thrown out */
+
+    cache_stats() : entries (0), bytes (0), hits (0), misses (0), evictions (0) { }
+
+    cache_stats& operator+= (const cache_stats& add)
+    {
+        entries   += add.entries;
+        bytes     += add.bytes;
+        hits      += add.hits;
+        misses    += add.misses;
+        evictions += add.evictions;
+        return *this;
+    }
+};
+
+/** Check if a cached value is still in use outside the cache.
+ *  Values like these are never evicted; whoever holds on to them would
+ *  otherwise end up with a copy that is no longer the one in memory. */
+template <class value>
+bool shared_elsewhere (const value&)
+{
+    return false;
+}
+
+template <class t>
+bool shared_elsewhere (const std::shared_ptr<t>& ptr)
+{
+    return ptr.use_count() > 1;
+}
+
+/** A write-back cache that can be used by many threads at once.
+ *  The keys are spread over a number of shards, each with its own lock,
+ *  so threads that look up different keys rarely get in each other's
+ *  way.  The locks are only held while the shard's tables are updated;
+ *  loading data from, or writing it back to, the underlying storage is
+ *  always done without holding a lock.
+ *
+ *  If several threads ask for the same missing key, only the first one
+ *  calls the loader.  The others wait for its result.
+ *
+ *  The cache keeps track of how much memory its elements use, and is
+ *  trimmed down to a size in bytes.
+ *
+ * \param key     The key type; needs std::hash
+ * \param value   The value type, usually a shared_ptr
+ * \param shards  The number of shards, must be a power of two */
+template <class key, class value, size_t shards = 16>
+class sharded_cache : boost::noncopyable
+{
+    static_assert((shards & (shards - 1)) == 0, "shards must be a power of two");
+
+public:
+    typedef key     key_type;
+    typedef value   mapped_type;
+
+    /** Estimates the memory used by a value, in bytes. */
+    typedef std::function<size_t(const value&)> footprint_fn;
+
+    /** Construct an empty cache.
+     * \param none       The value that signals 'not found'; it is never
+     *                   stored in the cache
+     * \param footprint  Estimates the memory used by a value, not
+     *                   including the cache's own bookkeeping.  The
+     *                   default is sizeof(value). */
+    sharded_cache (value none = value(), footprint_fn footprint = nullptr)
+        : none_ (none)
+        , footprint_ (footprint)
+    { }
+
+    /** Look up a key, and load it if it isn't in memory.
+     *  The loader is called without any locks held.  If it returns the
+     *  'not found' value, nothing is cached.
+     * \param k     The key
+     * \param load  Function that gets the value from somewhere else */
+    template <class loader>
+    value get (const key& k, loader load)
+    {
+        shard& s (shard_for(k));
+        std::promise<value> promise;
+        {
+        boost::unique_lock<boost::mutex> lock (s.lock);
+        value found;
+        if (s.find(k, found))
+        {
+            ++s.hits;
+            return found;
+        }
+
+        ++s.misses;
+
+        auto busy (s.loading.find(k));
+        if (busy != s.loading.end())
+        {
+            // Someone else is already fetching it; wait for them.
+            auto pending (busy->second);
+            lock.unlock();
+            return pending.get();
+        }
+
+        s.loading.emplace(k, promise.get_future().share());
+        }
+
+        value result (none_);
+        try
+        {
+            result = load();
+        }
+        catch (...)
+        {
+            boost::lock_guard<boost::mutex> lock (s.lock);
+            s.loading.erase(k);
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+
+        {
+        boost::lock_guard<boost::mutex> lock (s.lock);
+        s.loading.erase(k);
+
+        // If the key was stored while we were loading, the stored
+        // value is newer than whatever was on disk.
+        value newer;
+        if (s.find(k, newer))
+            result = newer;
+        else if (!(result == none_))
+            s.put(k, result, bytes_used(result));
+        }
+
+        promise.set_value(result);
+        return result;
+    }
+
+    /** Get a value if it's in memory, without loading it.
+     * \return The value, or 'not found' */
+    value peek (const key& k)
+    {
+        shard& s (shard_for(k));
+        boost::lock_guard<boost::mutex> lock (s.lock);
+        value result (none_);
+        s.find(k, result);
+        return result;
+    }
+
+    /** Store a value, and mark it as dirty. */
+    void store (const key& k, value v)
+    {
+        shard& s (shard_for(k));
+        size_t bytes (bytes_used(v));
+        boost::lock_guard<boost::mutex> lock (s.lock);
+        s.put(k, std::move(v), bytes);
+        s.dirty.insert(k);
+    }
+
+    /** Store a value that doesn't have to be written back. */
+    void insert (const key& k, value v)
+    {
+        shard& s (shard_for(k));
+        size_t bytes (bytes_used(v));
+        boost::lock_guard<boost::mutex> lock (s.lock);
+        s.put(k, std::move(v), bytes);
+    }
+
+    /** Store a value that was fetched from the underlying storage
+     ** without going through get(), e.g. by a prefetch.  It is only
+     ** stored if the key isn't in memory or being loaded already; in
+     ** that case the cached value is at least as recent.
+     * \return True if the value was stored */
+    bool insert_if_missing (const key& k, value v)
+    {
+        shard& s (shard_for(k));
+        size_t bytes (bytes_used(v));
+        boost::lock_guard<boost::mutex> lock (s.lock);
+        if (   s.lru.count(k) > 0 || s.writeback.count(k) > 0
+            || s.loading.count(k) > 0)
+        {
+            return false;
+        }
+
+        s.put(k, std::move(v), bytes);
+        return true;
+    }
+
+    /** Remove a value from memory, without writing it back.
+     *  Only use this for caches whose values are never dirty. */
+    void erase (const key& k)
+    {
+        shard& s (shard_for(k));
+        boost::lock_guard<boost::mutex> lock (s.lock);
+        if (s.lru.count(k) > 0)
+        {
+            s.bytes -= s.lru.get(k).bytes;
+            s.lru.remove(k);
+        }
+        s.dirty.erase(k);
+    }
+
+    /** Check if a key is in memory. */
+    bool contains (const key& k) const
+    {
+        const shard& s (shard_for(k));
+        boost::lock_guard<boost::mutex> lock (s.lock);
+        return s.lru.count(k) > 0 || s.writeback.count(k) > 0;
+    }
+
+    /** Check if a key was stored, but not written back yet. */
+    bool is_dirty (const key& k) const
+    {
+        const shard& s (shard_for(k));
+        boost::lock_guard<boost::mutex> lock (s.lock);
+        return s.dirty.count(k) > 0;
+    }
+
+    /** Clear the dirty flag, but only if the value hasn't been replaced
+     ** in the meantime.  Call this after \a v has been written back. */
+    void mark_clean (const key& k, const value& v)
+    {
+        shard& s (shard_for(k));
+        boost::lock_guard<boost::mutex> lock (s.lock);
+        if (s.lru.count(k) > 0 && s.lru.get(k).data == v)
+            s.dirty.erase(k);
+    }
+
+    /** The dirty values, as handed to the writer in flush(). */
+    typedef std::vector<std::pair<key, value>> batch;
+
+    /** Write back all dirty values, and trim the cache.
+     *  Values that are evicted before they've been written are kept
+     *  aside, so readers don't fetch stale data from the underlying
+     *  storage in the meantime.
+     * \param max_bytes  The cache is trimmed down to this size
+     * \param write      Callback that writes back a batch of key-value
+     *                   pairs; it is called once, and only if there is
+     *                   anything to write */
+    template <class writer>
+    void flush (size_t max_bytes, writer write)
+    {
+        flush(max_bytes, write, [](const batch&){ });
+    }
+
+    /** Write back all dirty values, trim the cache, and hand the
+     ** evicted values to a callback.
+     * \param max_bytes  The cache is trimmed down to this size
+     * \param write      Callback that writes back a batch of key-value
+     *                   pairs
+     * \param on_evict   Called once with everything that was thrown
+     *                   out, after all locks have been released.
+     *                   Values that are still used elsewhere (see
+     *                   shared_elsewhere()) are never thrown out. */
+    template <class writer, class evicted_fn>
+    void flush (size_t max_bytes, writer write, evicted_fn on_evict)
+    {
+        const size_t per_shard (max_bytes / shards);
+        batch out, evicted;
+
+        for (shard& s : shards_)
+        {
+            boost::lock_guard<boost::mutex> lock (s.lock);
+
+            // Evict first, so the copies made for the writer below
+            // don't make every dirty value look like it's in use.
+            while (s.bytes > per_shard && !s.lru.empty())
+            {
+                bool removed (s.lru.evict([&](const key& k, entry& e)
+                {
+                    s.bytes -= e.bytes;
+                    if (s.dirty.erase(k) > 0)
+                    {
+                        out.emplace_back(k, e.data);
+                        s.writeback[k] = e.data;
+                    }
+                    evicted.emplace_back(k, std::move(e.data));
+                },
+                [](const key&, const entry& e)
+                {
+                    return shared_elsewhere(e.data);
+                }));
+
+                if (!removed)
+                    break;
+
+                ++s.evictions;
+            }
+
+            for (auto& k : s.dirty)
+            {
+                if (s.lru.count(k) == 0)
+                    continue;
+
+                const value& v (s.lru.get(k).data);
+                out.emplace_back(k, v);
+                s.writeback[k] = v;
+            }
+            s.dirty.clear();
+        }
+
+        if (!out.empty())
+        {
+            write(out);
+
+            for (auto& p : out)
+            {
+                shard& s (shard_for(p.first));
+                boost::lock_guard<boost::mutex> lock (s.lock);
+                auto found (s.writeback.find(p.first));
+                if (found != s.writeback.end() && found->second == p.second)
+                    s.writeback.erase(found);
+            }
+            out.clear();
+        }
+
+        // By now, the evicted values are only held by on_evict, unless
+        // someone picked them up while they were being written back.
+        if (!evicted.empty())
+            on_evict(evicted);
+    }
+
+    /** The number of elements in memory. */
+    size_t size() const
+    {
+        return stats().entries;
+    }
+
+    /** The estimated memory use, in bytes. */
+    size_t bytes() const
+    {
+        return stats().bytes;
+    }
+
+    cache_stats stats() const
+    {
+        cache_stats result;
+        for (const shard& s : shards_)
+        {
+            boost::lock_guard<boost::mutex> lock (s.lock);
+            result.entries   += s.lru.size();
+            result.bytes     += s.bytes;
+            result.hits      += s.hits;
+            result.misses    += s.misses;
+            result.evictions += s.evictions;
+        }
+        return result;
+    }
+
+private:
+    struct entry
+    {
+        value   data;
+        size_t  bytes;
+
+        entry() : bytes (0) { }
+    };
+
+    /** Rough guess of the memory used by the bookkeeping of a single
+     ** element; the clock_cache keeps its hash table at most 3/4 full. */
+    static const size_t overhead = sizeof(key) + sizeof(entry) + 2 + 6 * sizeof(uint32_t);
+
+    struct shard
+    {
+        mutable boost::mutex    lock;
+        clock_cache<key, entry> lru;
+        std::unordered_set<key> dirty;
+        size_t                  bytes;
+        size_t                  hits, misses, evictions;
+
+        shard() : bytes (0), hits (0), misses (0), evictions (0) { }
+
+        /** Values that are being written back. */
+        std::unordered_map<key, value>  writeback;
+
+        /** Keys that are being loaded right now. */
+        std::unordered_map<key, std::shared_future<value>>  loading;
+
+        /** Look up a key, and mark it as recently used. */
+        bool find (const key& k, value& result)
+        {
+            auto found (lru.try_get(k));
+            if (found)
+            {
+                result = found->data;
+                return true;
+            }
+
+            auto written (writeback.find(k));
+            if (written != writeback.end())
+            {
+                result = written->second;
+                return true;
+            }
+
+            return false;
+        }
+
+        void put (const key& k, value v, size_t size)
+        {
+            entry& e (lru[k]);
+            bytes -= e.bytes;
+            bytes += size;
+            e.data  = std::move(v);
+            e.bytes = size;
+        }
+    };
+
+    size_t bytes_used (const value& v) const
+    {
+        return overhead + (footprint_ ? footprint_(v) : sizeof(value));
+    }
+
+    shard& shard_for (const key& k)
+    {
+        return shards_[index(k)];
+    }
+
+    const shard& shard_for (const key& k) const
+    {
+        return shards_[index(k)];
+    }
+
+    static size_t index (const key& k)
+    {
+        // Fibonacci hashing; the std::hash for our vectors puts most of
+        // the entropy in the lower bits.
+        if (shards == 1)
+            return 0;
+
+        uint64_t h (std::hash<key>()(k));
+        return (h * 0x9e3779b97f4a7c15ull) >> (64 - log2(shards));
+    }
+
+    static constexpr int log2 (size_t n)
+    {
+        return n <= 1 ? 0 : 1 + log2(n / 2);
+    }
+
+private:
+    std::array<shard, shards>   shards_;
+    value                       none_;
+    footprint_fn                footprint_;
+};
+
+} // namespace hexa
+
@@ -28,16 +28,40 @@
 #include "lightmap.hpp"
 #include "read_write_lockable.hpp"
 #include "surface.hpp"
+#include "voxel_range.hpp"
 
 namespace hexa {
 
 /** Interface for persistent storage modules. */
 class storage_i : public readers_writer_lock
 {
+public:
+    /** What to fetch in prefetch(); these can be or'ed together. */
+    enum prefetch_t
+    {
+        prefetch_chunks = 1, prefetch_surfaces = 2, prefetch_lightmaps = 4
+    };
+
 public:
     virtual ~storage_i() {}
     virtual void cleanup() {}
 
+    /** Hint that the data at a list of positions will be needed soon.
+     *  Implementations can use this to fetch it from disk in a single
+     *  batch.  The default does nothing.
+     * \param xyz   The positions
+     * \param what  A combination of prefetch_t flags */
+    virtual void prefetch (const std::vector<chunk_coordinates>& xyz, int what) { }
+
+    /** Hint that the data in a box will be needed soon.
+     * \param box   The box
+     * \param what  A combination of prefetch_t flags */
+    void prefetch (const range<chunk_coordinates>& box, int what)
+    {
+        if (!box.empty())
+            prefetch(std::vector<chunk_coordinates>(box.begin(), box.end()), what);
+    }
+
     virtual void store (map_coordinates   xy,  uint16_t index, area_ptr data) = 0;
     virtual void store (chunk_coordinates xyz, chunk_ptr data) = 0;
     virtual void store (chunk_coordinates xyz, lightmap_ptr data) = 0;
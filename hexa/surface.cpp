@@ -21,7 +21,12 @@
 
 #include "surface.hpp"
 
+#include <array>
 #include <boost/range/algorithm.hpp>
+#if defined(__SSE2__) && !defined(HEXA_FORCE_SCALAR_SURFACE)
+#  include <emmintrin.h>
+#  define HEXA_SSE2_SURFACE
+#endif
 #include "neighborhood.hpp"
 #include "voxel_range.hpp"
 
@@ -29,77 +34,328 @@ using namespace boost::range;
 
 namespace hexa {
 
-surface
-extract_surface (const neighborhood<chunk_ptr>& terrain)
+namespace {
+
+/** Call a function for every block on the outside of a chunk, in the
+ ** same order as \a every_block_in_chunk. */
+template <class func>
+void for_each_outer_block (func f)
 {
-    surface result;
-    result.reserve(256);
+    const int8_t last (chunk_size - 1);
+    for (int8_t z (0); z < chunk_size; ++z)
+    {
+        for (int8_t y (0); y < chunk_size; ++y)
+        {
+            if (z == 0 || z == last || y == 0 || y == last)
+            {
+                for (int8_t x (0); x < chunk_size; ++x)
+                    f(chunk_index(x, y, z));
+            }
+            else
+            {
+                f(chunk_index(0, y, z));
+                f(chunk_index(last, y, z));
+            }
+        }
+    }
+}
 
-    // Cache the center chunk
-    const chunk& center_chunk (*terrain.center());
+/** Check if all six chunks next to the center are made of a single,
+ ** visually solid material.  Nothing in the center chunk can be seen
+ ** in that case. */
+bool is_buried (const neighborhood<chunk_ptr>& terrain)
+{
+    for (uint8_t dir (0); dir < 6; ++dir)
+    {
+        auto cnk (terrain.chunk(dir_vector[dir]));
+        if (   !cnk->is_uniform()
+            || !type::is_visually_solid((*cnk)[chunk_index(0, 0, 0)].type))
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
-    for (chunk_index i : every_block_in_chunk)
+/** Run a face check for every block that could have a visible face.
+ *  In a uniform chunk, two neighboring blocks are always of the same
+ *  material, so only the blocks along the outside need checking. */
+template <class func>
+void for_each_candidate (const neighborhood<chunk_ptr>& terrain,
+                         const chunk& center_chunk, func f)
+{
+    if (!center_chunk.is_uniform())
     {
-        uint16_t type (center_chunk[i].type);
-        if (type != type::air)
-		{
-            uint8_t dirs (0);
-			for (uint8_t dir (0); dir < 6; ++dir)
-			{
-				uint16_t other_type (terrain[i + dir_vector[dir]].type);
-            
-				if (type != other_type && type::is_transparent(other_type))
-                    dirs += (1 << dir);
-			}
-
-            if (dirs != 0)
-                result.emplace_back(i, dirs, type);
-		}
+        for (chunk_index i : every_block_in_chunk)
+            f(i);
+
+        return;
     }
 
+    uint16_t type (center_chunk[chunk_index(0, 0, 0)].type);
+    if (type == type::air)
+        return;
+
+    if (material_prop[type].is_custom_block())
+    {
+        for (chunk_index i : every_block_in_chunk)
+            f(i);
+
+        return;
+    }
+
+    if (is_buried(terrain))
+        return;
+
+    for_each_outer_block(f);
+}
+
+/** The index of the lowest bit that is set. */
+inline int count_trailing_zeros (uint16_t v)
+{
+    assert(v != 0);
+#if defined(__GNUC__) && !defined(HEXA_FORCE_SW_BITCOUNT)
+    return __builtin_ctz(v);
+#else
+    int result (0);
+    for (; (v & 1) == 0; v >>= 1)
+        ++result;
+
     return result;
+#endif
 }
 
-surface
-extract_opaque_surface (const neighborhood<chunk_ptr>& terrain)
+/** A copy of the center chunk of a neighborhood, with a border of one
+ ** block taken from the six chunks next to it.
+ *  Every block also gets a set of flags, so the face checks don't have
+ *  to go through the material properties, and can be done for a whole
+ *  row of blocks at once. */
+class padded_chunk
 {
-    surface result;
-    result.reserve(256);
+public:
+    enum
+    {
+        /** Hides the faces of the blocks next to it. */
+        visually_solid = 1,
+        /** Not air, not transparent, and not a custom block. */
+        opaque = 2,
+        /** A custom block that isn't air. */
+        custom = 4,
+        /** Transparent, not air, and not a custom block. */
+        transparent = 8
+    };
 
-    // Cache the center chunk
-    const chunk& center_chunk (*terrain.center());
+    static const int length = chunk_size + 2;
+    static const int area   = length * length;
+    static const int volume = length * area;
 
-    for (chunk_index i : every_block_in_chunk)
+public:
+    explicit padded_chunk (const neighborhood<chunk_ptr>& terrain)
     {
-        uint16_t type (center_chunk[i].type);
-        if (type == type::air)
-            continue;
+        // The edges and corners are never looked at, but they do get
+        // flags below.
+        types_.fill(type::air);
 
-        if (material_prop[type].is_custom_block())
+        const chunk& center (*terrain.center());
+        auto src (center.begin());
+        for (int z (1); z <= chunk_size; ++z)
         {
-            result.emplace_back(i, 0x3f, type);
+            for (int y (1); y <= chunk_size; ++y)
+            {
+                auto dest (types_.begin() + 1 + y * length + z * area);
+                for (int x (0); x < chunk_size; ++x, ++src)
+                    *dest++ = src->type;
+            }
+        }
+
+        for (int dir (0); dir < 6; ++dir)
+        {
+            const chunk& nb (*terrain.chunk(dir_vector[dir]));
+            const block_vector d (dir_vector[dir]);
+            const int outside (d.x + d.y + d.z > 0 ? chunk_size : -1);
+            const int inside  (d.x + d.y + d.z > 0 ? 0 : chunk_size - 1);
+
+            for (int v (0); v < chunk_size; ++v)
+            {
+                for (int u (0); u < chunk_size; ++u)
+                {
+                    chunk_index src_pos;
+                    world_vector dest_pos;
+                    switch (dir / 2)
+                    {
+                    case 0:
+                        src_pos = chunk_index(inside, u, v);
+                        dest_pos = world_vector(outside, u, v);
+                        break;
+                    case 1:
+                        src_pos = chunk_index(u, inside, v);
+                        dest_pos = world_vector(u, outside, v);
+                        break;
+                    default:
+                        src_pos = chunk_index(u, v, inside);
+                        dest_pos = world_vector(u, v, outside);
+                    }
+                    types_[index(dest_pos)] = nb[src_pos].type;
+                }
+            }
+        }
+
+        // Chunks usually have long runs of the same material, so
+        // remembering the last lookup saves most of the trips to
+        // material_prop.
+        uint16_t last_type (types_[0]);
+        uint8_t  last_flags (flags_for(last_type));
+        for (int i (0); i < volume; ++i)
+        {
+            if (types_[i] != last_type)
+            {
+                last_type = types_[i];
+                last_flags = flags_for(last_type);
+            }
+            flags_[i] = last_flags;
+        }
+
+        for (int dir (0); dir < 6; ++dir)
+        {
+            const block_vector d (dir_vector[dir]);
+            offset_[dir] = d.x + d.y * length + d.z * area;
         }
-        else if (!type::is_transparent(type))
-		{
-            uint8_t dirs (0);
-			for (uint8_t dir (0); dir < 6; ++dir)
-			{
-				uint16_t other_type (terrain[i + dir_vector[dir]].type);
-            
-                if (!type::is_visually_solid(other_type))
-                    dirs += (1 << dir);
-			}
-
-            if (dirs != 0)
-                result.emplace_back(i, dirs, type);
-		}
     }
 
-    return result;
+    /** Find the faces of every block in a row along the X axis that
+     ** aren't hidden by a visually solid neighbor.
+     * \param y, z       The row, in chunk coordinates
+     * \param candidate  Only blocks that have this flag are checked
+     * \param dirs       The face masks for the 16 blocks in the row
+     * \return A bit mask of the blocks that have at least one face */
+    uint16_t open_faces (int y, int z, uint8_t candidate,
+                         std::array<uint8_t, chunk_size>& dirs) const
+    {
+        const int row (1 + (y + 1) * length + (z + 1) * area);
+
+#ifdef HEXA_SSE2_SURFACE
+        static_assert(chunk_size == 16, "the SSE2 kernel does 16 blocks at a time");
+
+        const __m128i zero (_mm_setzero_si128());
+        const __m128i solid_bit (_mm_set1_epi8(visually_solid));
+        __m128i result (zero);
+
+        for (int dir (0); dir < 6; ++dir)
+        {
+            __m128i nb (load(row + offset_[dir]));
+            __m128i open (_mm_cmpeq_epi8(_mm_and_si128(nb, solid_bit), zero));
+            result = _mm_or_si128(result, _mm_and_si128(open, _mm_set1_epi8(1 << dir)));
+        }
+
+        const __m128i cand_bit (_mm_set1_epi8(candidate));
+        __m128i is_cand (_mm_cmpeq_epi8(_mm_and_si128(load(row), cand_bit), cand_bit));
+        result = _mm_and_si128(result, is_cand);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&dirs[0]), result);
+
+        return ~_mm_movemask_epi8(_mm_cmpeq_epi8(result, zero)) & 0xffff;
+#else
+        uint16_t mask (0);
+        for (int x (0); x < chunk_size; ++x)
+        {
+            uint8_t d (0);
+            if (flags_[row + x] & candidate)
+            {
+                for (int dir (0); dir < 6; ++dir)
+                {
+                    if (!(flags_[row + x + offset_[dir]] & visually_solid))
+                        d += (1 << dir);
+                }
+            }
+            dirs[x] = d;
+            if (d != 0)
+                mask |= (1 << x);
+        }
+        return mask;
+#endif
+    }
+
+    /** Find the blocks in a row along the X axis that have a given
+     ** flag. */
+    uint16_t has_flag (int y, int z, uint8_t flag) const
+    {
+        const int row (1 + (y + 1) * length + (z + 1) * area);
+#ifdef HEXA_SSE2_SURFACE
+        const __m128i bit (_mm_set1_epi8(flag));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(load(row), bit), bit));
+#else
+        uint16_t mask (0);
+        for (int x (0); x < chunk_size; ++x)
+        {
+            if (flags_[row + x] & flag)
+                mask |= (1 << x);
+        }
+        return mask;
+#endif
+    }
+
+    /** The material at a position, in chunk coordinates. */
+    uint16_t type (chunk_index pos) const
+        { return types_[index(pos)]; }
+
+    /** The material next to a position, in chunk coordinates. */
+    uint16_t type (chunk_index pos, int dir) const
+        { return types_[index(pos) + offset_[dir]]; }
+
+    /** The flags of the block next to a position. */
+    uint8_t flags (chunk_index pos, int dir) const
+        { return flags_[index(pos) + offset_[dir]]; }
+
+private:
+    template <class pos_t>
+    static int index (pos_t p)
+        { return (p.x + 1) + (p.y + 1) * length + (p.z + 1) * area; }
+
+    static uint8_t flags_for (uint16_t t)
+    {
+        const material& m (material_prop[t]);
+        uint8_t result (0);
+        if (m.is_visually_solid())
+            result |= visually_solid;
+
+        if (t != type::air)
+        {
+            if (m.is_custom_block())
+                result |= custom;
+            else if (m.is_transparent())
+                result |= transparent;
+            else
+                result |= opaque;
+        }
+        return result;
+    }
+
+#ifdef HEXA_SSE2_SURFACE
+    __m128i load (int i) const
+        { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(&flags_[i])); }
+#endif
+
+private:
+    std::array<uint16_t, volume>    types_;
+    std::array<uint8_t, volume>     flags_;
+    std::array<int, 6>              offset_;
+};
+
+/** Check if a uniform center chunk can be skipped altogether. */
+bool nothing_visible (const neighborhood<chunk_ptr>& terrain,
+                      const chunk& center_chunk)
+{
+    if (!center_chunk.is_uniform())
+        return false;
+
+    uint16_t type (center_chunk[chunk_index(0, 0, 0)].type);
+    return    type == type::air
+           || (!material_prop[type].is_custom_block() && is_buried(terrain));
 }
 
+} // anonymous namespace
+
 surface
-extract_transparent_surface (const neighborhood<chunk_ptr>& terrain)
+extract_surface (const neighborhood<chunk_ptr>& terrain)
 {
     surface result;
     result.reserve(256);
@@ -107,36 +363,157 @@ extract_transparent_surface (const neighborhood<chunk_ptr>& terrain)
     // Cache the center chunk
     const chunk& center_chunk (*terrain.center());
 
-    for (chunk_index i : every_block_in_chunk)
+    for_each_candidate(terrain, center_chunk, [&](chunk_index i)
     {
         uint16_t type (center_chunk[i].type);
         if (type == type::air)
-            continue;
-
-        const auto& m (material_prop[type]);
-        if (!m.is_transparent() || m.is_custom_block())
-            continue;
+            return;
 
         uint8_t dirs (0);
         for (uint8_t dir (0); dir < 6; ++dir)
         {
             uint16_t other_type (terrain[i + dir_vector[dir]].type);
 
-            if (   type != other_type
-                && !type::is_visually_solid(other_type)
-                && m.textures[dir] != material_prop[other_type].textures[dir^1])
-            {
+            if (type != other_type && type::is_transparent(other_type))
                 dirs += (1 << dir);
-            }
         }
 
         if (dirs != 0)
             result.emplace_back(i, dirs, type);
+    });
+
+    return result;
+}
+
+surface
+extract_opaque_surface (const neighborhood<chunk_ptr>& terrain)
+{
+    surface result;
+    if (nothing_visible(terrain, *terrain.center()))
+        return result;
+
+    result.reserve(256);
+    padded_chunk pad (terrain);
+    std::array<uint8_t, chunk_size> dirs;
+
+    for (int z (0); z < chunk_size; ++z)
+    {
+        for (int y (0); y < chunk_size; ++y)
+        {
+            uint16_t faces (pad.open_faces(y, z, padded_chunk::opaque, dirs));
+            uint16_t custom (pad.has_flag(y, z, padded_chunk::custom));
+
+            for (uint16_t row (faces | custom); row != 0; row &= row - 1)
+            {
+                int x (count_trailing_zeros(row));
+                chunk_index i (x, y, z);
+                if (custom & (1 << x))
+                    result.emplace_back(i, 0x3f, pad.type(i));
+                else
+                    result.emplace_back(i, dirs[x], pad.type(i));
+            }
+        }
     }
 
     return result;
 }
 
+surface
+extract_transparent_surface (const neighborhood<chunk_ptr>& terrain)
+{
+    surface result;
+    if (nothing_visible(terrain, *terrain.center()))
+        return result;
+
+    result.reserve(256);
+    padded_chunk pad (terrain);
+    std::array<uint8_t, chunk_size> dirs;
+
+    for (int z (0); z < chunk_size; ++z)
+    {
+        for (int y (0); y < chunk_size; ++y)
+        {
+            // Transparent blocks are rare, and they also need their
+            // textures compared, so the row is only used to find the
+            // blocks that need a closer look.
+            uint16_t row (pad.open_faces(y, z, padded_chunk::transparent, dirs));
+            for (; row != 0; row &= row - 1)
+            {
+                int x (count_trailing_zeros(row));
+                chunk_index i (x, y, z);
+                uint16_t type (pad.type(i));
+                const auto& m (material_prop[type]);
+
+                uint8_t d (0);
+                for (uint8_t dir (0); dir < 6; ++dir)
+                {
+                    if (!(dirs[x] & (1 << dir)))
+                        continue;
+
+                    uint16_t other_type (pad.type(i, dir));
+                    if (   type != other_type
+                        && m.textures[dir] != material_prop[other_type].textures[dir^1])
+                    {
+                        d += (1 << dir);
+                    }
+                }
+
+                if (d != 0)
+                    result.emplace_back(i, d, type);
+            }
+        }
+    }
+
+    return result;
+}
+
+faces
+opaque_faces (const neighborhood<chunk_ptr>& terrain, chunk_index pos)
+{
+    uint16_t type ((*terrain.center())[pos].type);
+    if (type == type::air)
+        return faces(pos, 0, type);
+
+    if (material_prop[type].is_custom_block())
+        return faces(pos, 0x3f, type);
+
+    if (type::is_transparent(type))
+        return faces(pos, 0, type);
+
+    uint8_t dirs (0);
+    for (uint8_t dir (0); dir < 6; ++dir)
+    {
+        if (!type::is_visually_solid(terrain[pos + dir_vector[dir]].type))
+            dirs += (1 << dir);
+    }
+
+    return faces(pos, dirs, type);
+}
+
+faces
+transparent_faces (const neighborhood<chunk_ptr>& terrain, chunk_index pos)
+{
+    uint16_t type ((*terrain.center())[pos].type);
+    const auto& m (material_prop[type]);
+    if (type == type::air || !m.is_transparent() || m.is_custom_block())
+        return faces(pos, 0, type);
+
+    uint8_t dirs (0);
+    for (uint8_t dir (0); dir < 6; ++dir)
+    {
+        uint16_t other_type (terrain[pos + dir_vector[dir]].type);
+
+        if (   type != other_type
+            && !type::is_visually_solid(other_type)
+            && m.textures[dir] != material_prop[other_type].textures[dir^1])
+        {
+            dirs += (1 << dir);
+        }
+    }
+
+    return faces(pos, dirs, type);
+}
+
 size_t count_faces (const surface& s)
 {
     size_t result (0);
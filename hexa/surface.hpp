@@ -23,6 +23,7 @@
 #pragma once
 
 #include <memory>
+#include <type_traits>
 #include <vector>
 #include "basic_types.hpp"
 #include "chunk.hpp"
@@ -52,9 +53,32 @@ public:
         : pos_dirs(i, d), type (t)
     { }
 
+    /** Faces are written in the order they are laid out in memory, so
+     ** an array of them can be copied in one go. \sa flat_layout */
     template <class archive>
     archive& serialize(archive& ar)
-        { return ar(type)(pos)(dirs); }
+        { return ar(pos.x)(pos.y)(pos.z)(dirs)(type); }
+};
+
+static_assert(sizeof(faces) == 6 && std::is_trivially_copyable<faces>::value,
+              "the flat surface layout copies faces as they are");
+
+/** Faces are copied as they are; only the material needs to be put in
+ ** network byte order. */
+template <>
+struct flat_layout<faces> : std::true_type
+{
+    enum { field = 0 };
+
+    static void swap (char* data, size_t size)
+    {
+        const faces f;
+        const size_t type_at (  reinterpret_cast<const char*>(&f.type)
+                              - reinterpret_cast<const char*>(&f));
+
+        for (size_t i (type_at); i < size; i += sizeof(faces))
+            swap_byte_order(data + i, 2, 2);
+    }
 };
 
 /** A list of faces in a chunk. */
@@ -74,9 +98,59 @@ public:
     bool empty() const
         { return opaque.empty() && transparent.empty(); }
 
-    template <class archive>
-    archive& serialize(archive& ar)
-        { return ar(opaque)(transparent); }
+    enum
+    {
+        /** Marks the flat layout, version 2. */
+        flat_version = 0xf2,
+        /** The size of the serialized form of an empty surface. */
+        flat_header_size = 5
+    };
+
+    /** Serialize the surfaces in the flat layout.
+     *  This is the version byte, followed by the opaque and transparent
+     *  faces as two ordinary arrays.  Since faces have a flat_layout,
+     *  each array is copied with a single memcpy. */
+    template <class obj>
+    serializer<obj>& serialize(serializer<obj>& ar)
+    {
+        ar.reserve(flat_header_size + count() * sizeof(faces));
+        return ar(uint8_t(flat_version))(opaque)(transparent);
+    }
+
+    /** Deserialize the surfaces.
+     *  Surfaces that were stored before the flat layout was introduced
+     *  begin with the number of opaque faces as a 16-bit integer.  There
+     *  are never more than 4096 of those, so the first byte can't be
+     *  mistaken for the version byte. */
+    template <class obj>
+    deserializer<obj>& serialize(deserializer<obj>& ar)
+    {
+        if (ar.peek() != flat_version)
+        {
+            read_fields(ar, opaque);
+            return read_fields(ar, transparent);
+        }
+
+        uint8_t version;
+        return ar(version)(opaque)(transparent);
+    }
+
+private:
+    /** Read a surface that was stored one field at a time, with the
+     ** block position packed in 16 bits. */
+    template <class obj>
+    static deserializer<obj>& read_fields(deserializer<obj>& ar, surface& s)
+    {
+        uint16_t size;
+        ar(size);
+        s.resize(size);
+        for (auto& f : s)
+            ar(f.type)(f.pos)(f.dirs);
+
+        return ar;
+    }
+
+    size_t count() const { return opaque.size() + transparent.size(); }
 };
 
 typedef std::shared_ptr<surface_data> surface_ptr;
@@ -126,6 +200,18 @@ extract_opaque_surface (const neighborhood<chunk_ptr>& terrain);
 surface
 extract_transparent_surface (const neighborhood<chunk_ptr>& terrain);
 
+/** Find the visible opaque faces of a single block in the center
+ ** chunk, the same way extract_opaque_surface() does.
+ * @return The faces, with no directions set if there are none */
+faces
+opaque_faces (const neighborhood<chunk_ptr>& terrain, chunk_index pos);
+
+/** Find the visible transparent faces of a single block in the center
+ ** chunk, the same way extract_transparent_surface() does.
+ * @return The faces, with no directions set if there are none */
+faces
+transparent_faces (const neighborhood<chunk_ptr>& terrain, chunk_index pos);
+
 /** Count the number of faces in a surface. */
 size_t count_faces (const surface& s);
 
@@ -0,0 +1,184 @@
+//---------------------------------------------------------------------------
+// lib/surface_patch.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "surface_patch.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace hexa {
+
+namespace {
+
+/** The position of a block in the order of every_block_in_chunk. */
+int order (chunk_index p)
+{
+    return p.x + p.y * chunk_size + p.z * chunk_area;
+}
+
+bool in_order (const faces& a, const faces& b)
+{
+    return order(a.pos) < order(b.pos);
+}
+
+/** The number of faces set in a direction mask. */
+unsigned int face_count (uint8_t dirs)
+{
+    unsigned int result (0);
+    for (; dirs != 0; dirs &= dirs - 1)
+        ++result;
+
+    return result;
+}
+
+} // anonymous namespace
+
+void replace_faces (surface& s, lightmap& lm, const surface& changes)
+{
+    assert(count_faces(s) == lm.size());
+
+    surface sorted (changes);
+    std::stable_sort(sorted.begin(), sorted.end(), in_order);
+
+    surface  new_s;
+    lightmap new_lm;
+    new_s.reserve(s.size() + sorted.size());
+    new_lm.data.reserve(lm.size() + sorted.size() * 6);
+
+    auto old (s.begin());
+    auto li  (lm.begin());
+    auto chg (sorted.begin());
+
+    while (old != s.end() || chg != sorted.end())
+    {
+        if (chg == sorted.end() || (old != s.end() && in_order(*old, *chg)))
+        {
+            // Not touched; copy the faces and their light.
+            new_s.push_back(*old);
+            auto n (face_count(old->dirs));
+            new_lm.data.insert(new_lm.data.end(), li, li + n);
+            li += n;
+            ++old;
+            continue;
+        }
+
+        // If the same block shows up more than once, the last one wins.
+        auto next (chg + 1);
+        if (next != sorted.end() && order(next->pos) == order(chg->pos))
+        {
+            ++chg;
+            continue;
+        }
+
+        const bool replaces (old != s.end() && order(old->pos) == order(chg->pos));
+        if (chg->dirs != 0)
+        {
+            new_s.push_back(*chg);
+            for (uint8_t dir (0); dir < 6; ++dir)
+            {
+                if (!(*chg)[dir])
+                    continue;
+
+                if (replaces && (*old)[dir])
+                {
+                    uint8_t below (old->dirs & ((1 << dir) - 1));
+                    new_lm.push_back(*(li + face_count(below)));
+                }
+                else
+                {
+                    new_lm.push_back(light());
+                }
+            }
+        }
+
+        if (replaces)
+        {
+            li += face_count(old->dirs);
+            ++old;
+        }
+        ++chg;
+    }
+
+    s.swap(new_s);
+    lm.data.swap(new_lm.data);
+}
+
+void set_light (const surface& s, lightmap& lm,
+                const surface& lit, const lightmap& values)
+{
+    assert(count_faces(lit) == values.size());
+
+    // Where the light of every block starts in the light map.
+    std::vector<size_t> offset (s.size());
+    size_t count (0);
+    for (size_t i (0); i < s.size(); ++i)
+    {
+        offset[i] = count;
+        count += face_count(s[i].dirs);
+    }
+    assert(count == lm.size());
+
+    auto value (values.begin());
+    for (auto& f : lit)
+    {
+        auto found (std::lower_bound(s.begin(), s.end(), f, in_order));
+        const bool exists (found != s.end() && order(found->pos) == order(f.pos));
+
+        for (uint8_t dir (0); dir < 6; ++dir)
+        {
+            if (!f[dir])
+                continue;
+
+            if (exists && (*found)[dir])
+            {
+                uint8_t below (found->dirs & ((1 << dir) - 1));
+                lm.data[offset[found - s.begin()] + face_count(below)] = *value;
+            }
+            ++value;
+        }
+    }
+}
+
+void apply (const surface_patch& p, surface_data& s, light_data& l)
+{
+    replace_faces(s.opaque, l.opaque, p.opaque);
+    replace_faces(s.transparent, l.transparent, p.transparent);
+    set_light(s.opaque, l.opaque, p.opaque_lit, p.opaque_light);
+    set_light(s.transparent, l.transparent, p.transparent_lit, p.transparent_light);
+}
+
+surface faces_near (const surface& s, world_vector center, int radius)
+{
+    surface result;
+    for (auto& f : s)
+    {
+        if (   std::abs(f.pos.x - center.x) <= radius
+            && std::abs(f.pos.y - center.y) <= radius
+            && std::abs(f.pos.z - center.z) <= radius)
+        {
+            result.push_back(f);
+        }
+    }
+    return result;
+}
+
+} // namespace hexa
+
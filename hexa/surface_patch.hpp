@@ -0,0 +1,109 @@
+//---------------------------------------------------------------------------
+/// \file   hexa/surface_patch.hpp
+/// \brief  Small changes to the surface and light map of a chunk.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include "lightmap.hpp"
+#include "surface.hpp"
+
+namespace hexa {
+
+/** The changes to the surface and light map of a chunk after a single
+ ** block was changed.
+ *  Only the faces of the block itself and its six neighbors can be
+ *  different, and only the light of the faces nearby.  Applying a patch
+ *  twice has the same outcome as applying it once.
+ * \code
+
+surface_patch p;
+p.opaque.emplace_back(chunk_index(1, 2, 3), 0x10, 5);
+p.opaque_lit.emplace_back(chunk_index(1, 2, 3), 0x10, 5);
+p.opaque_light.push_back(light(15, 15, 0));
+
+apply(p, surf, light);
+
+ * \endcode */
+class surface_patch
+{
+public:
+    /** The new faces of the blocks that were looked at.  An entry
+     ** without any directions removes the block from the surface. */
+    surface     opaque;
+    /** \sa opaque */
+    surface     transparent;
+
+    /** The faces that have new light values. */
+    surface     opaque_lit;
+    /** The new light values, one for every face in \a opaque_lit. */
+    lightmap    opaque_light;
+
+    /** \sa opaque_lit */
+    surface     transparent_lit;
+    /** \sa opaque_light */
+    lightmap    transparent_light;
+
+public:
+    bool empty() const
+    {
+        return    opaque.empty() && transparent.empty()
+               && opaque_lit.empty() && transparent_lit.empty();
+    }
+
+    template <class archive>
+    archive& serialize(archive& ar)
+    {
+        return ar(opaque)(transparent)(opaque_lit)(opaque_light)
+                 (transparent_lit)(transparent_light);
+    }
+};
+
+/** Replace the faces of a few blocks in a surface, and keep the light
+ ** map in step with it.
+ *  The faces that are still there keep their light, new faces start out
+ *  dark.
+ * @param s        The surface, in the order of every_block_in_chunk
+ * @param lm       The light map that goes with \a s
+ * @param changes  The new faces of the blocks */
+void replace_faces (surface& s, lightmap& lm, const surface& changes);
+
+/** Set the light of a few faces.
+ *  Faces that are not in the surface are skipped.
+ * @param s       The surface
+ * @param lm      The light map that goes with \a s
+ * @param lit     The faces to change
+ * @param values  The new light values, one for every face in \a lit */
+void set_light (const surface& s, lightmap& lm,
+                const surface& lit, const lightmap& values);
+
+/** Apply a patch to the surface and light map of a chunk. */
+void apply (const surface_patch& p, surface_data& s, light_data& l);
+
+/** Get the blocks in a surface that are within a given distance of a
+ ** point.
+ * @param s       The surface
+ * @param center  The point, relative to the chunk's corner; this can be
+ *                outside the chunk
+ * @param radius  The maximum distance along any axis */
+surface faces_near (const surface& s, world_vector center, int radius);
+
+} // namespace hexa
+
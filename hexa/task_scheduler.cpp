@@ -0,0 +1,289 @@
+//---------------------------------------------------------------------------
+// hexa/task_scheduler.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "task_scheduler.hpp"
+
+#include <iostream>
+#include <boost/thread/tss.hpp>
+
+#include "trace.hpp"
+
+namespace hexa {
+
+namespace {
+
+struct worker_id
+{
+    const task_scheduler*   owner;
+    int                     index;
+};
+
+boost::thread_specific_ptr<worker_id> this_worker;
+
+} // anonymous namespace
+
+//---------------------------------------------------------------------------
+
+task_scheduler::task::task (std::function<void()> fn)
+    : fn_ (std::move(fn))
+    , waiting_for_ (1)
+    , done_ (false)
+{
+}
+
+void task_scheduler::task::depends_on (const task_ptr& other)
+{
+    boost::lock_guard<boost::mutex> lock (other->lock_);
+    if (other->done_)
+        return;
+
+    ++waiting_for_;
+    other->successors_.emplace_back(shared_from_this());
+}
+
+bool task_scheduler::task::finished () const
+{
+    boost::lock_guard<boost::mutex> lock (lock_);
+    return done_;
+}
+
+//---------------------------------------------------------------------------
+
+task_scheduler::task_scheduler (unsigned int threads, idle_handler on_idle)
+    : on_idle_ (on_idle)
+    , queued_ (0)
+    , stop_ (false)
+{
+    if (threads == 0)
+        threads = std::max(1u, boost::thread::hardware_concurrency());
+
+    for (unsigned int i (0); i < threads; ++i)
+        queues_.emplace_back(new worker_queue);
+
+    for (unsigned int i (0); i < threads; ++i)
+        workers_.emplace_back([=]{ worker(i); });
+}
+
+task_scheduler::~task_scheduler ()
+{
+    stop();
+}
+
+task_scheduler::task_ptr
+task_scheduler::make_task (std::function<void()> fn)
+{
+    return std::make_shared<task>(std::move(fn));
+}
+
+void task_scheduler::submit (const task_ptr& t)
+{
+    if (--t->waiting_for_ == 0)
+        enqueue(t);
+}
+
+void task_scheduler::wait (const task_ptr& t)
+{
+    if (current_worker() < 0)
+    {
+        boost::unique_lock<boost::mutex> lock (t->lock_);
+        while (!t->done_)
+            t->done_cond_.wait(lock);
+
+        return;
+    }
+
+    // We're a worker ourselves; make ourselves useful while waiting.
+    while (!t->finished())
+    {
+        task_ptr other;
+        if (find_task(other))
+        {
+            run(other);
+        }
+        else
+        {
+            boost::unique_lock<boost::mutex> lock (t->lock_);
+            if (!t->done_)
+                t->done_cond_.wait_for(lock, boost::chrono::milliseconds(1));
+        }
+    }
+}
+
+void task_scheduler::notify ()
+{
+    {
+    boost::lock_guard<boost::mutex> lock (sleep_lock_);
+    }
+    wake_.notify_one();
+}
+
+void task_scheduler::stop ()
+{
+    {
+    boost::lock_guard<boost::mutex> lock (sleep_lock_);
+    stop_ = true;
+    }
+    wake_.notify_all();
+
+    for (auto& w : workers_)
+    {
+        if (w.joinable() && w.get_id() != boost::this_thread::get_id())
+            w.join();
+    }
+}
+
+//---------------------------------------------------------------------------
+
+void task_scheduler::worker (unsigned int id)
+{
+    this_worker.reset(new worker_id { this, static_cast<int>(id) });
+    trace("launched worker %1%", id);
+
+    while (!stop_)
+    {
+        task_ptr t;
+        if (find_task(t))
+        {
+            run(t);
+            continue;
+        }
+
+        if (on_idle_ && on_idle_())
+            continue;
+
+        boost::unique_lock<boost::mutex> lock (sleep_lock_);
+        if (!stop_ && queued_ == 0)
+            wake_.wait_for(lock, boost::chrono::milliseconds(50));
+    }
+
+    trace("stopped worker %1%", id);
+}
+
+void task_scheduler::enqueue (const task_ptr& t)
+{
+    int id (current_worker());
+    worker_queue& q (id < 0 ? shared_ : *queues_[id]);
+    {
+    boost::lock_guard<boost::mutex> lock (q.lock);
+    q.tasks.push_back(t);
+    }
+    ++queued_;
+
+    {
+    boost::lock_guard<boost::mutex> lock (sleep_lock_);
+    }
+    wake_.notify_one();
+}
+
+bool task_scheduler::find_task (task_ptr& t)
+{
+    if (queued_ == 0)
+        return false;
+
+    int id (current_worker());
+
+    // Our own work first, newest first...
+    if (id >= 0)
+    {
+        worker_queue& own (*queues_[id]);
+        boost::lock_guard<boost::mutex> lock (own.lock);
+        if (!own.tasks.empty())
+        {
+            t = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            --queued_;
+            return true;
+        }
+    }
+
+    // ... then whatever was submitted from outside the pool...
+    {
+    boost::lock_guard<boost::mutex> lock (shared_.lock);
+    if (!shared_.tasks.empty())
+    {
+        t = std::move(shared_.tasks.front());
+        shared_.tasks.pop_front();
+        --queued_;
+        return true;
+    }
+    }
+
+    // ... and finally, steal the oldest task from another worker.
+    const int count (queues_.size());
+    for (int i (1); i < count + 1; ++i)
+    {
+        int victim ((std::max(id, 0) + i) % count);
+        if (victim == id)
+            continue;
+
+        worker_queue& other (*queues_[victim]);
+        boost::lock_guard<boost::mutex> lock (other.lock);
+        if (!other.tasks.empty())
+        {
+            t = std::move(other.tasks.front());
+            other.tasks.pop_front();
+            --queued_;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void task_scheduler::run (const task_ptr& t)
+{
+    try
+    {
+        t->fn_();
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "Uncaught exception in task: " << e.what() << std::endl;
+    }
+    catch (...)
+    {
+        std::cerr << "Uncaught exception in task" << std::endl;
+    }
+
+    std::vector<task_ptr> next;
+    {
+    boost::lock_guard<boost::mutex> lock (t->lock_);
+    t->done_ = true;
+    t->fn_ = nullptr;
+    next.swap(t->successors_);
+    }
+    t->done_cond_.notify_all();
+
+    for (auto& s : next)
+    {
+        if (--s->waiting_for_ == 0)
+            enqueue(s);
+    }
+}
+
+int task_scheduler::current_worker () const
+{
+    auto w (this_worker.get());
+    return (w != nullptr && w->owner == this) ? w->index : -1;
+}
+
+} // namespace hexa
+
@@ -0,0 +1,155 @@
+//---------------------------------------------------------------------------
+/// \file   hexa/task_scheduler.hpp
+/// \brief  Work-stealing scheduler for tasks with dependencies.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/utility.hpp>
+
+namespace hexa {
+
+/** A pool of worker threads that run a graph of tasks.
+ *  Every worker has its own queue of tasks that are ready to run.  Tasks
+ *  that become ready on a worker thread are put in that worker's queue,
+ *  and are picked up again last-in-first-out, which keeps the data they
+ *  work on in the cache.  A worker that runs out of work steals the
+ *  oldest task from one of the others.
+ *
+ *  Tasks can depend on other tasks.  They are only queued once all of
+ *  their dependencies have finished:
+ * \code
+    task_scheduler pool;
+    auto a (task_scheduler::make_task([]{ ... }));
+    auto b (task_scheduler::make_task([]{ ... }));
+    b->depends_on(a);
+    pool.submit(b);
+    pool.submit(a);
+    pool.wait(b);
+ * \endcode */
+class task_scheduler : boost::noncopyable
+{
+public:
+    class task;
+    typedef std::shared_ptr<task> task_ptr;
+
+    /** A unit of work. */
+    class task : public std::enable_shared_from_this<task>, boost::noncopyable
+    {
+        friend class task_scheduler;
+
+    public:
+        task (std::function<void()> fn);
+
+        /** Don't start this task before \a other has finished.
+         *  This can only be called before the task is submitted.  If
+         *  \a other has already finished, this does nothing. */
+        void depends_on (const task_ptr& other);
+
+        /** Check if this task has been run. */
+        bool finished () const;
+
+    private:
+        std::function<void()>       fn_;
+
+        /** Number of unfinished dependencies, plus one until the task
+         ** is submitted. */
+        std::atomic<int>            waiting_for_;
+
+        mutable boost::mutex        lock_;
+        boost::condition_variable   done_cond_;
+        std::vector<task_ptr>       successors_;
+        bool                        done_;
+    };
+
+    /** Called by idle workers to find new work.
+     *  This function should return false if there's nothing to do. */
+    typedef std::function<bool()> idle_handler;
+
+public:
+    /** Start the worker threads.
+     * \param threads  The number of workers; zero means one per core
+     * \param on_idle  Optional source of new work */
+    task_scheduler (unsigned int threads = 0,
+                    idle_handler on_idle = idle_handler());
+
+    ~task_scheduler ();
+
+    static task_ptr make_task (std::function<void()> fn);
+
+    /** Queue a task; it will run as soon as all its dependencies have
+     ** finished. */
+    void submit (const task_ptr& t);
+
+    /** Block until a task has finished.
+     *  If this is called from one of the workers, the calling thread
+     *  will run other tasks while it is waiting. */
+    void wait (const task_ptr& t);
+
+    /** Wake up an idle worker, so it can call the idle handler
+     ** again. */
+    void notify ();
+
+    /** Stop all workers.  Tasks that haven't started yet are dropped. */
+    void stop ();
+
+    /** The number of worker threads. */
+    unsigned int size () const
+        { return workers_.size(); }
+
+private:
+    struct worker_queue
+    {
+        boost::mutex            lock;
+        std::deque<task_ptr>    tasks;
+    };
+
+    void        worker (unsigned int id);
+    void        enqueue (const task_ptr& t);
+    bool        find_task (task_ptr& t);
+    void        run (const task_ptr& t);
+
+    /** The index of the worker running on this thread, or -1 if this
+     ** isn't one of our workers. */
+    int         current_worker () const;
+
+private:
+    std::vector<std::unique_ptr<worker_queue>>  queues_;
+    worker_queue                                shared_;
+    std::vector<boost::thread>                  workers_;
+    idle_handler                                on_idle_;
+
+    std::atomic<int>            queued_;
+    std::atomic<bool>           stop_;
+    boost::mutex                sleep_lock_;
+    boost::condition_variable   wake_;
+};
+
+} // namespace hexa
+
@@ -0,0 +1,541 @@
+//---------------------------------------------------------------------------
+// write_behind.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "write_behind.hpp"
+
+#include <iostream>
+#include <boost/format.hpp>
+#include "trace.hpp"
+
+namespace hexa {
+
+namespace {
+
+double seconds (std::chrono::steady_clock::duration d)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count() * 1.0e-6;
+}
+
+/** compressed_data can only be moved; the queue hands out copies. */
+compressed_data copy_of (const compressed_data& in)
+{
+    compressed_data result;
+    result.buf = in.buf;
+    result.unpacked_len = in.unpacked_len;
+    result.method = in.method;
+    return result;
+}
+
+} // anonymous namespace
+
+void
+write_behind::queue::clear()
+{
+    for (auto& m : data)
+        m.clear();
+
+    heights.clear();
+    count = 0;
+    bytes = 0;
+}
+
+void
+write_behind::queue::merge_older (queue&& older)
+{
+    for (size_t type (0); type < data.size(); ++type)
+    {
+        for (auto& elem : older.data[type])
+        {
+            auto inserted (data[type].emplace(elem.first, std::move(elem.second)));
+            if (inserted.second)
+            {
+                ++count;
+                bytes += inserted.first->second.size();
+            }
+        }
+    }
+
+    for (auto& h : older.heights)
+    {
+        if (heights.emplace(h.first, h.second).second)
+        {
+            ++count;
+            bytes += sizeof(map_coordinates) + sizeof(chunk_height);
+        }
+    }
+
+    older.clear();
+}
+
+const compressed_data*
+write_behind::queue::find (data_type type, chunk_coordinates xyz) const
+{
+    if (static_cast<size_t>(type) >= data.size())
+        return nullptr;
+
+    auto& m (data[type]);
+    auto found (m.find(xyz));
+    return found == m.end() ? nullptr : &found->second;
+}
+
+//---------------------------------------------------------------------------
+
+write_behind::write_behind (persistent_storage_i& next, size_t max_bytes,
+                            std::chrono::milliseconds interval)
+    : next_         (next)
+    , max_bytes_    (max_bytes)
+    , interval_     (interval)
+    , hurry_        (false)
+    , stop_         (false)
+    , written_      (0)
+    , failures_     (0)
+    , coalesced_    (0)
+    , batches_      (0)
+    , stalls_       (0)
+    , stall_time_   (clock::duration::zero())
+    , last_batch_   (clock::duration::zero())
+{
+    thread_ = boost::thread([=]{ worker(); });
+}
+
+write_behind::~write_behind()
+{
+    {
+    boost::lock_guard<boost::mutex> lock (mutex_);
+    stop_ = true;
+    work_cond_.notify_one();
+    }
+    thread_.join();
+}
+
+//---------------------------------------------------------------------------
+
+void
+write_behind::store (data_type type, chunk_coordinates xyz,
+                     const compressed_data& data)
+{
+    boost::unique_lock<boost::mutex> lock (mutex_);
+    wait_for_room(lock);
+    enqueue(type, xyz, data);
+}
+
+void
+write_behind::store (data_type type, const batch& data)
+{
+    boost::unique_lock<boost::mutex> lock (mutex_);
+    wait_for_room(lock);
+    for (auto& elem : data)
+        enqueue(type, elem.first, elem.second);
+}
+
+void
+write_behind::store (map_coordinates xy, chunk_height data)
+{
+    boost::unique_lock<boost::mutex> lock (mutex_);
+    wait_for_room(lock);
+
+    if (pending_.empty())
+        pending_since_ = clock::now();
+
+    auto inserted (pending_.heights.emplace(xy, data));
+    if (inserted.second)
+    {
+        ++pending_.count;
+        pending_.bytes += sizeof(map_coordinates) + sizeof(chunk_height);
+    }
+    else
+    {
+        inserted.first->second = data;
+        ++coalesced_;
+    }
+}
+
+void
+write_behind::wait_for_room (boost::unique_lock<boost::mutex>& lock)
+{
+    if (pending_.bytes < max_bytes_ || stop_)
+        return;
+
+    ++stalls_;
+    auto start (clock::now());
+    hurry_ = true;
+    work_cond_.notify_one();
+    while (pending_.bytes >= max_bytes_ && !stop_)
+        room_cond_.wait(lock);
+
+    stall_time_ += clock::now() - start;
+}
+
+void
+write_behind::enqueue (data_type type, chunk_coordinates xyz,
+                       const compressed_data& data)
+{
+    if (static_cast<size_t>(type) >= pending_.data.size())
+        throw std::logic_error("write_behind: cannot store this data type");
+
+    if (pending_.empty())
+        pending_since_ = clock::now();
+
+    auto& m (pending_.data[type]);
+    auto found (m.find(xyz));
+    if (found == m.end())
+    {
+        found = m.emplace(xyz, copy_of(data)).first;
+        ++pending_.count;
+    }
+    else
+    {
+        pending_.bytes -= found->second.size();
+        found->second = copy_of(data);
+        ++coalesced_;
+    }
+    pending_.bytes += found->second.size();
+
+    if (pending_.bytes >= max_bytes_ / 2)
+        work_cond_.notify_one();
+}
+
+//---------------------------------------------------------------------------
+
+const compressed_data*
+write_behind::find (data_type type, chunk_coordinates xyz) const
+{
+    auto found (pending_.find(type, xyz));
+    return found ? found : writing_.find(type, xyz);
+}
+
+compressed_data
+write_behind::retrieve (data_type type, chunk_coordinates xyz)
+{
+    {
+    boost::lock_guard<boost::mutex> lock (mutex_);
+    auto found (find(type, xyz));
+    if (found)
+        return copy_of(*found);
+    }
+    // Anything that was in the queue and isn't anymore has been written
+    // by now.
+    return next_.retrieve(type, xyz);
+}
+
+chunk_height
+write_behind::retrieve (map_coordinates xy)
+{
+    {
+    boost::lock_guard<boost::mutex> lock (mutex_);
+    for (auto q : { &pending_, &writing_ })
+    {
+        auto found (q->heights.find(xy));
+        if (found != q->heights.end())
+            return found->second;
+    }
+    }
+    return next_.retrieve(xy);
+}
+
+persistent_storage_i::batch
+write_behind::retrieve (data_type type, const range<chunk_coordinates>& box)
+{
+    // Look in the queue first.  Whatever leaves the queue after this has
+    // been written by the time we read from the storage.
+    batch queued;
+    if (!box.empty())
+    {
+        boost::lock_guard<boost::mutex> lock (mutex_);
+        for (auto pos : box)
+        {
+            auto found (find(type, pos));
+            if (found)
+                queued.emplace_back(pos, copy_of(*found));
+        }
+    }
+
+    auto result (next_.retrieve(type, box));
+    if (queued.empty())
+        return result;
+
+    // The queued versions are newer than what's on disk.
+    std::unordered_map<chunk_coordinates, size_t> index;
+    for (size_t i (0); i < result.size(); ++i)
+        index[result[i].first] = i;
+
+    for (auto& elem : queued)
+    {
+        auto i (index.find(elem.first));
+        if (i == index.end())
+            result.emplace_back(std::move(elem));
+        else
+            result[i->second].second = std::move(elem.second);
+    }
+
+    return result;
+}
+
+persistent_storage_i::batch
+write_behind::retrieve (data_type type, const std::vector<chunk_coordinates>& xyz)
+{
+    // Get what we can from the queue, and only ask the storage for the
+    // rest.
+    batch result;
+    std::vector<chunk_coordinates> rest;
+    {
+    boost::lock_guard<boost::mutex> lock (mutex_);
+    for (auto& pos : xyz)
+    {
+        auto found (find(type, pos));
+        if (found)
+            result.emplace_back(pos, copy_of(*found));
+        else
+            rest.emplace_back(pos);
+    }
+    }
+
+    for (auto& elem : next_.retrieve(type, rest))
+        result.emplace_back(std::move(elem));
+
+    return result;
+}
+
+bool
+write_behind::is_available (data_type type, chunk_coordinates xyz)
+{
+    {
+    boost::lock_guard<boost::mutex> lock (mutex_);
+    if (find(type, xyz))
+        return true;
+    }
+    return next_.is_available(type, xyz);
+}
+
+bool
+write_behind::is_available (data_type type, map_coordinates xy)
+{
+    if (type == height)
+    {
+        boost::lock_guard<boost::mutex> lock (mutex_);
+        if (pending_.heights.count(xy) || writing_.heights.count(xy))
+            return true;
+    }
+    return next_.is_available(type, xy);
+}
+
+//---------------------------------------------------------------------------
+
+void
+write_behind::store (const entity_system& es)
+{
+    next_.store(es);
+}
+
+void
+write_behind::store (const entity_system& es, es::entity entity_id)
+{
+    next_.store(es, entity_id);
+}
+
+void
+write_behind::retrieve (entity_system& es)
+{
+    next_.retrieve(es);
+}
+
+void
+write_behind::retrieve (entity_system& es, es::entity entity_id)
+{
+    next_.retrieve(es, entity_id);
+}
+
+bool
+write_behind::is_available (es::entity entity_id)
+{
+    return next_.is_available(entity_id);
+}
+
+//---------------------------------------------------------------------------
+
+void
+write_behind::cleanup()
+{
+    boost::lock_guard<boost::mutex> lock (mutex_);
+    hurry_ = true;
+    work_cond_.notify_one();
+}
+
+void
+write_behind::flush()
+{
+    boost::unique_lock<boost::mutex> lock (mutex_);
+    hurry_ = true;
+    work_cond_.notify_one();
+    const size_t failures (failures_);
+    while ((!pending_.empty() || !writing_.empty()) && failures_ == failures)
+        done_cond_.wait(lock);
+}
+
+write_behind::statistics
+write_behind::stats() const
+{
+    boost::lock_guard<boost::mutex> lock (mutex_);
+
+    statistics result;
+    result.pending       = pending_.count + writing_.count;
+    result.pending_bytes = pending_.bytes + writing_.bytes;
+    result.written       = written_;
+    result.failures      = failures_;
+    result.coalesced     = coalesced_;
+    result.batches       = batches_;
+    result.stalls        = stalls_;
+    result.stall_time    = seconds(stall_time_);
+    result.last_batch    = seconds(last_batch_);
+
+    if (!writing_.empty())
+        result.lag = seconds(clock::now() - writing_since_);
+    else if (!pending_.empty())
+        result.lag = seconds(clock::now() - pending_since_);
+    else
+        result.lag = 0;
+
+    return result;
+}
+
+//---------------------------------------------------------------------------
+
+void
+write_behind::worker()
+{
+    boost::unique_lock<boost::mutex> lock (mutex_);
+
+    for (;;)
+    {
+        // Wait until the oldest element has been in the queue long
+        // enough, unless someone is in a hurry.
+        while (!stop_ && !hurry_
+               && (pending_.empty() || clock::now() - pending_since_ < interval_)
+               && pending_.bytes < max_bytes_ / 2)
+        {
+            work_cond_.wait_for(lock, boost::chrono::milliseconds(
+                std::chrono::duration_cast<std::chrono::milliseconds>(interval_).count()));
+        }
+
+        hurry_ = false;
+
+        if (pending_.empty())
+        {
+            done_cond_.notify_all();
+            if (stop_)
+                return;
+
+            continue;
+        }
+
+        std::swap(pending_, writing_);
+        writing_since_ = pending_since_;
+        room_cond_.notify_all();
+
+        lock.unlock();
+        bool failed (false);
+        auto start (clock::now());
+        try
+        {
+            write(writing_);
+        }
+        catch (std::exception& e)
+        {
+            std::cerr << "write_behind: cannot write to storage: " << e.what() << std::endl;
+            failed = true;
+        }
+        auto elapsed (clock::now() - start);
+        lock.lock();
+
+        last_batch_ = elapsed;
+        if (!failed)
+        {
+            written_ += writing_.count;
+            ++batches_;
+            trace("write_behind: %1% elements in %2% s", writing_.count, seconds(elapsed));
+        }
+        else if (!stop_)
+        {
+            // Put the batch back so it is written on the next pass.
+            // Anything that was stored in the meantime is newer, and
+            // stays.
+            ++failures_;
+            pending_.merge_older(std::move(writing_));
+            pending_since_ = writing_since_;
+        }
+        else
+        {
+            ++failures_;
+            std::cerr << "write_behind: " << writing_.count
+                      << " elements were lost" << std::endl;
+        }
+
+        writing_.clear();
+        done_cond_.notify_all();
+
+        // Give the storage a moment before trying again.
+        if (failed && !stop_)
+        {
+            work_cond_.wait_for(lock, boost::chrono::milliseconds(
+                std::chrono::duration_cast<std::chrono::milliseconds>(interval_).count()));
+        }
+    }
+}
+
+void
+write_behind::write (queue& q)
+{
+    for (size_t type (0); type < q.data.size(); ++type)
+    {
+        if (q.data[type].empty())
+            continue;
+
+        // Readers can still look at the queue while this is written.
+        batch out;
+        out.reserve(q.data[type].size());
+        for (auto& elem : q.data[type])
+            out.emplace_back(elem.first, copy_of(elem.second));
+
+        next_.store(static_cast<data_type>(type), out);
+    }
+
+    for (auto& h : q.heights)
+        next_.store(h.first, h.second);
+
+    // Commit everything in one go.
+    next_.cleanup();
+}
+
+//---------------------------------------------------------------------------
+
+std::ostream& operator<< (std::ostream& str, const write_behind::statistics& s)
+{
+    return str << boost::format("write queue: %1% elements (%2% KiB), lag %3$.2f s; "
+                                "%4% written in %5% batches, %6% coalesced, %7% failed; "
+                                "%8% stalls (%9$.2f s), last batch %10$.2f s")
+                  % s.pending % (s.pending_bytes / 1024) % s.lag
+                  % s.written % s.batches % s.coalesced % s.failures
+                  % s.stalls % s.stall_time % s.last_batch
+               << std::endl;
+}
+
+} // namespace hexa
+
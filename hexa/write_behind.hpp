@@ -0,0 +1,177 @@
+//---------------------------------------------------------------------------
+/// \file   hexa/write_behind.hpp
+/// \brief  Persistent storage decorator that writes in the background.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <iosfwd>
+#include <unordered_map>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/utility.hpp>
+#include "persistent_storage_i.hpp"
+
+namespace hexa {
+
+/** Sits in front of a persistent storage, and writes to it from a
+ ** background thread.
+ *  Everything that is stored goes into a queue first.  If the same
+ *  element is stored several times before it is written, only the last
+ *  version is kept.  The background thread takes everything that is in
+ *  the queue, writes it as one batch, and commits it in one transaction.
+ *  Reads see the queued data, so the delay is invisible to the rest of
+ *  the program.
+ *
+ *  If a batch cannot be written, it goes back into the queue and is
+ *  tried again later.
+ *
+ *  The queue has a maximum size.  If it is full, store() blocks until
+ *  the background thread has caught up. */
+class write_behind : public persistent_storage_i, boost::noncopyable
+{
+public:
+    /** How far the writes are lagging behind. */
+    struct statistics
+    {
+        size_t  pending;        /**< Elements waiting to be written */
+        size_t  pending_bytes;  /**< Size of the waiting elements */
+        size_t  written;        /**< Elements written so far */
+        size_t  failures;       /**< Batches that could not be written */
+        size_t  coalesced;      /**< Writes that replaced a waiting one */
+        size_t  batches;        /**< Number of transactions */
+        size_t  stalls;         /**< Times store() had to wait for room */
+        double  stall_time;     /**< Time spent waiting in store(), in seconds */
+        double  lag;            /**< Age of the oldest waiting element, in seconds */
+        double  last_batch;     /**< Time taken by the last transaction, in seconds */
+    };
+
+public:
+    /** Start the background thread.
+     * \param next       The storage that is written to
+     * \param max_bytes  The maximum size of the queue
+     * \param interval   How long data can sit in the queue before it is
+     *                   written */
+    write_behind (persistent_storage_i& next,
+                  size_t max_bytes = 64 << 20,
+                  std::chrono::milliseconds interval = std::chrono::milliseconds(500));
+
+    /** Write everything that is still queued, and stop the thread. */
+    ~write_behind();
+
+    void store (data_type type, chunk_coordinates xyz, const compressed_data& data);
+    void store (map_coordinates xy, chunk_height data);
+    void store (data_type type, const batch& data);
+
+    compressed_data retrieve (data_type type, chunk_coordinates xyz);
+    chunk_height    retrieve (map_coordinates xy);
+    batch           retrieve (data_type type, const range<chunk_coordinates>& box);
+    batch           retrieve (data_type type, const std::vector<chunk_coordinates>& xyz);
+
+    bool is_available (data_type type, chunk_coordinates xyz);
+    bool is_available (data_type type, map_coordinates xy);
+
+    void store (const entity_system& es);
+    void store (const entity_system& es, es::entity entity_id);
+    void retrieve (entity_system& es);
+    void retrieve (entity_system& es, es::entity entity_id);
+    bool is_available (es::entity entity_id);
+
+    /** Wake up the background thread, so it writes everything that is
+     ** queued right away.  This doesn't wait for it to finish. */
+    void cleanup();
+
+    /** Block until everything that was queued so far is written and
+     ** committed, or until a write fails. */
+    void flush();
+
+    statistics stats() const;
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct queue
+    {
+        std::array<std::unordered_map<chunk_coordinates, compressed_data>, 4> data;
+        std::unordered_map<map_coordinates, chunk_height>  heights;
+        size_t  count;
+        size_t  bytes;
+
+        queue() : count (0), bytes (0) { }
+
+        bool empty() const { return count == 0; }
+        void clear();
+        /** Take over the elements of an older queue, except for the
+         ** ones this queue already has a newer version of. */
+        void merge_older (queue&& older);
+
+        const compressed_data* find (data_type type, chunk_coordinates xyz) const;
+    };
+
+    void    worker ();
+    void    write (queue& q);
+
+    /** Wait until there's room in the queue.
+     * \pre mutex_ is locked by \a lock */
+    void    wait_for_room (boost::unique_lock<boost::mutex>& lock);
+    void    enqueue (data_type type, chunk_coordinates xyz, const compressed_data& data);
+
+    /** Look for an element that hasn't been written yet.
+     * \pre mutex_ is locked */
+    const compressed_data* find (data_type type, chunk_coordinates xyz) const;
+
+private:
+    persistent_storage_i&       next_;
+    const size_t                max_bytes_;
+    const clock::duration       interval_;
+
+    mutable boost::mutex        mutex_;
+    boost::condition_variable   work_cond_;
+    boost::condition_variable   room_cond_;
+    boost::condition_variable   done_cond_;
+
+    /** Elements that are waiting. */
+    queue                       pending_;
+    /** Elements that are being written right now. */
+    queue                       writing_;
+    clock::time_point           pending_since_;
+    clock::time_point           writing_since_;
+    bool                        hurry_;
+    bool                        stop_;
+
+    size_t                      written_;
+    size_t                      failures_;
+    size_t                      coalesced_;
+    size_t                      batches_;
+    size_t                      stalls_;
+    clock::duration             stall_time_;
+    clock::duration             last_batch_;
+
+    boost::thread               thread_;
+};
+
+/** Print the write-behind statistics on a single line. */
+std::ostream& operator<< (std::ostream& str, const write_behind::statistics& s);
+
+} // namespace hexa
+
@@ -2,9 +2,13 @@
 #define BOOST_TEST_MODULE hexahedra_core test
 #include <boost/test/unit_test.hpp>
 
+#include <atomic>
 #include <chrono>
+#include <fstream>
+#include <map>
 #include <random>
 #include <set>
+#include <sstream>
 #include <thread>
 #include <boost/range/algorithm.hpp>
 #include <boost/filesystem/operations.hpp>
@@ -12,25 +16,36 @@
 #include <hexa/aabb.hpp>
 #include <hexa/algorithm.hpp>
 #include <hexa/chunk.hpp>
+#include <hexa/clock_cache.hpp>
 #include <hexa/collision.hpp>
 #include <hexa/compression.hpp>
 #include <hexa/concurrent_queue.hpp>
 #include <hexa/geometric.hpp>
+#include <hexa/lamp_index.hpp>
+#include <hexa/light_volume.hpp>
 #include <hexa/lru_cache.hpp>
+#include <hexa/dense_neighborhood.hpp>
 #include <hexa/memory_cache.hpp>
 #include <hexa/neighborhood.hpp>
+#include <hexa/palette_chunk.hpp>
+#include <hexa/persistence_regions.hpp>
 #include <hexa/persistence_sqlite.hpp>
 #include <hexa/persistence_null.hpp>
+#include <hexa/packet_buffer.hpp>
 #include <hexa/protocol.hpp>
 #include <hexa/quaternion.hpp>
 #include <hexa/ray.hpp>
 #include <hexa/ray_bundle.hpp>
 #include <hexa/serialize.hpp>
+#include <hexa/sharded_cache.hpp>
 #include <hexa/surface.hpp>
+#include <hexa/surface_patch.hpp>
+#include <hexa/task_scheduler.hpp>
 #include <hexa/vector3.hpp>
 #include <hexa/voxel_algorithm.hpp>
 #include <hexa/voxel_range.hpp>
 #include <hexa/wfpos.hpp>
+#include <hexa/write_behind.hpp>
 
 using namespace hexa;
 
@@ -60,6 +75,66 @@ BOOST_AUTO_TEST_CASE (serialize_test)
     BOOST_CHECK_EQUAL(d, e);
 }
 
+BOOST_AUTO_TEST_CASE (serialize_flat_test)
+{
+    static_assert(flat_layout<vector>::value, "vector3<float> is flat");
+    static_assert(flat_layout<light>::value, "light is flat");
+    static_assert(!flat_layout<block_vector>::value, "block_vector is packed");
+
+    // Arrays of flat types are copied in one go, but the result has to
+    // be the same as writing them one field at a time.
+    std::vector<msg::entity_update_physics::value> updates;
+    for (uint32_t i (0); i < 100; ++i)
+    {
+        updates.emplace_back(i, wfpos(world_coordinates(i, i * 1000, 7), vector(0.5f, i, -1.f)),
+                             vector(i * 0.25f, 2.f, 3.f));
+    }
+
+    binary_data expected;
+    auto by_field (make_serializer(expected));
+    by_field(uint16_t(updates.size()));
+    for (auto& u : updates)
+    {
+        by_field(u.entity_id)(u.pos.pos.x)(u.pos.pos.y)(u.pos.pos.z)
+                (u.pos.frac.x)(u.pos.frac.y)(u.pos.frac.z)
+                (u.velocity.x)(u.velocity.y)(u.velocity.z);
+    }
+
+    auto buf (serialize(updates));
+    BOOST_CHECK(buf == expected);
+
+    auto copy (deserialize_as<std::vector<msg::entity_update_physics::value>>(buf));
+    BOOST_REQUIRE_EQUAL(copy.size(), updates.size());
+    for (size_t i (0); i < copy.size(); ++i)
+    {
+        BOOST_CHECK_EQUAL(copy[i].entity_id, updates[i].entity_id);
+        BOOST_CHECK_EQUAL(copy[i].pos.pos, updates[i].pos.pos);
+        BOOST_CHECK_EQUAL(copy[i].pos.frac, updates[i].pos.frac);
+        BOOST_CHECK_EQUAL(copy[i].velocity, updates[i].velocity);
+    }
+
+    std::vector<light> lights { light(1, 2, 3), light(15, 0, 7) };
+    binary_data expected_light;
+    make_serializer(expected_light)(uint16_t(2))(lights[0])(lights[1]);
+    BOOST_CHECK(serialize(lights) == expected_light);
+
+    auto light_copy (deserialize_as<std::vector<light>>(expected_light));
+    BOOST_REQUIRE_EQUAL(light_copy.size(), 2);
+    BOOST_CHECK_EQUAL(light_copy[1].sunlight, 15);
+    BOOST_CHECK_EQUAL(light_copy[1].artificial, 7);
+
+    // Chunk offsets are still packed one at a time.
+    std::vector<block_vector> offsets { block_vector(1, 2, 3), block_vector(4, 5, 6) };
+    auto offsets_buf (serialize(offsets));
+    BOOST_CHECK_EQUAL(offsets_buf.size(), 6);
+    BOOST_CHECK(deserialize_as<std::vector<block_vector>>(offsets_buf) == offsets);
+
+    // Running out of data is noticed.
+    buf.resize(buf.size() - 1);
+    BOOST_CHECK_THROW(deserialize_as<std::vector<msg::entity_update_physics::value>>(buf),
+                      std::runtime_error);
+}
+
 BOOST_AUTO_TEST_CASE (vector2_test)
 {
     vector2<int> first (1, 2);
@@ -279,6 +354,680 @@ BOOST_AUTO_TEST_CASE (lrucache_test)
     BOOST_CHECK(cache.empty());
 }
 
+BOOST_AUTO_TEST_CASE (clockcache_test)
+{
+    clock_cache<int, std::string> cache;
+
+    cache[1] = "one";
+    cache[8] = "eight";
+    cache[5] = "five";
+
+    BOOST_CHECK_EQUAL(cache.size(), 3);
+    BOOST_CHECK_EQUAL(cache.count(2), 0);
+    BOOST_CHECK_EQUAL(cache.count(5), 1);
+    BOOST_CHECK_EQUAL(cache.get(1), "one");
+    BOOST_CHECK_EQUAL(*cache.try_get(8), "eight");
+    BOOST_CHECK_THROW(cache.get(2), std::runtime_error);
+
+    // The first sweep clears all the reference flags, and takes '1'.
+    cache.prune(2);
+    BOOST_CHECK_EQUAL(cache.size(), 2);
+    BOOST_CHECK_EQUAL(cache.count(1), 0);
+
+    // '8' was used since the last sweep, so '5' goes first.
+    cache.touch(8);
+    std::vector<int> keys;
+    cache.prune(1, [&](int k, std::string& v){ keys.push_back(k); });
+    BOOST_CHECK_EQUAL(keys.size(), 1);
+    BOOST_CHECK_EQUAL(keys[0], 5);
+    BOOST_CHECK_EQUAL(cache.get(8), "eight");
+
+    // Compare against std::map under random inserts and removals, to
+    // exercise growing and the backward shift deletion.
+    std::mt19937 rng (1);
+    std::map<int, int> reference;
+    clock_cache<int, int> numbers;
+    for (int i (0); i < 20000; ++i)
+    {
+        int k (rng() % 2000);
+        if (rng() % 3 == 0)
+        {
+            numbers.remove(k);
+            reference.erase(k);
+        }
+        else
+        {
+            numbers[k] = i;
+            reference[k] = i;
+        }
+    }
+    BOOST_CHECK_EQUAL(numbers.size(), reference.size());
+    for (auto& p : reference)
+        BOOST_CHECK_EQUAL(numbers.get(p.first), p.second);
+
+    size_t visited (0);
+    numbers.for_each([&](int k, int v){ ++visited; BOOST_CHECK_EQUAL(reference[k], v); });
+    BOOST_CHECK_EQUAL(visited, reference.size());
+
+    numbers.prune(100);
+    BOOST_CHECK_EQUAL(numbers.size(), 100);
+    numbers.for_each([&](int k, int v){ BOOST_CHECK_EQUAL(reference[k], v); });
+
+    numbers.clear();
+    BOOST_CHECK(numbers.empty());
+    BOOST_CHECK_EQUAL(numbers.count(reference.begin()->first), 0);
+}
+
+BOOST_AUTO_TEST_CASE (shardedcache_test)
+{
+    typedef std::shared_ptr<std::string> str_ptr;
+    sharded_cache<int, str_ptr, 4> cache (nullptr, [](const str_ptr& p)
+    {
+        return p->size();
+    });
+    std::atomic<int> loads (0);
+
+    auto slow_load ([&]
+    {
+        ++loads;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        return std::make_shared<std::string>("loaded");
+    });
+
+    // Threads that ask for the same key share a single load.
+    std::vector<std::thread> readers;
+    std::vector<str_ptr> results (8);
+    for (int i (0); i < 8; ++i)
+        readers.emplace_back([&, i]{ results[i] = cache.get(42, slow_load); });
+
+    for (auto& t : readers)
+        t.join();
+
+    BOOST_CHECK_EQUAL(int(loads), 1);
+    for (auto& r : results)
+        BOOST_CHECK_EQUAL(r, results[0]);
+
+    // 'Not found' isn't cached.
+    BOOST_CHECK(cache.get(1, []{ return str_ptr(); }) == nullptr);
+    BOOST_CHECK(!cache.contains(1));
+    BOOST_CHECK(cache.contains(42));
+    BOOST_CHECK(!cache.is_dirty(42));
+
+    // Stored values are written back once, and survive a prune until
+    // they've been written.
+    for (int i (0); i < 100; ++i)
+        cache.store(i, std::make_shared<std::string>(std::to_string(i)));
+
+    BOOST_CHECK(cache.is_dirty(5));
+    BOOST_CHECK_EQUAL(*cache.peek(5), "5");
+
+    size_t full (cache.bytes());
+    BOOST_CHECK_EQUAL(cache.size(), 100);
+
+    std::map<int, std::string> written;
+    int batches (0);
+    cache.flush(full / 2, [&](const std::vector<std::pair<int, str_ptr>>& b)
+    {
+        ++batches;
+        for (auto& p : b)
+        {
+            BOOST_CHECK(cache.contains(p.first));
+            written[p.first] = *p.second;
+        }
+    });
+    BOOST_CHECK_EQUAL(batches, 1);
+    BOOST_CHECK_EQUAL(written.size(), 100);
+    BOOST_CHECK_EQUAL(written[99], "99");
+    BOOST_CHECK(cache.bytes() <= full / 2);
+    BOOST_CHECK(cache.size() < 100);
+    BOOST_CHECK(!cache.is_dirty(5));
+
+    auto st (cache.stats());
+    BOOST_CHECK_EQUAL(st.entries, cache.size());
+    BOOST_CHECK_EQUAL(st.evictions, 100 - cache.size());
+    BOOST_CHECK_EQUAL(st.hits + st.misses, 9);
+    BOOST_CHECK(st.misses >= 2);
+
+    cache.flush(full, [&](const std::vector<std::pair<int, str_ptr>>&){ ++batches; });
+    BOOST_CHECK_EQUAL(batches, 1);
+
+    // Prefetched values don't replace anything that's already there.
+    BOOST_CHECK(!cache.insert_if_missing(99, std::make_shared<std::string>("stale")));
+    BOOST_CHECK(cache.insert_if_missing(2000, std::make_shared<std::string>("new")));
+    BOOST_CHECK(!cache.is_dirty(2000));
+
+    // Replacing a value updates the memory use.
+    cache.store(1000, std::make_shared<std::string>("abcde"));
+    size_t before (cache.bytes());
+    cache.store(1000, std::make_shared<std::string>("abcdefghi"));
+    BOOST_CHECK_EQUAL(cache.bytes() - before, 4);
+
+    // A dirty flag is only cleared for the value that was written.
+    auto old (std::make_shared<std::string>("old"));
+    cache.store(7, old);
+    cache.store(7, std::make_shared<std::string>("new"));
+    cache.mark_clean(7, old);
+    BOOST_CHECK(cache.is_dirty(7));
+    cache.mark_clean(7, cache.peek(7));
+    BOOST_CHECK(!cache.is_dirty(7));
+
+    // Values that are still held somewhere else are never evicted.
+    auto held (cache.peek(2000));
+    cache.flush(0, [](const std::vector<std::pair<int, str_ptr>>&){ });
+    BOOST_CHECK_EQUAL(cache.size(), 1);
+    BOOST_CHECK_EQUAL(cache.peek(2000), held);
+}
+
+BOOST_AUTO_TEST_CASE (memorycache_budget_test)
+{
+    persistence_null db;
+    memory_cache cache (db, 1 << 20);
+
+    chunk_coordinates pos (world_chunk_center);
+    for (int i (0); i < 100; ++i)
+    {
+        cache.store(pos + chunk_coordinates(i, 0, 0), std::make_shared<chunk>());
+        cache.store(pos + chunk_coordinates(i, 0, 0),
+                    std::make_shared<surface_data>(surface(1000), surface()));
+    }
+
+    auto before (cache.stats());
+    BOOST_CHECK_EQUAL(before.types[persistent_storage_i::chunk].entries, 100);
+    BOOST_CHECK(before.types[persistent_storage_i::chunk].bytes >= 100 * chunk_volume * sizeof(block));
+    BOOST_CHECK(before.total.bytes > cache.budget());
+
+    // Chunks get three times the room of surfaces.
+    BOOST_CHECK_THROW(set_cache_weights(cache, "chunk=x"), std::runtime_error);
+    BOOST_CHECK_THROW(set_cache_weights(cache, "foo=1"), std::runtime_error);
+    set_cache_weights(cache, "chunk=3, surface=1");
+    BOOST_CHECK_EQUAL(cache.weight(persistent_storage_i::chunk), 3.0);
+
+    cache.cleanup();
+
+    auto after (cache.stats());
+    BOOST_CHECK(after.total.bytes <= cache.budget());
+    BOOST_CHECK(after.types[persistent_storage_i::chunk].bytes
+                > 2 * after.types[persistent_storage_i::surface].bytes);
+    BOOST_CHECK(after.types[persistent_storage_i::chunk].entries < 100);
+
+    std::ostringstream str;
+    str << after;
+    BOOST_CHECK(str.str().find("chunk") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE (palettechunk_test)
+{
+    chunk cnk;
+    cnk(1, 2, 3) = block(12);
+    cnk.last_used = 42;
+
+    palette_chunk packed (cnk);
+    BOOST_CHECK_EQUAL(packed.width(), 1);
+    BOOST_CHECK_EQUAL(packed.palette_size(), 2);
+    BOOST_CHECK_EQUAL(packed(1, 2, 3).type, 12);
+    BOOST_CHECK_EQUAL(packed(3, 2, 1).type, 0);
+    BOOST_CHECK(packed.bytes() * 8 < chunk_volume * sizeof(block));
+
+    auto back (packed.unpack());
+    BOOST_CHECK(*back == cnk);
+    BOOST_CHECK_EQUAL(back->last_used, 42);
+
+    // The indices get wider as the palette grows.
+    packed.set(0, 0, 0, block(5));
+    BOOST_CHECK_EQUAL(packed.width(), 2);
+    for (int i (0); i < 20; ++i)
+        packed.set(i % 16, 15, i / 16, block(100 + i));
+
+    BOOST_CHECK_EQUAL(packed.width(), 8);
+    BOOST_CHECK_EQUAL(packed(0, 0, 0).type, 5);
+    BOOST_CHECK_EQUAL(packed(1, 2, 3).type, 12);
+    BOOST_CHECK_EQUAL(packed(19 % 16, 15, 1).type, 119);
+
+    // More than 256 materials switches to the dense layout.
+    chunk many;
+    for (size_t i (0); i < chunk_volume; ++i)
+        many[i] = block(i % 300);
+
+    palette_chunk dense (many);
+    BOOST_CHECK(dense.is_dense());
+    BOOST_CHECK(*dense.unpack() == many);
+
+    palette_chunk grown;
+    for (int i (0); i < 300; ++i)
+        grown.set(i % 16, (i / 16) % 16, i / 256, block(i + 1));
+
+    BOOST_CHECK(grown.is_dense());
+    BOOST_CHECK_EQUAL(grown(299 % 16, (299 / 16) % 16, 1).type, 300);
+    BOOST_CHECK_EQUAL(grown(15, 15, 15).type, 0);
+}
+
+BOOST_AUTO_TEST_CASE (uniform_chunk_test)
+{
+    register_new_material(0).transparency = 255;
+    register_new_material(1).is_solid = true;
+
+    chunk rock;
+    rock.clear(block(1));
+    rock.last_used = 42;
+    rock.generation_phase = 3;
+    BOOST_CHECK(rock.is_uniform());
+
+    // A uniform chunk only stores its material.
+    auto buf (serialize(rock));
+    BOOST_CHECK(buf.size() < 16);
+
+    auto back (deserialize_as<chunk>(buf));
+    BOOST_CHECK(back == rock);
+    BOOST_CHECK_EQUAL(back.last_used, 42);
+    BOOST_CHECK_EQUAL(back.generation_phase, 3);
+
+    // Anything else still stores every block.
+    chunk mixed;
+    mixed(1, 2, 3) = block(1);
+    BOOST_CHECK(!mixed.is_uniform());
+    auto buf2 (serialize(mixed));
+    BOOST_CHECK(buf2.size() > chunk_volume * sizeof(block));
+    BOOST_CHECK(deserialize_as<chunk>(buf2) == mixed);
+
+    palette_chunk packed (rock);
+    BOOST_CHECK(packed.is_uniform());
+    BOOST_CHECK_EQUAL(packed(5, 6, 7).type, 1);
+    BOOST_CHECK(*packed.unpack() == rock);
+    packed.set(5, 6, 7, block(0));
+    BOOST_CHECK_EQUAL(packed.width(), 1);
+    BOOST_CHECK_EQUAL(packed(5, 6, 7).type, 0);
+    BOOST_CHECK_EQUAL(packed(5, 6, 8).type, 1);
+
+    // A chunk of rock surrounded by rock has no surface.  With air on
+    // one side, only that side is visible.
+    persistence_null db;
+    memory_cache cache (db);
+    auto rock_ptr (std::make_shared<chunk>());
+    rock_ptr->clear(block(1));
+    auto air_ptr (std::make_shared<chunk>());
+
+    neighborhood<chunk_ptr> buried (cache, world_chunk_center);
+    buried.add(block_vector(0, 0, 0), rock_ptr);
+    for (int dir (0); dir < 6; ++dir)
+        buried.add(dir_vector[dir], rock_ptr);
+
+    BOOST_CHECK(extract_opaque_surface(buried).empty());
+    BOOST_CHECK(extract_transparent_surface(buried).empty());
+
+    neighborhood<chunk_ptr> open (cache, world_chunk_center);
+    open.add(block_vector(0, 0, 0), rock_ptr);
+    for (int dir (0); dir < 6; ++dir)
+        open.add(dir_vector[dir], dir == dir_up ? air_ptr : rock_ptr);
+
+    auto top (extract_opaque_surface(open));
+    BOOST_CHECK_EQUAL(top.size(), chunk_area);
+    BOOST_CHECK_EQUAL(count_faces(top), chunk_area);
+
+    // The same surface as a chunk that isn't uniform.
+    auto almost (std::make_shared<chunk>());
+    almost->clear(block(1));
+    (*almost)(4, 4, 4) = block(2);
+    register_new_material(2).is_solid = true;
+    open.add(block_vector(0, 0, 0), almost);
+    BOOST_CHECK(extract_opaque_surface(open) == top);
+}
+
+template <template <size_t> class layout>
+void check_layout ()
+{
+    chunk_base<block, chunk_size, layout> cnk;
+    std::vector<bool> seen (chunk_volume, false);
+    for (chunk_index i : every_block_in_chunk)
+    {
+        size_t idx (cnk.pos_to_index(i));
+        BOOST_REQUIRE(idx < chunk_volume);
+        BOOST_CHECK(!seen[idx]);
+        seen[idx] = true;
+        BOOST_CHECK_EQUAL(cnk.index_to_pos(idx), i);
+
+        cnk[i] = block(i.x + i.y * 16 + i.z * 256);
+    }
+
+    for (auto it (cnk.begin()); it != cnk.end(); ++it)
+    {
+        chunk_index i (cnk.index_to_pos(it));
+        BOOST_CHECK_EQUAL(it->type, i.x + i.y * 16 + i.z * 256);
+    }
+}
+
+BOOST_AUTO_TEST_CASE (chunk_layout_test)
+{
+    check_layout<linear_layout>();
+    check_layout<morton_layout>();
+    check_layout<brick_layout>();
+
+    // The two neighbors along the Z axis are in the same brick.
+    chunk_base<block, chunk_size, brick_layout> bricks;
+    BOOST_CHECK_EQUAL(bricks.pos_to_index(chunk_index(5, 6, 9))
+                      - bricks.pos_to_index(chunk_index(5, 6, 8)), 16);
+    BOOST_CHECK_EQUAL(morton_layout<16>::index(15, 15, 15), chunk_volume - 1);
+}
+
+// The straightforward versions of the surface extraction functions.
+surface reference_opaque_surface (const neighborhood<chunk_ptr>& terrain)
+{
+    surface result;
+    for (chunk_index i : every_block_in_chunk)
+    {
+        uint16_t type ((*terrain.center())[i].type);
+        if (type == type::air)
+            continue;
+
+        if (material_prop[type].is_custom_block())
+        {
+            result.emplace_back(i, 0x3f, type);
+        }
+        else if (!type::is_transparent(type))
+        {
+            uint8_t dirs (0);
+            for (uint8_t dir (0); dir < 6; ++dir)
+            {
+                if (!type::is_visually_solid(terrain[i + dir_vector[dir]].type))
+                    dirs += (1 << dir);
+            }
+            if (dirs != 0)
+                result.emplace_back(i, dirs, type);
+        }
+    }
+    return result;
+}
+
+surface reference_transparent_surface (const neighborhood<chunk_ptr>& terrain)
+{
+    surface result;
+    for (chunk_index i : every_block_in_chunk)
+    {
+        uint16_t type ((*terrain.center())[i].type);
+        const auto& m (material_prop[type]);
+        if (type == type::air || !m.is_transparent() || m.is_custom_block())
+            continue;
+
+        uint8_t dirs (0);
+        for (uint8_t dir (0); dir < 6; ++dir)
+        {
+            uint16_t other_type (terrain[i + dir_vector[dir]].type);
+            if (   type != other_type
+                && !type::is_visually_solid(other_type)
+                && m.textures[dir] != material_prop[other_type].textures[dir^1])
+            {
+                dirs += (1 << dir);
+            }
+        }
+        if (dirs != 0)
+            result.emplace_back(i, dirs, type);
+    }
+    return result;
+}
+
+void check_same_surface (const surface& a, const surface& b)
+{
+    BOOST_REQUIRE_EQUAL(a.size(), b.size());
+    for (size_t i (0); i < a.size(); ++i)
+    {
+        BOOST_CHECK_EQUAL(a[i].pos, b[i].pos);
+        BOOST_CHECK_EQUAL((int)a[i].dirs, (int)b[i].dirs);
+        BOOST_CHECK_EQUAL(a[i].type, b[i].type);
+    }
+}
+
+BOOST_AUTO_TEST_CASE (surface_kernel_test)
+{
+    register_new_material(0).transparency = 255;
+    register_new_material(10).is_solid = true;
+    register_new_material(11).is_solid = true;
+    material& water (register_new_material(12));
+    water.transparency = 100;
+    boost::range::fill(water.textures, 5);
+    material& glass (register_new_material(13));
+    glass.transparency = 200;
+    boost::range::fill(glass.textures, 6);
+    glass.textures[dir_up] = 7;
+    register_new_material(14).model.resize(1);
+
+    persistence_null db;
+    memory_cache cache (db);
+    std::mt19937 rng (12);
+    std::discrete_distribution<int> pick { 40, 20, 20, 8, 6, 6 };
+    const uint16_t materials[] = { 0, 10, 11, 12, 13, 14 };
+
+    for (int round (0); round < 5; ++round)
+    {
+        neighborhood<chunk_ptr> nbh (cache, world_chunk_center);
+        for (int z (-1); z <= 1; ++z)
+        {
+            for (int y (-1); y <= 1; ++y)
+            {
+                for (int x (-1); x <= 1; ++x)
+                {
+                    auto cnk (std::make_shared<chunk>());
+                    for (auto& b : *cnk)
+                        b = block(materials[pick(rng)]);
+
+                    nbh.add(block_vector(x, y, z), cnk);
+                }
+            }
+        }
+
+        check_same_surface(extract_opaque_surface(nbh),
+                           reference_opaque_surface(nbh));
+        check_same_surface(extract_transparent_surface(nbh),
+                           reference_transparent_surface(nbh));
+    }
+}
+
+/** Give every face a light value that tells where it came from. */
+lightmap light_by_position (const surface& s)
+{
+    lightmap result;
+    for (auto& f : s)
+    {
+        for (uint8_t dir (0); dir < 6; ++dir)
+        {
+            if (f[dir])
+                result.push_back(light(f.pos.x, f.pos.y, dir));
+        }
+    }
+    return result;
+}
+
+BOOST_AUTO_TEST_CASE (surface_patch_test)
+{
+    register_new_material(0).transparency = 255;
+    register_new_material(10).is_solid = true;
+
+    persistence_null db;
+    memory_cache cache (db);
+    std::mt19937 rng (15);
+    std::bernoulli_distribution solid (0.5);
+
+    neighborhood<chunk_ptr> nbh (cache, world_chunk_center);
+    auto center (std::make_shared<chunk>());
+    for (int z (-1); z <= 1; ++z)
+    {
+        for (int y (-1); y <= 1; ++y)
+        {
+            for (int x (-1); x <= 1; ++x)
+            {
+                auto cnk (x == 0 && y == 0 && z == 0 ? center : std::make_shared<chunk>());
+                for (auto& b : *cnk)
+                    b = block(solid(rng) ? 10 : 0);
+
+                nbh.add(block_vector(x, y, z), cnk);
+            }
+        }
+    }
+
+    surface_data s (extract_opaque_surface(nbh), extract_transparent_surface(nbh));
+    light_data l (light_by_position(s.opaque), lightmap());
+
+    // Change a few blocks, and patch the faces around them.
+    surface_patch p;
+    for (chunk_index c : { chunk_index(3, 4, 5), chunk_index(0, 0, 0),
+                           chunk_index(15, 7, 9) })
+    {
+        (*center)[c] = block((*center)[c].type == 0 ? 10 : 0);
+        for (int dir (-1); dir < 6; ++dir)
+        {
+            chunk_index n (dir < 0 ? c : chunk_index(c + dir_vector[dir]));
+            if (   n.x < 0 || n.y < 0 || n.z < 0
+                || n.x >= chunk_size || n.y >= chunk_size || n.z >= chunk_size)
+            {
+                continue;
+            }
+            p.opaque.emplace_back(opaque_faces(nbh, n));
+        }
+    }
+
+    auto expected (extract_opaque_surface(nbh));
+    p.opaque_lit = faces_near(expected, world_vector(3, 4, 5), 2);
+    p.opaque_light = light_by_position(p.opaque_lit);
+    for (auto& v : p.opaque_light)
+        v.artificial = 15;
+
+    // Send it over the wire first.
+    auto buf (serialize(p));
+    auto q (deserialize_as<surface_patch>(buf));
+    BOOST_CHECK_EQUAL(q.opaque.size(), p.opaque.size());
+    BOOST_CHECK_EQUAL(q.opaque_light.size(), p.opaque_light.size());
+
+    for (int twice (0); twice < 2; ++twice)
+    {
+        apply(q, s, l);
+        BOOST_REQUIRE_EQUAL(s.opaque.size(), expected.size());
+        BOOST_REQUIRE_EQUAL(l.opaque.size(), count_faces(expected));
+        for (size_t i (0); i < expected.size(); ++i)
+            BOOST_CHECK(s.opaque[i] == expected[i]);
+
+        // The faces that were already there kept their light, the new
+        // ones are dark, and the ones near the first block are lit.
+        auto li (l.opaque.begin());
+        for (auto& f : s.opaque)
+        {
+            for (uint8_t dir (0); dir < 6; ++dir)
+            {
+                if (!f[dir])
+                    continue;
+
+                const light& v (*li++);
+                if (   std::abs(f.pos.x - 3) <= 2 && std::abs(f.pos.y - 4) <= 2
+                    && std::abs(f.pos.z - 5) <= 2)
+                {
+                    BOOST_CHECK_EQUAL(v.artificial, 15);
+                }
+                else if (v.sunlight != 0 || v.ambient != 0 || v.artificial != 0)
+                {
+                    BOOST_CHECK_EQUAL(v.sunlight, f.pos.x);
+                    BOOST_CHECK_EQUAL(v.ambient, f.pos.y);
+                    BOOST_CHECK_EQUAL(v.artificial, dir);
+                }
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE (flat_surface_test)
+{
+    surface_data s;
+    light_data   l;
+    for (int i (0); i < 300; ++i)
+    {
+        chunk_index pos (i % 16, (i / 16) % 16, i / 256);
+        s.opaque.emplace_back(pos, uint8_t(i % 63 + 1), uint16_t(i * 7));
+        for (int d (0); d < 6; ++d)
+        {
+            if (s.opaque.back()[d])
+                l.opaque.push_back(light(i % 16, d, 15 - i % 16));
+        }
+    }
+    s.transparent.emplace_back(chunk_index(1, 2, 3), 0x10, 4);
+    l.transparent.push_back(light(1, 2, 3));
+    l.phase = 2;
+
+    // The faces and light values are copied in one go, but the result
+    // is the same as writing them one field at a time.
+    auto buf (serialize(s));
+    BOOST_CHECK_EQUAL(buf.size(), surface_data::flat_header_size + 301 * 6);
+    BOOST_CHECK_EQUAL(uint8_t(buf[0]), int(surface_data::flat_version));
+
+    binary_data by_field;
+    auto ser (make_serializer(by_field));
+    ser(uint8_t(surface_data::flat_version))(uint16_t(s.opaque.size()));
+    for (auto& f : s.opaque)
+        ser(f);
+    ser(uint16_t(1))(s.transparent[0]);
+    BOOST_CHECK(buf == by_field);
+
+    auto s2 (deserialize_as<surface_data>(buf));
+    BOOST_CHECK(s2.opaque == s.opaque);
+    BOOST_CHECK(s2.transparent == s.transparent);
+    for (size_t i (0); i < s.opaque.size(); ++i)
+        BOOST_CHECK_EQUAL(s2.opaque[i].type, s.opaque[i].type);
+
+    auto lbuf (serialize(l));
+    BOOST_CHECK_EQUAL(lbuf.size(), 6 + (l.opaque.size() + 1) * sizeof(light));
+    auto l2 (deserialize_as<light_data>(lbuf));
+    BOOST_CHECK_EQUAL(l2.phase, 2);
+    BOOST_REQUIRE_EQUAL(l2.opaque.size(), l.opaque.size());
+    BOOST_CHECK(std::equal(l.opaque.begin(), l.opaque.end(), l2.opaque.begin(),
+                [](light a, light b){ return *(uint16_t*)&a == *(uint16_t*)&b; }));
+
+    BOOST_CHECK_EQUAL(serialize_c(surface_data()).size(), surface_data::flat_header_size);
+
+    // Surfaces that were stored with packed block positions can still
+    // be read.
+    binary_data old;
+    auto old_ser (make_serializer(old));
+    old_ser(uint16_t(s.opaque.size()));
+    for (auto& f : s.opaque)
+        old_ser(f.type)(f.pos)(f.dirs);
+    old_ser(uint16_t(1))(s.transparent[0].type)(s.transparent[0].pos)(s.transparent[0].dirs);
+
+    auto s3 (deserialize_as<surface_data>(old));
+    BOOST_CHECK(s3.opaque == s.opaque);
+    BOOST_CHECK(s3.transparent == s.transparent);
+    BOOST_CHECK_EQUAL(s3.transparent[0].type, 4);
+}
+
+BOOST_AUTO_TEST_CASE (memorycache_packed_test)
+{
+    persistence_null db;
+    memory_cache cache (db, 256 * 1024);
+
+    chunk_coordinates pos (world_chunk_center);
+    for (int i (0); i < 100; ++i)
+    {
+        auto cnk (std::make_shared<chunk>());
+        (*cnk)(0, 0, 0) = block(i + 1);
+        cache.store(pos + chunk_coordinates(i, 0, 0), cnk);
+    }
+    cache.cleanup();
+
+    // The chunks that were thrown out are still around, in a lot less
+    // memory.
+    auto s (cache.stats());
+    BOOST_CHECK(s.packed.entries > 0);
+    BOOST_CHECK_EQUAL(s.types[persistent_storage_i::chunk].entries + s.packed.entries, 100);
+    BOOST_CHECK(s.packed.bytes * 4 < s.packed.entries * chunk_volume * sizeof(block));
+
+    for (int i (0); i < 100; ++i)
+    {
+        auto cnk (cache.get_chunk(pos + chunk_coordinates(i, 0, 0)));
+        BOOST_REQUIRE(cnk != nullptr);
+        BOOST_CHECK_EQUAL((*cnk)(0, 0, 0).type, i + 1);
+    }
+
+    // Without a share, the packed chunks are dropped.
+    cache.packed_share(0);
+    cache.cleanup();
+    BOOST_CHECK_EQUAL(cache.stats().packed.entries, 0);
+    BOOST_CHECK_THROW(cache.packed_share(2), std::invalid_argument);
+}
+
 
 BOOST_AUTO_TEST_CASE (compress_test)
 {
@@ -289,6 +1038,132 @@ BOOST_AUTO_TEST_CASE (compress_test)
 
     BOOST_CHECK_EQUAL(li, std::string(decompr.begin(), decompr.end()));
     BOOST_CHECK_EQUAL(li.size(), decompr.size());
+
+    // LZ4 data is serialized the way it always was.
+    auto buf (serialize(compr));
+    BOOST_CHECK_EQUAL(buf.size(), 4 + compr.size());
+    BOOST_CHECK(deserialize_as<compressed_data>(buf) == compr);
+
+    compressed_data deflated (compress(li, codec::deflate));
+    BOOST_CHECK(deflated.method == codec::deflate);
+    BOOST_CHECK(!deflated.uses_dictionary());
+    decompr = decompress(deflated);
+    BOOST_CHECK_EQUAL(li, std::string(decompr.begin(), decompr.end()));
+
+    auto deflated_buf (serialize(deflated));
+    auto deflated_copy (deserialize_as<compressed_data>(deflated_buf));
+    BOOST_CHECK(deflated_copy == deflated);
+    BOOST_CHECK(recompress(std::move(deflated_copy), codec::lz4) == compr);
+
+    // A dictionary trained on similar data helps a lot.
+    std::mt19937 prng (1);
+    std::vector<binary_data> samples;
+    for (int i (0); i < 50; ++i)
+    {
+        std::string tmp;
+        for (int j (0); j < 20; ++j)
+            tmp += prng() % 2 ? "stone stone stone dirt grass " : "water sand sand clay stone ";
+
+        samples.emplace_back(tmp.begin(), tmp.end());
+    }
+    auto dict (std::make_shared<compression_dictionary>(train_dictionary(samples, 1024)));
+    BOOST_CHECK(!dict->data.empty());
+    BOOST_CHECK(dict->data.size() <= 1024);
+
+    const binary_data& sample (samples.back());
+    compressed_data plain (compress(sample, codec::deflate));
+    compressed_data with_dict (compress(sample, compression_method(codec::deflate, dict)));
+    BOOST_CHECK(with_dict.uses_dictionary());
+    BOOST_CHECK_LT(with_dict.size(), plain.size());
+
+    // It can only be unpacked once the dictionary is known.
+    BOOST_CHECK_THROW(decompress(with_dict), std::runtime_error);
+    register_dictionary(dict);
+    BOOST_CHECK(decompress(with_dict) == sample);
+
+    BOOST_CHECK(codec_by_name("deflate") == codec::deflate);
+    BOOST_CHECK_THROW(codec_by_name("zip"), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE (compress_large_test)
+{
+    // Something that doesn't fit in a single LZ4 block, and doesn't end
+    // on a frame boundary.
+    std::mt19937 prng (2);
+    binary_data big (lz4_frame_size * 3 + 1234);
+    for (auto& c : big)
+        c = "stone dirt"[prng() % 10];
+
+    for (codec method : { codec::lz4, codec::deflate })
+    {
+        compressed_data packed (compress(big, method));
+        BOOST_CHECK_EQUAL(packed.unpacked_len, big.size());
+        BOOST_CHECK(decompress(packed) == big);
+
+        // Too large for the old serialization format.
+        auto buf (serialize(packed));
+        BOOST_CHECK(deserialize_as<compressed_data>(buf) == packed);
+
+        // Packing it a piece at a time gives the same result.
+        compressor c (method);
+        for (size_t i (0); i < big.size(); i += 1000)
+            c.write(&big[i], std::min<size_t>(1000, big.size() - i));
+
+        BOOST_CHECK(c.finish() == packed);
+
+        // So does unpacking it.
+        decompressor d (packed);
+        binary_data result;
+        char piece[777];
+        while (d.bytes_left() > 0)
+        {
+            size_t n (d.read(piece, sizeof(piece)));
+            result.insert(result.end(), piece, piece + n);
+        }
+        BOOST_CHECK(result == big);
+        BOOST_CHECK_EQUAL(d.read(piece, sizeof(piece)), 0);
+    }
+
+    // Small streams are still a single block.
+    compressor c;
+    c.write(&big[0], 100);
+    c.write(&big[100], 100);
+    BOOST_CHECK(c.finish() == compress(&big[0], 200));
+
+    // Cut off data is noticed.
+    compressed_data cut (compress(big));
+    cut.resize(cut.size() / 2);
+    BOOST_CHECK_THROW(decompress(cut), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE (packet_buffer_test)
+{
+    const uint8_t* memory;
+    void* handle;
+    {
+    packet_buffer a;
+    a.bytes().assign(1000, 7);
+    memory = a.data();
+
+    packet_buffer b (a);
+    BOOST_CHECK_EQUAL(b.data(), memory);
+    handle = b.retain();
+    }
+
+    // The handle keeps the buffer alive after the last packet_buffer.
+    BOOST_CHECK_EQUAL(static_cast<packet_buffer::block*>(handle)->bytes.size(), 1000);
+
+    size_t pooled (packet_buffer::pooled());
+    packet_buffer::release(handle);
+    BOOST_CHECK_EQUAL(packet_buffer::pooled(), pooled + 1);
+
+    // The next buffer reuses the memory.
+    msg::entity_update_physics m;
+    m.updates.resize(10);
+    auto buf (serialize_packet(m));
+    BOOST_CHECK_EQUAL(buf.data(), memory);
+    BOOST_CHECK_EQUAL(buf.data()[0], msg::entity_update_physics::msg_id);
+    BOOST_CHECK_EQUAL(packet_buffer::pooled(), pooled);
 }
 
 BOOST_AUTO_TEST_CASE (concurrent_queue_test)
@@ -327,6 +1202,74 @@ BOOST_AUTO_TEST_CASE (concurrent_queue_test)
     BOOST_CHECK_EQUAL(q.size(), 1);
 }
 
+BOOST_AUTO_TEST_CASE (task_scheduler_test)
+{
+    task_scheduler pool (4);
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+
+    // A diamond: two tasks that need the same input, and a final task
+    // that needs both of them.
+    std::atomic<int> order (0);
+    int a (-1), b (-1), c (-1), d (-1);
+
+    auto ta (task_scheduler::make_task([&]{ a = order++; }));
+    auto tb (task_scheduler::make_task([&]{ b = order++; }));
+    auto tc (task_scheduler::make_task([&]{ c = order++; }));
+    auto td (task_scheduler::make_task([&]{ d = order++; }));
+    tb->depends_on(ta);
+    tc->depends_on(ta);
+    td->depends_on(tb);
+    td->depends_on(tc);
+
+    pool.submit(td);
+    pool.submit(tc);
+    pool.submit(tb);
+    BOOST_CHECK(!td->finished());
+
+    pool.submit(ta);
+    pool.wait(td);
+
+    BOOST_CHECK_EQUAL(a, 0);
+    BOOST_CHECK(b > a && c > a);
+    BOOST_CHECK_EQUAL(d, 3);
+
+    // Depending on a task that has already finished is a no-op.
+    bool ran (false);
+    auto te (task_scheduler::make_task([&]{ ran = true; }));
+    te->depends_on(ta);
+    pool.submit(te);
+    pool.wait(te);
+    BOOST_CHECK(ran);
+
+    // Lots of small tasks that were all waiting for the same one.
+    std::atomic<int> count (0);
+    auto root (task_scheduler::make_task([]{}));
+    std::vector<task_scheduler::task_ptr> leaves;
+    for (int i (0); i < 1000; ++i)
+    {
+        leaves.emplace_back(task_scheduler::make_task([&]{ ++count; }));
+        leaves.back()->depends_on(root);
+        pool.submit(leaves.back());
+    }
+    pool.submit(root);
+    for (auto& t : leaves)
+        pool.wait(t);
+
+    BOOST_CHECK_EQUAL(int(count), 1000);
+
+    // Idle workers ask for more work.
+    std::atomic<int> idle_work (10);
+    task_scheduler fed (2, [&]
+    {
+        return idle_work > 0 && --idle_work >= 0;
+    });
+    while (idle_work > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    fed.stop();
+    BOOST_CHECK(idle_work <= 0);
+}
+
 /*
 BOOST_AUTO_TEST_CASE (sqlite_test)
 {
@@ -368,6 +1311,287 @@ BOOST_AUTO_TEST_CASE (sqlite_test)
 }
 */
 
+BOOST_AUTO_TEST_CASE (sqlite_batch_test)
+{
+    using namespace boost;
+
+    auto dir (filesystem::temp_directory_path() / filesystem::unique_path());
+    filesystem::create_directories(dir);
+    {
+    std::ofstream setup ((dir / "setup.sql").string());
+    setup << "CREATE TABLE height (x INTEGER, y INTEGER, z INTEGER, timestamp INTEGER, PRIMARY KEY (x, y));" << std::endl
+          << "CREATE TABLE area (x INTEGER, y INTEGER, idx INTEGER, data BLOB, PRIMARY KEY (x, y, idx));" << std::endl
+          << "CREATE TABLE chunk (x INTEGER, y INTEGER, z INTEGER, data BLOB, timestamp INTEGER, PRIMARY KEY (x, y, z));" << std::endl
+          << "CREATE TABLE lightmap (x INTEGER, y INTEGER, z INTEGER, data BLOB, timestamp INTEGER, PRIMARY KEY (x, y, z));" << std::endl
+          << "CREATE TABLE surface (x INTEGER, y INTEGER, z INTEGER, data BLOB, timestamp INTEGER, PRIMARY KEY (x, y, z));" << std::endl;
+    }
+
+    boost::asio::io_service io;
+    persistence_sqlite per (io, dir / "world.db", dir / "setup.sql");
+    const auto type (persistent_storage_i::chunk);
+
+    // Store every other chunk in a 4x4x4 box.  The first block tells
+    // where the chunk is.
+    auto code ([](chunk_coordinates p){ return uint16_t(1 + p.x * 16 + p.y * 4 + p.z); });
+
+    persistent_storage_i::batch in;
+    for (auto p : hexa::range<chunk_coordinates>(chunk_coordinates(0, 0, 0),
+                                          chunk_coordinates(4, 4, 4)))
+    {
+        if ((p.x + p.y + p.z) % 2 == 0)
+        {
+            chunk cnk;
+            cnk[0] = block(code(p));
+            in.emplace_back(world_chunk_center + p, compress(serialize(cnk)));
+        }
+    }
+    per.store(type, in);
+    BOOST_CHECK(per.is_available(type, world_chunk_center));
+
+    auto box (per.retrieve(type, hexa::range<chunk_coordinates>(world_chunk_center + chunk_coordinates(1, 1, 1),
+                                                          world_chunk_center + chunk_coordinates(3, 3, 3))));
+    BOOST_CHECK_EQUAL(box.size(), 4);
+    for (auto& elem : box)
+    {
+        chunk_coordinates rel (elem.first - world_chunk_center);
+        BOOST_CHECK((rel.x + rel.y + rel.z) % 2 == 0);
+        auto cnk (deserialize_as<chunk>(decompress(elem.second)));
+        BOOST_CHECK_EQUAL(cnk[0].type, code(rel));
+    }
+
+    std::vector<chunk_coordinates> list {
+        world_chunk_center + chunk_coordinates(0, 0, 0),
+        world_chunk_center + chunk_coordinates(0, 0, 1), // not stored
+        world_chunk_center + chunk_coordinates(0, 0, 3), // not stored
+        world_chunk_center + chunk_coordinates(2, 2, 2),
+        world_chunk_center + chunk_coordinates(0, 0, 2),
+        world_chunk_center + chunk_coordinates(9, 9, 9)  // outside the box
+    };
+    auto found (per.retrieve(type, list));
+    BOOST_CHECK_EQUAL(found.size(), 3);
+    std::set<chunk_coordinates> found_pos;
+    for (auto& elem : found)
+        found_pos.insert(elem.first);
+
+    BOOST_CHECK(found_pos.count(list[0]));
+    BOOST_CHECK(found_pos.count(list[3]));
+    BOOST_CHECK(found_pos.count(list[4]));
+
+    BOOST_CHECK_THROW(per.retrieve(persistent_storage_i::height, list), std::logic_error);
+
+    // A memory cache on top of it loads the whole list in one go.
+    {
+    memory_cache cache (per);
+    cache.prefetch(list, storage_i::prefetch_chunks);
+    BOOST_CHECK_EQUAL(cache.stats().types[type].entries, 3);
+    auto cnk (cache.get_chunk(list[3]));
+    BOOST_REQUIRE(cnk != nullptr);
+    BOOST_CHECK_EQUAL((*cnk)[0].type, code(chunk_coordinates(2, 2, 2)));
+    BOOST_CHECK_EQUAL(cache.stats().types[type].misses, 0);
+    }
+
+    // Without auto commit, cleanup() commits the data.
+    per.auto_commit(false);
+    per.store(map_coordinates(7, 8), 42);
+    per.cleanup();
+    {
+    persistence_sqlite other (io, dir / "world.db", dir / "setup.sql");
+    BOOST_CHECK_EQUAL(other.retrieve(map_coordinates(7, 8)), 42);
+    }
+
+    filesystem::remove_all(dir);
+}
+
+BOOST_AUTO_TEST_CASE (regions_test)
+{
+    using namespace boost;
+
+    auto dir (filesystem::temp_directory_path() / filesystem::unique_path());
+    const auto type (persistent_storage_i::surface);
+    auto data ([](chunk_coordinates p, size_t len)
+    {
+        // Random bytes, so the compressed size is about the same.
+        std::mt19937 prng (p.x * 3 + p.y * 5 + p.z * 7);
+        std::vector<char> buf (len);
+        for (auto& c : buf)
+            c = char(prng());
+
+        return compress(buf);
+    });
+
+    // The world center is on a region boundary, so this box is spread
+    // over eight region files.
+    const chunk_coordinates lo (world_chunk_center - chunk_coordinates(2, 2, 2));
+    const chunk_coordinates hi (world_chunk_center + chunk_coordinates(2, 2, 2));
+    {
+    persistence_regions per (dir);
+    BOOST_CHECK(!per.is_available(type, world_chunk_center));
+    BOOST_CHECK_THROW(per.retrieve(type, world_chunk_center), not_in_storage_error);
+
+    persistent_storage_i::batch in;
+    for (auto p : hexa::range<chunk_coordinates>(lo, hi))
+        in.emplace_back(p, data(p, 100));
+
+    per.store(type, in);
+    per.store(map_coordinates(world_chunk_center.x, world_chunk_center.y), 1234);
+
+    BOOST_CHECK(per.is_available(type, lo));
+    BOOST_CHECK(!per.is_available(persistent_storage_i::chunk, lo));
+    BOOST_CHECK(per.retrieve(type, lo) == data(lo, 100));
+
+    auto box (per.retrieve(type, hexa::range<chunk_coordinates>(lo - chunk_coordinates(1, 1, 1),
+                                                                world_chunk_center + chunk_coordinates(1, 1, 1))));
+    BOOST_CHECK_EQUAL(box.size(), 27);
+    for (auto& elem : box)
+        BOOST_CHECK(elem.second == data(elem.first, 100));
+
+    std::vector<chunk_coordinates> list { lo, hi, world_chunk_center, lo + chunk_coordinates(1, 2, 3) };
+    BOOST_CHECK_EQUAL(per.retrieve(type, list).size(), 3);
+    BOOST_CHECK_THROW(per.retrieve(persistent_storage_i::height, list), std::logic_error);
+
+    // Overwrite the same chunk until most of the file is garbage.
+    auto file_size ([&]
+    {
+        size_t total (0);
+        for (filesystem::directory_iterator i (dir); i != filesystem::directory_iterator(); ++i)
+            total += filesystem::file_size(*i);
+        return total;
+    });
+    for (int i (0); i < 50; ++i)
+        per.store(type, world_chunk_center, data(chunk_coordinates(i, 0, 0), 4000));
+
+    const size_t before (file_size());
+    per.compact();
+    BOOST_CHECK(file_size() < before);
+    BOOST_CHECK(per.retrieve(type, world_chunk_center) == data(chunk_coordinates(49, 0, 0), 4000));
+    }
+
+    // Everything is still there after opening the files again.
+    {
+    persistence_regions per (dir);
+    BOOST_CHECK(per.retrieve(type, lo) == data(lo, 100));
+    BOOST_CHECK(per.retrieve(type, world_chunk_center) == data(chunk_coordinates(49, 0, 0), 4000));
+    BOOST_CHECK_EQUAL(per.retrieve(map_coordinates(world_chunk_center.x, world_chunk_center.y)), 1234);
+    BOOST_CHECK(!per.is_available(persistent_storage_i::height, map_coordinates(world_chunk_center.x + 1, world_chunk_center.y)));
+    }
+
+    // The codec is stored with the data.
+    {
+    persistence_regions per (dir);
+    std::string text (2000, 'x');
+    per.store(type, lo, compress(text, codec::deflate));
+    auto back (per.retrieve(type, lo));
+    BOOST_CHECK(back.method == codec::deflate);
+    auto unpacked (decompress(back));
+    BOOST_CHECK_EQUAL(std::string(unpacked.begin(), unpacked.end()), text);
+    }
+
+    filesystem::remove_all(dir);
+}
+
+namespace {
+
+/** Keeps everything in memory, and takes its time writing it. */
+class slow_storage : public persistence_null
+{
+public:
+    slow_storage(int delay) : delay_ (delay), batches (0), commits (0) { }
+
+    void store (data_type type, chunk_coordinates xyz, const compressed_data& data)
+    {
+        boost::lock_guard<boost::mutex> l (lock);
+        stored[xyz] = decompress(data);
+    }
+
+    void store (data_type type, const batch& data)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(delay_));
+        boost::lock_guard<boost::mutex> l (lock);
+        ++batches;
+        for (auto& elem : data)
+            stored[elem.first] = decompress(elem.second);
+    }
+
+    compressed_data retrieve (data_type type, chunk_coordinates xyz)
+    {
+        boost::lock_guard<boost::mutex> l (lock);
+        return compress(stored.at(xyz));
+    }
+
+    bool is_available (data_type type, chunk_coordinates xyz)
+    {
+        boost::lock_guard<boost::mutex> l (lock);
+        return stored.count(xyz) > 0;
+    }
+
+    void cleanup() { ++commits; }
+
+    int delay_;
+    std::map<chunk_coordinates, binary_data> stored;
+    std::atomic<int> batches, commits;
+};
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE (writebehind_test)
+{
+    const auto type (persistent_storage_i::chunk);
+    chunk_coordinates pos (world_chunk_center);
+
+    slow_storage disk (0);
+    {
+    write_behind queue (disk, 1 << 20, std::chrono::milliseconds(50));
+
+    // Repeated writes to the same key are coalesced, and reads see the
+    // latest version before it hits the disk.
+    for (char i (0); i < 10; ++i)
+        queue.store(type, pos, compress(binary_data(100, i)));
+
+    BOOST_CHECK(queue.is_available(type, pos));
+    BOOST_CHECK(decompress(queue.retrieve(type, pos)) == binary_data(100, 9));
+    BOOST_CHECK_EQUAL(queue.retrieve(type, std::vector<chunk_coordinates>{ pos }).size(), 1);
+
+    auto st (queue.stats());
+    BOOST_CHECK_EQUAL(st.coalesced, 9);
+    BOOST_CHECK_EQUAL(st.pending, 1);
+
+    queue.flush();
+    BOOST_CHECK(disk.stored.at(pos) == binary_data(100, 9));
+    BOOST_CHECK_EQUAL(int(disk.batches), 1);
+    BOOST_CHECK(disk.commits >= 1);
+
+    st = queue.stats();
+    BOOST_CHECK_EQUAL(st.pending, 0);
+    BOOST_CHECK_EQUAL(st.written, 1);
+    BOOST_CHECK_EQUAL(st.lag, 0);
+
+    // Written in the background, without asking.
+    queue.store(type, pos + chunk_coordinates(1, 0, 0), compress(binary_data(10, 1)));
+    for (int i (0); i < 100 && disk.batches < 2; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    BOOST_CHECK_EQUAL(int(disk.batches), 2);
+    }
+
+    // A full queue makes the writers wait.
+    slow_storage slow_disk (50);
+    {
+    write_behind queue (slow_disk, 256, std::chrono::milliseconds(10));
+    for (int i (0); i < 10; ++i)
+    {
+        binary_data noise (200);
+        std::generate(noise.begin(), noise.end(), std::mt19937(i));
+        queue.store(type, pos + chunk_coordinates(i, 0, 0), compress(noise));
+    }
+
+    auto st (queue.stats());
+    BOOST_CHECK(st.stalls > 0);
+    BOOST_CHECK(st.stall_time > 0);
+    }
+    // The destructor writes everything that's left.
+    BOOST_CHECK_EQUAL(slow_disk.stored.size(), 10);
+}
+
 BOOST_AUTO_TEST_CASE (voxelrange_test)
 {
     size_t count (0);
@@ -435,6 +1659,174 @@ BOOST_AUTO_TEST_CASE (neighborhood_test)
     */
 }
 
+BOOST_AUTO_TEST_CASE (dense_neighborhood_test)
+{
+    persistence_null db;
+    memory_cache cache (db);
+
+    const chunk_coordinates center (world_chunk_center);
+    for (int c (0); c < 3; ++c)
+    {
+        auto cnk (std::make_shared<chunk>());
+        for (auto i : every_block_in_chunk)
+            (*cnk)[i].type = 1 + c * 1000 + i.x + i.y * 16 + (i.z % 4) * 256;
+
+        cache.store(center + chunk_coordinates(c - 1, 0, 0), cnk);
+    }
+
+    // Across the three chunks, plus a bit of the missing ones above and
+    // next to them.
+    const world_vector lo (-5, 3, 10), hi (37, 16, 20);
+    for (unsigned int threads : { 1, 3 })
+    {
+        dense_neighborhood nbh (cache, center, lo, hi, threads);
+        BOOST_CHECK_EQUAL(nbh.lower(), lo);
+        BOOST_CHECK_EQUAL(nbh.upper(), hi);
+
+        bool same (true);
+        for (auto p : range<world_vector>(lo, hi))
+        {
+            uint16_t expected (type::air);
+            if (p.z < chunk_size && p.x < 2 * chunk_size)
+            {
+                int c ((p.x + chunk_size) / chunk_size);
+                world_vector i (p.x + chunk_size - c * chunk_size, p.y, p.z);
+                expected = 1 + c * 1000 + i.x + i.y * 16 + (i.z % 4) * 256;
+            }
+            same &= nbh[p] == expected;
+        }
+        BOOST_CHECK(same);
+
+        world_vector a (-3, 4, 12), b (30, 9, 18);
+        BOOST_CHECK_EQUAL(nbh.at(nbh.index(a) + nbh.offset(b - a)), nbh[b]);
+    }
+
+    ray_bundle rays { { {0,0,0}, {-20,3,1}, {2,40,-7} }, 1.0f };
+    world_vector rlo (0, 0, 0), rhi (chunk_size, chunk_size, chunk_size);
+    extend_to_reach(rays, rlo, rhi);
+    BOOST_CHECK_EQUAL(rlo, world_vector(-20, 0, -7));
+    BOOST_CHECK_EQUAL(rhi, world_vector(18, 56, 17));
+}
+
+BOOST_AUTO_TEST_CASE (lamp_index_test)
+{
+    register_new_material(0).transparency = 255;
+    register_new_material(20).is_solid = true;
+    register_new_material(21).light_emission = 255;
+    register_new_material(23).light_emission = 100;
+
+    persistence_null db;
+    memory_cache cache (db);
+
+    const chunk_coordinates center (world_chunk_center);
+    auto cnk (std::make_shared<chunk>());
+    (*cnk)[chunk_index(1, 2, 3)].type = 21;
+    (*cnk)[chunk_index(15, 15, 15)].type = 23;
+    (*cnk)[chunk_index(8, 8, 8)].type = 20;
+    cache.store(center, cnk);
+
+    auto sorted = [](std::vector<lamp_index::lamp> v)
+    {
+        std::vector<std::pair<world_vector, int>> result;
+        for (auto& l : v)
+            result.emplace_back(l.pos, l.strength);
+
+        std::sort(result.begin(), result.end());
+        return result;
+    };
+
+    lamp_index idx (cache);
+    auto found (sorted(idx.near(center, 4)));
+    BOOST_CHECK_EQUAL(found.size(), 2);
+    BOOST_CHECK_EQUAL(found[0].first, world_vector(1, 2, 3));
+    BOOST_CHECK_EQUAL(found[0].second, 255);
+    BOOST_CHECK_EQUAL(found[1].first, world_vector(15, 15, 15));
+
+    // Seen from the next chunk, only one of them is close enough.
+    found = sorted(idx.near(center + world_vector(1, 0, 0), 4));
+    BOOST_CHECK_EQUAL(found.size(), 1);
+    BOOST_CHECK_EQUAL(found[0].first, world_vector(-1, 15, 15));
+    BOOST_CHECK_EQUAL(found[0].second, 100);
+    BOOST_CHECK(idx.near(center + world_vector(2, 0, 0), 4).empty());
+
+    // The index does not look at the chunk again by itself.
+    (*cnk)[chunk_index(1, 2, 3)].type = 0;
+    idx.changed(center * chunk_size + world_vector(8, 8, 8), 23);
+    found = sorted(idx.near(center, 4));
+    BOOST_CHECK_EQUAL(found.size(), 3);
+    BOOST_CHECK_EQUAL(found[1].first, world_vector(8, 8, 8));
+
+    idx.forget(center);
+    found = sorted(idx.near(center, 4));
+    BOOST_CHECK_EQUAL(found.size(), 1);
+    BOOST_CHECK_EQUAL(found[0].first, world_vector(15, 15, 15));
+}
+
+BOOST_AUTO_TEST_CASE (light_volume_test)
+{
+    register_new_material(0).transparency = 255;
+    register_new_material(20).is_solid = true;
+    register_new_material(21).light_emission = 255;
+    register_new_material(22).transparency = 128;
+
+    persistence_null db;
+    memory_cache cache (db);
+
+    // A floor, and a roof over half of it with a lamp underneath.
+    const chunk_coordinates center (world_chunk_center);
+    auto cnk (std::make_shared<chunk>());
+    for (auto i : every_block_in_chunk)
+    {
+        if (i.z == 0 || (i.z == 10 && i.x < 8))
+            (*cnk)[i].type = 20;
+    }
+    (*cnk)[chunk_index(3, 8, 5)].type = 21;
+    cache.store(center, cnk);
+    cache.store(map_coordinates(center), chunk_height(center.z + 1));
+
+    typedef light_volume lv;
+    lv vol (cache, center);
+    BOOST_CHECK(vol.contains(world_vector(-16, -16, -16)));
+    BOOST_CHECK(!vol.contains(world_vector(-17, 0, 0)));
+    BOOST_CHECK(vol.covers(world_vector(-17, 0, 0)));
+
+    // Light finds its way around the roof and the floor, since the
+    // neighboring chunks are all air.
+    BOOST_CHECK_EQUAL(vol.level(world_vector(12, 8, 1), lv::sky), 15);
+    BOOST_CHECK_EQUAL(vol.level(world_vector(12, 8, 20), lv::sky), 15);
+    BOOST_CHECK_EQUAL(vol.level(world_vector(8, 8, 5), lv::sky), 15);
+    BOOST_CHECK_EQUAL(vol.level(world_vector(5, 8, 5), lv::sky), 12);
+    BOOST_CHECK_EQUAL(vol.level(world_vector(12, 8, -1), lv::sky), 11);
+    BOOST_CHECK_EQUAL(vol.level(world_vector(3, 8, 5), lv::artificial), 15);
+    BOOST_CHECK_EQUAL(vol.level(world_vector(3, 8, 6), lv::artificial), 14);
+    BOOST_CHECK_EQUAL(vol.level(world_vector(3, 11, 7), lv::artificial), 10);
+    BOOST_CHECK_EQUAL(vol.level(world_vector(3, 8, 11), lv::artificial), 1);
+
+    // Every change must give the same light as starting over.
+    std::mt19937 rng (42);
+    std::uniform_int_distribution<int> coord (0, chunk_size - 1);
+    const uint16_t materials[] = { 0, 0, 20, 20, 21, 22 };
+    for (int round (0); round < 40; ++round)
+    {
+        chunk_index i (coord(rng), coord(rng), coord(rng));
+        const uint16_t m (materials[rng() % 6]);
+        (*cnk)[i].type = m;
+        vol.change(world_vector(i), m);
+
+        if (round % 8 != 7)
+            continue;
+
+        lv fresh (cache, center);
+        bool same (true);
+        for (auto p : range<world_vector>(vol.lower(), vol.upper()))
+        {
+            same &=    vol.level(p, lv::sky) == fresh.level(p, lv::sky)
+                    && vol.level(p, lv::artificial) == fresh.level(p, lv::artificial);
+        }
+        BOOST_CHECK(same);
+    }
+}
+
 /*
 BOOST_AUTO_TEST_CASE (clientworld_test)
 {
@@ -695,6 +2087,32 @@ BOOST_AUTO_TEST_CASE (raybundle_test)
     BOOST_CHECK_EQUAL(two.branches.size(), 1);
     BOOST_CHECK_EQUAL(two.branches[0].trunk.size(), 1);
     BOOST_CHECK_EQUAL(two.branches[0].trunk[0], world_vector(2,2,2));
+
+    // The flattened tree: {0,0,0} -> {1,1,1} -> ({2,2,2}, {2,2,3})
+    BOOST_REQUIRE_EQUAL(one.flat.size(), 4);
+    BOOST_CHECK_EQUAL(one.flat_voxels.size(), 4);
+    BOOST_CHECK_EQUAL(one.flat[0].skip, 4);
+    BOOST_CHECK_EQUAL(one.flat[1].skip, 4);
+    BOOST_CHECK_EQUAL(one.flat[2].skip, 3);
+    BOOST_CHECK_EQUAL(one.flat[3].skip, 4);
+    BOOST_CHECK(one.flat[0].leading);
+    BOOST_CHECK(!one.flat[1].leading);
+    BOOST_CHECK_EQUAL(one.flat_voxels[one.flat[3].first], world_vector(2,2,3));
+
+    one.multiply_weight(0.5f);
+    BOOST_CHECK_EQUAL(one.flat[0].weight, 1.0f);
+    BOOST_CHECK_EQUAL(one.flat[2].weight, 0.5f);
+
+    auto clear ([](world_vector, bool) { return 0.0f; });
+    BOOST_CHECK_EQUAL(one.follow(1.0f, clear), 1.0f);
+
+    // Blocking {1,1,1} takes away its own weight, and skips the branches.
+    auto wall ([](world_vector v, bool) { return v == world_vector(1,1,1) ? 1.0f : 0.0f; });
+    BOOST_CHECK_CLOSE(one.follow(1.5f, wall), 0.75f, 0.01);
+
+    // The first voxel is flagged, so custom blocks can be skipped.
+    auto first_only ([](world_vector, bool first) { return first ? 0.6f : 0.0f; });
+    BOOST_CHECK_CLOSE(one.follow(1.5f, first_only), 1.5f - 0.6f, 0.01);
 }
 
 /*
@@ -0,0 +1,439 @@
+//---------------------------------------------------------------------------
+// unit_tests/test_world.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2013, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include <boost/test/unit_test.hpp>
+
+#include <map>
+#include <unordered_set>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread.hpp>
+
+#include <hexa/block_types.hpp>
+#include <hexa/memory_cache.hpp>
+#include <hexa/neighborhood.hpp>
+#include <hexa/persistence_null.hpp>
+#include <hexa/surface.hpp>
+#include <hexa/voxel_range.hpp>
+#include <hexa/server/generation_queue.hpp>
+#include <hexa/server/lightmap_generator_i.hpp>
+#include <hexa/server/terrain_generator_i.hpp>
+#include <hexa/server/world.hpp>
+
+using namespace hexa;
+
+namespace {
+
+const chunk_height test_height (world_chunk_center.z + 4);
+
+uint32_t hash (uint32_t x, uint32_t y)
+{
+    uint32_t h (x * 73856093u ^ y * 19349663u);
+    h ^= h >> 13;
+    h *= 0x5bd1e995;
+    return h ^ (h >> 15);
+}
+
+/** Rolling hills, somewhere between 4 chunks below and 3 chunks above
+ ** the water level. */
+class test_terrain : public terrain_generator_i
+{
+public:
+    test_terrain (world& w)
+        : terrain_generator_i (w, boost::property_tree::ptree())
+    { }
+
+    void generate (chunk_coordinates pos, chunk& dest)
+    {
+        for (auto i : every_block_in_chunk)
+        {
+            world_coordinates wp (pos * chunk_size + i);
+            uint32_t h (water_level - 64 + hash(wp.x / 4, wp.y / 4) % 112);
+            dest[i].type = wp.z <= h ? 1 : 0;
+        }
+    }
+
+    chunk_height estimate_height (map_coordinates) const
+        { return test_height; }
+};
+
+/** Puts a few crosses on the map that reach into the neighboring
+ ** chunks, so the workers have to fight over lock_range(). */
+class test_features : public terrain_generator_i
+{
+public:
+    test_features (world& w)
+        : terrain_generator_i (w, boost::property_tree::ptree())
+    { }
+
+    void generate (chunk_coordinates pos, chunk& dest)
+    {
+        // Stay clear of the air chunks; creating one of those moves the
+        // coarse height, and then the outcome depends on timing.
+        if (pos.z + 2 >= test_height || hash(pos.x, pos.y + pos.z) % 3 != 0)
+            return;
+
+        range<chunk_coordinates> rng (pos - chunk_coordinates(1, 1, 1),
+                                      pos + chunk_coordinates(2, 2, 2));
+        auto region (w_.lock_range(rng, *this));
+
+        world_coordinates c (pos * chunk_size);
+        for (int i (-12); i <= 20; ++i)
+        {
+            region(c.x + i, c.y, c.z) = 2;
+            region(c.x, c.y + i, c.z) = 2;
+            region(c.x, c.y, c.z + i) = 2;
+        }
+    }
+};
+
+bool same_faces (const surface& a, const surface& b)
+{
+    if (a.size() != b.size())
+        return false;
+
+    for (size_t i (0); i < a.size(); ++i)
+    {
+        if (!(a[i] == b[i]) || a[i].type != b[i].type)
+            return false;
+    }
+    return true;
+}
+
+/** Light that only depends on where a face is. */
+class test_light : public lightmap_generator_i
+{
+public:
+    test_light (world& w)
+        : lightmap_generator_i (w, boost::property_tree::ptree())
+    { }
+
+    lightmap& generate (const chunk_coordinates&, const surface& s,
+                        lightmap& lm, unsigned int) const
+    {
+        auto lmi (lm.begin());
+        for (auto& f : s)
+        {
+            for (int d (0); d < 6; ++d)
+            {
+                if (f[d])
+                    *lmi++ = light(f.pos.x & 15, f.pos.y & 15, d + 1);
+            }
+        }
+        return lm;
+    }
+
+    unsigned int influence_radius() const { return 3; }
+};
+
+/** Puts the phase it was asked for in the ambient channel. */
+class phased_light : public test_light
+{
+public:
+    phased_light (world& w) : test_light (w) { }
+
+    lightmap& generate (const chunk_coordinates& pos, const surface& s,
+                        lightmap& lm, unsigned int phase) const
+    {
+        test_light::generate(pos, s, lm, phase);
+        for (auto& l : lm)
+            l.ambient = phase;
+
+        return lm;
+    }
+
+    unsigned int phases() const { return 3; }
+};
+
+void generate_region (world& w, const range<chunk_coordinates>& r,
+                      world::request::type_t type = world::request::surface)
+{
+    boost::mutex               m;
+    boost::condition_variable  done;
+    size_t                     count (0), total (r.size());
+
+    for (auto pos : r)
+    {
+        w.requests.push({ type, pos, [&]
+        {
+            boost::lock_guard<boost::mutex> lock (m);
+            if (++count == total)
+                done.notify_one();
+        }});
+    }
+
+    boost::unique_lock<boost::mutex> lock (m);
+    while (count < total)
+        done.wait(lock);
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE (generation_queue_test)
+{
+    typedef generation_queue::request rq;
+    const chunk_coordinates c (world_chunk_center);
+    int answered (0);
+
+    generation_queue q (10);
+    generation_queue::request out;
+    BOOST_CHECK(!q.try_pop(out));
+
+    // Without players, first come first served.
+    q.push({ rq::surface, c + chunk_coordinates(5, 0, 0), [&]{ ++answered; } });
+    q.push({ rq::surface, c, [&]{ ++answered; } });
+    q.push({ rq::lightmap, c + chunk_coordinates(5, 0, 0), [&]{ ++answered; } });
+    BOOST_CHECK_EQUAL(q.size(), 2);
+
+    out = q.pop();
+    BOOST_CHECK_EQUAL(out.pos, c + chunk_coordinates(5, 0, 0));
+    BOOST_CHECK_EQUAL(out.type, rq::surface_and_lightmap);
+    out.answer();
+    BOOST_CHECK_EQUAL(answered, 2);
+
+    out = q.pop();
+    BOOST_CHECK_EQUAL(out.pos, c);
+    BOOST_CHECK(q.empty());
+
+    // Nearest to a player goes first.
+    q.update_player(1, c);
+    for (uint32_t i (8); i > 0; --i)
+        q.push({ rq::surface, c + chunk_coordinates(i, 0, 0), [&]{ ++answered; } });
+
+    BOOST_CHECK(q.try_pop(out));
+    BOOST_CHECK_EQUAL(out.pos, c + chunk_coordinates(1, 0, 0));
+
+    // Move the player, and make sure the queue gets reordered.  Chunks
+    // that are out of sight are dropped.
+    q.update_player(1, c + chunk_coordinates(14, 0, 0));
+    out = q.pop();
+    BOOST_CHECK_EQUAL(out.pos, c + chunk_coordinates(8, 0, 0));
+    BOOST_CHECK_EQUAL(q.size(), 4);
+    BOOST_CHECK_EQUAL(answered, 4); // The dropped ones still get an answer.
+
+    // A second player nearby keeps the others alive.
+    q.update_player(2, c);
+    q.update_player(1, c + chunk_coordinates(100, 0, 0));
+    out = q.pop();
+    BOOST_CHECK_EQUAL(out.pos, c + chunk_coordinates(4, 0, 0));
+
+    q.remove_player(2);
+    BOOST_CHECK(!q.try_pop(out));
+    BOOST_CHECK_EQUAL(answered, 7);
+
+    // Quit requests jump the queue.
+    q.remove_player(1);
+    q.push({ rq::surface, c, []{} });
+    q.push({ rq::quit, c, []{} });
+    BOOST_CHECK_EQUAL(q.pop().type, rq::quit);
+    BOOST_CHECK_EQUAL(q.pop().pos, c);
+
+    // Clearing the queue answers everything that was waiting.
+    q.push({ rq::surface, c, [&]{ ++answered; } });
+    q.push({ rq::lightmap, c + chunk_coordinates(1, 0, 0), [&]{ ++answered; } });
+    q.clear();
+    BOOST_CHECK(q.empty());
+    BOOST_CHECK_EQUAL(answered, 9);
+}
+
+BOOST_AUTO_TEST_CASE (world_multithreaded_test)
+{
+    register_new_material(1).is_solid = true;
+    register_new_material(2).is_solid = true;
+
+    range<chunk_coordinates> region (world_chunk_center - chunk_coordinates(16, 16, 4),
+                                     world_chunk_center + chunk_coordinates(16, 16, 4));
+    BOOST_REQUIRE_EQUAL(region.size(), 32 * 32 * 8);
+
+    persistence_null single_db, multi_db;
+    memory_cache     single_cache (single_db), multi_cache (multi_db);
+    world            single (single_cache, 1), multi (multi_cache, 4);
+
+    BOOST_CHECK_EQUAL(single.worker_count(), 1);
+    BOOST_CHECK_EQUAL(multi.worker_count(), 4);
+
+    for (world* w : { &single, &multi })
+    {
+        w->add_terrain_generator(std::unique_ptr<terrain_generator_i>(new test_terrain(*w)));
+        w->add_terrain_generator(std::unique_ptr<terrain_generator_i>(new test_features(*w)));
+    }
+
+    generate_region(single, region);
+    generate_region(multi, region);
+
+    for (auto pos : region)
+    {
+        auto a (single.get_chunk(pos)), b (multi.get_chunk(pos));
+        BOOST_REQUIRE_EQUAL(a == nullptr, b == nullptr);
+        if (a)
+        {
+            BOOST_CHECK(*a == *b);
+            BOOST_CHECK_EQUAL(int(a->generation_phase), int(b->generation_phase));
+        }
+
+        // The stored surfaces can't be compared directly: features that
+        // cross chunk borders may still be added after a surface was
+        // extracted, and the order in which that happens depends on
+        // the scheduling.  Extract them again from the final terrain.
+        neighborhood<chunk_ptr> na (single, pos), nb (multi, pos);
+        BOOST_CHECK(same_faces(extract_opaque_surface(na),
+                               extract_opaque_surface(nb)));
+        BOOST_CHECK(same_faces(extract_transparent_surface(na),
+                               extract_transparent_surface(nb)));
+    }
+}
+
+BOOST_AUTO_TEST_CASE (world_change_block_test)
+{
+    register_new_material(1).is_solid = true;
+    register_new_material(2).is_solid = true;
+
+    persistence_null db;
+    memory_cache     cache (db);
+    world            w (cache, 2);
+    w.add_terrain_generator(std::unique_ptr<terrain_generator_i>(new test_terrain(w)));
+    w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(new test_light(w)));
+
+    chunk_coordinates c (world_chunk_center);
+    range<chunk_coordinates> region (c - chunk_coordinates(2, 2, 2),
+                                     c + chunk_coordinates(3, 3, 3));
+    generate_region(w, region, world::request::surface_and_lightmap);
+    while (w.pending_tasks() > 0)
+        boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+
+    w.take_changeset();
+    w.take_patches();
+
+    // Dig a hole at the border of two chunks, and fill another one.
+    std::vector<world_coordinates> changes;
+    for (int i (0); i < 16; ++i)
+        changes.emplace_back(c * chunk_size + world_vector(0, i, 15 - i));
+
+    std::map<chunk_coordinates, std::pair<surface_data, light_data>> before;
+    for (auto pos : range<chunk_coordinates>(c - chunk_coordinates(1, 1, 1),
+                                             c + chunk_coordinates(2, 2, 2)))
+    {
+        before[pos] = std::make_pair(*w.get_surface(pos), *w.get_lightmap(pos));
+    }
+
+    for (auto& pos : changes)
+        w.change_block(pos, w.get_block(pos).type == 0 ? 2 : 0);
+
+    BOOST_CHECK(w.take_changeset().empty());
+    auto patches (w.take_patches());
+    BOOST_CHECK(!patches.empty());
+    for (auto& p : patches)
+    {
+        BOOST_REQUIRE(before.count(p.first));
+        apply(p.second, before[p.first].first, before[p.first].second);
+    }
+
+    // The patches turn the old surfaces into the same ones a full
+    // update would have made.
+    for (auto& b : before)
+    {
+        neighborhood<chunk_ptr> nbh (w, b.first);
+        surface_data fresh (extract_opaque_surface(nbh),
+                            extract_transparent_surface(nbh));
+
+        auto s (w.get_surface(b.first));
+        auto l (w.get_lightmap(b.first));
+        BOOST_CHECK(same_faces(s->opaque, fresh.opaque));
+        BOOST_CHECK(same_faces(b.second.first.opaque, fresh.opaque));
+        BOOST_REQUIRE_EQUAL(l->opaque.size(), count_faces(fresh.opaque));
+
+        lightmap expected (l->opaque);
+        test_light(w).generate(b.first, fresh.opaque, expected, 0);
+        BOOST_CHECK(l->opaque.data.size() == b.second.second.opaque.data.size());
+        for (size_t i (0); i < expected.size(); ++i)
+        {
+            BOOST_CHECK_EQUAL(*(uint16_t*)&l->opaque.data[i], *(uint16_t*)&expected.data[i]);
+            BOOST_CHECK_EQUAL(*(uint16_t*)&b.second.second.opaque.data[i],
+                              *(uint16_t*)&expected.data[i]);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE (world_refinement_test)
+{
+    register_new_material(1).is_solid = true;
+    register_new_material(2).is_solid = true;
+
+    persistence_null db;
+    memory_cache     cache (db);
+    world            w (cache, 2);
+    w.add_terrain_generator(std::unique_ptr<terrain_generator_i>(new test_terrain(w)));
+    w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(new phased_light(w)));
+
+    chunk_coordinates c (world_chunk_center);
+    range<chunk_coordinates> region (c - chunk_coordinates(1, 1, 1),
+                                     c + chunk_coordinates(2, 2, 2));
+
+    // Without a budget, the players only get the first phase.
+    w.refine_budget(0);
+    generate_region(w, region, world::request::surface_and_lightmap);
+    while (w.pending_tasks() > 0)
+        boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+
+    boost::this_thread::sleep_for(boost::chrono::milliseconds(100));
+    BOOST_CHECK_EQUAL(w.refinements.size(), region.size());
+    BOOST_CHECK(w.take_refined().empty());
+
+    std::vector<chunk_coordinates> lit;
+    for (auto pos : region)
+    {
+        auto l (cache.get_lightmap(pos));
+        if (l == nullptr)
+            continue;
+
+        BOOST_CHECK_EQUAL(l->phase, 0);
+        lit.push_back(pos);
+    }
+    BOOST_REQUIRE(!lit.empty());
+
+    // Once there's time, they are brought up to the last phase.
+    w.refine_budget(1);
+    std::unordered_set<chunk_coordinates> refined;
+    for (int wait (0); wait < 1000 && refined.size() < lit.size(); ++wait)
+    {
+        boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+        for (auto& pos : w.take_refined())
+        {
+            if (cache.get_lightmap(pos)->phase == 2)
+                refined.insert(pos);
+        }
+    }
+    BOOST_CHECK_EQUAL(refined.size(), lit.size());
+
+    for (auto pos : lit)
+    {
+        auto l (cache.get_lightmap(pos));
+        BOOST_CHECK_EQUAL(l->phase, 2);
+        BOOST_CHECK(l->opaque.empty() || l->opaque.data.front().ambient == 2);
+    }
+
+    // Nothing is left to refine after the last phase.
+    for (int wait (0); wait < 1000 && !w.is_idle(); ++wait)
+        boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+
+    BOOST_CHECK(w.is_idle());
+    BOOST_CHECK(w.refinements.empty());
+}